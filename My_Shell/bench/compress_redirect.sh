@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# compress_redirect.sh - Times "seq 1 N > out.zst" against "seq 1 N | zstd -T0 > out.zst" (and the
+# gzip equivalents), and reads each file back with "wc -l < out.zst", to compare the shell's
+# in-process codecs with an external compressor stage.
+# The piped files get no suffix, or the shell would compress them a second time.
+# Usage: bench/compress_redirect.sh [path/to/myshell] [lines]
+#
+
+SHELL_BIN=$(realpath "${1:-./myshell}")
+LINES=${2:-5000000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+. "$(dirname "$0")/lib.sh"
+cd "$WORK" || exit 1
+
+echo "$LINES lines, $(nproc) CPUs"
+for codec in zst gz; do
+    case $codec in
+        zst) tool="zstd -q -T0"; untool="zstd -dc" ;;
+        gz) tool="gzip"; untool="gzip -dc" ;;
+    esac
+    if ! command -v "${tool%% *}" > /dev/null; then
+        echo "$codec: ${tool%% *} not installed, skipped"
+        continue
+    fi
+    write_redirect=$(timed "seq 1 $LINES > r.$codec")
+    write_pipe=$(timed "seq 1 $LINES | $tool > p_$codec")
+    read_redirect=$(timed "wc -l < r.$codec")
+    count=$(grep -c "^$LINES\$" "$WORK/out")
+    read_pipe=$(timed "$untool p_$codec | wc -l")
+    count=$((count + $(grep -c "^$LINES\$" "$WORK/out")))
+    printf '%-4s  write: %6d ms redirect  %6d ms pipe   read: %6d ms redirect  %6d ms pipe  (%d bytes, %s)\n' \
+        "$codec" "$write_redirect" "$write_pipe" "$read_redirect" "$read_pipe" "$(wc -c < "r.$codec")" \
+        "$([ "$count" = 2 ] && echo correct || echo WRONG)"
+done
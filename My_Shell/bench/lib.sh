@@ -0,0 +1,12 @@
+#
+# lib.sh - Helpers shared by the bench scripts; sourced after SHELL_BIN and WORK are set.
+#
+
+# Runs one command line in the shell and prints its wall time in ms; the output lands in $WORK/out
+timed() {
+    echo "$1" > "$WORK/line.sh"
+    start=$(date +%s%N)
+    MYSHELL_STATS=/dev/null "$SHELL_BIN" "$WORK/line.sh" > "$WORK/out" 2>&1
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# locate_query.sh - Indexes a tree with "locate -u", then times substring and glob queries
+# against the same searches done with find.
+# Usage: bench/locate_query.sh [path/to/myshell] [tree] [runs]
+#
+
+SHELL_BIN=$(realpath "${1:-./myshell}")
+TREE=${2:-/usr}
+RUNS=${3:-20}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+export MYSHELL_INDEX="$WORK/index" MYSHELL_INDEX_ROOT="$TREE" MYSHELL_STATS=/dev/null
+
+echo 'locate -u' > "$WORK/update.sh"
+"$SHELL_BIN" "$WORK/update.sh" | grep '^Indexed'
+echo "index: $(wc -c < "$WORK/index") bytes"
+
+# Query $1 RUNS times in one shell, reporting microseconds per query
+query() {
+    r=0
+    while [ "$r" -lt "$RUNS" ]; do
+        echo "locate -c $1"
+        r=$((r + 1))
+    done > "$WORK/q.sh"
+    start=$(date +%s%N)
+    # Run from the empty work directory so the shell leaves glob patterns to locate
+    count=$(cd "$WORK" && "$SHELL_BIN" q.sh 2>/dev/null | tail -n 1)
+    end=$(date +%s%N)
+    printf '%-12s %8d matches  %8d us/query\n' "$1" "$count" $(( (end - start) / 1000 / RUNS ))
+}
+
+query stdio
+query '*.h'
+
+start=$(date +%s%N)
+count=$(find "$TREE" -xdev -mindepth 1 -path '*stdio*' | wc -l)
+end=$(date +%s%N)
+printf '%-12s %8d matches  %8d us/query\n' "find stdio" "$count" $(( (end - start) / 1000 ))
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# pack_tree.sh - Times "pack dir > out" and "unpack < out" against "tar -cf - dir | zstd -T0"
+# and "zstd -dc | tar -xf -" on a generated tree of many small files and a few large ones.
+# Usage: bench/pack_tree.sh [path/to/myshell] [small files]
+#
+
+SHELL_BIN=$(realpath "${1:-./myshell}")
+FILES=${2:-20000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+. "$(dirname "$0")/lib.sh"
+cd "$WORK" || exit 1
+
+mkdir -p tree
+i=0
+while [ "$i" -lt "$FILES" ]; do
+    d=tree/d$((i % 200))
+    [ -d "$d" ] || mkdir "$d"
+    echo "file $i" > "$d/f$i"
+    i=$((i + 1))
+done
+seq 1 5000000 > tree/big.txt
+head -c 50000000 /dev/urandom > tree/random.bin
+
+echo "$FILES small files + 85 MB, $(nproc) CPUs"
+pack_ms=$(timed "pack tree > tree.tzst")
+mkdir out1
+unpack_ms=$(timed "unpack -C out1 < tree.tzst")
+same=$(diff -r tree out1/tree > /dev/null && echo correct || echo WRONG)
+printf 'pack/unpack  %6d ms pack  %6d ms unpack  %10d bytes  (%s)\n' "$pack_ms" "$unpack_ms" "$(wc -c < tree.tzst)" "$same"
+if command -v zstd > /dev/null; then
+    tar_ms=$(timed "tar -cf - tree | zstd -q -T0 > tree_tar")
+    mkdir out2
+    untar_ms=$(timed "zstd -dc tree_tar | tar -xf - -C out2")
+    printf 'tar | zstd   %6d ms pack  %6d ms unpack  %10d bytes\n' "$tar_ms" "$untar_ms" "$(wc -c < tree_tar)"
+fi
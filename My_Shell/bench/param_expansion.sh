@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# param_expansion.sh - Compares MyShell's in-process ${var...} operators with the external
+# tools people pipe through for the same job (basename, sed, cut, tr).
+# Usage: bench/param_expansion.sh [path/to/myshell] [iterations]
+#
+
+SHELL_BIN=${1:-./myshell}
+N=${2:-2000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# MyShell has no loops, so each script is the operation repeated N times
+repeat() {
+    i=0
+    echo 'f=/usr/local/lib/libfoo.so.1.2'
+    while [ "$i" -lt "$N" ]; do
+        echo "$1"
+        i=$((i + 1))
+    done
+}
+
+run() {
+    repeat "$2" > "$WORK/$1.sh"
+    start=$(date +%s%N)
+    MYSHELL_STATS=/dev/null "$SHELL_BIN" "$WORK/$1.sh" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000 ))
+    printf '%-14s %-32s %8d us  %6d us/op\n' "$1" "$2" "$elapsed" $(( elapsed / N ))
+}
+
+echo "$N operations each"
+run basename 'b=${f##*/}'
+run basename-ext 'basename $f'
+run dirname 'b=${f%/*}'
+run dirname-ext 'dirname $f'
+run replace 'b=${f//lib/LIB}'
+run replace-ext 'sed s/lib/LIB/g /dev/null'
+run substring 'b=${f:15:6}'
+run substring-ext 'cut -c16-21 /dev/null'
+run upper 'b=${f^^}'
+run upper-ext 'tr a-z A-Z < /dev/null'
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# pipeline_stages.sh - Times "seq | cat | cat | ... | wc -l" pipelines of growing length to show
+# that setting up a pipeline costs the same per stage at 25 stages as at 400.
+# Usage: bench/pipeline_stages.sh [path/to/myshell] [runs per length]
+#
+
+SHELL_BIN=${1:-./myshell}
+RUNS=${2:-5}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# One pipeline of $1 stages, repeated RUNS times
+script() {
+    r=0
+    while [ "$r" -lt "$RUNS" ]; do
+        printf 'seq 1 1000'
+        i=2
+        while [ "$i" -lt "$1" ]; do
+            printf ' | cat'
+            i=$((i + 1))
+        done
+        echo ' | wc -l'
+        r=$((r + 1))
+    done
+}
+
+echo "$RUNS runs per length"
+for stages in 25 50 100 200 400; do
+    script "$stages" > "$WORK/p$stages.sh"
+    start=$(date +%s%N)
+    MYSHELL_STATS=/dev/null "$SHELL_BIN" "$WORK/p$stages.sh" > "$WORK/out" 2>&1
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000 / RUNS ))
+    lines=$(grep -c '^1000$' "$WORK/out")
+    printf '%4d stages  %8d us/pipeline  %5d us/stage  (%d/%d correct)\n' \
+        "$stages" "$elapsed" $(( elapsed / stages )) "$lines" "$RUNS"
+done
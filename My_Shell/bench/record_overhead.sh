@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# record_overhead.sh - Measures what "myshell --record" costs on an output-heavy session: the same
+# commands run plain, under --record, and (when installed) under script(1) for comparison.
+# Usage: bench/record_overhead.sh [path/to/myshell] [lines of output]
+#
+
+SHELL_BIN=${1:-./myshell}
+LINES=${2:-3000000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+printf 'seq 1 %d\ncat %s/big\nexit\n' "$LINES" "$WORK" > "$WORK/session"
+seq 1 "$LINES" > "$WORK/big"
+bytes=$(( $(wc -c < "$WORK/big") * 2 ))
+
+run() {
+    start=$(date +%s%N)
+    "$@" < "$WORK/session" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000000 ))
+    [ "$elapsed" -gt 0 ] || elapsed=1
+    printf '%-10s %6d ms  %6d MiB/s\n' "$label" "$elapsed" $(( bytes * 1000 / elapsed / 1048576 ))
+}
+
+echo "$bytes bytes of output per session"
+export MYSHELL_STATS=/dev/null
+label=plain run "$SHELL_BIN"
+label=record run "$SHELL_BIN" --record "$WORK/session.log"
+ls -l "$WORK/session.log" | awk '{ printf "           log %d bytes\n", $5 }'
+if command -v script > /dev/null 2>&1; then
+    label=script run script -q -c "$SHELL_BIN" "$WORK/typescript"
+fi
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# tree_compare.sh - Times "dircmp a b" against "diff -r a b" on two copies of a generated tree
+# that differ in one byte of a large file, and the cmp builtin against the system cmp.
+# Usage: bench/tree_compare.sh [path/to/myshell] [small files]
+#
+
+SHELL_BIN=$(realpath "${1:-./myshell}")
+FILES=${2:-20000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+. "$(dirname "$0")/lib.sh"
+cd "$WORK" || exit 1
+
+mkdir -p a
+i=0
+while [ "$i" -lt "$FILES" ]; do
+    d=a/d$((i % 200))
+    [ -d "$d" ] || mkdir "$d"
+    echo "file $i" > "$d/f$i"
+    i=$((i + 1))
+done
+head -c 300000000 /dev/urandom > a/big.bin
+cp -a a b
+printf 'x' | dd of=b/big.bin bs=1 seek=299000000 conv=notrunc 2> /dev/null
+
+echo "$FILES small files + 300 MB, $(nproc) CPUs"
+ms=$(timed "dircmp a b")
+found=$(grep -c '^differs  big.bin' "$WORK/out")
+printf 'dircmp a b    %6d ms  (%s)\n' "$ms" "$([ "$found" = 1 ] && echo correct || echo WRONG)"
+ms=$(timed "diff -r a b")
+printf 'diff -r a b   %6d ms\n' "$ms"
+ms=$(timed "cmp a/big.bin b/big.bin")
+printf 'cmp builtin   %6d ms\n' "$ms"
+ms=$(timed "/usr/bin/env cmp a/big.bin b/big.bin")
+printf 'system cmp    %6d ms\n' "$ms"
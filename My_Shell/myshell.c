@@ -1,3 +1,4 @@
+#define _GNU_SOURCE               // GNU extensions, ex: wcwidth, strndup, splice
 #include <stdio.h>                // std input output
 #include <stdlib.h>               // std library dynamic malloc, free 
 #include <string.h>               // string handling
@@ -5,59 +6,982 @@
 #include <sys/wait.h>             // process control, ex: wait, waitpid, fork()
 #include <sys/stat.h>             // file status/permission, ex: mkdir
 #include <sys/types.h>            // data types, ex: process ID, size_t
+#include <sys/resource.h>         // child resource usage, ex: wait4, rusage
+#include <sys/file.h>             // advisory locking of the stats log, ex: flock
+#include <sys/time.h>             // wall clock timestamps, ex: gettimeofday
+#include <stdint.h>               // fixed-width integers for the stats file format
+#include <limits.h>               // descriptor numbers in redirections, ex: INT_MAX
+#include <malloc.h>               // heap accounting, ex: mallinfo2
+
+// USDT probes for perf/bpftrace when systemtap's sys/sdt.h is available; otherwise they compile away
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define MYSHELL_USDT 1
+#endif
+#endif
+#ifdef MYSHELL_USDT
+#define SHELL_PROBE(name, ...) STAP_PROBEV(myshell, name, ##__VA_ARGS__)
+#define SHELL_PROBE_ENABLED(name) __builtin_expect(myshell_##name##_semaphore, 0)
+#define SHELL_PROBE_SEMAPHORE(name) unsigned short myshell_##name##_semaphore __attribute__((unused, section(".probes")))
+#else
+static inline void shell_probe_unused(int unused, ...) { (void)unused; }
+#define SHELL_PROBE(name, ...) do { if (0) shell_probe_unused(0, ##__VA_ARGS__); } while (0)
+#define SHELL_PROBE_ENABLED(name) 0
+#define SHELL_PROBE_SEMAPHORE(name) extern int myshell_##name##_semaphore_unused
+#endif
 #include <fcntl.h>                // file control, ex: open, creat, redirection (> <)
-#include <readline/readline.h>    // GNU Readline Library, user input -> auto complete
-#include <readline/history.h>     // Readline History function, history, history clear
+#include <termios.h>              // raw terminal mode for the line editor
+#include <sys/ioctl.h>            // terminal window size, ex: TIOCGWINSZ
+#include <sys/uio.h>              // gathered writes of session log records, ex: writev
+#include <poll.h>                 // session recorder relay, ex: poll
+#include <pthread.h>              // file index worker thread
+#include <sys/inotify.h>          // file index updates, ex: inotify_add_watch
+#include <sys/syscall.h>          // idle I/O priority for the index worker, ex: SYS_ioprio_set
+#include <locale.h>               // locale for UTF-8 decoding
+#include <wchar.h>                // wide characters, ex: mbrtowc, wcwidth
+#include <sys/mman.h>             // shared memory for pipe meter counters, ex: mmap
+#include <time.h>                 // monotonic clock, ex: clock_gettime
 #include <dirent.h>               // directory handling, opendir, readdir
 #include <glob.h>                 // pattern matching/wildcards
+#include <fnmatch.h>              // wildcard matching for patterns the compiled matcher hands back
+#include <regex.h>                // [[ string =~ regex ]]
 #include <errno.h>                // error handling, strerror
 #include <signal.h>               // signal handling, ex: SIGCHLD
+#include <dlfcn.h>                // loadable builtins, ex: dlopen, dlsym
+#include <ctype.h>                // character classes for the arithmetic compiler, ex: isdigit
+#include "myshell_plugin.h"       // plugin descriptor and the services the shell exports to it
 
 /*
  * MyShell: A custom Unix-like shell for university project.
  * Features: Built-in commands, system commands, redirection, multiple piping,
- *           tab completion (files and commands), command history, recursive delete,
- *           folder copy/move, wildcard support, background processes.
+ *           native line editor with syntax highlighting, tab completion (files and commands),
+ *           command history, recursive delete,
+ *           folder copy/move, wildcard support, background processes, pipe throughput meter,
+ *           pipeline bottleneck profiler, scripts with a per-line profiler, command statistics log,
+ *           internal memory and cache accounting, loadable builtins (enable -f),
+ *           shell variables, parameter expansion operators (${var#pat}, ${var/pat/rep}, ...),
+ *           arithmetic expansion $(( )) with compiled expressions, block-buffered read builtin,
+ *           mapfile/readarray, command lists (; && ||), test/[/[[ with a stat cache,
+ *           compiled pattern cache for ${var#pattern} and [[ == / =~ ]], "did you mean" suggestions
+ *           for unknown commands, session recording on a shell-managed pty (--record/--replay),
+ *           jobs, --json / -0 record output from help, history, jobs and set, file index kept by a
+ *           background worker (set -o fileindex) with the locate builtin and indexed path completion,
+ *           redirections to and from .zst/.gz/.lz4 files compressed in-process (zstd multi-threaded),
+ *           pack/unpack archives (tar in independently compressed zstd chunks, built and extracted in parallel),
+ *           cmp over mapped files and dircmp comparing two trees across worker threads.
  * Author: Laden
  */
 
 #define MAX_INPUT_SIZE 1024 // Maximum input size for commands
 #define MAX_ARGS 64         // Maximum number of arguments
 #define MAX_HISTORY 100     // Maximum history entries
-#define MAX_PIPES 10        // Maximum number of pipes
 #define MAX_PATH 512        // Maximum path length
 #define MAX_RECURSION 100   // [FIX: Maximum recursion depth for recursive operations]
 
+// Per-stage measurements gathered by the pipeline profiler
+struct stage_profile {
+    double cpu;                   // seconds of CPU used
+    double wall;                  // seconds the stage was alive
+    double blocked_in;            // seconds asleep on an empty input pipe
+    double blocked_out;           // seconds asleep on a full output pipe
+    unsigned long long ticks;     // utime + stime at the previous sample, in clock ticks
+};
+
+/*
+ * Command statistics log (~/.myshell_stats, or $MYSHELL_STATS), written once set -o statslog
+ *
+ * A header page followed by fixed-size blocks of STATS_BLOCK_RECORDS records. Inside a block
+ * each column is stored contiguously, so a query that needs start times and durations touches
+ * only those pages of the mmapped file.
+ */
+#define STATS_MAGIC "MYSHSTA1"
+#define STATS_BLOCK_RECORDS 8192
+#define STATS_HEADER_SIZE 4096
+enum { COL_START, COL_DURATION, COL_STATUS, COL_UTIME, COL_STIME, COL_MAXRSS, COL_PIPE_BYTES,
+       COL_CWD_HASH, COL_CMD_HASH, COL_NAME, COL_COUNT };
+static const size_t stats_col_size[COL_COUNT] = {8, 8, 4, 8, 8, 8, 8, 8, 8, 16};
+struct stats_header {
+    char magic[8];
+    uint32_t block_records;
+    uint32_t reserved;
+    uint64_t count;
+};
+struct stats_record {
+    int64_t start_us;             // wall-clock start, microseconds since the epoch
+    uint64_t duration_us;
+    int32_t status;
+    uint64_t utime_us, stime_us;  // CPU of the children reaped for this command
+    uint64_t maxrss_kb;           // children's peak RSS high-water mark
+    uint64_t pipe_bytes;
+    uint64_t cwd_hash, cmd_hash;
+    char name[16];                // argv[0], truncated
+};
+// Per-subsystem accounting reported by shellstat. entries/bytes are current sizes;
+// hits, misses and allocs are counters that shellstat --reset zeroes
+enum { SUB_HISTORY, SUB_COMPLETION, SUB_COMMAND_LOOKUP, SUB_GLOB, SUB_PARSER, SUB_STATSLOG, SUB_PROFILER, SUB_ARENA,
+       SUB_VARIABLES, SUB_ARITH, SUB_READ, SUB_STATCACHE, SUB_PATTERN,
+       SUB_CMDINDEX, SUB_FILEINDEX, SUB_COUNT };
+struct subsystem_stats {
+    const char *name;
+    unsigned long entries, bytes;
+    unsigned long hits, misses, allocs;
+};
+
+// Builtin flags
+#define BUILTIN_PIPELINE_SAFE   0x1   // may run in-process inside a forked pipeline stage
+#define BUILTIN_BACKGROUND_SAFE 0x2   // may run in a forked child when followed by '&'
+#define BUILTIN_NEEDS_PARENT    0x4   // changes shell state: ignores '&' and is refused as a pipeline stage
+#define BUILTIN_RECORDS         0x8   // lists records, so accepts a leading --json or -0
+#define MAX_BUILTINS 128
+#define BUILTIN_SLOTS 256             // perfect-hash table size upper bound (power of two)
+
+// One registered builtin; dispatch, completion and help all read this table
+struct builtin {
+    const char *name;
+    int (*handler)(char *args[], int background);
+    unsigned flags;
+    const char *usage;
+    const char *help;
+    const struct myshell_plugin *plugin;   // set for builtins loaded with enable -f
+    void *module;                          // dlopen handle the plugin came from
+};
+
+// One redirection of a command; a command's list is applied left to right after its pipes
+// [n]<file [n]>file [n]>>file [n]<>file [n]>&m [n]<&m [n]>&- [n]<&- &>file &>>file
+enum { REDIR_INPUT, REDIR_OUTPUT, REDIR_APPEND, REDIR_READWRITE, REDIR_DUP, REDIR_CLOSE };
+struct redirect {
+    int fd;                       // descriptor being redirected
+    int kind;
+    int source;                   // REDIR_DUP: descriptor copied onto fd
+    char *file;
+    struct redirect *next;
+};
+// A descriptor a builtin's redirections replaced, and the copy that puts it back (-1: it was closed)
+struct saved_fd {
+    int fd, copy;
+};
+
+// Compressed redirections: "< f.zst", "> f.gz", ">> f.lz4" go through a pipe to a worker thread
+// that (de)compresses with the codec's library, loaded with dlopen on first use so the shell
+// builds and runs without any of them. The prototypes below are the libraries' stable ABI.
+#define CODEC_BUFFER (1 << 20)
+#define CODEC_OUT_BUFFER (CODEC_BUFFER + CODEC_BUFFER / 8 + 65536)  // above every codec's bound for CODEC_BUFFER
+enum { CODEC_ZSTD, CODEC_GZIP, CODEC_LZ4, CODEC_COUNT };
+#define ZSTD_C_COMPRESSION_LEVEL 100
+#define ZSTD_C_NB_WORKERS 400
+#define ZSTD_E_CONTINUE 0
+#define ZSTD_E_END 2
+#define LZ4F_VERSION 100
+#define Z_BUF_ERROR (-5)              // zlib: the stream ended early
+struct zstd_buffer {
+    void *data;
+    size_t size, pos;
+};
+struct lz4_preferences {          // LZ4F_preferences_t
+    int block_size_id, block_mode, content_checksum, frame_type;
+    unsigned long long content_size;
+    unsigned dict_id;
+    int block_checksum;
+    int compression_level;
+    unsigned auto_flush, favor_dec_speed, reserved[3];
+};
+// One pointer per library function, in the order codec_load looks their names up
+struct zstd_api {
+    void *(*create_cctx)(void);
+    size_t (*free_cctx)(void *ctx);
+    size_t (*set_parameter)(void *ctx, int parameter, int value);
+    size_t (*compress_stream2)(void *ctx, struct zstd_buffer *output, struct zstd_buffer *input, int end_op);
+    void *(*create_dctx)(void);
+    size_t (*free_dctx)(void *ctx);
+    size_t (*decompress_stream)(void *ctx, struct zstd_buffer *output, struct zstd_buffer *input);
+    unsigned (*is_error)(size_t code);
+    const char *(*error_name)(size_t code);
+};
+struct zlib_api {
+    void *(*dopen)(int fd, const char *mode);
+    int (*buffer)(void *file, unsigned size);
+    int (*read)(void *file, void *data, unsigned len);
+    int (*write)(void *file, const void *data, unsigned len);
+    int (*close)(void *file);
+    const char *(*error)(void *file, int *code);
+    int (*direct)(void *file);
+};
+struct lz4_api {
+    size_t (*create_cctx)(void **ctx, unsigned version);
+    size_t (*free_cctx)(void *ctx);
+    size_t (*compress_begin)(void *ctx, void *dst, size_t capacity, const struct lz4_preferences *prefs);
+    size_t (*compress_update)(void *ctx, void *dst, size_t capacity, const void *src, size_t size, const void *options);
+    size_t (*compress_end)(void *ctx, void *dst, size_t capacity, const void *options);
+    size_t (*create_dctx)(void **ctx, unsigned version);
+    size_t (*free_dctx)(void *ctx);
+    size_t (*decompress)(void *ctx, void *dst, size_t *dst_size, const void *src, size_t *src_size, const void *options);
+    unsigned (*is_error)(size_t code);
+    const char *(*error_name)(size_t code);
+};
+// A redirection being (de)compressed; the worker owns thread_fd and file_fd
+struct codec_job {
+    int codec, compress;
+    int thread_fd;                // worker's end of the pipe
+    int command_fd;               // command's end, which the redirection duplicates
+    int file_fd;
+    int level, threads;
+    int background;               // reaped later instead of waited for
+    int started;
+    volatile int failed;
+    char *file;
+    pthread_t thread;
+    struct codec_job *next;
+};
+
+// pack/unpack archives: a tar stream cut into PACK_CHUNK pieces, each compressed as its own zstd
+// frame, so "zstd -dc archive | tar x" reads it too. zstd skippable frames, which decoders pass
+// over, carry the member table first, a size marker before each chunk, and a chunk index last.
+#define PACK_MAGIC "MYSHPAK1"
+#define PACK_INDEX_MAGIC "MYSHPKIX"
+#define PACK_CHUNK (4 << 20)
+#define PACK_TABLE_FRAME 0x184D2A5B
+#define PACK_CHUNK_FRAME 0x184D2A5C
+#define PACK_INDEX_FRAME 0x184D2A5D
+#define PACK_INDEX_ENTRY 12       // u64 offset of the chunk's zstd frame, u32 its size
+#define PACK_MAX_JOBS 256
+struct pack_member {
+    char *path;                   // archive path, without a directory's trailing '/'
+    char *link;                   // symlink target, NULL otherwise
+    char type;                    // tar typeflag: '0' file, '5' directory, '2' symlink
+    int selected;                 // unpack: extracted
+    unsigned mode, uid, gid;
+    int64_t mtime;
+    long mtime_nsec;
+    uint64_t size;
+    uint64_t header_offset;       // where its tar header(s) start in the uncompressed stream
+    uint64_t data_offset;         // where its contents start
+};
+// A compressed chunk waiting for its turn to be written (pack), or to be extracted (unpack)
+struct pack_slot {
+    uint64_t chunk;
+    char *data;
+    size_t size;
+    int ready;
+};
+// Shared by the builtin and its worker threads; everything below lock is guarded by it
+struct pack_state {
+    int root_fd;
+    const char *prefix;           // pack: the folder's name, which member paths start with ("" for none)
+    size_t prefix_skip;           // pack: bytes of a member path before its path under root_fd
+    int level;
+    struct pack_member *members;
+    size_t count, cap;
+    uint64_t tar_size, chunks;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char **dirs;                  // pack: directories still to be read
+    size_t dir_count, dir_cap;
+    int walking;                  // pack: workers reading a directory
+    uint64_t next_chunk, written; // pack: next chunk to compress, chunks written out
+    struct pack_slot *slots;      // pack: indexed by chunk % window; unpack: a queue from head
+    size_t window, head, queued;
+    pthread_t *threads;
+    int closed;                   // unpack: no more chunks are coming
+    int stop;                     // a fatal error; workers give up
+    int failed;                   // some member could not be read or written
+};
+// Growable byte buffer for the skippable frames
+struct pack_bytes {
+    unsigned char *data;
+    size_t len, cap;
+};
+
+// cmp/dircmp: files are compared through mmap in windows of CMP_WINDOW bytes, and dircmp splits
+// large files into DIRCMP_RANGE pieces so several workers can compare one file
+#define CMP_WINDOW (1ULL << 30)
+#define CMP_BLOCK 65536
+#define DIRCMP_RANGE (64ULL << 20)
+enum { DIRCMP_MISSING, DIRCMP_EXTRA, DIRCMP_DIFFERS };
+// Work for a dircmp worker: a folder present on both sides, or a byte range of a file
+struct dircmp_item {
+    char *rel;                    // path under both roots ("" for the roots themselves)
+    int dir;
+    uint64_t offset, len;
+    struct dircmp_item *next;
+};
+struct dircmp_result {
+    char *path;
+    int state;
+    const char *reason;           // DIRCMP_DIFFERS: "size", "type", "link" or "content"
+    uint64_t offset;              // "content": first differing byte
+};
+// Shared by dircmp's workers; everything below lock is guarded by it
+struct dircmp_state {
+    int fd_a, fd_b;
+    int trust_mtime;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct dircmp_item *items;
+    int busy;                     // workers holding an item, which may add more
+    struct dircmp_result *results;
+    size_t result_count, result_cap;
+    int trouble;
+};
+
+// Byte buffer over a file descriptor, used for plugin stdin/stdout
+#define IO_BUFFER_SIZE 65536
+struct io_buffer {
+    int fd;
+    char *data;
+    size_t start, len, cap;       // unread bytes are data[start..len) for input, data[0..len) for output
+    int failed;                   // set once an output byte is dropped
+};
+
+// Read-ahead of the read builtin, per descriptor. For files, offset is the file position of
+// data[start]; for pipes, the bytes handed out but not yet taken from the pipe
+#define READ_FDS 10
+enum { READ_FILE = 1, READ_PIPE, READ_TTY, READ_BYTES };
+struct read_buffer {
+    struct io_buffer io;
+    dev_t dev;
+    ino_t ino;
+    int kind;
+    off_t offset;
+    int peek[2];                  // private pipe that tee(2) copies a pipe's contents into
+};
+
+// Bump allocator for per-command scratch memory; reset after every command line
+#define ARENA_CHUNK_SIZE 65536
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+// Shell variables, chained by the hash of their name
+#define VAR_BUCKETS 256
+struct shell_var {
+    struct shell_var *next;
+    char *name;
+    char *value;
+    long long number;             // value as an integer, valid when set by arithmetic
+    int number_valid;
+    char **items;                 // array elements (NULL for a plain variable), pointing into storage
+    size_t count;
+    char *storage;                // the elements back to back, NUL-terminated
+    size_t storage_size;
+};
+
+// Growable string used while expanding a command line
+struct text_builder {
+    char *data;
+    size_t len, cap;
+};
+
+// Expanded values stand in for quoted text: the operator characters in them are held as
+// PROTECT_BASE + their index in protected_ops until the line is split into words
+#define PROTECT_BASE 0x1c
+static const char protected_ops[] = "|<>&";
+
+// Arithmetic expressions compile once to a postfix program, cached by expression text
+#define ARITH_CACHE_SLOTS 64
+#define ARITH_MAX_DEPTH 16        // variables whose values are expressions, evaluated recursively
+enum arith_op {
+    AOP_PUSH, AOP_LOAD, AOP_STORE, AOP_POP, AOP_JZ, AOP_JNZ, AOP_JMP, AOP_BOOL,
+    AOP_NEG, AOP_NOT, AOP_BITNOT,
+    AOP_MUL, AOP_DIV, AOP_MOD, AOP_POW, AOP_ADD, AOP_SUB, AOP_SHL, AOP_SHR,
+    AOP_LT, AOP_LE, AOP_GT, AOP_GE, AOP_EQ, AOP_NE, AOP_BAND, AOP_XOR, AOP_BOR, AOP_AND, AOP_OR
+};
+struct arith_insn {
+    int op;
+    int operand;                  // variable index for LOAD/STORE
+    long long value;              // constant for PUSH, target for jumps
+};
+struct arith_program {
+    char *text;
+    struct arith_insn *code;
+    int length, cap;
+    char **names;                 // variables referenced, indexed by operand
+    int name_count;
+};
+
+// test / [ / [[ ]] evaluation: words being parsed and whether [[ ]] rules apply
+struct cond_parser {
+    char **words;
+    int count, pos;
+    int extended;
+    const char *error;
+};
+
+// statx results cached for the duration of one command list, so file tests in a chain share them
+#define STAT_CACHE_SLOTS 16
+struct stat_entry {
+    char *path;
+    int follow;                   // 0 for lstat-style tests (-L, -h)
+    int error;                    // errno of a failed statx, 0 on success
+    struct statx stx;
+};
+
+// Wildcard and regex patterns compile once into an LRU cache keyed by pattern text
+#define PATTERN_CACHE_SLOTS 64
+enum pattern_kind { PATTERN_GLOB, PATTERN_REGEX };
+// How a compiled pattern is matched: the common shapes skip the general token matcher
+enum pattern_plan {
+    PLAN_LITERAL, PLAN_PREFIX, PLAN_SUFFIX, PLAN_CONTAINS, PLAN_ANY, PLAN_TOKENS, PLAN_FNMATCH, PLAN_REGEX
+};
+enum pattern_op { TOK_BYTE, TOK_ANY, TOK_STAR, TOK_CLASS };
+struct pattern_token {
+    unsigned char op;
+    unsigned short arg;           // the byte for TOK_BYTE, the class index for TOK_CLASS
+};
+struct pattern {
+    struct pattern *prev, *next;  // LRU order, most recently used first
+    char *text;
+    unsigned long hash;
+    int kind, plan;
+    struct pattern_token *tokens;
+    int count;
+    unsigned char (*classes)[32]; // one 256-bit bitmap per [...] class
+    int class_count;
+    char *literal;                // the literal bytes, for the LITERAL/PREFIX/SUFFIX/CONTAINS plans
+    size_t literal_len;
+    size_t head_len, tail_len;    // literal bytes every match starts / ends with (PLAN_TOKENS)
+    size_t min_len;               // bytes any match needs
+    int multibyte;                // has ? or [...], which match whole characters in a UTF-8 locale
+    regex_t re;
+    size_t size;
+};
+
+// "Did you mean" index: a BK-tree over builtin and PATH command names, kept per source so a
+// changed PATH directory is rescanned on its own
+#define SUGGEST_MAX 3
+struct bk_node {
+    char *name;
+    int refs;                     // sources currently providing the name; 0 once it is gone
+    int distance;                 // edit distance to the parent node
+    struct bk_node *child, *sibling;
+};
+// A name preprocessed for bit-parallel Levenshtein (Myers): one bitmask per byte value
+struct edit_pattern {
+    uint64_t peq[256];
+    size_t len;
+};
+struct command_source {
+    char *path;                   // PATH directory, or NULL for the builtin table
+    struct timespec mtime;        // directory mtime when last scanned
+    dev_t dev;
+    ino_t ino;
+    struct bk_node **names;
+    int count;
+};
+
+// Session log (--record / --replay): a header per recorded session, then one record per relayed chunk
+#define RECORD_MAGIC "MYSHREC1"
+#define RECORD_TYPE_SHIFT 30
+#define RECORD_SIZE_MASK ((1u << RECORD_TYPE_SHIFT) - 1)
+enum { RECORD_OUTPUT, RECORD_INPUT, RECORD_RESIZE, RECORD_END };
+struct session_header {
+    char magic[8];
+    uint64_t started;             // seconds since the epoch
+    uint16_t rows, cols;
+    uint32_t reserved;
+};
+struct record_header {
+    uint32_t delay_us;            // since the previous record of the session
+    uint32_t size;                // payload bytes, record type in the top two bits
+};
+
+/*
+ * File index (~/.myshell_index, or $MYSHELL_INDEX) of everything under $MYSHELL_INDEX_ROOT ($HOME)
+ *
+ * The root path, then every path below it on the same mount in byte order, front-coded: a varint
+ * count of bytes shared with the previous path, a varint suffix length and the suffix. Every
+ * INDEX_RESTART-th path shares nothing and its offset goes in a table at the end, so a lookup
+ * binary searches the restarts and decodes at most INDEX_RESTART paths.
+ */
+#define INDEX_MAGIC "MYSHIDX1"
+#define INDEX_RESTART 64
+#define INDEX_PATH_MAX 4096
+#define INDEX_RESCAN_SECONDS 600      // without inotify watches
+#define INDEX_SETTLE_MS 500           // quiet time before a batch of changes is written
+#define INDEX_IOPRIO_IDLE (3 << 13)   // IOPRIO_CLASS_IDLE
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+struct index_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t restarts;            // offset of the restart table, one uint64_t per INDEX_RESTART paths
+    int64_t built;                // seconds since the epoch
+    uint32_t root_len;            // root path follows the header
+    uint32_t reserved;
+};
+// Paths gathered by a scan; the worker's scan also owns the inotify descriptor and its watches
+struct index_scan {
+    char **paths;
+    size_t count, cap;
+    dev_t dev;                    // mount being indexed
+    int inotify_fd;
+    char **watches;               // directory path by watch descriptor
+    int watch_cap;
+};
+// Sequential decoder over the mapped index
+struct index_cursor {
+    const unsigned char *next, *end;
+    uint64_t left;                // paths not yet decoded
+    size_t len, shared;           // current path length, bytes shared with the path before it
+    char path[INDEX_PATH_MAX];
+};
+
 // Function prototypes
 void print_prompt(void);
 char *read_command(void);
-int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char **input_files, char **output_files, int *appends, int *background);
+int parse_command(const char *command, char **args[], int *num_commands, struct redirect **redirects, int *background,
+                  int max_commands);
+const char *parse_redirect(const char *token, struct redirect *r, int *both);
+int add_redirect(struct redirect **list, int fd, int kind, int source, const char *file);
+void free_redirects(struct redirect *list);
+int apply_redirects(const struct redirect *list, struct saved_fd *saved, int *saved_count);
+void restore_redirects(struct saved_fd *saved, int count);
+int codec_load(int codec);
+int start_codecs(struct redirect **redirects, int num_commands, int background);
+int finish_codecs(void);
+void release_codecs(void);
+void codec_wait(void);
 int execute_builtin(char *args[], int background);
-void execute_system_command(char *args[], char *input_file, char *output_file, int append, int background);
-void execute_multiple_pipes(char *args[][MAX_ARGS], int num_commands, char **input_files, char **output_files, int *appends, int *background);
+int run_builtin(const struct builtin *builtin, char *args[], int background);
+void record_open(void);
+void record_text(const char *key, const char *value);
+size_t utf8_sequence(const unsigned char *text, size_t len);
+void record_number(const char *key, long long value);
+void record_bool(const char *key, int value);
+void record_close(void);
+void job_add(pid_t pid, const char *command);
+const struct builtin *lookup_builtin(const char *name);
+void seal_builtins(void);
+int builtin_exit(char *args[], int background);
+int builtin_cd(char *args[], int background);
+int builtin_help(char *args[], int background);
+int builtin_mkdir(char *args[], int background);
+int builtin_rmdir(char *args[], int background);
+int builtin_touch(char *args[], int background);
+int builtin_cp(char *args[], int background);
+int builtin_mv(char *args[], int background);
+int builtin_rm(char *args[], int background);
+int builtin_writefile(char *args[], int background);
+int builtin_history(char *args[], int background);
+int builtin_set(char *args[], int background);
+int builtin_jobs(char *args[], int background);
+int builtin_locate(char *args[], int background);
+int builtin_pack(char *args[], int background);
+int builtin_unpack(char *args[], int background);
+int builtin_cmp(char *args[], int background);
+int builtin_dircmp(char *args[], int background);
+int builtin_meter(char *args[], int background);
+int builtin_pipeprof(char *args[], int background);
+int builtin_stats(char *args[], int background);
+int builtin_shellstat(char *args[], int background);
+int builtin_enable(char *args[], int background);
+int builtin_let(char *args[], int background);
+int builtin_unset(char *args[], int background);
+int builtin_read(char *args[], int background);
+int builtin_test(char *args[], int background);
+int run_cond_command(const char *text);
+int cond_or(struct cond_parser *ps);
+int cond_and(struct cond_parser *ps);
+int cond_not(struct cond_parser *ps);
+int cond_primary(struct cond_parser *ps);
+int cond_binary_op(const char *word, int extended);
+int cached_statx(const char *path, int follow, struct statx *out);
+void clear_stat_cache(void);
+struct pattern *pattern_get(const char *text, int kind);
+struct pattern *pattern_compile(const char *text, int kind);
+int pattern_match(const struct pattern *pat, const char *value, size_t len);
+void pattern_free(struct pattern *pat);
+char *ifs_field(char **cursor, const char *ifs, int last, int quoted);
+void remove_backslashes(char *text);
+int read_record(int fd, int delim, long limit, int raw, struct text_builder *out);
+ssize_t read_refill(int fd, struct read_buffer *rb);
+int release_pipe(int fd, struct read_buffer *rb);
+void release_read_ahead(void);
+int redirect_builtin(const struct redirect *list, struct saved_fd *saved, int *saved_count);
+void restore_redirect(struct saved_fd *saved, int count);
+void set_var_array(const char *name, char **items, size_t count);
+void free_var_items(struct shell_var *var);
+void adopt_var_array(const char *name, char *storage, size_t storage_size, char **items, size_t count);
+int builtin_mapfile(char *args[], int background);
+size_t mapfile_build(const char *name, const char *data, size_t size, int delim, int strip, long skip, long max);
+struct shell_var *find_var(const char *name);
+const char *get_var(const char *name);
+void set_var(const char *name, const char *value);
+void set_var_number(const char *name, long long number);
+void unset_var(const char *name);
+int assign_variables(char *args[]);
+int expand_line(const char *line, char **out, int protect);
+void protect_text(struct text_builder *text, size_t from);
+void unprotect_word(char *word);
+int expand_parameter(const char *body, struct text_builder *text);
+void text_append(struct text_builder *text, const char *data, size_t len);
+int arith_eval(const char *text, long long *result, int depth);
+struct arith_program *arith_compile(const char *text);
+int arith_run(const struct arith_program *prog, long long *result, int depth);
+void arith_free(struct arith_program *prog);
+int arith_command(const char *line);
+int builtin_plugin(char *args[], int background);
+int register_plugin(const char *path, const char *name);
+void unregister_plugin(const char *name);
+char *plugin_generator(const char *text, int state);
+void *arena_alloc(size_t size);
+char *arena_strdup(const char *text);
+void arena_reset(void);
+char *io_read_line(struct io_buffer *buf, size_t *len);
+void io_write(struct io_buffer *buf, const void *data, size_t len);
+void io_flush(struct io_buffer *buf);
+uint64_t probe_clock_ns(void);
+void execute_system_command(char *args[], struct redirect *redirects, int background);
+void execute_multiple_pipes(char **args[], int num_commands, struct redirect **redirects, int *background, int profile);
 void recursive_delete(const char *path, int depth);
 void recursive_copy(const char *src, const char *dest, int depth);
 char *command_generator(const char *text, int state);
-char **custom_completion(const char *text, int start, int end);
+char **custom_completion(const char *line, int start, int end);
 void sigchld_handler(int sig, siginfo_t *info, void *context);
+int argv_append(char ***argv, int *argc, int *cap, const char *word);
+void free_args(char **args);
+int wait_foreground(pid_t pid);
+int is_chunkable(char *args[]);
+int chunk_has_target(const char *command);
+int open_pidfd(pid_t pid);
+void await_children(const int *pidfds, int count, int timeout_ms);
+size_t argv_bytes(char *args[]);
+long arg_limit(void);
+int execute_chunked(char *args[], struct redirect *redirects, int jobs);
+int copy_file(const char *src, const char *dest);
+char *edit_line(void);
+void lex_line(const char *line, size_t len, unsigned char *classes);
+int command_exists(const char *name);
+int resolve_command(const char *name, char *out, size_t size);
+void report_not_found(const char *name, int error);
+int edit_distance(const char *a, const char *b, int transpose);
+struct bk_node *bk_insert(const char *name);
+int suggest_commands(const char *name, const char **out, int max);
+void refresh_command_index(void);
+void index_file(char *path, size_t size);
+int index_root(char *root);
+void index_scan_dir(struct index_scan *scan, char *path, size_t len);
+int index_build(struct index_scan *scan, const char *root);
+int index_write(const char *file, const char *root, char **paths, size_t count);
+int index_start(void);
+void index_stop(void);
+int index_map(void);
+int index_next(struct index_cursor *cur);
+int index_seek(struct index_cursor *cur, const char *key);
+char *filename_generator(const char *text, int state);
+char **completion_matches(const char *text, char *(*generator)(const char *, int));
+void add_history_entry(const char *line);
+void clear_history_entries(void);
+int meter_relay(int in_fd, int out_fd, unsigned long long *counter, int report);
+void wait_pipeline(pid_t *pids, int num_commands, pid_t *relay_pids, unsigned long long *edge_bytes,
+                   struct stage_profile *prof, int *held_fds);
+void sample_stages(pid_t *pids, int num_commands, int *stage_done, struct stage_profile *prof, int *held_fds, double interval);
+void report_profile(char **args[], int num_commands, struct stage_profile *prof);
+void format_bytes(double bytes, char *buf, size_t size);
+double now_seconds(void);
+void close_fds(int *fds, int count);
+void note_inherited_fds(void);
+void close_shell_fds(void);
+void run_command_line(char *command);
+int write_all(int fd, const void *data, size_t len);
+int record_session(const char *path);
+int replay_session(const char *path, double speed);
+char *next_list_separator(char *p);
+void run_pipeline(char *command);
+void execute_parsed(char **args[], int num_commands, struct redirect **redirects, int *background);
+unsigned long hash_string(const char *text);
+void profile_record(const char *text, char **args[], int num_commands, double wall, double child_cpu,
+                    unsigned long forks, unsigned long execs);
+void profile_report(void);
+void stats_append(const struct stats_record *record);
+void stats_query(char *args[]);
+void shellstat(char *args[]);
+size_t stats_column_offset(int column);
+
+// Command history kept by the line editor; entries are numbered from history_base
+static char *history_lines[MAX_HISTORY];
+static int history_count = 0;
+static int history_base = 1;
+
+// Prompt currently on screen and its width in terminal columns (escape sequences excluded)
+static char current_prompt[MAX_PATH + 32];
+static int current_prompt_width = 0;
+
+// Output format of record-listing builtins for the current call: text, JSON Lines, or NUL-separated first fields
+enum { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_NUL };
+static int output_mode = OUTPUT_TEXT;
+static int record_fields = 0;
+static struct io_buffer record_out = {.fd = STDOUT_FILENO};
+
+// Background jobs; done and status are written by the SIGCHLD handler
+#define MAX_JOBS 64
+struct job {
+    pid_t pid;
+    volatile sig_atomic_t done;
+    volatile sig_atomic_t status;
+    char *command;
+    time_t started;
+};
+static struct job jobs[MAX_JOBS];
+static int job_count = 0;
+
+// File index worker (set -o fileindex); the flags are shared with the worker thread
+static pthread_t index_thread;
+static int index_running = 0;
+static int index_wake[2] = {-1, -1};
+static int index_stop_requested = 0;
+static int index_live = 0;        // built, and inotify sees every change
+static int index_pending = 0;     // changes seen but not yet written
+// The index as mapped for locate and completion
+static struct {
+    char *map;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    const struct index_header *header;
+    const uint64_t *restarts;
+    uint64_t restart_count;
+} file_index;
+// Compressed redirection libraries and workers: this line's, and those still finishing for background commands
+static const char *const codec_suffixes[CODEC_COUNT] = {".zst", ".gz", ".lz4"};
+static struct zstd_api zstd_api;
+static struct zlib_api zlib_api;
+static struct lz4_api lz4_api;
+static struct codec_job *codec_active = NULL;
+static struct codec_job *codec_background = NULL;
+
+// Shell options toggled with set -o / set +o
+enum { OPT_PIPEMETER, OPT_PROFILE, OPT_STATSLOG, OPT_FILEINDEX, OPT_COUNT };
+static const char *option_names[OPT_COUNT] = {"pipemeter", "profile", "statslog", "fileindex"};
+static int shell_options[OPT_COUNT] = {0};
+
+// Bytes that crossed the pipes of the last metered pipeline (0 when not metered)
+static unsigned long long last_pipe_bytes = 0;
+
+static int stats_fd = -1;
+
+// Script being run (NULL when interactive) and the number of the line being executed
+static const char *script_name = NULL;
+static int script_line = 0;
+
+// Processes forked and programs exec'd by the shell, for the line profiler
+static unsigned long fork_count = 0, exec_count = 0;
+
+// Line profiler: one entry per script line, one per command name, collapsed stacks to profile_out
+struct profile_line {
+    char *text;                   // command line as written
+    char *stack;                  // stage names joined by '|'
+    unsigned long count, forks, execs;
+    double wall, child_cpu;
+};
+struct profile_command {
+    char *name;
+    unsigned long calls, forks;
+    double wall, child_cpu;
+};
+static struct profile_line *profile_lines = NULL;
+static int profile_line_cap = 0;
+static struct profile_command *profile_commands = NULL;
+static unsigned profile_command_cap = 0, profile_command_count = 0;
+static const char *profile_out = "myshell.folded";
+
+// Exit status of the last foreground command, aggregated across chunks and pipeline stages
+static int last_status = 0;
+
+static struct subsystem_stats shell_counters[SUB_COUNT] = {
+    [SUB_HISTORY] = {"history"}, [SUB_COMPLETION] = {"completion"}, [SUB_COMMAND_LOOKUP] = {"command_lookup"},
+    [SUB_GLOB] = {"glob"}, [SUB_PARSER] = {"parser"}, [SUB_STATSLOG] = {"statslog"}, [SUB_PROFILER] = {"profiler"},
+    [SUB_ARENA] = {"arena"}, [SUB_VARIABLES] = {"variables"}, [SUB_ARITH] = {"arith_cache"},
+    [SUB_READ] = {"read_ahead"}, [SUB_STATCACHE] = {"stat_cache"}, [SUB_PATTERN] = {"pattern_cache"},
+    [SUB_CMDINDEX] = {"command_index"}, [SUB_FILEINDEX] = {"file_index"}
+};
+// Heap in use at the end of the busiest command line since start (or --reset)
+static size_t heap_high_water = 0;
+
+// Probe semaphores: a tracer attaching to a probe raises its counter, so argument setup
+// (like timing) is skipped entirely when nobody is listening
+SHELL_PROBE_SEMAPHORE(parse__start);
+SHELL_PROBE_SEMAPHORE(parse__done);
+SHELL_PROBE_SEMAPHORE(glob);
+SHELL_PROBE_SEMAPHORE(spawn);
+SHELL_PROBE_SEMAPHORE(reap);
+SHELL_PROBE_SEMAPHORE(builtin__entry);
+SHELL_PROBE_SEMAPHORE(builtin__exit);
 
 // Global variables for command completion
-static const char *builtin_commands[] = {
-    "exit", "cd", "help", "mkdir", "rmdir", "touch", "cp", "mv", "rm", "writefile", "history", NULL
+static struct builtin builtins[MAX_BUILTINS] = {
+    {.name = "exit", .handler = builtin_exit, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "exit", .help = "Exit the shell"},
+    {.name = "cd", .handler = builtin_cd, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "cd [dir]", .help = "Change directory"},
+    {.name = "help", .handler = builtin_help, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_RECORDS,
+     .usage = "help [--json|-0]", .help = "Show this list"},
+    {.name = "mkdir", .handler = builtin_mkdir, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "mkdir [dir]", .help = "Create a folder"},
+    {.name = "rmdir", .handler = builtin_rmdir, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "rmdir [dir]", .help = "Delete an empty folder"},
+    {.name = "rm", .handler = builtin_rm, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "rm [-r] [file/dir]...", .help = "Delete files or folders (recursive with -r)"},
+    {.name = "touch", .handler = builtin_touch, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "touch [file]...", .help = "Create files"},
+    {.name = "cp", .handler = builtin_cp, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "cp [-r] [source]... [dest]", .help = "Copy files or folders (recursive with -r)"},
+    {.name = "mv", .handler = builtin_mv, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "mv [-r] [source] [dest]", .help = "Move/rename file or folder (recursive with -r)"},
+    {.name = "writefile", .handler = builtin_writefile, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "writefile [file]", .help = "Write text to a file"},
+    {.name = "history", .handler = builtin_history, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_RECORDS,
+     .usage = "history [--json|-0] [clear]", .help = "Show or clear command history"},
+    {.name = "jobs", .handler = builtin_jobs, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_RECORDS,
+     .usage = "jobs [--json|-0]", .help = "List background jobs and how they ended"},
+    {.name = "set", .handler = builtin_set, .flags = BUILTIN_NEEDS_PARENT | BUILTIN_RECORDS,
+     .usage = "set [--json|-0] [-o|+o option]",
+     .help = "Show or toggle shell options (pipemeter, profile, statslog, fileindex)"},
+    {.name = "locate", .handler = builtin_locate, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE | BUILTIN_RECORDS,
+     .usage = "locate [--json|-0] [-u] [-c] [-n count] pattern",
+     .help = "Find indexed paths by substring or glob (-u rebuilds the index)"},
+    {.name = "pack", .handler = builtin_pack, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "pack [-j jobs] [-l level] dir > dir.tzst",
+     .help = "Archive a folder to stdout as zstd-compressed tar chunks, read and compressed in parallel"},
+    {.name = "unpack", .handler = builtin_unpack, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE | BUILTIN_RECORDS,
+     .usage = "unpack [--json|-0] [-t] [-j jobs] [-C dir] [path]... < dir.tzst",
+     .help = "Extract (or -t list) a pack archive from stdin, writing files in parallel"},
+    {.name = "cmp", .handler = builtin_cmp, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "cmp [-s] file1 file2",
+     .help = "Report the first differing byte of two files (mapped, compared a block at a time)"},
+    {.name = "dircmp", .handler = builtin_dircmp, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE | BUILTIN_RECORDS,
+     .usage = "dircmp [--json|-0] [-m] [-j jobs] dir1 dir2",
+     .help = "List entries missing, extra or differing between two trees, compared in parallel (-m trusts mtime)"},
+    {.name = "meter", .handler = builtin_meter, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "... | meter | ...", .help = "Pipeline stage reporting bytes and bytes/s on stderr"},
+    {.name = "pipeprof", .handler = builtin_pipeprof, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "pipeprof [pipeline]", .help = "Report per-stage CPU and pipe waits, naming the bottleneck"},
+    {.name = "stats", .handler = builtin_stats, .flags = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE,
+     .usage = "stats [-w window] [command]", .help = "Latency percentiles, failures and CPU per command"},
+    {.name = "enable", .handler = builtin_enable, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "enable [-f plugin.so name...] [-d name]",
+     .help = "List builtins, load builtins from a plugin, or unload them"},
+    {.name = "let", .handler = builtin_let, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "let expr...", .help = "Evaluate arithmetic, ex: let i=i+1 (also (( expr )))"},
+    {.name = "read", .handler = builtin_read, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "read [-r] [-d delim] [-n count] [-a array] [-u fd] [name]...",
+     .help = "Read a line into variables, split on IFS"},
+    {.name = "mapfile", .handler = builtin_mapfile, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]",
+     .help = "Load lines into an array (MAPFILE by default)"},
+    {.name = "readarray", .handler = builtin_mapfile, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "readarray ...", .help = "Same as mapfile"},
+    {.name = "test", .handler = builtin_test, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "test expr", .help = "Check files, strings and integers (also [ expr ])"},
+    {.name = "[", .handler = builtin_test, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "[ expr ]", .help = "Same as test"},
+    {.name = "[[", .handler = builtin_test, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "[[ expr ]]", .help = "test with && || ( ), pattern == and regex =~ (no globbing or redirection inside)"},
+    {.name = "unset", .handler = builtin_unset, .flags = BUILTIN_NEEDS_PARENT,
+     .usage = "unset [name]...", .help = "Remove shell variables"},
+    {.name = "shellstat", .handler = builtin_shellstat, .flags = BUILTIN_PIPELINE_SAFE,
+     .usage = "shellstat [--json] [--reset]", .help = "Memory use and per-subsystem cache counters"},
+};
+static int builtin_count = 0;
+// Perfect hash over builtin names: slot -> index + 1 (0 = empty), rebuilt whenever the table changes
+static unsigned char builtin_slots[BUILTIN_SLOTS];
+static unsigned builtin_hash_seed = 0, builtin_hash_mask = 0;
+// Set in a forked pipeline stage that runs a builtin instead of exec'ing
+static int running_as_stage = 0;
+
+// Plugin stdin/stdout buffers and the scratch arena, plus the services table handed to plugins
+static struct io_buffer plugin_in = {.fd = STDIN_FILENO}, plugin_out = {.fd = STDOUT_FILENO};
+// The pipe or terminal stdin was when plugin_in's read-ahead was filled
+static dev_t plugin_in_dev;
+static ino_t plugin_in_ino;
+static struct arena_chunk *arena_head = NULL;
+static char *plugin_api_read_line(size_t *len) { return io_read_line(&plugin_in, len); }
+static void plugin_api_write(const void *data, size_t len) { io_write(&plugin_out, data, len); }
+static void plugin_api_print(const char *text) { io_write(&plugin_out, text, strlen(text)); }
+static void plugin_api_flush(void) { io_flush(&plugin_out); }
+static const struct myshell_api plugin_api = {
+    MYSHELL_PLUGIN_ABI, sizeof(struct myshell_api), plugin_api_read_line, plugin_api_write, plugin_api_print,
+    plugin_api_flush, arena_alloc, arena_strdup
 };
+// Shell variables (NAME=value, let, $(( )) assignments) and compiled arithmetic expressions
+static struct shell_var *variables[VAR_BUCKETS];
+static struct arith_program *arith_cache[ARITH_CACHE_SLOTS];
+static struct read_buffer read_buffers[READ_FDS];
+static struct stat_entry stat_cache[STAT_CACHE_SLOTS];
+static int stat_cache_count = 0, stat_cache_next = 0;
+static struct pattern *pattern_lru = NULL;
+static int pattern_count = 0;
+static struct bk_node *command_index = NULL;
+static struct command_source *command_sources = NULL;
+static int command_source_count = 0;
+static char *indexed_path = NULL;
+// Plugin whose completion hook is being asked, and the argument number being completed
+static const struct myshell_plugin *completing_plugin = NULL;
+static int completing_argn = 0;
 static char *system_commands[] = {"ls", "cat", "echo", "grep", "wc", NULL};
+// Descriptors above 2 the shell was started with, ascending; commands inherit these and no others
+#define INHERITED_FDS 64
+static int inherited_fds[INHERITED_FDS];
+static int inherited_fd_count = 0;
+// External commands whose operands may be split across several invocations when argv exceeds
+// ARG_MAX, matched by basename (the rm, touch, cp and mv builtins take any number in-process).
+// The ones in chunk_target_commands keep their last operand, a directory, in every batch
+static const char *chunkable_commands[] = {"rm", "rmdir", "touch", "cp", "mv", "ln", NULL};
+static const char *chunk_target_commands[] = {"cp", "mv", "ln", NULL};
 
 // main ()
-int main() {
+int main(int argc, char *argv[]) {
     char *command;
-    char *args[MAX_PIPES][MAX_ARGS];
-    char *input_files[MAX_PIPES] = {NULL};
-    char *output_files[MAX_PIPES] = {NULL};
-    int appends[MAX_PIPES] = {0};
-    int num_commands, background;
+    FILE *script = NULL;
+
+    // Command line: myshell [--profile] [--profile-out file] [--record file] [--replay file [--speed n]] [script]
+    const char *record_path = NULL, *replay_path = NULL;
+    double replay_speed = 1;
+    note_inherited_fds();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            shell_options[OPT_PROFILE] = 1;
+        } else if (strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) {
+            profile_out = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replay_speed = atof(argv[++i]);
+        } else if (!script) {
+            script_name = argv[i];
+            // Kept above 10 and away from commands, so redirections of 3-9 never touch it
+            int fd = open(script_name, O_RDONLY | O_CLOEXEC);
+            int high = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 10) : -1;
+            if (fd >= 0) close(fd);
+            script = high >= 0 ? fdopen(high, "r") : NULL;
+            if (!script) {
+                perror(script_name);
+                exit(127);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--profile] [--profile-out file] [--record file] [--replay file [--speed n]] [script]\n",
+                    argv[0]);
+            exit(2);
+        }
+    }
+    if (replay_path) exit(replay_session(replay_path, replay_speed));
+    // The recorder relays from here on; only its child carries on as the shell
+    if (record_path) record_session(record_path);
+    // A profiled run reports once, whichever way the shell exits
+    atexit(profile_report);
+    // Input read peeked at but handed out must be gone from a shared pipe when the shell exits
+    atexit(release_read_ahead);
 
-    // Limit command history
-    stifle_history(MAX_HISTORY);
+    // Build the builtin dispatch hash before the first command
+    seal_builtins();
+
+    // Decode UTF-8 input so the line editor can size wide characters
+    setlocale(LC_CTYPE, "");
 
     // [FIX: Use sigaction for safer signal handling]
     struct sigaction sa;
@@ -69,69 +993,541 @@ int main() {
         exit(1);
     }
 
+    if (script) {
+        // Scripts run line by line without prompts; '#' starts a comment line
+        size_t cap = 0;
+        command = NULL;
+        while (getline(&command, &cap, script) >= 0) {
+            script_line++;
+            command[strcspn(command, "\n")] = '\0';
+            char *text = command + strspn(command, " \t");
+            if (*text && *text != '#') {
+                run_command_line(text);
+            }
+        }
+        free(command);
+        fclose(script);
+        exit(last_status);
+    }
+
     // Print welcome message
     printf("          \033[1;35mWelcome to MyShell [Developed by Laden (^_^)]\033[0m          \n");
     printf("             \033[1;35mStay focused, keep coding (^_^)\033[0m              \n");
     fflush(stdout);
 
-    // Set up tab completion
-    rl_attempted_completion_function = custom_completion;
-
     while (1) {
         print_prompt();
         command = read_command();
-        if (!command || !*command) {
-            free(command);
-            continue;
+        if (!command) {
+            // End of input (Ctrl+D on an empty line, or end of a piped script)
+            printf("\nShutting down shell..(^_^)\n");
+            exit(last_status);
+        }
+        if (*command) {
+            script_line++;
+            run_command_line(command);
+        }
+        free(command);
+    }
+    return 0;
+}
+
+/*
+ * write_all - Writes len bytes, retrying short writes. Returns 0, or -1 with errno set.
+ */
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-        // Initialize args array
-        for (int c = 0; c < MAX_PIPES; c++) {
-            for (int j = 0; j < MAX_ARGS; j++) {
-                args[c][j] = NULL;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * splice_out - Moves exactly len bytes out of pipe_fd into out_fd, with splice while the target
+ * accepts it (*use_splice is cleared on the first EINVAL) and through buffer otherwise.
+ */
+static int splice_out(int pipe_fd, int out_fd, size_t len, int *use_splice, char *buffer, size_t size) {
+    while (len > 0) {
+        ssize_t n;
+        if (*use_splice) {
+            n = splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                *use_splice = 0;
+                continue;
             }
-            input_files[c] = NULL;
-            output_files[c] = NULL;
-            appends[c] = 0;
+        } else {
+            n = read(pipe_fd, buffer, len < size ? len : size);
+            if (n > 0 && write_all(out_fd, buffer, n) != 0) n = -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * record_event - Appends one record header (and, unless the payload was spliced, its bytes) to the log.
+ */
+static void record_event(int log_fd, int type, const void *data, size_t len, double *last) {
+    double now = now_seconds();
+    double delay = (now - *last) * 1e6;
+    *last = now;
+    struct record_header header = {delay > UINT32_MAX ? UINT32_MAX : (uint32_t)delay,
+                                   (uint32_t)len | ((uint32_t)type << RECORD_TYPE_SHIFT)};
+    struct iovec parts[2] = {{&header, sizeof(header)}, {(void *)data, data ? len : 0}};
+    while (writev(log_fd, parts, data ? 2 : 1) < 0 && errno == EINTR) {
+    }
+}
+
+static volatile sig_atomic_t record_resized = 0;
+static void record_winch(int sig) {
+    (void)sig;
+    record_resized = 1;
+}
+
+/*
+ * record_session - myshell --record file: runs the session on a pty the shell allocates itself.
+ * Returns 0 in the child, which goes on to be the shell on the pty's slave side. The parent relays
+ * the terminal and never returns: pty output is spliced into a pipe, tee'd to a second pipe, and
+ * spliced from the two to the terminal and the log, so output bytes are not copied through
+ * userspace (read/write take over where an end cannot splice). Keystrokes are logged too.
+ */
+int record_session(const char *path) {
+    int log_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (log_fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    // Append-only by discipline: splice refuses O_APPEND files, so seek to the end once
+    lseek(log_fd, 0, SEEK_END);
+    struct winsize ws = {24, 80, 0, 0};
+    ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    char *slave_name = master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0 ? ptsname(master) : NULL;
+    if (!slave_name) {
+        perror("pty allocation failed");
+        exit(1);
+    }
+    ioctl(master, TIOCSWINSZ, &ws);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(master);
+        close(log_fd);
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0 || ioctl(slave, TIOCSCTTY, 0) < 0) {
+            perror("pty setup failed");
+            _exit(1);
         }
-        num_commands = 0;
-        background = 0;
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO) close(slave);
+        return 0;
+    }
+
+    struct session_header session = {RECORD_MAGIC, (uint64_t)time(NULL), ws.ws_row, ws.ws_col, 0};
+    write_all(log_fd, &session, sizeof(session));
+    struct termios saved;
+    int raw = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (raw) {
+        struct termios t = saved;
+        cfmakeraw(&t);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = record_winch;
+    sigaction(SIGWINCH, &sa, NULL);
 
-        if (!parse_command(command, args, &num_commands, input_files, output_files, appends, &background)) {
-            // [FIX: Free input/output files on parse error]
-            for (int c = 0; c < MAX_PIPES; c++) {
-                if (input_files[c]) free(input_files[c]);
-                if (output_files[c]) free(output_files[c]);
+    int out_pipe[2] = {-1, -1}, log_pipe[2] = {-1, -1};
+    int use_splice = pipe2(out_pipe, O_CLOEXEC) == 0 && pipe2(log_pipe, O_CLOEXEC) == 0;
+    int splice_terminal = use_splice, splice_log = use_splice;
+    char buffer[IO_BUFFER_SIZE];
+    double last = now_seconds(), last_output = last, eof_sent = -1;
+    int input_open = 1;
+    while (1) {
+        if (!input_open && last_output > eof_sent) {
+            // Ctrl+D once the line editor is reading raw bytes: in canonical mode the pty would consume it
+            // before the editor starts. A command reading stdin in cooked mode gets it after a quiet second.
+            // Another goes out only after new output (the next prompt), until the shell exits.
+            struct termios t;
+            if ((tcgetattr(master, &t) == 0 && !(t.c_lflag & ICANON)) || now_seconds() - last_output > 1) {
+                write_all(master, "\004", 1);
+                eof_sent = now_seconds();
             }
-            free(command);
-            continue;
         }
-        if (num_commands > 1) {
-            execute_multiple_pipes(args, num_commands, input_files, output_files, appends, &background);
-        } else if (execute_builtin(args[0], background)) {
-            // Built-in command executed
-        } else {
-            execute_system_command(args[0], input_files[0], output_files[0], appends[0], background);
+        if (record_resized) {
+            record_resized = 0;
+            struct winsize now_ws;
+            if (ioctl(STDIN_FILENO, TIOCGWINSZ, &now_ws) == 0 &&
+                (now_ws.ws_row != ws.ws_row || now_ws.ws_col != ws.ws_col)) {
+                ws = now_ws;
+                ioctl(master, TIOCSWINSZ, &ws);
+                uint16_t size[2] = {ws.ws_row, ws.ws_col};
+                record_event(log_fd, RECORD_RESIZE, size, sizeof(size), &last);
+            }
+        }
+        struct pollfd fds[2] = {{master, POLLIN, 0}, {input_open ? STDIN_FILENO : -1, POLLIN, 0}};
+        if (poll(fds, 2, !input_open && last_output > eof_sent ? 50 : -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) {
+            last_output = now_seconds();
+            // Reading the master fails with EIO once the shell and everything it started have exited
+            ssize_t n;
+            if (use_splice) {
+                n = splice(master, NULL, out_pipe[1], NULL, sizeof(buffer), 0);
+                if (n < 0 && errno == EINVAL) {
+                    use_splice = 0;
+                    continue;
+                }
+                ssize_t teed = n > 0 ? tee(out_pipe[0], log_pipe[1], n, 0) : 0;
+                if (n > 0 && teed != n) {
+                    // Never short with both pipes drained each round, but stay correct if it is: drop
+                    // exactly what tee copied (nothing when it failed) so no read here can block
+                    char scratch[IO_BUFFER_SIZE];
+                    for (ssize_t left = teed; left > 0;) {
+                        ssize_t got = read(log_pipe[0], scratch, left < (ssize_t)sizeof(scratch) ? left : (ssize_t)sizeof(scratch));
+                        if (got <= 0) break;
+                        left -= got;
+                    }
+                    n = read(out_pipe[0], buffer, n);
+                    if (n > 0) {
+                        record_event(log_fd, RECORD_OUTPUT, buffer, n, &last);
+                        write_all(STDOUT_FILENO, buffer, n);
+                    }
+                } else if (n > 0) {
+                    record_event(log_fd, RECORD_OUTPUT, NULL, n, &last);
+                    if (splice_out(log_pipe[0], log_fd, n, &splice_log, buffer, sizeof(buffer)) != 0 ||
+                        splice_out(out_pipe[0], STDOUT_FILENO, n, &splice_terminal, buffer, sizeof(buffer)) != 0) {
+                        break;
+                    }
+                }
+            } else {
+                n = read(master, buffer, sizeof(buffer));
+                if (n > 0) {
+                    record_event(log_fd, RECORD_OUTPUT, buffer, n, &last);
+                    write_all(STDOUT_FILENO, buffer, n);
+                }
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n > 0) {
+                // Lines typed with echo off (password prompts) are not logged; the line editor's raw
+                // mode turns echo off too, but it is not canonical
+                struct termios child;
+                if (tcgetattr(master, &child) != 0 || (child.c_lflag & (ICANON | ECHO)) != ICANON) {
+                    record_event(log_fd, RECORD_INPUT, buffer, n, &last);
+                }
+                write_all(master, buffer, n);
+            } else if (n == 0 || errno != EINTR) {
+                // Input ran out (a piped session): end of file for the shell, as Ctrl+D would be
+                input_open = 0;
+            }
+        }
+    }
+    record_event(log_fd, RECORD_END, NULL, 0, &last);
+    if (raw) tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    close(log_fd);
+    close(master);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+/*
+ * replay_session - myshell --replay file: plays back the output of every session in a log with
+ * its original pauses, divided by speed. Returns the exit status.
+ */
+int replay_session(const char *path, double speed) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct session_header session;
+    char buffer[IO_BUFFER_SIZE];
+    int status = 0;
+    while (read(fd, &session, sizeof(session)) == (ssize_t)sizeof(session)) {
+        if (memcmp(session.magic, RECORD_MAGIC, sizeof(session.magic)) != 0) {
+            fprintf(stderr, "%s: not a session log\n", path);
+            status = 1;
+            break;
         }
-        // Free allocated arguments and redirection files
-        for (int c = 0; c < num_commands; c++) {
-            for (int j = 0; args[c][j]; j++) {
-                if (args[c][j]) {
-                    free(args[c][j]);
-                    args[c][j] = NULL;
+        struct record_header header;
+        while (read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)) {
+            int type = header.size >> RECORD_TYPE_SHIFT;
+            size_t len = header.size & RECORD_SIZE_MASK;
+            if (type == RECORD_END) break;
+            if (type == RECORD_OUTPUT && header.delay_us > 0 && speed > 0) {
+                double pause = header.delay_us / 1e6 / speed;
+                struct timespec ts = {(time_t)pause, (long)((pause - (time_t)pause) * 1e9)};
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
                 }
             }
-            if (input_files[c]) {
-                free(input_files[c]);
-                input_files[c] = NULL;
+            // Keystrokes are skipped: the terminal's echo of them is already in the output
+            while (len > 0) {
+                ssize_t n = read(fd, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+                if (n <= 0) {
+                    len = 0;
+                    break;
+                }
+                if (type == RECORD_OUTPUT) write_all(STDOUT_FILENO, buffer, n);
+                len -= n;
             }
-            if (output_files[c]) {
-                free(output_files[c]);
-                output_files[c] = NULL;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+/*
+ * run_command_line - Runs a command list: pipelines joined by ';', '&&' and '||', evaluated left
+ * to right ('&&' runs the next pipeline only after success, '||' only after failure).
+ */
+void run_command_line(char *command) {
+    char *copy = strdup(command);
+    if (!copy) {
+        perror("strdup failed");
+        return;
+    }
+    // File tests share stat results within one list only
+    clear_stat_cache();
+    char *segment = copy;
+    int connector = ';';
+    for (;;) {
+        char *end = next_list_separator(segment);
+        int next = *end;
+        *end = '\0';
+        char *text = segment + strspn(segment, " \t");
+        if (*text) {
+            if (connector == ';' || (connector == '&' && last_status == 0) || (connector == '|' && last_status != 0)) {
+                run_pipeline(text);
             }
+        } else if (connector != ';' || next == '&' || next == '|') {
+            fprintf(stderr, "parse error: missing command near '%s'\n", next == ';' ? ";" : next == '&' ? "&&" : "||");
+            last_status = 2;
+            break;
         }
-        free(command);
+        if (!next) break;
+        connector = next;
+        segment = end + (next == ';' ? 1 : 2);
     }
-    return 0;
+    clear_stat_cache();
+    free(copy);
+}
+
+/*
+ * next_list_separator - Finds the next top-level ';', '&&' or '||' in a command list, skipping
+ * $(( )), ${ } and [[ ]], whose own operators belong to them, quoted text and backslash-escaped
+ * characters ("find -exec rm {} \;"). Returns the end of the string when there is none.
+ */
+char *next_list_separator(char *p) {
+    char *start = p;
+    char quote = 0;
+    while (*p) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+            p++;
+            continue;
+        }
+        if (*p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'' || *p == '"') {
+            quote = *p++;
+            continue;
+        }
+        if (p[0] == '$' && (p[1] == '(' || p[1] == '{')) {
+            // Skip to the matching close, counting nested opens
+            char open = p[1], close = open == '(' ? ')' : '}';
+            int depth = 0;
+            for (p++; *p; p++) {
+                if (*p == open) depth++;
+                if (*p == close && --depth == 0) break;
+            }
+            if (*p) p++;
+            continue;
+        }
+        int word_start = p == start || p[-1] == ' ' || p[-1] == '\t';
+        if (word_start && p[0] == '[' && p[1] == '[' && (p[2] == ' ' || p[2] == '\t')) {
+            // [[ runs to the word "]]"
+            char *close = p + 2;
+            while ((close = strstr(close, "]]")) && !((close[-1] == ' ' || close[-1] == '\t') &&
+                                                      (!close[2] || strchr(" \t;&|", close[2])))) {
+                close += 2;
+            }
+            p = close ? close + 2 : p + strlen(p);
+            continue;
+        }
+        if (*p == ';' || (p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|')) return p;
+        p++;
+    }
+    return p;
+}
+
+/*
+ * run_pipeline - Parses and executes one pipeline, charging it to the profile and the stats log.
+ * "(( ))" and "[[ ]]" lines run in the shell without a pipeline but are charged the same way.
+ */
+void run_pipeline(char *command) {
+    int num_commands = 0, background = 0, max_commands = 0;
+    char ***args = NULL;
+    struct redirect **redirects = NULL;
+    char *expanded = NULL;
+
+    // Snapshot the counters the line is charged with in the profile and the stats log
+    double started = now_seconds();
+    struct timeval wall_start;
+    struct rusage children_before;
+    unsigned long forks_before = fork_count, execs_before = exec_count;
+    gettimeofday(&wall_start, NULL);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    last_pipe_bytes = 0;
+
+    // "(( expr ))" is an arithmetic command rather than a pipeline. [[ ]] splits its own words
+    // before expanding them: its && || < > are operators, its patterns are not globs and its
+    // operands are never split
+    int done = arith_command(command) || run_cond_command(command);
+    // Variables and $(( )) are expanded on the raw line, before words and pipes are split; the
+    // operators in their values are protected so they split into words but never into syntax
+    if (!done && strchr(command, '$') && expand_line(command, &expanded, 1) != 0) {
+        last_status = 1;
+        done = 1;
+    }
+    if (!done) {
+        // Stage arrays are sized from the '|' count, so a pipeline has no fixed stage limit
+        const char *line = expanded ? expanded : command;
+        max_commands = 1;
+        for (const char *p = line; *p; p++) max_commands += *p == '|';
+        args = calloc(max_commands, sizeof(char **));
+        redirects = calloc(max_commands, sizeof(struct redirect *));
+        if (!args || !redirects) {
+            perror("calloc failed");
+            last_status = 1;
+        } else {
+            uint64_t parse_started = SHELL_PROBE_ENABLED(parse__done) ? probe_clock_ns() : 0;
+            SHELL_PROBE(parse__start, command);
+            int parsed = parse_command(line, args, &num_commands, redirects, &background, max_commands);
+            SHELL_PROBE(parse__done, parsed, num_commands, parse_started ? probe_clock_ns() - parse_started : 0);
+            if (parsed) execute_parsed(args, num_commands, redirects, &background);
+            else num_commands = 0;
+        }
+    }
+
+    double elapsed = now_seconds() - started;
+    struct rusage children_after;
+    getrusage(RUSAGE_CHILDREN, &children_after);
+    int64_t utime_us = (children_after.ru_utime.tv_sec - children_before.ru_utime.tv_sec) * 1000000LL +
+                       (children_after.ru_utime.tv_usec - children_before.ru_utime.tv_usec);
+    int64_t stime_us = (children_after.ru_stime.tv_sec - children_before.ru_stime.tv_sec) * 1000000LL +
+                       (children_after.ru_stime.tv_usec - children_before.ru_stime.tv_usec);
+    if (shell_options[OPT_PROFILE]) {
+        profile_record(command, args, num_commands, elapsed, (utime_us + stime_us) / 1e6,
+                       fork_count - forks_before, exec_count - execs_before);
+    }
+    // Background lines are not waited for, so they have no duration or status to log. Lines
+    // without a pipeline are logged under their first word, "((" or "[["
+    char first_word[16];
+    snprintf(first_word, sizeof(first_word), "%.*s", (int)strcspn(command, " \t"), command);
+    const char *name = num_commands ? args[0][0] : first_word;
+    if (shell_options[OPT_STATSLOG] && !background && name && *name) {
+        struct stats_record record;
+        memset(&record, 0, sizeof(record));
+        char cwd[MAX_PATH];
+        record.start_us = wall_start.tv_sec * 1000000LL + wall_start.tv_usec;
+        record.duration_us = elapsed * 1e6;
+        record.status = last_status;
+        record.utime_us = utime_us;
+        record.stime_us = stime_us;
+        record.maxrss_kb = children_after.ru_maxrss;
+        record.pipe_bytes = last_pipe_bytes;
+        record.cwd_hash = getcwd(cwd, sizeof(cwd)) ? hash_string(cwd) : 0;
+        record.cmd_hash = hash_string(name);
+        snprintf(record.name, sizeof(record.name), "%s", name);
+        stats_append(&record);
+    }
+
+    // Heap high-water is sampled while the line's allocations are still live
+    struct mallinfo2 heap = mallinfo2();
+    if (heap.uordblks + heap.hblkhd > heap_high_water) heap_high_water = heap.uordblks + heap.hblkhd;
+    arena_reset();
+    free(expanded);
+
+    // Free allocated arguments and redirections, including those of a failed parse
+    for (int c = 0; args && redirects && c < max_commands; c++) {
+        free_args(args[c]);
+        free_redirects(redirects[c]);
+    }
+    free(args);
+    free(redirects);
+}
+
+/*
+ * execute_parsed - Runs a parsed pipeline: a "pipeprof" prefix, variable assignments, builtins
+ * (with their redirections applied around them), external commands or a multi-stage pipeline.
+ */
+void execute_parsed(char **args[], int num_commands, struct redirect **redirects, int *background) {
+    // "pipeprof" prefixes a pipeline to be profiled; drop the word before executing
+    int profile = 0;
+    if (args[0][0] && args[0][1] && strcmp(args[0][0], "pipeprof") == 0) {
+        int argc = 0;
+        while (args[0][argc]) argc++;
+        free(args[0][0]);
+        memmove(args[0], args[0] + 1, argc * sizeof(char *));
+        profile = !*background;
+    }
+    // Only read shares the read-ahead; anything else must find stdin where read left it
+    if (num_commands > 1 || !args[0][0] || strcmp(args[0][0], "read") != 0) release_read_ahead();
+    // Cached stat results survive only a run of tests; other commands may change files
+    if (num_commands > 1 || !args[0][0] || lookup_builtin(args[0][0]) == NULL ||
+        lookup_builtin(args[0][0])->handler != builtin_test) {
+        clear_stat_cache();
+    }
+    // Compressed files are opened, and their workers started, before any command runs
+    if (start_codecs(redirects, num_commands, *background) != 0) {
+        last_status = 1;
+    } else if (num_commands > 1 || profile) {
+        execute_multiple_pipes(args, num_commands, redirects, background, profile);
+    } else if (assign_variables(args[0])) {
+        // Every word was NAME=value
+    } else if (redirects[0] && args[0][0] && lookup_builtin(args[0][0])) {
+        // Builtins run in the shell, so their redirections are applied around the call and undone
+        int count = 0;
+        for (const struct redirect *r = redirects[0]; r; r = r->next) count++;
+        struct saved_fd saved[count];
+        if (redirect_builtin(redirects[0], saved, &count) == 0) {
+            execute_builtin(args[0], *background);
+            restore_redirect(saved, count);
+        } else {
+            last_status = 1;
+        }
+    } else if (execute_builtin(args[0], *background)) {
+        // Built-in command executed
+    } else {
+        execute_system_command(args[0], redirects[0], *background);
+    }
+    if (finish_codecs()) last_status = 1;
 }
 
 /*
@@ -143,19 +1539,40 @@ void print_prompt() {
         perror("getcwd failed");
         return;
     }
-    printf("\033[1;33m%s->$\033[0m ", cwd);
+    snprintf(current_prompt, sizeof(current_prompt), "\033[1;33m%s->$\033[0m ", cwd);
+    // Remember the visible width so the line editor can address columns after the prompt
+    current_prompt_width = 0;
+    mbstate_t mb;
+    memset(&mb, 0, sizeof(mb));
+    for (const char *p = current_prompt; *p;) {
+        if (*p == '\033') {
+            while (*p && *p != 'm') p++;
+            if (*p) p++;
+            continue;
+        }
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, p, strlen(p), &mb);
+        if (n == (size_t)-1 || n == (size_t)-2 || n == 0) {
+            memset(&mb, 0, sizeof(mb));
+            n = 1;
+            wc = '?';
+        }
+        int w = wcwidth(wc);
+        current_prompt_width += w > 0 ? w : 0;
+        p += n;
+    }
+    printf("%s", current_prompt);
     fflush(stdout);
 }
 
 /*
- * read_command - Reads user input using readline for tab completion and history.
+ * read_command - Reads user input with the built-in line editor for tab completion and history.
  */
 char *read_command() {
-    char *command = readline("");
+    char *command = edit_line();
     if (command) {
-        printf("Debug: read_command got: '%s'\n", command);
         if (*command) {
-            add_history(command);
+            add_history_entry(command);
         }
     }
     return command;
@@ -163,19 +1580,17 @@ char *read_command() {
 
 /*
  * parse_command - Parses input command into arguments, redirection, pipes, and background flags.
+ * The arrays hold max_commands stages, one more than the number of '|' in command.
  */
-int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char **input_files, char **output_files, int *appends, int *background) {
+int parse_command(const char *command, char **args[], int *num_commands, struct redirect **redirects, int *background,
+                  int max_commands) {
     int i = 0, cmd_idx = 0;
     *background = 0;
 
     // Initialize arrays
-    for (int c = 0; c < MAX_PIPES; c++) {
-        for (int j = 0; j < MAX_ARGS; j++) {
-            args[c][j] = NULL;
-        }
-        input_files[c] = NULL;
-        output_files[c] = NULL;
-        appends[c] = 0;
+    for (int c = 0; c < max_commands; c++) {
+        args[c] = NULL;
+        redirects[c] = NULL;
     }
 
     char *cmd_copy = strdup(command);
@@ -185,9 +1600,9 @@ int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char
     }
 
     // Split by pipes
-    char *cmd_tokens[MAX_PIPES];
+    char *cmd_tokens[max_commands + 1];
     cmd_tokens[cmd_idx] = strtok(cmd_copy, "|");
-    while (cmd_tokens[cmd_idx] && cmd_idx < MAX_PIPES - 1) {
+    while (cmd_tokens[cmd_idx] && cmd_idx < max_commands) {
         cmd_tokens[++cmd_idx] = strtok(NULL, "|");
     }
     *num_commands = cmd_idx;
@@ -198,6 +1613,7 @@ int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char
 
     for (int c = 0; c < *num_commands; c++) {
         i = 0;
+        int cap = MAX_ARGS;
         if (!cmd_tokens[c]) continue;
 
         // Trim whitespace
@@ -212,77 +1628,96 @@ int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char
 
         // Tokenize
         char *sub_copy = strdup(trimmed);
-        if (!sub_copy) {
+        args[c] = malloc(cap * sizeof(char *));
+        if (!sub_copy || !args[c]) {
             perror("strdup failed");
+            free(sub_copy);
             free(cmd_copy);
             return 0;
         }
+        args[c][0] = NULL;
         char *token = strtok(sub_copy, " \t\n");
-        int prev_was_redirect = 0; // [FIX: Track redirection operators]
-        while (token && i < MAX_ARGS - 1) {
-            if (strcmp(token, ">") == 0) {
-                token = strtok(NULL, " \t\n");
-                if (!token) {
-                    fprintf(stderr, "parse error: missing output file after '>'\n");
-                    free(sub_copy);
-                    free(cmd_copy);
-                    return 0;
+        while (token) {
+            struct redirect r;
+            int both;
+            const char *target = parse_redirect(token, &r, &both);
+            if (target) {
+                // The target is either attached ("2>err", "2>&1") or the next word
+                const char *op = token;
+                if (!*target) target = strtok(NULL, " \t\n");
+                int ok = target != NULL;
+                if (!ok) {
+                    fprintf(stderr, "parse error: missing target after '%s'\n", op);
+                } else if (r.kind == REDIR_DUP && strcmp(target, "-") == 0) {
+                    ok = add_redirect(&redirects[c], r.fd, REDIR_CLOSE, -1, NULL) == 0;
+                } else if (r.kind == REDIR_DUP && isdigit((unsigned char)target[0])) {
+                    char *digits_end;
+                    long source = strtol(target, &digits_end, 10);
+                    ok = *digits_end == '\0' && source <= INT_MAX;
+                    if (!ok) fprintf(stderr, "parse error: bad file descriptor '%s'\n", target);
+                    else ok = add_redirect(&redirects[c], r.fd, REDIR_DUP, (int)source, NULL) == 0;
+                } else if (r.kind == REDIR_DUP && !(r.fd == STDOUT_FILENO && op[0] == '>')) {
+                    fprintf(stderr, "parse error: bad file descriptor '%s'\n", target);
+                    ok = 0;
+                } else {
+                    // ">&file" is the old spelling of "&>file"
+                    if (r.kind == REDIR_DUP) {
+                        r.kind = REDIR_OUTPUT;
+                        both = 1;
+                    }
+                    ok = add_redirect(&redirects[c], r.fd, r.kind, -1, target) == 0;
+                    if (ok && both) ok = add_redirect(&redirects[c], STDERR_FILENO, REDIR_DUP, STDOUT_FILENO, NULL) == 0;
                 }
-                output_files[c] = strdup(token);
-                appends[c] = 0;
-                prev_was_redirect = 1;
-                break;
-            } else if (strcmp(token, ">>") == 0) {
-                token = strtok(NULL, " \t\n");
-                if (!token) {
-                    fprintf(stderr, "parse error: missing output file after '>>'\n");
+                if (!ok) {
                     free(sub_copy);
                     free(cmd_copy);
                     return 0;
                 }
-                output_files[c] = strdup(token);
-                appends[c] = 1;
-                prev_was_redirect = 1;
-                break;
-            } else if (strcmp(token, "<") == 0) {
                 token = strtok(NULL, " \t\n");
-                if (!token) {
-                    fprintf(stderr, "parse error: missing input file after '<'\n");
+                continue;
+            } else if (strcmp(token, "&") == 0 && c == *num_commands - 1) {
+                *background = 1;
+                break;
+            } else if (strcmp(token, "\\;") == 0 || strcmp(token, "';'") == 0 || strcmp(token, "\";\"") == 0) {
+                // The list splitter left this ';' alone for the command, ex: find -exec ... \;
+                if (!argv_append(&args[c], &i, &cap, ";")) {
                     free(sub_copy);
                     free(cmd_copy);
                     return 0;
                 }
-                input_files[c] = strdup(token);
-                prev_was_redirect = 1;
-                break;
-            } else if (strcmp(token, "&") == 0 && c == *num_commands - 1) {
-                *background = 1;
-                break;
-            } else if (prev_was_redirect) {
-                fprintf(stderr, "parse error: unexpected token '%s' after redirection\n", token);
-                free(sub_copy);
-                free(cmd_copy);
-                return 0;
+                token = strtok(NULL, " \t\n");
+                continue;
             }
             glob_t glob_result;
             int has_wildcard = (strchr(token, '*') || strchr(token, '?') || strchr(token, '['));
+            int ok = 1;
+            // Glob expansion is unbounded; the executor chunks argv that exceeds ARG_MAX. Globs are
+            // not cached, so the glob counters are matched versus unmatched patterns; an unmatched
+            // one stays literal, as GLOB_NOCHECK would leave it
             if (has_wildcard) {
-                if (glob(token, GLOB_NOCHECK | GLOB_TILDE, NULL, &glob_result) == 0) {
-                    for (size_t j = 0; j < glob_result.gl_pathc && i < MAX_ARGS - 1; j++) {
-                        args[c][i++] = strdup(glob_result.gl_pathv[j]);
+                if (glob(token, GLOB_TILDE, NULL, &glob_result) == 0) {
+                    SHELL_PROBE(glob, token, glob_result.gl_pathc);
+                    shell_counters[SUB_GLOB].hits++;
+                    shell_counters[SUB_GLOB].entries = glob_result.gl_pathc;
+                    for (size_t j = 0; ok && j < glob_result.gl_pathc; j++) {
+                        ok = argv_append(&args[c], &i, &cap, glob_result.gl_pathv[j]);
                     }
                     globfree(&glob_result);
                 } else {
-                    args[c][i++] = strdup(token);
+                    shell_counters[SUB_GLOB].misses++;
+                    ok = argv_append(&args[c], &i, &cap, token);
                     globfree(&glob_result);
                 }
             } else {
-                args[c][i++] = strdup(token);
+                ok = argv_append(&args[c], &i, &cap, token);
+            }
+            if (!ok) {
+                free(sub_copy);
+                free(cmd_copy);
+                return 0;
             }
-            prev_was_redirect = 0;
             token = strtok(NULL, " \t\n");
         }
-        args[c][i] = NULL;
         free(sub_copy);
     }
     free(cmd_copy);
@@ -291,571 +1726,8338 @@ int parse_command(char *command, char *args[][MAX_ARGS], int *num_commands, char
         return 0;
     }
 
-    // Debug print
-    for (int c = 0; c < *num_commands; c++) {
-        printf("Debug: Command %d: ", c);
-        for (int j = 0; args[c][j]; j++) {
-            printf("'%s' ", args[c][j]);
-        }
-        printf("\n");
+    return 1;
+}
+
+/*
+ * parse_redirect - Recognizes a word starting with a redirection operator, optionally after a
+ * descriptor number: "<", "2>", ">>", "0<>", "2>&", "<&", "&>", "&>>". Fills r->fd and r->kind
+ * (REDIR_DUP for the >& and <& forms) and sets *both for &> and &>>. Returns the text after the
+ * operator, "" when the target is the next word, or NULL when token is an ordinary word.
+ */
+const char *parse_redirect(const char *token, struct redirect *r, int *both) {
+    const char *p = token;
+    long fd = -1;
+    *both = 0;
+    if (isdigit((unsigned char)*p)) {
+        fd = 0;
+        while (isdigit((unsigned char)*p) && fd <= INT_MAX) fd = fd * 10 + (*p++ - '0');
+        if (fd > INT_MAX || (*p != '<' && *p != '>')) return NULL;
+    } else if (p[0] == '&' && p[1] == '>') {
+        *both = 1;
+        p++;
     }
-    printf("Debug: Background: %d\n", *background);
-    for (int c = 0; c < *num_commands; c++) {
-        printf("Debug: Command %d - Input file: %s, Output file: %s, Append: %d\n",
-               c, input_files[c] ? input_files[c] : "none",
-               output_files[c] ? output_files[c] : "none",
-               appends[c]);
+    // Operators starting with '<' redirect stdin unless a descriptor is given
+    int input_side = p[0] == '<';
+    if (p[0] == '<' && p[1] == '>') {
+        r->kind = REDIR_READWRITE;
+        p += 2;
+    } else if (p[0] == '<' && p[1] == '&') {
+        r->kind = REDIR_DUP;
+        p += 2;
+    } else if (p[0] == '<') {
+        r->kind = REDIR_INPUT;
+        p++;
+    } else if (p[0] == '>' && p[1] == '>') {
+        r->kind = REDIR_APPEND;
+        p += 2;
+    } else if (p[0] == '>' && p[1] == '&' && !*both) {
+        r->kind = REDIR_DUP;
+        p += 2;
+    } else if (p[0] == '>') {
+        r->kind = REDIR_OUTPUT;
+        p++;
+    } else {
+        return NULL;
     }
+    r->fd = fd >= 0 ? (int)fd : input_side ? STDIN_FILENO : STDOUT_FILENO;
+    return p;
+}
 
-    return 1;
+/*
+ * add_redirect - Appends a redirection to the end of a command's list. Returns 0, or -1 when out of memory.
+ */
+int add_redirect(struct redirect **list, int fd, int kind, int source, const char *file) {
+    struct redirect *r = calloc(1, sizeof(struct redirect));
+    if (!r || (file && !(r->file = strdup(file)))) {
+        perror("malloc failed");
+        free(r);
+        return -1;
+    }
+    if (r->file) unprotect_word(r->file);
+    r->fd = fd;
+    r->kind = kind;
+    r->source = source;
+    while (*list) list = &(*list)->next;
+    *list = r;
+    return 0;
 }
 
 /*
- * execute_builtin - Executes built-in commands like exit, cd, help, etc.
+ * free_redirects - Frees a command's redirection list.
  */
-int execute_builtin(char *args[], int background) {
-    if (args[0] == NULL) return 1;
+void free_redirects(struct redirect *list) {
+    while (list) {
+        struct redirect *next = list->next;
+        free(list->file);
+        free(list);
+        list = next;
+    }
+}
 
-    printf("Debug: execute_builtin called with args[0] = '%s'\n", args[0] ? args[0] : "NULL");
-
-    if (strcmp(args[0], "exit") == 0) {
-        printf("Shutting down shell..(^_^)\n");
-        exit(0);
-    } else if (strcmp(args[0], "cd") == 0) {
-        char *dir = args[1] ? args[1] : getenv("HOME");
-        if (chdir(dir) != 0) {
-            perror("chdir failed");
-        }
-        return 1;
-    } else if (strcmp(args[0], "help") == 0) {
-        printf("\033[1;32mAvailable commands:\033[0m\n");
-        printf("  exit - Exit the shell\n");
-        printf("  cd [dir] - Change directory\n");
-        printf("  mkdir [dir] - Create a folder\n");
-        printf("  rmdir [dir] - Delete an empty folder\n");
-        printf("  rm [-r] [file/dir] - Delete file or folder (recursive with -r)\n");
-        printf("  touch [file] - Create a file\n");
-        printf("  cp [-r] [source] [dest] - Copy file or folder (recursive with -r)\n");
-        printf("  mv [-r] [source] [dest] - Move/rename file or folder (recursive with -r)\n");
-        printf("  writefile [file] - Write text to a file\n");
-        printf("  history - Show command history\n");
-        printf("  history clear - Clear command history\n");
-        printf("  Supports: Redirection (<, >, >>), multiple pipes (|), wildcards (*.txt), background (&)\n");
-        return 1;
-    } else if (strcmp(args[0], "mkdir") == 0) {
-        if (args[1] == NULL) {
-            printf("Usage: mkdir [directory]\n");
-            return 1;
-        }
-        if (mkdir(args[1], 0755) != 0) {
-            perror("mkdir failed");
-        }
-        return 1;
-    } else if (strcmp(args[0], "rmdir") == 0) {
-        if (args[1] == NULL) {
-            printf("Usage: rmdir [directory]\n");
-            return 1;
+/*
+ * apply_redirects - Performs a command's redirections in order. With saved, each descriptor is
+ * first copied above 10 (close-on-exec) so restore_redirects can put it back; children pass NULL.
+ * Returns 0, or -1 after reporting the first redirection that fails.
+ */
+int apply_redirects(const struct redirect *list, struct saved_fd *saved, int *saved_count) {
+    static const int open_flags[] = {
+        [REDIR_INPUT] = O_RDONLY, [REDIR_OUTPUT] = O_WRONLY | O_CREAT | O_TRUNC,
+        [REDIR_APPEND] = O_WRONLY | O_CREAT | O_APPEND, [REDIR_READWRITE] = O_RDWR | O_CREAT
+    };
+    for (const struct redirect *r = list; r; r = r->next) {
+        if (saved) {
+            int i = 0;
+            while (i < *saved_count && saved[i].fd != r->fd) i++;
+            if (i == *saved_count) {
+                int copy = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+                if (copy < 0 && errno != EBADF) {
+                    perror("dup failed");
+                    return -1;
+                }
+                saved[i].fd = r->fd;
+                saved[i].copy = copy;
+                (*saved_count)++;
+            }
         }
-        if (rmdir(args[1]) != 0) {
-            perror("rmdir failed");
+        if (r->kind == REDIR_CLOSE) {
+            close(r->fd);
+            continue;
         }
-        return 1;
-    } else if (strcmp(args[0], "touch") == 0) {
-        if (args[1] == NULL) {
-            printf("Usage: touch [file]\n");
-            return 1;
+        if (r->kind == REDIR_DUP) {
+            int ok = r->source == r->fd ? fcntl(r->fd, F_GETFD) >= 0 : dup2(r->source, r->fd) >= 0;
+            if (!ok) {
+                fprintf(stderr, "%d: %s\n", r->source, strerror(errno));
+                return -1;
+            }
+            continue;
         }
-        int fd = open(args[1], O_CREAT | O_WRONLY, 0644);
+        int fd = open(r->file, open_flags[r->kind], 0644);
         if (fd < 0) {
-            perror("touch failed");
-        } else {
-            close(fd);
-        }
-        return 1;
-    } else if (strcmp(args[0], "cp") == 0) {
-        int recursive = 0;
-        int arg_start = 1;
-        if (args[1] && strcmp(args[1], "-r") == 0) {
-            recursive = 1;
-            arg_start = 2;
-        }
-        if (args[arg_start] == NULL || args[arg_start + 1] == NULL) {
-            printf("Usage: cp [-r] [source] [destination]\n");
-            return 1;
+            perror(r->file);
+            return -1;
         }
-        if (recursive) {
-            recursive_copy(args[arg_start], args[arg_start + 1], 0);
-        } else {
-            struct stat st;
-            if (stat(args[arg_start], &st) != 0) {
-                perror("cp: cannot stat source");
-                return 1;
-            }
-            int src_fd = open(args[arg_start], O_RDONLY);
-            if (src_fd < 0) {
-                perror("cp: cannot open source");
-                return 1;
-            }
-            struct stat dest_st;
-            char final_dest[MAX_PATH];
-            if (stat(args[arg_start + 1], &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
-                snprintf(final_dest, sizeof(final_dest), "%s/%s", args[arg_start + 1], strrchr(args[arg_start], '/') ? strrchr(args[arg_start], '/') + 1 : args[arg_start]);
-                if (snprintf(final_dest, sizeof(final_dest), "%s/%s", args[arg_start + 1], strrchr(args[arg_start], '/') ? strrchr(args[arg_start], '/') + 1 : args[arg_start]) >= sizeof(final_dest)) {
-                    fprintf(stderr, "cp: destination path too long\n");
-                    close(src_fd);
-                    return 1;
-                }
-            } else {
-                strncpy(final_dest, args[arg_start + 1], sizeof(final_dest));
-            }
-            int dest_fd = open(final_dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
-            if (dest_fd < 0) {
-                perror("cp: cannot open destination");
-                close(src_fd);
-                return 1;
-            }
-            char buffer[1024];
-            ssize_t bytes;
-            while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
-                if (write(dest_fd, buffer, bytes) != bytes) {
-                    perror("cp: write failed");
-                    close(src_fd);
-                    close(dest_fd);
-                    return 1;
-                }
-            }
-            if (bytes < 0) {
-                perror("cp: read failed");
+        if (fd != r->fd) {
+            int ok = dup2(fd, r->fd) >= 0;
+            close(fd);
+            if (!ok) {
+                fprintf(stderr, "%d: %s\n", r->fd, strerror(errno));
+                return -1;
             }
-            close(src_fd);
-            close(dest_fd);
         }
-        return 1;
-    } else if (strcmp(args[0], "mv") == 0) {
-        int recursive = 0;
-        int arg_start = 1;
-        if (args[1] && strcmp(args[1], "-r") == 0) {
-            recursive = 1;
-            arg_start = 2;
+    }
+    return 0;
+}
+
+/*
+ * restore_redirects - Undoes apply_redirects for the descriptors it saved, last change first.
+ */
+void restore_redirects(struct saved_fd *saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if (saved[i].copy < 0) {
+            close(saved[i].fd);
+            continue;
         }
-        if (args[arg_start] == NULL || args[arg_start + 1] == NULL) {
-            printf("Usage: mv [-r] [source] [destination]\n");
-            return 1;
+        dup2(saved[i].copy, saved[i].fd);
+        close(saved[i].copy);
+    }
+}
+
+/*
+ * codec_load - Loads a codec's library on first use. Returns 0, or -1 (once reported) when the
+ * library or one of its functions is missing.
+ */
+int codec_load(int codec) {
+    static const char *const zstd_names[] = {
+        "ZSTD_createCCtx", "ZSTD_freeCCtx", "ZSTD_CCtx_setParameter", "ZSTD_compressStream2", "ZSTD_createDCtx",
+        "ZSTD_freeDCtx", "ZSTD_decompressStream", "ZSTD_isError", "ZSTD_getErrorName"};
+    static const char *const zlib_names[] = {"gzdopen", "gzbuffer", "gzread", "gzwrite", "gzclose", "gzerror",
+                                              "gzdirect"};
+    static const char *const lz4_names[] = {
+        "LZ4F_createCompressionContext", "LZ4F_freeCompressionContext", "LZ4F_compressBegin",
+        "LZ4F_compressUpdate", "LZ4F_compressEnd", "LZ4F_createDecompressionContext", "LZ4F_freeDecompressionContext",
+        "LZ4F_decompress", "LZ4F_isError", "LZ4F_getErrorName"};
+    static const struct {
+        const char *library;
+        const char *const *names;
+        void *table;
+        size_t count;
+    } libraries[CODEC_COUNT] = {
+        [CODEC_ZSTD] = {"libzstd.so.1", zstd_names, &zstd_api, sizeof(zstd_names) / sizeof(zstd_names[0])},
+        [CODEC_GZIP] = {"libz.so.1", zlib_names, &zlib_api, sizeof(zlib_names) / sizeof(zlib_names[0])},
+        [CODEC_LZ4] = {"liblz4.so.1", lz4_names, &lz4_api, sizeof(lz4_names) / sizeof(lz4_names[0])},
+    };
+    // 0 = not tried yet, 1 = loaded, -1 = unavailable
+    static int state[CODEC_COUNT];
+    if (state[codec]) return state[codec] > 0 ? 0 : -1;
+    state[codec] = -1;
+    void *handle = dlopen(libraries[codec].library, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "%s redirection needs %s: %s\n", codec_suffixes[codec], libraries[codec].library, dlerror());
+        return -1;
+    }
+    // Each table is a struct of function pointers in the order of its names
+    void **slots = libraries[codec].table;
+    for (size_t i = 0; i < libraries[codec].count; i++) {
+        if (!(slots[i] = dlsym(handle, libraries[codec].names[i]))) {
+            fprintf(stderr, "%s: %s missing\n", libraries[codec].library, libraries[codec].names[i]);
+            dlclose(handle);
+            return -1;
         }
-        if (recursive) {
-            recursive_copy(args[arg_start], args[arg_start + 1], 0);
-            recursive_delete(args[arg_start], 0);
-        } else {
-            struct stat dest_st;
-            char final_dest[MAX_PATH];
-            if (stat(args[arg_start + 1], &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
-                if (snprintf(final_dest, sizeof(final_dest), "%s/%s", args[arg_start + 1], strrchr(args[arg_start], '/') ? strrchr(args[arg_start], '/') + 1 : args[arg_start]) >= sizeof(final_dest)) {
-                    fprintf(stderr, "mv: destination path too long\n");
-                    return 1;
-                }
-            } else {
-                strncpy(final_dest, args[arg_start + 1], sizeof(final_dest));
-            }
-            if (rename(args[arg_start], final_dest) != 0) {
-                perror("mv failed");
+    }
+    state[codec] = 1;
+    return 0;
+}
+
+/*
+ * codec_compress - Worker side of "> file.zst": compresses everything read from the pipe into the file.
+ */
+static int codec_compress(struct codec_job *job, char *in, char *out) {
+    ssize_t n;
+    if (job->codec == CODEC_GZIP) {
+        char mode[] = "wb6";
+        mode[2] = '0' + (job->level < 1 ? 1 : job->level > 9 ? 9 : job->level);
+        void *gz = zlib_api.dopen(job->file_fd, mode);
+        if (!gz) return -1;
+        job->file_fd = -1;
+        zlib_api.buffer(gz, CODEC_BUFFER);
+        int failed = 0;
+        while (!failed && (n = read(job->thread_fd, in, CODEC_BUFFER)) != 0) {
+            if (n < 0) failed = errno != EINTR;
+            else failed = zlib_api.write(gz, in, n) != n;
+        }
+        return zlib_api.close(gz) != 0 || failed ? -1 : 0;
+    }
+    if (job->codec == CODEC_LZ4) {
+        struct lz4_preferences prefs = {.compression_level = job->level};
+        void *ctx;
+        if (lz4_api.is_error(lz4_api.create_cctx(&ctx, LZ4F_VERSION))) return -1;
+        size_t made = lz4_api.compress_begin(ctx, out, CODEC_OUT_BUFFER, &prefs);
+        int failed = lz4_api.is_error(made) || write_all(job->file_fd, out, made) != 0;
+        while (!failed && (n = read(job->thread_fd, in, CODEC_BUFFER)) != 0) {
+            if (n < 0) {
+                failed = errno != EINTR;
+                continue;
             }
+            made = lz4_api.compress_update(ctx, out, CODEC_OUT_BUFFER, in, n, NULL);
+            failed = lz4_api.is_error(made) || write_all(job->file_fd, out, made) != 0;
         }
-        return 1;
-    } else if (strcmp(args[0], "rm") == 0) {
-        int recursive = 0;
-        int arg_start = 1;
-        if (args[1] && strcmp(args[1], "-r") == 0) {
-            recursive = 1;
-            arg_start = 2;
+        if (!failed) {
+            made = lz4_api.compress_end(ctx, out, CODEC_OUT_BUFFER, NULL);
+            failed = lz4_api.is_error(made) || write_all(job->file_fd, out, made) != 0;
         }
-        if (args[arg_start] == NULL) {
-            printf("Usage: rm [-r] [file/directory]\n");
-            return 1;
+        lz4_api.free_cctx(ctx);
+        return failed ? -1 : 0;
+    }
+    void *ctx = zstd_api.create_cctx();
+    if (!ctx) return -1;
+    zstd_api.set_parameter(ctx, ZSTD_C_COMPRESSION_LEVEL, job->level);
+    // Errors here only mean a libzstd built without threads; it then compresses inline
+    if (job->threads > 0) zstd_api.set_parameter(ctx, ZSTD_C_NB_WORKERS, job->threads);
+    int failed = 0, end = 0;
+    while (!failed && !end) {
+        n = read(job->thread_fd, in, CODEC_BUFFER);
+        if (n < 0) {
+            failed = errno != EINTR;
+            continue;
         }
-        if (recursive) {
-            recursive_delete(args[arg_start], 0);
-        } else {
-            if (unlink(args[arg_start]) != 0) {
-                perror("rm failed");
+        end = n == 0;
+        struct zstd_buffer input = {in, n, 0};
+        size_t left;
+        do {
+            struct zstd_buffer output = {out, CODEC_OUT_BUFFER, 0};
+            left = zstd_api.compress_stream2(ctx, &output, &input, end ? ZSTD_E_END : ZSTD_E_CONTINUE);
+            if (zstd_api.is_error(left)) {
+                fprintf(stderr, "%s: %s\n", job->file, zstd_api.error_name(left));
+                failed = 1;
+                break;
             }
+            failed = write_all(job->file_fd, out, output.pos) != 0;
+        } while (!failed && (end ? left != 0 : input.pos < input.size));
+    }
+    zstd_api.free_cctx(ctx);
+    return failed ? -1 : 0;
+}
+
+/*
+ * codec_decompress - Worker side of "< file.zst": decompresses the file into the pipe. A reader
+ * that stops early (head) is not an error.
+ */
+static int codec_decompress(struct codec_job *job, char *in, char *out) {
+    ssize_t n;
+    if (job->codec == CODEC_GZIP) {
+        void *gz = zlib_api.dopen(job->file_fd, "rb");
+        if (!gz) return -1;
+        job->file_fd = -1;
+        zlib_api.buffer(gz, CODEC_BUFFER);
+        // gzread passes anything without a gzip header through unchanged; that is not a .gz file
+        if (zlib_api.direct(gz)) {
+            fprintf(stderr, "%s: not in gzip format\n", job->file);
+            zlib_api.close(gz);
+            return -1;
         }
-        return 1;
-    } else if (strcmp(args[0], "writefile") == 0) {
-        if (args[1] == NULL) {
-            printf("Usage: writefile [file]\n");
-            return 1;
+        int failed = 0, closed = 0, code = 0;
+        while ((n = zlib_api.read(gz, out, CODEC_BUFFER)) > 0) {
+            if (write_all(job->thread_fd, out, n) != 0) {
+                closed = 1;
+                break;
+            }
         }
-        printf("Enter text to write (press Ctrl+D to finish):\n");
-        FILE *file = fopen(args[1], "w");
-        if (file == NULL) {
-            perror("writefile failed");
-            return 1;
+        // A truncated stream ends with a short read and Z_BUF_ERROR rather than a -1
+        const char *message = zlib_api.error(gz, &code);
+        if (n < 0 || (!closed && code == Z_BUF_ERROR)) {
+            fprintf(stderr, "%s: %s\n", job->file, code == Z_BUF_ERROR ? "truncated input" : message);
+            failed = 1;
         }
-        char buffer[MAX_INPUT_SIZE];
-        while (fgets(buffer, MAX_INPUT_SIZE, stdin) != NULL) {
-            fprintf(file, "%s", buffer);
+        if (zlib_api.close(gz) != 0 && !closed && !failed) {
+            fprintf(stderr, "%s: truncated input\n", job->file);
+            failed = 1;
         }
-        fclose(file);
-        printf("Written to %s\n", args[1]);
-        return 1;
-    } else if (strcmp(args[0], "history") == 0) {
-        if (args[1] && strcmp(args[1], "clear") == 0) {
-            clear_history();
-            printf("Command history cleared\n");
-            return 1;
+        return failed ? -1 : 0;
+    }
+    void *ctx = NULL;
+    if (job->codec == CODEC_LZ4 ? lz4_api.is_error(lz4_api.create_dctx(&ctx, LZ4F_VERSION)) : !(ctx = zstd_api.create_dctx())) {
+        return -1;
+    }
+    int failed = 0, closed = 0;
+    size_t pending = 0;           // nonzero while a frame is incomplete
+    while (!failed && !closed && (n = read(job->file_fd, in, CODEC_BUFFER)) != 0) {
+        if (n < 0) {
+            failed = errno != EINTR;
+            continue;
         }
-        int history_len = history_length;
-        for (int i = 0; i < history_len; i++) {
-            HIST_ENTRY *entry = history_get(i + history_base);
-            if (entry) {
-                printf("%d: %s\n", i + 1, entry->line);
+        size_t pos = 0;
+        while (!failed && !closed && pos < (size_t)n) {
+            size_t made;
+            if (job->codec == CODEC_LZ4) {
+                size_t used = n - pos;
+                made = CODEC_OUT_BUFFER;
+                pending = lz4_api.decompress(ctx, out, &made, in + pos, &used, NULL);
+                if (lz4_api.is_error(pending)) {
+                    fprintf(stderr, "%s: %s\n", job->file, lz4_api.error_name(pending));
+                    failed = 1;
+                    break;
+                }
+                pos += used;
+            } else {
+                struct zstd_buffer input = {in, n, pos}, output = {out, CODEC_OUT_BUFFER, 0};
+                pending = zstd_api.decompress_stream(ctx, &output, &input);
+                if (zstd_api.is_error(pending)) {
+                    fprintf(stderr, "%s: %s\n", job->file, zstd_api.error_name(pending));
+                    failed = 1;
+                    break;
+                }
+                pos = input.pos;
+                made = output.pos;
             }
+            closed = write_all(job->thread_fd, out, made) != 0;
         }
-        return 1;
     }
-    return 0;
+    if (!failed && !closed && pending) {
+        fprintf(stderr, "%s: truncated input\n", job->file);
+        failed = 1;
+    }
+    if (job->codec == CODEC_LZ4) lz4_api.free_dctx(ctx);
+    else zstd_api.free_dctx(ctx);
+    return failed ? -1 : 0;
 }
 
 /*
- * sigchld_handler - Handles SIGCHLD signal for background process completion.
+ * codec_worker - Thread relaying between a command's pipe and a compressed file.
  */
-void sigchld_handler(int sig, siginfo_t *info, void *context) {
-    pid_t pid;
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        printf("[PID %d] Completed\n", pid);
+static void *codec_worker(void *arg) {
+    struct codec_job *job = arg;
+    char *in = malloc(CODEC_BUFFER), *out = malloc(CODEC_OUT_BUFFER);
+    if (in && out) {
+        job->failed = (job->compress ? codec_compress : codec_decompress)(job, in, out) != 0;
+    } else {
+        job->failed = 1;
     }
+    if (job->failed && job->compress) fprintf(stderr, "%s: compression failed\n", job->file);
+    free(in);
+    free(out);
+    // Cleared before the close, so a child forked meanwhile never closes a reused number
+    close(__atomic_exchange_n(&job->thread_fd, -1, __ATOMIC_SEQ_CST));
+    if (job->file_fd >= 0) close(job->file_fd);
+    return NULL;
 }
 
 /*
- * execute_system_command - Executes system commands with redirection and background support.
+ * free_codec_job - Releases a job whose worker has been joined or never started.
  */
-void execute_system_command(char *args[], char *input_file, char *output_file, int append, int background) {
-    if (args[0] == NULL) return;
+static void free_codec_job(struct codec_job *job) {
+    if (!job->started) {
+        if (job->thread_fd >= 0) close(job->thread_fd);
+        if (job->file_fd >= 0) close(job->file_fd);
+    }
+    free(job->file);
+    free(job);
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork failed");
-        return;
+/*
+ * codec_wait - Lets background compressed redirections finish their files before the shell exits.
+ */
+void codec_wait(void) {
+    finish_codecs();
+    int waiting = 0;
+    for (struct codec_job *job = codec_background; job; job = job->next) waiting++;
+    if (waiting) fprintf(stderr, "Waiting for %d compressed redirection(s) to finish\n", waiting);
+    while (codec_background) {
+        struct codec_job *job = codec_background;
+        codec_background = job->next;
+        pthread_join(job->thread, NULL);
+        free_codec_job(job);
     }
-    if (pid == 0) {
-        // Child process
-        int input_fd = -1, output_fd = -1;
-        if (input_file) {
-            input_fd = open(input_file, O_RDONLY);
-            if (input_fd < 0) {
-                perror("open input failed");
-                exit(1);
+}
+
+/*
+ * start_codecs - Turns every "< file", "> file" and ">> file" naming a .zst, .gz or .lz4 file into a
+ * pipe with a worker thread (de)compressing on the other end; the redirection then duplicates the
+ * command's end of the pipe. COMPRESS_LEVEL sets the level and COMPRESS_THREADS the zstd workers
+ * (0 = one per CPU). Returns 0, or -1 after reporting a file or library problem.
+ */
+int start_codecs(struct redirect **redirects, int num_commands, int background) {
+    static const int default_level[CODEC_COUNT] = {[CODEC_ZSTD] = 3, [CODEC_GZIP] = 6, [CODEC_LZ4] = 0};
+    for (int c = 0; c < num_commands; c++) {
+        for (struct redirect *r = redirects[c]; r; r = r->next) {
+            if (r->kind != REDIR_INPUT && r->kind != REDIR_OUTPUT && r->kind != REDIR_APPEND) continue;
+            size_t len = strlen(r->file);
+            int codec = 0;
+            while (codec < CODEC_COUNT && !(len > strlen(codec_suffixes[codec]) &&
+                                             strcmp(r->file + len - strlen(codec_suffixes[codec]), codec_suffixes[codec]) == 0)) {
+                codec++;
             }
-            dup2(input_fd, STDIN_FILENO);
-        }
-        if (output_file) {
-            int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-            output_fd = open(output_file, flags, 0644);
-            if (output_fd < 0) {
-                perror("open output failed");
-                if (input_fd >= 0) close(input_fd);
-                exit(1);
+            if (codec == CODEC_COUNT) continue;
+            if (codec_load(codec) != 0) return -1;
+            struct codec_job *job = calloc(1, sizeof(struct codec_job));
+            if (!job || !(job->file = strdup(r->file))) {
+                perror("malloc failed");
+                free(job);
+                return -1;
             }
-            dup2(output_fd, STDOUT_FILENO);
+            job->codec = codec;
+            job->compress = r->kind != REDIR_INPUT;
+            job->thread_fd = job->command_fd = -1;
+            static const int file_flags[] = {[REDIR_INPUT] = O_RDONLY, [REDIR_OUTPUT] = O_WRONLY | O_CREAT | O_TRUNC,
+                                             [REDIR_APPEND] = O_WRONLY | O_CREAT | O_APPEND};
+            job->file_fd = open(r->file, file_flags[r->kind] | O_CLOEXEC, 0644);
+            int ends[2];
+            if (job->file_fd < 0 || pipe2(ends, O_CLOEXEC) != 0) {
+                perror(r->file);
+                if (job->file_fd >= 0) close(job->file_fd);
+                free(job->file);
+                free(job);
+                return -1;
+            }
+            fcntl(ends[1], F_SETPIPE_SZ, CODEC_BUFFER);
+            // The command's end goes above 10, clear of the descriptors redirections name
+            int command_end = job->compress ? ends[1] : ends[0];
+            job->thread_fd = job->compress ? ends[0] : ends[1];
+            job->command_fd = fcntl(command_end, F_DUPFD_CLOEXEC, 10);
+            close(command_end);
+            const char *level = get_var("COMPRESS_LEVEL"), *threads = get_var("COMPRESS_THREADS");
+            job->level = level ? atoi(level) : default_level[codec];
+            job->threads = threads ? atoi(threads) : 0;
+            if (job->threads <= 0) job->threads = sysconf(_SC_NPROCESSORS_ONLN);
+            job->background = background;
+            job->next = codec_active;
+            codec_active = job;
+            if (job->command_fd < 0) {
+                perror("fcntl failed");
+                return -1;
+            }
+            // Workers take no signals; SIGINT and SIGCHLD stay with the shell's main thread
+            sigset_t all, old_mask;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+            int error = pthread_create(&job->thread, NULL, codec_worker, job);
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            if (error) {
+                fprintf(stderr, "%s: %s\n", r->file, strerror(error));
+                return -1;
+            }
+            job->started = 1;
+            static int registered = 0;
+            if (background && !registered) atexit(codec_wait);
+            registered |= background;
+            r->kind = REDIR_DUP;
+            r->source = job->command_fd;
         }
-        if (background) {
-            setsid();
+    }
+    return 0;
+}
+
+/*
+ * finish_codecs - Closes the shell's copies of this line's command ends once its commands have
+ * run (or been started in the background), then waits for the foreground workers. Workers of
+ * background commands are kept and joined on a later call once they are done.
+ * Returns nonzero when a foreground worker failed.
+ */
+int finish_codecs(void) {
+    int failed = 0;
+    while (codec_active) {
+        struct codec_job *job = codec_active;
+        codec_active = job->next;
+        if (job->command_fd >= 0) close(job->command_fd);
+        if (job->background && job->started) {
+            job->next = codec_background;
+            codec_background = job;
+            continue;
         }
-        // [FIX: Close file descriptors before execvp]
-        if (input_fd >= 0) close(input_fd);
-        if (output_fd >= 0) close(output_fd);
-        if (execvp(args[0], args) == -1) {
-            fprintf(stderr, "Error: Command '%s' not found or permission denied\n", args[0]);
-            exit(1);
+        if (job->started) {
+            pthread_join(job->thread, NULL);
+            failed |= job->failed;
         }
-    } else {
-        // Parent process
-        if (!background) {
-            waitpid(pid, NULL, 0);
+        free_codec_job(job);
+    }
+    for (struct codec_job **link = &codec_background; *link;) {
+        struct codec_job *job = *link;
+        if (pthread_tryjoin_np(job->thread, NULL) == 0) {
+            *link = job->next;
+            free_codec_job(job);
         } else {
-            printf("[PID %d] Running in background\n", pid);
+            link = &job->next;
         }
     }
+    return failed;
 }
 
 /*
- * execute_multiple_pipes - Executes multiple commands connected by pipes.
+ * release_codecs - In a forked child that runs a builtin instead of exec'ing, closes the workers'
+ * ends, which would otherwise keep a decompressing pipe from ever reaching end of file.
  */
-void execute_multiple_pipes(char *args[][MAX_ARGS], int num_commands, char **input_files, char **output_files, int *appends, int *background) {
-    int pipefd[2 * (num_commands - 1)];
-    pid_t pids[MAX_PIPES];
-
-    // Create pipes
-    for (int i = 0; i < num_commands - 1; i++) {
-        if (pipe(pipefd + i * 2) == -1) {
-            perror("pipe failed");
-            for (int j = 0; j < i * 2; j++) {
-                close(pipefd[j]);
-            }
-            return;
+void release_codecs(void) {
+    struct codec_job *lists[] = {codec_active, codec_background};
+    for (int i = 0; i < 2; i++) {
+        for (struct codec_job *job = lists[i]; job; job = job->next) {
+            int fd = __atomic_load_n(&job->thread_fd, __ATOMIC_SEQ_CST);
+            if (fd >= 0) close(fd);
         }
     }
+}
 
-    // Fork for each command
-    for (int i = 0; i < num_commands; i++) {
-        pids[i] = fork();
-        if (pids[i] < 0) {
+/*
+ * execute_builtin - Runs args as a builtin if it names one, firing the builtin probes around it.
+ * Background-safe builtins followed by '&' run in a forked child. Returns 0 when args is not a builtin.
+ */
+int execute_builtin(char *args[], int background) {
+    if (args[0] == NULL) return 1;
+
+    const struct builtin *builtin = lookup_builtin(args[0]);
+    if (!builtin) return 0;
+    // Shell-changing builtins ignore '&': a forked child's changes would be lost
+    if (background && (builtin->flags & BUILTIN_BACKGROUND_SAFE) && !(builtin->flags & BUILTIN_NEEDS_PARENT)) {
+        fflush(stdout);
+        pid_t pid = fork();
+        fork_count++;
+        if (pid < 0) {
             perror("fork failed");
-            for (int j = 0; j < 2 * (num_commands - 1); j++) {
-                close(pipefd[j]);
-            }
-            return;
-        }
-        if (pids[i] == 0) {
-            // Child
-            int input_fd = -1, output_fd = -1;
-            if (input_files[i]) {
-                input_fd = open(input_files[i], O_RDONLY);
-                if (input_fd < 0) {
-                    perror("open input failed");
-                    for (int j = 0; j < 2 * (num_commands - 1); j++) {
-                        close(pipefd[j]);
-                    }
-                    exit(1);
-                }
-                dup2(input_fd, STDIN_FILENO);
-            } else if (i > 0) {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
-            }
-            if (output_files[i]) {
-                int flags = O_WRONLY | O_CREAT | (appends[i] ? O_APPEND : O_TRUNC);
-                output_fd = open(output_files[i], flags, 0644);
-                if (output_fd < 0) {
-                    perror("open output failed");
-                    if (input_fd >= 0) close(input_fd);
-                    for (int j = 0; j < 2 * (num_commands - 1); j++) {
-                        close(pipefd[j]);
-                    }
-                    exit(1);
-                }
-                dup2(output_fd, STDOUT_FILENO);
-            } else if (i < num_commands - 1) {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
-            }
-            // Close all pipes in child
-            for (int j = 0; j < 2 * (num_commands - 1); j++) {
-                close(pipefd[j]);
-            }
-            // [FIX: Close file descriptors before execvp]
-            if (input_fd >= 0) close(input_fd);
-            if (output_fd >= 0) close(output_fd);
-            if (execvp(args[i][0], args[i]) == -1) {
-                fprintf(stderr, "execvp failed: %s\n", args[i][0]);
-                exit(1);
-            }
+        } else if (pid == 0) {
+            setsid();
+            release_codecs();
+            run_builtin(builtin, args, 0);
+            fflush(stdout);
+            _exit(last_status);
+        } else {
+            // stdout may still be the builtin's redirection here, so the notice goes to stderr
+            fprintf(stderr, "[PID %d] Running in background\n", pid);
+            job_add(pid, args[0]);
         }
+        return 1;
     }
+    uint64_t started = SHELL_PROBE_ENABLED(builtin__exit) ? probe_clock_ns() : 0;
+    SHELL_PROBE(builtin__entry, args[0]);
+    run_builtin(builtin, args, background);
+    SHELL_PROBE(builtin__exit, args[0], last_status, started ? probe_clock_ns() - started : 0);
+    return 1;
+}
 
-    // Close pipes in parent
-    for (int i = 0; i < 2 * (num_commands - 1); i++) {
-        close(pipefd[i]);
-    }
-    // Wait for children if not background
-    if (!*background) {
-        for (int i = 0; i < num_commands; i++) {
-            waitpid(pids[i], NULL, 0);
-        }
-    } else {
-        for (int i = 0; i < num_commands; i++) {
-            printf("[PID %d] Running in background\n", pids[i]);
-        }
+/*
+ * run_builtin - Calls a builtin's handler. For record-listing builtins a leading --json or -0
+ * is taken off args and selects the output format for this call.
+ */
+int run_builtin(const struct builtin *builtin, char *args[], int background) {
+    int mode = OUTPUT_TEXT;
+    if ((builtin->flags & BUILTIN_RECORDS) && args[1]) {
+        if (strcmp(args[1], "--json") == 0) mode = OUTPUT_JSON;
+        else if (strcmp(args[1], "-0") == 0) mode = OUTPUT_NUL;
     }
+    if (mode == OUTPUT_TEXT) return builtin->handler(args, background);
+
+    int argc = 0;
+    while (args[argc]) argc++;
+    char *rest[argc];
+    rest[0] = args[0];
+    memcpy(rest + 1, args + 2, (argc - 1) * sizeof(char *));
+    // Records bypass stdio, so anything already printed must go out first
+    fflush(stdout);
+    record_out.fd = STDOUT_FILENO;
+    output_mode = mode;
+    int result = builtin->handler(rest, background);
+    io_flush(&record_out);
+    output_mode = OUTPUT_TEXT;
+    return result;
 }
 
 /*
- * recursive_delete - Recursively deletes a directory and its contents.
+ * builtin_hash - Seeded FNV-1a over a builtin name.
  */
-void recursive_delete(const char *path, int depth) {
-    // [FIX: Limit recursion depth]
-    if (depth > MAX_RECURSION) {
-        fprintf(stderr, "recursive_delete: maximum recursion depth exceeded\n");
-        return;
+static unsigned builtin_hash(const char *name, unsigned seed) {
+    unsigned hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
     }
-    struct stat st;
-    // [FIX: Use stat to avoid following symlinks]
-    if (stat(path, &st) != 0) {
-        perror("stat failed");
-        return;
-    }
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (!dir) {
-            perror("opendir failed");
-            return;
-        }
-        struct dirent *entry;
-        while ((entry = readdir(dir))) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
+    return hash ^ (hash >> 15);
+}
+
+/*
+ * seal_builtins - Builds a collision-free hash over the registered names by trying seeds
+ * until every name lands in its own slot. Runs once at startup and again after each
+ * registration, so dispatch is one hash and one strcmp however many builtins exist.
+ */
+void seal_builtins(void) {
+    builtin_count = 0;
+    while (builtin_count < MAX_BUILTINS && builtins[builtin_count].name) builtin_count++;
+    unsigned size = 16;
+    while (size < 2 * (unsigned)builtin_count && size < BUILTIN_SLOTS) size *= 2;
+    for (;;) {
+        for (unsigned seed = 1; seed < 100000; seed++) {
+            memset(builtin_slots, 0, sizeof(builtin_slots));
+            int i;
+            for (i = 0; i < builtin_count; i++) {
+                unsigned slot = builtin_hash(builtins[i].name, seed) & (size - 1);
+                if (builtin_slots[slot]) break;
+                builtin_slots[slot] = i + 1;
             }
-            char full_path[MAX_PATH];
-            if (snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name) >= sizeof(full_path)) {
-                fprintf(stderr, "recursive_delete: path too long\n");
-                closedir(dir);
+            if (i == builtin_count) {
+                builtin_hash_seed = seed;
+                builtin_hash_mask = size - 1;
                 return;
             }
-            recursive_delete(full_path, depth + 1);
-        }
-        closedir(dir);
-        if (rmdir(path) != 0) {
-            perror("rmdir failed");
         }
-    } else {
-        if (unlink(path) != 0) {
-            perror("unlink failed");
+        // Crowded table: give the search more room
+        if (size == BUILTIN_SLOTS) {
+            fprintf(stderr, "seal_builtins: no perfect hash found\n");
+            exit(1);
         }
+        size *= 2;
     }
 }
 
 /*
- * recursive_copy - Recursively copies a directory and its contents.
+ * lookup_builtin - O(1) dispatch: the name's perfect-hash slot holds the only candidate.
  */
-void recursive_copy(const char *src, const char *dest, int depth) {
-    // [FIX: Limit recursion depth]
-    if (depth > MAX_RECURSION) {
-        fprintf(stderr, "recursive_copy: maximum recursion depth exceeded\n");
-        return;
-    }
+const struct builtin *lookup_builtin(const char *name) {
+    if (!builtin_hash_mask) seal_builtins();
+    unsigned char index = builtin_slots[builtin_hash(name, builtin_hash_seed) & builtin_hash_mask];
+    if (index && strcmp(builtins[index - 1].name, name) == 0) return &builtins[index - 1];
+    return NULL;
+}
+
+/*
+ * probe_clock_ns - Monotonic nanoseconds for probe durations.
+ */
+uint64_t probe_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * builtin_exit - Exits the shell.
+ */
+int builtin_exit(char *args[], int background) {
+    printf("Shutting down shell..(^_^)\n");
+    exit(0);
+    return 1;
+}
+
+/*
+ * builtin_cd - Changes the working directory (HOME without an argument).
+ */
+int builtin_cd(char *args[], int background) {
+    char *dir = args[1] ? args[1] : getenv("HOME");
+    if (chdir(dir) != 0) {
+        perror("chdir failed");
+    }
+    return 1;
+}
+
+/*
+ * builtin_help - Lists the builtins from the registration table.
+ */
+int builtin_help(char *args[], int background) {
+    if (output_mode != OUTPUT_TEXT) {
+        for (int i = 0; i < builtin_count; i++) {
+            record_open();
+            record_text("name", builtins[i].name);
+            record_text("usage", builtins[i].usage);
+            record_text("description", builtins[i].help);
+            record_bool("pipeline_safe", builtins[i].flags & BUILTIN_PIPELINE_SAFE);
+            record_bool("background_safe", builtins[i].flags & BUILTIN_BACKGROUND_SAFE);
+            record_bool("plugin", builtins[i].plugin != NULL);
+            record_close();
+        }
+        return 1;
+    }
+    printf("\033[1;32mAvailable commands:\033[0m\n");
+    for (int i = 0; i < builtin_count; i++) {
+        printf("  %s - %s\n", builtins[i].usage, builtins[i].help);
+    }
+    printf("  --chunk[=jobs] [command] [args...] - Split argv exceeding ARG_MAX into batches\n");
+    printf("  Supports: Redirection ([n]< [n]> [n]>> [n]<> [n]>&m [n]<&m [n]>&- &> &>>), multiple pipes (|),\n");
+    printf("            compressed files (< f.zst, > f.gz, >> f.lz4; COMPRESS_LEVEL, COMPRESS_THREADS),\n");
+    printf("            wildcards (*.txt), background (&),\n");
+    printf("            variables (NAME=value, $NAME, ${NAME}), arithmetic ($(( expr ))),\n");
+    printf("            ${#v} ${v:-w} ${v:=w} ${v:+w} ${v:?w} ${v#p} ${v##p} ${v%%p} ${v%%%%p} ${v/p/r} ${v//p/r}\n");
+    printf("            ${v:off:len} ${v^p} ${v^^p} ${v,p} ${v,,p}, lists (a ; b, a && b, a || b)\n");
+    printf("            --json (JSON Lines) or -0 (NUL-separated) records from help, history, jobs, set, locate,\n");
+    printf("            unpack -t and dircmp\n");
+    return 1;
+}
+
+/*
+ * builtin_mkdir - Creates a folder.
+ */
+int builtin_mkdir(char *args[], int background) {
+    if (args[1] == NULL) {
+        printf("Usage: mkdir [directory]\n");
+        return 1;
+    }
+    if (mkdir(args[1], 0755) != 0) {
+        perror("mkdir failed");
+    }
+    return 1;
+}
+
+/*
+ * builtin_rmdir - Deletes an empty folder.
+ */
+int builtin_rmdir(char *args[], int background) {
+    if (args[1] == NULL) {
+        printf("Usage: rmdir [directory]\n");
+        return 1;
+    }
+    if (rmdir(args[1]) != 0) {
+        perror("rmdir failed");
+    }
+    return 1;
+}
+
+/*
+ * builtin_touch - Creates every file named.
+ */
+int builtin_touch(char *args[], int background) {
+    if (args[1] == NULL) {
+        printf("Usage: touch [file]\n");
+        return 1;
+    }
+    // Builtins never exec, so every operand of an unbounded glob is handled in-process
+    last_status = 0;
+    for (int i = 1; args[i]; i++) {
+        int fd = open(args[i], O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            perror("touch failed");
+            last_status = 1;
+        } else {
+            close(fd);
+        }
+    }
+    return 1;
+}
+
+/*
+ * builtin_cp - Copies files or folders, several sources into a directory.
+ */
+int builtin_cp(char *args[], int background) {
+    int recursive = 0;
+    int arg_start = 1;
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        recursive = 1;
+        arg_start = 2;
+    }
+    if (args[arg_start] == NULL || args[arg_start + 1] == NULL) {
+        printf("Usage: cp [-r] [source] [destination]\n");
+        return 1;
+    }
+    int argc = 0;
+    while (args[argc]) argc++;
+    struct stat dest_st;
+    int dest_is_dir = (stat(args[argc - 1], &dest_st) == 0 && S_ISDIR(dest_st.st_mode));
+    if (argc - arg_start > 2 && !dest_is_dir) {
+        fprintf(stderr, "cp: target '%s' is not a directory\n", args[argc - 1]);
+        last_status = 1;
+        return 1;
+    }
+    // Several sources are copied into the directory given as the last operand
+    last_status = 0;
+    for (int i = arg_start; i < argc - 1; i++) {
+        if (recursive && argc - arg_start > 2) {
+            char dest_path[MAX_PATH];
+            if (snprintf(dest_path, sizeof(dest_path), "%s/%s", args[argc - 1], strrchr(args[i], '/') ? strrchr(args[i], '/') + 1 : args[i]) >= sizeof(dest_path)) {
+                fprintf(stderr, "cp: destination path too long\n");
+                last_status = 1;
+                continue;
+            }
+            recursive_copy(args[i], dest_path, 0);
+        } else if (recursive) {
+            recursive_copy(args[i], args[argc - 1], 0);
+        } else if (copy_file(args[i], args[argc - 1]) != 0) {
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * builtin_mv - Moves or renames a file or folder.
+ */
+int builtin_mv(char *args[], int background) {
+    int recursive = 0;
+    int arg_start = 1;
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        recursive = 1;
+        arg_start = 2;
+    }
+    if (args[arg_start] == NULL || args[arg_start + 1] == NULL) {
+        printf("Usage: mv [-r] [source] [destination]\n");
+        return 1;
+    }
+    if (recursive) {
+        recursive_copy(args[arg_start], args[arg_start + 1], 0);
+        recursive_delete(args[arg_start], 0);
+    } else {
+        struct stat dest_st;
+        char final_dest[MAX_PATH];
+        if (stat(args[arg_start + 1], &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
+            if (snprintf(final_dest, sizeof(final_dest), "%s/%s", args[arg_start + 1], strrchr(args[arg_start], '/') ? strrchr(args[arg_start], '/') + 1 : args[arg_start]) >= sizeof(final_dest)) {
+                fprintf(stderr, "mv: destination path too long\n");
+                return 1;
+            }
+        } else {
+            strncpy(final_dest, args[arg_start + 1], sizeof(final_dest));
+        }
+        if (rename(args[arg_start], final_dest) != 0) {
+            perror("mv failed");
+        }
+    }
+    return 1;
+}
+
+/*
+ * builtin_rm - Deletes files, or folders with -r.
+ */
+int builtin_rm(char *args[], int background) {
+    int recursive = 0;
+    int arg_start = 1;
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        recursive = 1;
+        arg_start = 2;
+    }
+    if (args[arg_start] == NULL) {
+        printf("Usage: rm [-r] [file/directory]\n");
+        return 1;
+    }
+    last_status = 0;
+    for (int i = arg_start; args[i]; i++) {
+        if (recursive) {
+            recursive_delete(args[i], 0);
+        } else if (unlink(args[i]) != 0) {
+            perror("rm failed");
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * builtin_writefile - Writes standard input to a file.
+ */
+int builtin_writefile(char *args[], int background) {
+    if (args[1] == NULL) {
+        printf("Usage: writefile [file]\n");
+        return 1;
+    }
+    printf("Enter text to write (press Ctrl+D to finish):\n");
+    FILE *file = fopen(args[1], "w");
+    if (file == NULL) {
+        perror("writefile failed");
+        return 1;
+    }
+    char buffer[MAX_INPUT_SIZE];
+    while (fgets(buffer, MAX_INPUT_SIZE, stdin) != NULL) {
+        fprintf(file, "%s", buffer);
+    }
+    fclose(file);
+    printf("Written to %s\n", args[1]);
+    return 1;
+}
+
+/*
+ * builtin_history - Shows or clears the command history. Listing works as a pipeline stage;
+ * clearing needs the shell itself.
+ */
+int builtin_history(char *args[], int background) {
+    if (args[1] && strcmp(args[1], "clear") == 0) {
+        if (running_as_stage) {
+            fprintf(stderr, "history: clear cannot run in a pipeline\n");
+            last_status = 1;
+            return 1;
+        }
+        clear_history_entries();
+        printf("Command history cleared\n");
+        return 1;
+    }
+    for (int i = 0; i < history_count; i++) {
+        if (output_mode == OUTPUT_TEXT) {
+            printf("%d: %s\n", i + 1, history_lines[i]);
+            continue;
+        }
+        record_open();
+        record_text("command", history_lines[i]);
+        record_number("number", i + 1);
+        record_close();
+    }
+    return 1;
+}
+
+/*
+ * builtin_jobs - Lists background jobs; finished ones are dropped once they have been shown.
+ */
+int builtin_jobs(char *args[], int background) {
+    time_t now = time(NULL);
+    for (int i = 0; i < job_count; i++) {
+        const struct job *job = &jobs[i];
+        int status = job->status;
+        int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        if (output_mode == OUTPUT_TEXT) {
+            if (job->done) printf("[PID %d] Done (%d)  %s\n", (int)job->pid, code, job->command);
+            else printf("[PID %d] Running %lds  %s\n", (int)job->pid, (long)(now - job->started), job->command);
+            continue;
+        }
+        record_open();
+        record_number("pid", job->pid);
+        record_text("state", job->done ? "done" : "running");
+        if (job->done) record_number("status", code);
+        record_text("command", job->command);
+        record_number("elapsed", now - job->started);
+        record_close();
+    }
+    // A pipeline stage only has a copy of the table
+    if (running_as_stage) return 1;
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    int kept = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].done) {
+            free(jobs[i].command);
+        } else {
+            jobs[kept++] = jobs[i];
+        }
+    }
+    job_count = kept;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+}
+
+/*
+ * job_add - Remembers a background process for jobs; finished jobs are recycled when the table is full.
+ */
+void job_add(pid_t pid, const char *command) {
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    if (job_count == MAX_JOBS) {
+        int kept = 0;
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i].done) free(jobs[i].command);
+            else jobs[kept++] = jobs[i];
+        }
+        job_count = kept;
+    }
+    if (job_count < MAX_JOBS) {
+        struct job *job = &jobs[job_count];
+        job->pid = pid;
+        job->done = 0;
+        job->status = 0;
+        job->command = strdup(command);
+        job->started = time(NULL);
+        // The child may have exited, and been reaped by the handler, before it got here
+        int status;
+        pid_t reaped = waitpid(pid, &status, WNOHANG);
+        if (reaped == pid) {
+            job->status = status;
+            job->done = 1;
+            printf("[PID %d] Completed\n", pid);
+        } else if (reaped < 0 && errno == ECHILD) {
+            job->done = 1;
+        }
+        if (job->command) job_count++;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/*
+ * job_done - Marks the job for pid finished; called from the SIGCHLD handler, so it only stores.
+ */
+static void job_done(pid_t pid, int status) {
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].pid == pid) {
+            jobs[i].status = status;
+            jobs[i].done = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * builtin_set - Shows or toggles shell options.
+ */
+int builtin_set(char *args[], int background) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < OPT_COUNT; i++) {
+            if (output_mode == OUTPUT_TEXT) {
+                printf("%-12s %s\n", option_names[i], shell_options[i] ? "on" : "off");
+                continue;
+            }
+            record_open();
+            record_text("option", option_names[i]);
+            record_bool("enabled", shell_options[i]);
+            record_close();
+        }
+        return 1;
+    }
+    if ((strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0) || args[2] == NULL) {
+        printf("Usage: set [-o|+o option]\n");
+        return 1;
+    }
+    for (int i = 0; i < OPT_COUNT; i++) {
+        if (strcmp(args[2], option_names[i]) == 0) {
+            // Turning the profiler off reports what it gathered
+            if (i == OPT_PROFILE && shell_options[i] && args[1][0] == '+') profile_report();
+            if (i == OPT_FILEINDEX && args[1][0] == '-' && index_start() != 0) {
+                last_status = 1;
+                return 1;
+            }
+            if (i == OPT_FILEINDEX && args[1][0] == '+') index_stop();
+            shell_options[i] = (args[1][0] == '-');
+            return 1;
+        }
+    }
+    fprintf(stderr, "set: unknown option '%s'\n", args[2]);
+    last_status = 1;
+    return 1;
+}
+
+/*
+ * builtin_meter - Relays stdin to stdout with a throughput status line when run as a pipeline stage.
+ */
+int builtin_meter(char *args[], int background) {
+    if (!running_as_stage) {
+        printf("Usage: command | meter | command (meter is a pipeline stage)\n");
+        return 1;
+    }
+    last_status = meter_relay(STDIN_FILENO, STDOUT_FILENO, NULL, 1);
+    return 1;
+}
+
+/*
+ * builtin_pipeprof - Only valid as a prefix; run_command_line strips it before dispatch.
+ */
+int builtin_pipeprof(char *args[], int background) {
+    printf("Usage: pipeprof command [| command]...\n");
+    return 1;
+}
+
+/*
+ * builtin_stats - Queries the command statistics log.
+ */
+int builtin_stats(char *args[], int background) {
+    stats_query(args);
+    return 1;
+}
+
+/*
+ * builtin_shellstat - Reports memory use and subsystem counters.
+ */
+int builtin_shellstat(char *args[], int background) {
+    shellstat(args);
+    return 1;
+}
+
+/*
+ * builtin_enable - Lists builtins, loads builtins from a plugin (-f), or unloads a loaded one (-d).
+ */
+int builtin_enable(char *args[], int background) {
+    last_status = 0;
+    if (!args[1]) {
+        for (int i = 0; i < builtin_count; i++) {
+            if (builtins[i].plugin) {
+                Dl_info info;
+                const char *path = dladdr(builtins[i].plugin, &info) ? info.dli_fname : "?";
+                printf("enable -f %s %s\n", path, builtins[i].name);
+            } else {
+                printf("enable %s\n", builtins[i].name);
+            }
+        }
+    } else if (strcmp(args[1], "-f") == 0 && args[2] && args[3]) {
+        for (int i = 3; args[i]; i++) {
+            if (register_plugin(args[2], args[i]) != 0) last_status = 1;
+        }
+    } else if (strcmp(args[1], "-d") == 0 && args[2]) {
+        for (int i = 2; args[i]; i++) {
+            const struct builtin *builtin = lookup_builtin(args[i]);
+            if (!builtin || !builtin->plugin) {
+                fprintf(stderr, "enable: %s: not a loaded builtin\n", args[i]);
+                last_status = 1;
+                continue;
+            }
+            unregister_plugin(args[i]);
+        }
+    } else {
+        printf("Usage: enable [-f plugin.so name...] [-d name...]\n");
+        last_status = 2;
+    }
+    return 1;
+}
+
+/*
+ * register_plugin - Loads myshell_plugin_<name> from the shared object at path and adds it to
+ * the builtin table. Returns 0 on success, 1 with a message on stderr otherwise.
+ */
+int register_plugin(const char *path, const char *name) {
+    if (lookup_builtin(name)) {
+        fprintf(stderr, "enable: %s: already a builtin\n", name);
+        return 1;
+    }
+    if (builtin_count + 1 >= MAX_BUILTINS) {
+        fprintf(stderr, "enable: %s: builtin table is full\n", name);
+        return 1;
+    }
+    // A bare file name means the current directory, not the dynamic linker's search path
+    char local[MAX_PATH];
+    if (!strchr(path, '/') && access(path, F_OK) == 0) {
+        snprintf(local, sizeof(local), "./%s", path);
+        path = local;
+    }
+    void *module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!module) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 1;
+    }
+    char symbol[128];
+    snprintf(symbol, sizeof(symbol), "myshell_plugin_%s", name);
+    const struct myshell_plugin *plugin = dlsym(module, symbol);
+    const char *problem = NULL;
+    if (!plugin) {
+        problem = "no such builtin in plugin";
+    } else if (plugin->abi != MYSHELL_PLUGIN_ABI || plugin->size < sizeof(struct myshell_plugin)) {
+        problem = "plugin built for a different ABI";
+    } else if (!plugin->handler || !plugin->name || strcmp(plugin->name, name) != 0) {
+        problem = "malformed plugin descriptor";
+    }
+    if (problem) {
+        fprintf(stderr, "enable: %s: %s: %s\n", path, name, problem);
+        dlclose(module);
+        return 1;
+    }
+    struct builtin *slot = &builtins[builtin_count];
+    slot->name = plugin->name;
+    slot->handler = builtin_plugin;
+    // Plugins only see the services table, so they can never need the parent shell
+    slot->flags = plugin->flags & (BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE);
+    slot->usage = plugin->usage ? plugin->usage : plugin->name;
+    slot->help = plugin->help ? plugin->help : "Loadable builtin";
+    slot->plugin = plugin;
+    slot->module = module;
+    seal_builtins();
+    return 0;
+}
+
+/*
+ * unregister_plugin - Removes a loaded builtin and closes its module (dlopen reference counts
+ * keep the code mapped while other builtins from the same object remain).
+ */
+void unregister_plugin(const char *name) {
+    const struct builtin *builtin = lookup_builtin(name);
+    int index = builtin - builtins;
+    void *module = builtins[index].module;
+    memmove(&builtins[index], &builtins[index + 1], (builtin_count - index - 1) * sizeof(struct builtin));
+    memset(&builtins[builtin_count - 1], 0, sizeof(struct builtin));
+    seal_builtins();
+    dlclose(module);
+}
+
+/*
+ * builtin_plugin - Dispatches a loadable builtin through its descriptor with the shell's services.
+ */
+int builtin_plugin(char *args[], int background) {
+    const struct builtin *builtin = lookup_builtin(args[0]);
+    int argc = 0;
+    while (args[argc]) argc++;
+    // Read-ahead left by an earlier plugin is handed to this one while stdin is still that pipe
+    struct stat st;
+    int have_stdin = fstat(STDIN_FILENO, &st) == 0;
+    if (!have_stdin || S_ISREG(st.st_mode) || st.st_dev != plugin_in_dev || st.st_ino != plugin_in_ino) {
+        plugin_in.start = plugin_in.len = 0;
+    }
+    plugin_in_dev = have_stdin ? st.st_dev : 0;
+    plugin_in_ino = have_stdin ? st.st_ino : 0;
+    // stdio output already written must come out before the plugin's buffered output
+    fflush(stdout);
+    last_status = builtin->plugin->handler(&plugin_api, argc, args);
+    io_flush(&plugin_out);
+    // A file gets its unread bytes back, so whatever reads stdin next starts where the plugin stopped
+    if (have_stdin && S_ISREG(st.st_mode) && plugin_in.len > plugin_in.start) {
+        lseek(STDIN_FILENO, -(off_t)(plugin_in.len - plugin_in.start), SEEK_CUR);
+        plugin_in.start = plugin_in.len = 0;
+    }
+    return 1;
+}
+
+/*
+ * io_read_line - Returns the next line from buf without its newline, refilling with read(2)
+ * as needed. The line stays valid until the next call; NULL at end of input.
+ */
+char *io_read_line(struct io_buffer *buf, size_t *len) {
+    size_t scanned = buf->start;
+    for (;;) {
+        char *newline = buf->data ? memchr(buf->data + scanned, '\n', buf->len - scanned) : NULL;
+        if (newline) {
+            char *line = buf->data + buf->start;
+            *newline = '\0';
+            if (len) *len = newline - line;
+            buf->start = newline + 1 - buf->data;
+            return line;
+        }
+        // Slide the partial line to the front, growing the buffer when it already fills it
+        if (buf->start > 0) {
+            memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+            buf->len -= buf->start;
+            buf->start = 0;
+        }
+        if (buf->len + 1 >= buf->cap) {
+            size_t cap = buf->cap ? buf->cap * 2 : IO_BUFFER_SIZE;
+            char *data = realloc(buf->data, cap);
+            if (!data) {
+                perror("realloc failed");
+                return NULL;
+            }
+            buf->data = data;
+            buf->cap = cap;
+        }
+        scanned = buf->len;
+        ssize_t n = read(buf->fd, buf->data + buf->len, buf->cap - buf->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // A last line without a newline is still a line
+            if (buf->len == 0) return NULL;
+            buf->data[buf->len] = '\0';
+            if (len) *len = buf->len;
+            buf->start = buf->len = 0;
+            return buf->data;
+        }
+        buf->len += n;
+    }
+}
+
+/*
+ * io_write - Appends to an output buffer, flushing it when full; large writes go straight through.
+ */
+void io_write(struct io_buffer *buf, const void *data, size_t len) {
+    if (!buf->data) {
+        buf->data = malloc(IO_BUFFER_SIZE);
+        if (!buf->data) {
+            perror("malloc failed");
+            buf->failed = 1;
+            return;
+        }
+        buf->cap = IO_BUFFER_SIZE;
+    }
+    if (buf->len + len > buf->cap) io_flush(buf);
+    if (len >= buf->cap) {
+        buf->len = len;
+        char *saved = buf->data;
+        buf->data = (char *)data;
+        io_flush(buf);
+        buf->data = saved;
+        return;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/*
+ * io_flush - Writes out everything buffered, retrying short writes.
+ */
+void io_flush(struct io_buffer *buf) {
+    size_t done = 0;
+    while (done < buf->len) {
+        ssize_t n = write(buf->fd, buf->data + done, buf->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            buf->failed = 1;
+            break;
+        }
+        done += n;
+    }
+    buf->len = 0;
+}
+
+/*
+ * record_open - Starts one output record of a --json or -0 listing.
+ */
+void record_open(void) {
+    record_fields = 0;
+    if (output_mode == OUTPUT_JSON) io_write(&record_out, "{", 1);
+}
+
+/*
+ * record_field - Writes the key of the next JSON field; in -0 mode reports whether this field is the one kept.
+ */
+static int record_field(const char *key) {
+    int first = record_fields++ == 0;
+    if (output_mode != OUTPUT_JSON) return first;
+    if (!first) io_write(&record_out, ",", 1);
+    io_write(&record_out, "\"", 1);
+    io_write(&record_out, key, strlen(key));
+    io_write(&record_out, "\":", 2);
+    return 1;
+}
+
+/*
+ * utf8_sequence - Length of the well-formed UTF-8 sequence at the start of text, or 0 if it is
+ * not one (a stray continuation byte, a truncated, overlong or surrogate sequence, or past U+10FFFF).
+ */
+size_t utf8_sequence(const unsigned char *text, size_t len) {
+    unsigned char c = text[0];
+    size_t n;
+    unsigned int code;
+    if (c < 0x80) return 1;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        code = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3;
+        code = c & 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        code = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (len < n) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((text[i] & 0xC0) != 0x80) return 0;
+        code = code << 6 | (text[i] & 0x3F);
+    }
+    if ((n == 3 && code < 0x800) || (n == 4 && code < 0x10000) || code > 0x10FFFF) return 0;
+    if (code >= 0xD800 && code <= 0xDFFF) return 0;
+    return n;
+}
+
+/*
+ * record_text - Adds a string field, JSON-escaped; in -0 mode the first field is written raw.
+ * Bytes that are not well-formed UTF-8 become U+FFFD, so the JSON stays valid.
+ */
+void record_text(const char *key, const char *value) {
+    if (!record_field(key)) return;
+    size_t len = strlen(value);
+    if (output_mode != OUTPUT_JSON) {
+        io_write(&record_out, value, len);
+        return;
+    }
+    io_write(&record_out, "\"", 1);
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = value[i];
+        if (c >= 0x80) {
+            size_t n = utf8_sequence((const unsigned char *)value + i, len - i);
+            if (n) {
+                i += n - 1;
+                continue;
+            }
+            io_write(&record_out, value + run, i - run);
+            run = i + 1;
+            io_write(&record_out, "\\ufffd", 6);
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        io_write(&record_out, value + run, i - run);
+        run = i + 1;
+        char escape[8];
+        if (c == '"' || c == '\\') snprintf(escape, sizeof(escape), "\\%c", c);
+        else if (c == '\n') strcpy(escape, "\\n");
+        else if (c == '\t') strcpy(escape, "\\t");
+        else snprintf(escape, sizeof(escape), "\\u%04x", c);
+        io_write(&record_out, escape, strlen(escape));
+    }
+    io_write(&record_out, value + run, len - run);
+    io_write(&record_out, "\"", 1);
+}
+
+/*
+ * record_number - Adds an integer field.
+ */
+void record_number(const char *key, long long value) {
+    if (!record_field(key)) return;
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%lld", value);
+    io_write(&record_out, text, n);
+}
+
+/*
+ * record_bool - Adds a true/false field.
+ */
+void record_bool(const char *key, int value) {
+    if (!record_field(key)) return;
+    io_write(&record_out, value ? "true" : "false", value ? 4 : 5);
+}
+
+/*
+ * record_close - Ends the record: a newline in JSON Lines, a NUL after the first field in -0 mode.
+ */
+void record_close(void) {
+    if (output_mode == OUTPUT_JSON) io_write(&record_out, "}\n", 2);
+    else io_write(&record_out, "", 1);
+}
+
+/*
+ * arena_alloc - Bump-allocates size bytes (16-byte aligned) from the per-command arena.
+ */
+void *arena_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (!arena_head || arena_head->used + size > arena_head->size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (!chunk) {
+            perror("malloc failed");
+            return NULL;
+        }
+        chunk->next = arena_head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena_head = chunk;
+        shell_counters[SUB_ARENA].entries++;
+        shell_counters[SUB_ARENA].bytes += chunk_size;
+        shell_counters[SUB_ARENA].misses++;
+    } else {
+        shell_counters[SUB_ARENA].hits++;
+    }
+    void *memory = arena_head->data + arena_head->used;
+    arena_head->used += size;
+    shell_counters[SUB_ARENA].allocs++;
+    return memory;
+}
+
+/*
+ * arena_strdup - Copies a string into the per-command arena.
+ */
+char *arena_strdup(const char *text) {
+    size_t len = strlen(text) + 1;
+    char *copy = arena_alloc(len);
+    if (copy) memcpy(copy, text, len);
+    return copy;
+}
+
+/*
+ * arena_reset - Releases the arena after a command line, keeping one chunk for the next.
+ */
+void arena_reset(void) {
+    if (!arena_head) return;
+    // Chunks are pushed on the front; keep the oldest and free the rest
+    while (arena_head->next) {
+        struct arena_chunk *next = arena_head->next;
+        shell_counters[SUB_ARENA].entries--;
+        shell_counters[SUB_ARENA].bytes -= arena_head->size;
+        free(arena_head);
+        arena_head = next;
+    }
+    arena_head->used = 0;
+}
+
+/*
+ * builtin_let - Evaluates each argument as an arithmetic expression; status 0 when the last is non-zero.
+ */
+int builtin_let(char *args[], int background) {
+    if (!args[1]) {
+        fprintf(stderr, "let: expression expected\n");
+        last_status = 2;
+        return 1;
+    }
+    long long value = 0;
+    for (int i = 1; args[i]; i++) {
+        if (arith_eval(args[i], &value, 0) != 0) {
+            last_status = 1;
+            return 1;
+        }
+    }
+    last_status = value == 0;
+    return 1;
+}
+
+/*
+ * builtin_unset - Removes shell variables.
+ */
+int builtin_unset(char *args[], int background) {
+    for (int i = 1; args[i]; i++) unset_var(args[i]);
+    last_status = 0;
+    return 1;
+}
+
+/*
+ * find_var - Looks a shell variable up by name; NULL when it is not set.
+ */
+struct shell_var *find_var(const char *name) {
+    struct shell_var *var = variables[hash_string(name) & (VAR_BUCKETS - 1)];
+    while (var && strcmp(var->name, name) != 0) var = var->next;
+    return var;
+}
+
+/*
+ * get_var - Value of a variable: $? and $$ first, then shell variables, then the environment.
+ * Returns NULL when the name is not set anywhere.
+ */
+const char *get_var(const char *name) {
+    static char special[32];
+    if (strcmp(name, "?") == 0) {
+        snprintf(special, sizeof(special), "%d", last_status);
+        return special;
+    }
+    if (strcmp(name, "$") == 0) {
+        snprintf(special, sizeof(special), "%d", (int)getpid());
+        return special;
+    }
+    struct shell_var *var = find_var(name);
+    return var ? var->value : getenv(name);
+}
+
+/*
+ * set_var - Sets a shell variable, creating it when needed.
+ */
+void set_var(const char *name, const char *value) {
+    char *copy = strdup(value);
+    if (!copy) {
+        perror("strdup failed");
+        return;
+    }
+    struct shell_var *var = find_var(name);
+    if (!var) {
+        var = calloc(1, sizeof(struct shell_var));
+        if (!var || !(var->name = strdup(name))) {
+            perror("malloc failed");
+            free(var);
+            free(copy);
+            return;
+        }
+        unsigned long bucket = hash_string(name) & (VAR_BUCKETS - 1);
+        var->next = variables[bucket];
+        variables[bucket] = var;
+        shell_counters[SUB_VARIABLES].entries++;
+        shell_counters[SUB_VARIABLES].bytes += sizeof(struct shell_var) + strlen(name) + 1;
+    } else {
+        shell_counters[SUB_VARIABLES].bytes -= strlen(var->value) + 1;
+        free(var->value);
+        free_var_items(var);
+    }
+    var->value = copy;
+    var->number_valid = 0;
+    shell_counters[SUB_VARIABLES].bytes += strlen(copy) + 1;
+    shell_counters[SUB_VARIABLES].allocs++;
+}
+
+/*
+ * set_var_number - Sets a variable from arithmetic, keeping the integer so reads skip conversion.
+ */
+void set_var_number(const char *name, long long number) {
+    struct shell_var *var = find_var(name);
+    if (var && var->number_valid && var->number == number) return;
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", number);
+    set_var(name, text);
+    var = find_var(name);
+    if (var) {
+        var->number = number;
+        var->number_valid = 1;
+    }
+}
+
+/*
+ * set_var_array - Makes name an array of copies of items, stored back to back in one block.
+ * $name (without a subscript) is the first element.
+ */
+void set_var_array(const char *name, char **items, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += strlen(items[i]) + 1;
+    char *storage = malloc(total ? total : 1);
+    char **copies = malloc((count ? count : 1) * sizeof(char *));
+    if (!storage || !copies) {
+        perror("malloc failed");
+        free(storage);
+        free(copies);
+        return;
+    }
+    char *p = storage;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(items[i]) + 1;
+        memcpy(p, items[i], len);
+        copies[i] = p;
+        p += len;
+    }
+    adopt_var_array(name, storage, total, copies, count);
+}
+
+/*
+ * adopt_var_array - Makes name an array whose elements point into storage; the variable takes
+ * ownership of both blocks.
+ */
+void adopt_var_array(const char *name, char *storage, size_t storage_size, char **items, size_t count) {
+    set_var(name, count ? items[0] : "");
+    struct shell_var *var = find_var(name);
+    if (!var) {
+        free(storage);
+        free(items);
+        return;
+    }
+    var->storage = storage;
+    var->storage_size = storage_size;
+    var->items = items;
+    var->count = count;
+    shell_counters[SUB_VARIABLES].bytes += storage_size + count * sizeof(char *);
+}
+
+/*
+ * free_var_items - Turns an array variable back into a plain one.
+ */
+void free_var_items(struct shell_var *var) {
+    if (!var->items) return;
+    shell_counters[SUB_VARIABLES].bytes -= var->storage_size + var->count * sizeof(char *);
+    free(var->items);
+    free(var->storage);
+    var->items = NULL;
+    var->storage = NULL;
+    var->storage_size = 0;
+    var->count = 0;
+}
+
+/*
+ * unset_var - Removes a shell variable if it exists.
+ */
+void unset_var(const char *name) {
+    struct shell_var **link = &variables[hash_string(name) & (VAR_BUCKETS - 1)];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    struct shell_var *var = *link;
+    if (!var) return;
+    *link = var->next;
+    shell_counters[SUB_VARIABLES].entries--;
+    shell_counters[SUB_VARIABLES].bytes -= sizeof(struct shell_var) + strlen(var->name) + strlen(var->value) + 2;
+    free_var_items(var);
+    free(var->name);
+    free(var->value);
+    free(var);
+}
+
+/*
+ * valid_name_length - Length of the variable name at the start of text (0 if it does not start with one).
+ */
+static size_t valid_name_length(const char *text) {
+    if (!isalpha((unsigned char)*text) && *text != '_') return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)text[len]) || text[len] == '_') len++;
+    return len;
+}
+
+/*
+ * assign_variables - Handles a command made only of NAME=value words by setting each variable.
+ * Returns 0 (and changes nothing) when any word is not an assignment.
+ */
+int assign_variables(char *args[]) {
+    if (!args[0]) return 0;
+    for (int i = 0; args[i]; i++) {
+        size_t len = valid_name_length(args[i]);
+        if (!len || args[i][len] != '=') return 0;
+    }
+    for (int i = 0; args[i]; i++) {
+        char *equals = strchr(args[i], '=');
+        *equals = '\0';
+        set_var(args[i], equals + 1);
+        *equals = '=';
+    }
+    last_status = 0;
+    return 1;
+}
+
+/*
+ * text_append - Appends len bytes to a text builder, keeping it NUL-terminated.
+ */
+void text_append(struct text_builder *text, const char *data, size_t len) {
+    if (text->len + len + 1 > text->cap) {
+        size_t cap = text->cap ? text->cap : 256;
+        while (text->len + len + 1 > cap) cap *= 2;
+        char *grown = realloc(text->data, cap);
+        if (!grown) {
+            perror("realloc failed");
+            return;
+        }
+        text->data = grown;
+        text->cap = cap;
+    }
+    memcpy(text->data + text->len, data, len);
+    text->len += len;
+    text->data[text->len] = '\0';
+}
+
+/*
+ * protect_text - Swaps the operator characters appended to text since from for their
+ * PROTECT_BASE stand-ins, so the parser takes them as plain word characters.
+ */
+void protect_text(struct text_builder *text, size_t from) {
+    for (size_t i = from; i < text->len; i++) {
+        const char *op = strchr(protected_ops, text->data[i]);
+        if (op && *op) text->data[i] = PROTECT_BASE + (op - protected_ops);
+    }
+}
+
+/*
+ * unprotect_word - Puts back the operator characters protect_text swapped out of a word.
+ */
+void unprotect_word(char *word) {
+    for (; *word; word++) {
+        unsigned char c = *word;
+        if (c >= PROTECT_BASE && c < PROTECT_BASE + sizeof(protected_ops) - 1) *word = protected_ops[c - PROTECT_BASE];
+    }
+}
+
+/*
+ * expand_line - Replaces $NAME, ${...} (see expand_parameter), $?, $$ and $(( expr )) in a command line.
+ * With protect, the substituted text is kept from being read as |, <, > or & (see protect_text).
+ * Stores a new string in *out and returns 0, or prints the problem and returns 1.
+ */
+int expand_line(const char *line, char **out, int protect) {
+    struct text_builder text = {NULL, 0, 0};
+    const char *p = line;
+    while (*p) {
+        const char *dollar = strchr(p, '$');
+        if (!dollar) {
+            text_append(&text, p, strlen(p));
+            break;
+        }
+        text_append(&text, p, dollar - p);
+        size_t value_start = text.len;
+        p = dollar + 1;
+        if (p[0] == '(' && p[1] == '(') {
+            // Find the "))" closing this expansion, skipping nested parentheses
+            const char *end = p + 2;
+            int depth = 0;
+            while (*end && !(depth == 0 && end[0] == ')' && end[1] == ')')) {
+                if (*end == '(') depth++;
+                if (*end == ')') depth--;
+                end++;
+            }
+            if (!*end) {
+                fprintf(stderr, "myshell: missing '))' in '%s'\n", line);
+                free(text.data);
+                return 1;
+            }
+            char *inner = strndup(p + 2, end - p - 2), *inner_expanded = NULL;
+            long long value;
+            int failed = !inner || (strchr(inner, '$') && expand_line(inner, &inner_expanded, 0) != 0) ||
+                         arith_eval(inner_expanded ? inner_expanded : inner, &value, 0) != 0;
+            free(inner);
+            free(inner_expanded);
+            if (failed) {
+                free(text.data);
+                return 1;
+            }
+            char number[32];
+            text_append(&text, number, snprintf(number, sizeof(number), "%lld", value));
+            p = end + 2;
+        } else if (p[0] == '{') {
+            // The matching '}', skipping braces of nested expansions
+            const char *close = p + 1;
+            int depth = 0;
+            while (*close && !(depth == 0 && *close == '}')) {
+                if (*close == '{') depth++;
+                if (*close == '}') depth--;
+                close++;
+            }
+            if (!*close) {
+                fprintf(stderr, "myshell: missing '}' in '%s'\n", line);
+                free(text.data);
+                return 1;
+            }
+            char *body = arena_alloc(close - p);
+            if (!body) {
+                free(text.data);
+                return 1;
+            }
+            memcpy(body, p + 1, close - p - 1);
+            body[close - p - 1] = '\0';
+            if (expand_parameter(body, &text) != 0) {
+                free(text.data);
+                return 1;
+            }
+            p = close + 1;
+        } else if (p[0] == '?' || p[0] == '$') {
+            char name[2] = {p[0], '\0'};
+            const char *value = get_var(name);
+            text_append(&text, value, strlen(value));
+            p++;
+        } else if (valid_name_length(p)) {
+            size_t len = valid_name_length(p);
+            char *name = strndup(p, len);
+            const char *value = name ? get_var(name) : NULL;
+            if (value) text_append(&text, value, strlen(value));
+            free(name);
+            p += len;
+        } else {
+            // A lone '$' is literal
+            text_append(&text, "$", 1);
+        }
+        if (protect) protect_text(&text, value_start);
+    }
+    if (!text.data) text_append(&text, "", 0);
+    *out = text.data;
+    return *out ? 0 : 1;
+}
+
+/*
+ * pattern_get - Compiled form of a wildcard (PATTERN_GLOB) or extended regex (PATTERN_REGEX) pattern,
+ * from an LRU cache keyed by pattern text. Returns NULL if a regex does not compile.
+ * The result stays valid until the next pattern_get call.
+ */
+struct pattern *pattern_get(const char *text, int kind) {
+    unsigned long hash = hash_string(text);
+    for (struct pattern *pat = pattern_lru; pat; pat = pat->next) {
+        if (pat->hash == hash && pat->kind == kind && strcmp(pat->text, text) == 0) {
+            shell_counters[SUB_PATTERN].hits++;
+            if (pat != pattern_lru) {
+                // Move to the front
+                pat->prev->next = pat->next;
+                if (pat->next) pat->next->prev = pat->prev;
+                pat->prev = NULL;
+                pat->next = pattern_lru;
+                pattern_lru->prev = pat;
+                pattern_lru = pat;
+            }
+            return pat;
+        }
+    }
+    shell_counters[SUB_PATTERN].misses++;
+    struct pattern *pat = pattern_compile(text, kind);
+    if (!pat) return NULL;
+    pat->hash = hash;
+    if (pattern_count == PATTERN_CACHE_SLOTS) {
+        struct pattern *oldest = pattern_lru;
+        while (oldest->next) oldest = oldest->next;
+        if (oldest->prev) oldest->prev->next = NULL;
+        shell_counters[SUB_PATTERN].bytes -= oldest->size;
+        pattern_free(oldest);
+        pattern_count--;
+    }
+    pat->next = pattern_lru;
+    if (pattern_lru) pattern_lru->prev = pat;
+    pattern_lru = pat;
+    pattern_count++;
+    shell_counters[SUB_PATTERN].entries = pattern_count;
+    shell_counters[SUB_PATTERN].bytes += pat->size;
+    shell_counters[SUB_PATTERN].allocs++;
+    return pat;
+}
+
+/*
+ * glob_bracket - Parses the bracket expression at p (just past '[') into a 256-bit class bitmap.
+ * Returns the position after the closing ']', or NULL if it is not a class this matcher handles
+ * (no closing ']', or [=x=] / [.x.] collating elements), in which case fnmatch takes over.
+ */
+static const char *glob_bracket(const char *p, unsigned char *bits) {
+    static const struct { const char *name; int (*test)(int); } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper}, {"lower", islower},
+        {"space", isspace}, {"blank", isblank}, {"punct", ispunct}, {"print", isprint}, {"graph", isgraph},
+        {"cntrl", iscntrl}, {"xdigit", isxdigit}
+    };
+    int negate = *p == '!' || *p == '^';
+    if (negate) p++;
+    memset(bits, 0, 32);
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        first = 0;
+        if (p[0] == '[' && (p[1] == '=' || p[1] == '.')) return NULL;
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            size_t i, count = sizeof(classes) / sizeof(classes[0]);
+            for (i = 0; end && i < count; i++) {
+                if (strlen(classes[i].name) == (size_t)(end - p - 2) && strncmp(classes[i].name, p + 2, end - p - 2) == 0) break;
+            }
+            if (!end || i == count) return NULL;
+            for (int c = 0; c < 256; c++) {
+                if (classes[i].test(c)) bits[c >> 3] |= 1 << (c & 7);
+            }
+            p = end + 2;
+            continue;
+        }
+        if (*p == '\\' && p[1]) p++;
+        unsigned char low = *p++, high = low;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            p++;
+            if (*p == '\\' && p[1]) p++;
+            high = *p++;
+        }
+        for (int c = low; c <= high; c++) bits[c >> 3] |= 1 << (c & 7);
+    }
+    if (*p != ']') return NULL;
+    if (negate) {
+        for (int i = 0; i < 32; i++) bits[i] = ~bits[i];
+    }
+    return p + 1;
+}
+
+/*
+ * pattern_compile - Compiles a pattern. Wildcards become a token list (literal bytes, ?, *, and
+ * classes as bitmaps), and the common shapes get a plan that avoids the general matcher:
+ * "lit", "lit*", "*lit", "*lit*" and "*".
+ */
+struct pattern *pattern_compile(const char *text, int kind) {
+    size_t text_len = strlen(text);
+    struct pattern *pat = calloc(1, sizeof(struct pattern));
+    if (!pat || !(pat->text = strdup(text))) {
+        perror("malloc failed");
+        free(pat);
+        return NULL;
+    }
+    pat->kind = kind;
+    pat->size = sizeof(struct pattern) + text_len + 1;
+    if (kind == PATTERN_REGEX) {
+        if (regcomp(&pat->re, text, REG_EXTENDED | REG_NOSUB) != 0) {
+            free(pat->text);
+            free(pat);
+            return NULL;
+        }
+        pat->plan = PLAN_REGEX;
+        return pat;
+    }
+    // At most one token per pattern byte, plus room for the literal bytes
+    pat->tokens = malloc((text_len + 1) * sizeof(struct pattern_token));
+    pat->literal = malloc(text_len + 1);
+    if (!pat->tokens || !pat->literal) {
+        perror("malloc failed");
+        pattern_free(pat);
+        return NULL;
+    }
+    pat->size += (text_len + 1) * (sizeof(struct pattern_token) + 1);
+    int stars = 0, others = 0, lead_star = 0, trail_star = 0;
+    for (const char *p = text; *p;) {
+        struct pattern_token *tok = &pat->tokens[pat->count];
+        if (*p == '*') {
+            while (*p == '*') p++;
+            tok->op = TOK_STAR;
+            stars++;
+            if (pat->count == 0) lead_star = 1;
+            trail_star = *p == '\0';
+        } else if (*p == '?') {
+            tok->op = TOK_ANY;
+            pat->multibyte = 1;
+            others++;
+            p++;
+        } else if (*p == '[' && strchr(p + 1, ']')) {
+            unsigned char bits[32];
+            const char *end = glob_bracket(p + 1, bits);
+            if (!end) {
+                pat->plan = PLAN_FNMATCH;
+                return pat;
+            }
+            unsigned char (*grown)[32] = realloc(pat->classes, (pat->class_count + 1) * sizeof(*pat->classes));
+            if (!grown) {
+                perror("realloc failed");
+                pattern_free(pat);
+                return NULL;
+            }
+            pat->classes = grown;
+            memcpy(pat->classes[pat->class_count], bits, 32);
+            tok->op = TOK_CLASS;
+            tok->arg = pat->class_count++;
+            pat->size += 32;
+            pat->multibyte = 1;
+            others++;
+            p = end;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            tok->op = TOK_BYTE;
+            tok->arg = (unsigned char)*p++;
+            pat->literal[pat->literal_len++] = tok->arg;
+        }
+        pat->count++;
+    }
+    if (others == 0 && stars == 0) pat->plan = PLAN_LITERAL;
+    else if (others == 0 && pat->literal_len == 0) pat->plan = PLAN_ANY;
+    else if (others == 0 && stars == 1 && trail_star) pat->plan = PLAN_PREFIX;
+    else if (others == 0 && stars == 1 && lead_star) pat->plan = PLAN_SUFFIX;
+    else if (others == 0 && stars == 2 && lead_star && trail_star) pat->plan = PLAN_CONTAINS;
+    else pat->plan = PLAN_TOKENS;
+    // Cheap rejections before the token scan: fixed literal ends and the shortest possible match
+    pat->min_len = pat->count - stars;
+    while (pat->head_len < (size_t)pat->count && pat->tokens[pat->head_len].op == TOK_BYTE) pat->head_len++;
+    if (stars) {
+        while (pat->tail_len < (size_t)pat->count &&
+               pat->tokens[pat->count - 1 - pat->tail_len].op == TOK_BYTE) pat->tail_len++;
+    }
+    return pat;
+}
+
+/*
+ * pattern_match - Whether the first len bytes of value match the whole pattern (regexes search value,
+ * which must then be NUL-terminated at len). Same answers as fnmatch(text, value, 0) and regexec.
+ */
+int pattern_match(const struct pattern *pat, const char *value, size_t len) {
+    switch (pat->plan) {
+    case PLAN_LITERAL:
+        return len == pat->literal_len && memcmp(value, pat->literal, len) == 0;
+    case PLAN_ANY:
+        return 1;
+    case PLAN_PREFIX:
+        return len >= pat->literal_len && memcmp(value, pat->literal, pat->literal_len) == 0;
+    case PLAN_SUFFIX:
+        return len >= pat->literal_len && memcmp(value + len - pat->literal_len, pat->literal, pat->literal_len) == 0;
+    case PLAN_CONTAINS:
+        return memmem(value, len, pat->literal, pat->literal_len) != NULL;
+    case PLAN_REGEX:
+        return regexec(&pat->re, value, 0, NULL, 0) == 0;
+    }
+    if (len < pat->min_len || memcmp(value, pat->literal, pat->head_len) != 0 ||
+        memcmp(value + len - pat->tail_len, pat->literal + pat->literal_len - pat->tail_len, pat->tail_len) != 0) {
+        return 0;
+    }
+    // ? and [...] match one character, which in a UTF-8 locale may be several bytes
+    int fallback = pat->plan == PLAN_FNMATCH;
+    if (!fallback && pat->multibyte && MB_CUR_MAX > 1) {
+        for (size_t i = 0; i < len && !fallback; i++) fallback = (unsigned char)value[i] >= 0x80;
+    }
+    if (fallback) {
+        char *copy = strndup(value, len);
+        int matched = copy && fnmatch(pat->text, copy, 0) == 0;
+        free(copy);
+        return matched;
+    }
+    // Greedy scan that backtracks only to the most recent '*'
+    size_t t = 0, i = 0, star_i = 0;
+    long star_t = -1;
+    while (i < len) {
+        const struct pattern_token *tok = t < (size_t)pat->count ? &pat->tokens[t] : NULL;
+        unsigned char c = value[i];
+        if (tok && tok->op == TOK_STAR) {
+            star_t = t++;
+            star_i = i;
+        } else if (tok && (tok->op == TOK_ANY || (tok->op == TOK_BYTE && tok->arg == c) ||
+                           (tok->op == TOK_CLASS && (pat->classes[tok->arg][c >> 3] & (1 << (c & 7)))))) {
+            t++;
+            i++;
+        } else if (star_t >= 0) {
+            t = star_t + 1;
+            i = ++star_i;
+        } else {
+            return 0;
+        }
+    }
+    while (t < (size_t)pat->count && pat->tokens[t].op == TOK_STAR) t++;
+    return t == (size_t)pat->count;
+}
+
+/*
+ * pattern_free - Releases a compiled pattern.
+ */
+void pattern_free(struct pattern *pat) {
+    if (pat->plan == PLAN_REGEX) regfree(&pat->re);
+    free(pat->text);
+    free(pat->tokens);
+    free(pat->literal);
+    free(pat->classes);
+    free(pat);
+}
+
+/*
+ * match_prefix - Length of the shortest (or longest) prefix of value matching pat, -1 if none.
+ */
+static long match_prefix(const char *value, size_t len, const struct pattern *pat, int longest) {
+    for (size_t i = 0; i <= len; i++) {
+        size_t cut = longest ? len - i : i;
+        if (pattern_match(pat, value, cut)) return cut;
+    }
+    return -1;
+}
+
+/*
+ * match_suffix - Start of the shortest (or longest) suffix of value matching pat, -1 if none.
+ */
+static long match_suffix(const char *value, size_t len, const struct pattern *pat, int longest) {
+    for (size_t i = 0; i <= len; i++) {
+        size_t start = longest ? i : len - i;
+        if (pattern_match(pat, value + start, len - start)) return start;
+    }
+    return -1;
+}
+
+/*
+ * expand_parameter - Expands the body of ${...}: NAME, NAME[i], NAME[@], #NAME, NAME:-word and friends, #/##/%/%%
+ * pattern removal, / // /# /% replacement, :offset:length, and ^ ^^ , ,, case changes (of the
+ * characters matching an optional pattern).
+ * Patterns go through the compiled pattern cache (fnmatch semantics); intermediate strings live
+ * in the per-command arena. Returns 0, or 1 after printing the problem.
+ */
+int expand_parameter(const char *body, struct text_builder *text) {
+    int length_of = body[0] == '#' && body[1];
+    const char *p = body + length_of;
+    size_t name_len = (*p == '?' || *p == '$') ? 1 : valid_name_length(p);
+    if (!name_len) {
+        fprintf(stderr, "myshell: ${%s}: bad substitution\n", body);
+        return 1;
+    }
+    char *name = arena_alloc(name_len + 1);
+    if (!name) return 1;
+    memcpy(name, p, name_len);
+    name[name_len] = '\0';
+    const char *op = p + name_len;
+    const char *found = get_var(name);
+    char *value = NULL;
+    size_t elements = found ? 1 : 0;
+    int all_elements = 0;
+    if (*op == '[') {
+        // Array subscript: [@] or [*] is every element joined by spaces, otherwise arithmetic
+        const char *close = strchr(op, ']');
+        if (!close) {
+            fprintf(stderr, "myshell: ${%s}: bad substitution\n", body);
+            return 1;
+        }
+        struct shell_var *var = find_var(name);
+        size_t count = var && var->items ? var->count : elements;
+        if (close == op + 2 && (op[1] == '@' || op[1] == '*')) {
+            elements = count;
+            all_elements = 1;
+            struct text_builder joined = {NULL, 0, 0};
+            for (size_t i = 0; i < count; i++) {
+                const char *item = var && var->items ? var->items[i] : found;
+                if (i) text_append(&joined, " ", 1);
+                text_append(&joined, item, strlen(item));
+            }
+            value = arena_strdup(joined.data ? joined.data : "");
+            free(joined.data);
+        } else {
+            char *subscript = arena_alloc(close - op);
+            long long index;
+            if (!subscript) return 1;
+            memcpy(subscript, op + 1, close - op - 1);
+            subscript[close - op - 1] = '\0';
+            if (arith_eval(subscript, &index, 0) != 0) return 1;
+            if (index < 0) index += count;
+            found = NULL;
+            if (index >= 0 && (size_t)index < count) found = var && var->items ? var->items[index] : get_var(name);
+        }
+        op = close + 1;
+    }
+    if (!value) value = arena_strdup(found ? found : "");
+    if (!value) return 1;
+    size_t len = strlen(value);
+
+    if (length_of) {
+        if (*op) {
+            fprintf(stderr, "myshell: ${%s}: bad substitution\n", body);
+            return 1;
+        }
+        // ${#name[@]} counts elements; otherwise characters
+        char number[32];
+        size_t n = all_elements ? elements : len;
+        text_append(text, number, snprintf(number, sizeof(number), "%zu", n));
+        return 0;
+    }
+    if (!*op) {
+        text_append(text, value, len);
+        return 0;
+    }
+
+    // Everything after the operator is itself expanded ($NAME, $(( )), nested ${})
+    int colon = op[0] == ':' && op[1] && strchr("-=+?", op[1]);
+    const char *word = op + colon + 1;
+    if (strchr("#%/^,", *op) && (op[0] == op[1] || (op[0] == '/' && (op[1] == '#' || op[1] == '%')))) word++;
+    if (*op == ':' && !colon) word = op + 1;
+    char *expanded = NULL;
+    if (strchr(word, '$') && expand_line(word, &expanded, 0) != 0) return 1;
+    char *arg = arena_strdup(expanded ? expanded : word);
+    free(expanded);
+    if (!arg) return 1;
+
+    // Unset-or-null tests: with ':' an empty value counts as unset
+    if (strchr("-=+?", op[colon])) {
+        int missing = !found || (colon && !*value);
+        switch (op[colon]) {
+        case '-': if (missing) value = arg; break;
+        case '=':
+            if (missing) {
+                set_var(name, arg);
+                value = arg;
+            }
+            break;
+        case '+': value = missing ? "" : arg; break;
+        case '?':
+            if (missing) {
+                fprintf(stderr, "myshell: %s: %s\n", name, *arg ? arg : "parameter null or not set");
+                return 1;
+            }
+            break;
+        }
+        text_append(text, value, strlen(value));
+        return 0;
+    }
+
+    // Pattern operators compile their pattern once, however many positions they try
+    struct pattern *pat = NULL;
+    if ((*op == '#' || *op == '%') && !(pat = pattern_get(arg, PATTERN_GLOB))) return 1;
+    switch (*op) {
+    case '#': {
+        long cut = match_prefix(value, len, pat, op[1] == '#');
+        if (cut > 0) value += cut;
+        break;
+    }
+    case '%': {
+        long start = match_suffix(value, len, pat, op[1] == '%');
+        if (start >= 0) value[start] = '\0';
+        break;
+    }
+    case '/': {
+        // pattern/replacement; a missing replacement deletes the matches
+        int all = op[1] == '/', anchor = (op[1] == '#' || op[1] == '%') ? op[1] : 0;
+        char *replacement = arg;
+        while (*replacement && *replacement != '/') replacement += (replacement[0] == '\\' && replacement[1]) ? 2 : 1;
+        if (*replacement) *replacement++ = '\0';
+        if (!(pat = pattern_get(arg, PATTERN_GLOB))) return 1;
+        struct text_builder out = {NULL, 0, 0};
+        size_t pos = 0;
+        int replaced = 0;
+        while (pos <= len) {
+            long end = -1;
+            if (!replaced || all) {
+                if (anchor == '%') {
+                    if (pattern_match(pat, value + pos, len - pos)) end = len;
+                } else if (!anchor || pos == 0) {
+                    // Longest match starting here
+                    end = match_prefix(value + pos, len - pos, pat, 1);
+                    if (end >= 0) end += pos;
+                }
+            }
+            if (end > (long)pos || (end == (long)pos && anchor)) {
+                text_append(&out, replacement, strlen(replacement));
+                replaced = 1;
+                pos = end;
+                if (end == (long)pos && pos == len) break;
+                continue;
+            }
+            if (pos < len) text_append(&out, value + pos, 1);
+            pos++;
+        }
+        text_append(text, out.data ? out.data : "", out.len);
+        free(out.data);
+        return 0;
+    }
+    case '^':
+    case ',':
+        // A pattern limits the change to the characters it matches one at a time (default: any)
+        if (*arg && !(pat = pattern_get(arg, PATTERN_GLOB))) return 1;
+        for (size_t i = 0; i < len && (i == 0 || op[1] == op[0]); i++) {
+            if (pat && !pattern_match(pat, value + i, 1)) continue;
+            value[i] = *op == '^' ? toupper((unsigned char)value[i]) : tolower((unsigned char)value[i]);
+        }
+        break;
+    case ':': {
+        // Offset and length are arithmetic; negative values count from the end
+        char *length_text = strchr(arg, ':');
+        if (length_text) *length_text++ = '\0';
+        long long offset = 0, count = len;
+        if (arith_eval(arg, &offset, 0) != 0) return 1;
+        if (length_text && arith_eval(length_text, &count, 0) != 0) return 1;
+        if (offset < 0) offset += len;
+        if (offset < 0 || offset > (long long)len) offset = len;
+        if (count < 0) count += len - offset;
+        if (count < 0) {
+            fprintf(stderr, "myshell: %s: substring expression < 0\n", length_text);
+            return 1;
+        }
+        if (count > (long long)len - offset) count = len - offset;
+        text_append(text, value + offset, count);
+        return 0;
+    }
+    default:
+        fprintf(stderr, "myshell: ${%s}: bad substitution\n", body);
+        return 1;
+    }
+    text_append(text, value, strlen(value));
+    return 0;
+}
+
+/*
+ * arith_command - Runs a line of the form "(( expr ))": status 0 when the value is non-zero.
+ * Returns 0 when the line is not an arithmetic command.
+ */
+int arith_command(const char *line) {
+    size_t len = strlen(line);
+    while (len && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    if (len < 4 || strncmp(line, "((", 2) != 0 || strncmp(line + len - 2, "))", 2) != 0) return 0;
+    char *inner = strndup(line + 2, len - 4), *expanded = NULL;
+    if (!inner) return 1;
+    long long value;
+    if ((strchr(inner, '$') && expand_line(inner, &expanded, 0) != 0) ||
+        arith_eval(expanded ? expanded : inner, &value, 0) != 0) {
+        last_status = 1;
+    } else {
+        last_status = value == 0;
+    }
+    free(inner);
+    free(expanded);
+    return 1;
+}
+
+/*
+ * arith_eval - Evaluates an arithmetic expression, compiling it on a cache miss.
+ * depth counts variables being evaluated as expressions. Returns 0, or 1 after printing an error.
+ */
+int arith_eval(const char *text, long long *result, int depth) {
+    unsigned long slot = hash_string(text) & (ARITH_CACHE_SLOTS - 1);
+    struct arith_program *prog = arith_cache[slot];
+    if (prog && strcmp(prog->text, text) == 0) {
+        shell_counters[SUB_ARITH].hits++;
+        return arith_run(prog, result, depth);
+    }
+    shell_counters[SUB_ARITH].misses++;
+    prog = arith_compile(text);
+    if (!prog) return 1;
+    // A nested evaluation must not evict the program that is running above it
+    if (depth > 0 && arith_cache[slot]) {
+        int failed = arith_run(prog, result, depth);
+        arith_free(prog);
+        return failed;
+    }
+    if (arith_cache[slot]) {
+        struct arith_program *old = arith_cache[slot];
+        shell_counters[SUB_ARITH].bytes -= strlen(old->text) + 1 + old->cap * sizeof(struct arith_insn);
+        arith_free(old);
+    } else {
+        shell_counters[SUB_ARITH].entries++;
+    }
+    arith_cache[slot] = prog;
+    shell_counters[SUB_ARITH].allocs++;
+    shell_counters[SUB_ARITH].bytes += strlen(prog->text) + 1 + prog->cap * sizeof(struct arith_insn);
+    return arith_run(prog, result, depth);
+}
+
+// Compiler state: a recursive-descent parser emitting postfix code into prog
+struct arith_parser {
+    const char *p;
+    struct arith_program *prog;
+    const char *error;
+};
+
+// Binary operators by precedence level (0 binds loosest); "not_next" rejects longer operators
+static const struct {
+    const char *op, *not_next;
+    int level, code;
+} arith_binops[] = {
+    {"||", "", 0, AOP_OR}, {"&&", "", 1, AOP_AND}, {"|", "|=", 2, AOP_BOR}, {"^", "=", 3, AOP_XOR},
+    {"&", "&=", 4, AOP_BAND}, {"==", "", 5, AOP_EQ}, {"!=", "", 5, AOP_NE}, {"<=", "", 6, AOP_LE},
+    {">=", "", 6, AOP_GE}, {"<", "<=", 6, AOP_LT}, {">", ">=", 6, AOP_GT}, {"<<", "=", 7, AOP_SHL},
+    {">>", "=", 7, AOP_SHR}, {"+", "+=", 8, AOP_ADD}, {"-", "-=", 8, AOP_SUB}, {"*", "*=", 9, AOP_MUL},
+    {"/", "=", 9, AOP_DIV}, {"%", "=", 9, AOP_MOD}, {"**", "=", 10, AOP_POW},
+};
+#define ARITH_LEVELS 11
+
+// Assignment operators and the binary operation a compound one applies first
+static const struct {
+    const char *op;
+    int code;
+} arith_assignops[] = {
+    {"<<=", AOP_SHL}, {">>=", AOP_SHR}, {"*=", AOP_MUL}, {"/=", AOP_DIV}, {"%=", AOP_MOD}, {"+=", AOP_ADD},
+    {"-=", AOP_SUB}, {"&=", AOP_BAND}, {"^=", AOP_XOR}, {"|=", AOP_BOR}, {"=", -1},
+};
+
+static void arith_comma(struct arith_parser *ps);
+static void arith_assign(struct arith_parser *ps);
+
+/*
+ * arith_emit - Appends one instruction and returns its index.
+ */
+static int arith_emit(struct arith_parser *ps, int op, int operand, long long value) {
+    struct arith_program *prog = ps->prog;
+    if (prog->length == prog->cap) {
+        int cap = prog->cap ? prog->cap * 2 : 16;
+        struct arith_insn *code = realloc(prog->code, cap * sizeof(struct arith_insn));
+        if (!code) {
+            ps->error = "out of memory";
+            return 0;
+        }
+        prog->code = code;
+        prog->cap = cap;
+    }
+    prog->code[prog->length].op = op;
+    prog->code[prog->length].operand = operand;
+    prog->code[prog->length].value = value;
+    return prog->length++;
+}
+
+/*
+ * arith_name - Index of a variable name in the program's name table, adding it if new.
+ */
+static int arith_name(struct arith_parser *ps, const char *name, size_t len) {
+    struct arith_program *prog = ps->prog;
+    for (int i = 0; i < prog->name_count; i++) {
+        if (strlen(prog->names[i]) == len && strncmp(prog->names[i], name, len) == 0) return i;
+    }
+    char **names = realloc(prog->names, (prog->name_count + 1) * sizeof(char *));
+    if (!names || !(names[prog->name_count] = strndup(name, len))) {
+        if (names) prog->names = names;
+        ps->error = "out of memory";
+        return 0;
+    }
+    prog->names = names;
+    return prog->name_count++;
+}
+
+/*
+ * arith_accept - Consumes op (after blanks) unless it is followed by a character in not_next.
+ */
+static int arith_accept(struct arith_parser *ps, const char *op, const char *not_next) {
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+    size_t len = strlen(op);
+    if (strncmp(ps->p, op, len) != 0 || (ps->p[len] && strchr(not_next, ps->p[len]))) return 0;
+    ps->p += len;
+    return 1;
+}
+
+/*
+ * arith_number - Compiles a constant: decimal, 0x hex, 0 octal or base#digits (base 2-36).
+ */
+static void arith_number(struct arith_parser *ps) {
+    char *end;
+    unsigned long long value = strtoull(ps->p, &end, 0);
+    if (*end == '#') {
+        long base = strtol(ps->p, NULL, 10);
+        if (base < 2 || base > 36) {
+            ps->error = "invalid arithmetic base";
+            return;
+        }
+        const char *digits = end + 1;
+        value = strtoull(digits, &end, base);
+        if (end == digits) {
+            ps->error = "invalid number";
+            return;
+        }
+    }
+    if (isalnum((unsigned char)*end) || *end == '_') {
+        ps->error = "invalid number";
+        return;
+    }
+    ps->p = end;
+    arith_emit(ps, AOP_PUSH, 0, (long long)value);
+}
+
+/*
+ * arith_primary - Numbers, variables (with postfix ++/--) and parenthesised expressions.
+ */
+static void arith_primary(struct arith_parser *ps) {
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+    if (*ps->p == '(') {
+        ps->p++;
+        arith_comma(ps);
+        if (!ps->error && !arith_accept(ps, ")", "")) ps->error = "missing ')'";
+    } else if (isdigit((unsigned char)*ps->p)) {
+        arith_number(ps);
+    } else if (valid_name_length(ps->p)) {
+        size_t len = valid_name_length(ps->p);
+        int var = arith_name(ps, ps->p, len);
+        ps->p += len;
+        int step = arith_accept(ps, "++", "") ? AOP_ADD : arith_accept(ps, "--", "") ? AOP_SUB : -1;
+        arith_emit(ps, AOP_LOAD, var, 0);
+        if (step >= 0) {
+            // Old value stays on the stack under the updated one, which is stored and dropped
+            arith_emit(ps, AOP_LOAD, var, 0);
+            arith_emit(ps, AOP_PUSH, 0, 1);
+            arith_emit(ps, step, 0, 0);
+            arith_emit(ps, AOP_STORE, var, 0);
+            arith_emit(ps, AOP_POP, 0, 0);
+        }
+    } else {
+        ps->error = *ps->p ? "operand expected" : "unexpected end of expression";
+    }
+}
+
+/*
+ * arith_unary - Prefix operators: ++ -- + - ! ~.
+ */
+static void arith_unary(struct arith_parser *ps) {
+    if (arith_accept(ps, "++", "") || arith_accept(ps, "--", "")) {
+        int step = ps->p[-1] == '+' ? AOP_ADD : AOP_SUB;
+        while (isspace((unsigned char)*ps->p)) ps->p++;
+        size_t len = valid_name_length(ps->p);
+        if (!len) {
+            ps->error = "++ and -- need a variable";
+            return;
+        }
+        int var = arith_name(ps, ps->p, len);
+        ps->p += len;
+        arith_emit(ps, AOP_LOAD, var, 0);
+        arith_emit(ps, AOP_PUSH, 0, 1);
+        arith_emit(ps, step, 0, 0);
+        arith_emit(ps, AOP_STORE, var, 0);
+    } else if (arith_accept(ps, "-", "")) {
+        arith_unary(ps);
+        arith_emit(ps, AOP_NEG, 0, 0);
+    } else if (arith_accept(ps, "+", "")) {
+        arith_unary(ps);
+    } else if (arith_accept(ps, "!", "=")) {
+        arith_unary(ps);
+        arith_emit(ps, AOP_NOT, 0, 0);
+    } else if (arith_accept(ps, "~", "")) {
+        arith_unary(ps);
+        arith_emit(ps, AOP_BITNOT, 0, 0);
+    } else {
+        arith_primary(ps);
+    }
+}
+
+/*
+ * arith_binary - Operators of one precedence level and tighter. && and || jump over their
+ * right operand; ** is right associative.
+ */
+static void arith_binary(struct arith_parser *ps, int level) {
+    if (level == ARITH_LEVELS) {
+        arith_unary(ps);
+        return;
+    }
+    arith_binary(ps, level + 1);
+    while (!ps->error) {
+        int code = -1;
+        for (size_t i = 0; i < sizeof(arith_binops) / sizeof(arith_binops[0]); i++) {
+            if (arith_binops[i].level == level && arith_accept(ps, arith_binops[i].op, arith_binops[i].not_next)) {
+                code = arith_binops[i].code;
+                break;
+            }
+        }
+        if (code < 0) return;
+        if (code == AOP_AND || code == AOP_OR) {
+            int jump = arith_emit(ps, code == AOP_AND ? AOP_JZ : AOP_JNZ, 0, 0);
+            arith_binary(ps, level + 1);
+            arith_emit(ps, AOP_BOOL, 0, 0);
+            int skip = arith_emit(ps, AOP_JMP, 0, 0);
+            ps->prog->code[jump].value = arith_emit(ps, AOP_PUSH, 0, code == AOP_OR);
+            ps->prog->code[skip].value = ps->prog->length;
+        } else {
+            arith_binary(ps, code == AOP_POW ? level : level + 1);
+            arith_emit(ps, code, 0, 0);
+        }
+    }
+}
+
+/*
+ * arith_ternary - cond ? a : b, evaluating only the chosen branch.
+ */
+static void arith_ternary(struct arith_parser *ps) {
+    arith_binary(ps, 0);
+    if (ps->error || !arith_accept(ps, "?", "")) return;
+    int to_else = arith_emit(ps, AOP_JZ, 0, 0);
+    arith_assign(ps);
+    if (!ps->error && !arith_accept(ps, ":", "")) ps->error = "missing ':'";
+    if (ps->error) return;
+    int to_end = arith_emit(ps, AOP_JMP, 0, 0);
+    ps->prog->code[to_else].value = ps->prog->length;
+    arith_assign(ps);
+    ps->prog->code[to_end].value = ps->prog->length;
+}
+
+/*
+ * arith_assign - NAME = expr and the compound forms (+=, <<=, ...), right associative.
+ */
+static void arith_assign(struct arith_parser *ps) {
+    const char *start = ps->p;
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+    size_t len = valid_name_length(ps->p);
+    if (len) {
+        const char *name = ps->p;
+        ps->p += len;
+        for (size_t i = 0; i < sizeof(arith_assignops) / sizeof(arith_assignops[0]); i++) {
+            if (arith_accept(ps, arith_assignops[i].op, "=")) {
+                int var = arith_name(ps, name, len);
+                if (arith_assignops[i].code >= 0) arith_emit(ps, AOP_LOAD, var, 0);
+                arith_assign(ps);
+                if (arith_assignops[i].code >= 0) arith_emit(ps, arith_assignops[i].code, 0, 0);
+                arith_emit(ps, AOP_STORE, var, 0);
+                return;
+            }
+        }
+    }
+    ps->p = start;
+    arith_ternary(ps);
+}
+
+/*
+ * arith_comma - expr, expr: evaluates both, keeping the right value.
+ */
+static void arith_comma(struct arith_parser *ps) {
+    arith_assign(ps);
+    while (!ps->error && arith_accept(ps, ",", "")) {
+        arith_emit(ps, AOP_POP, 0, 0);
+        arith_assign(ps);
+    }
+}
+
+/*
+ * arith_compile - Compiles an expression to a postfix program. Returns NULL after printing
+ * the syntax error.
+ */
+struct arith_program *arith_compile(const char *text) {
+    struct arith_program *prog = calloc(1, sizeof(struct arith_program));
+    if (!prog || !(prog->text = strdup(text))) {
+        perror("malloc failed");
+        free(prog);
+        return NULL;
+    }
+    struct arith_parser ps = {text, prog, NULL};
+    while (isspace((unsigned char)*ps.p)) ps.p++;
+    if (*ps.p) {
+        arith_comma(&ps);
+    } else {
+        // An empty expression is 0
+        arith_emit(&ps, AOP_PUSH, 0, 0);
+    }
+    while (!ps.error && isspace((unsigned char)*ps.p)) ps.p++;
+    if (!ps.error && *ps.p) ps.error = "syntax error";
+    if (ps.error) {
+        fprintf(stderr, "myshell: %s: %s (at '%s')\n", text, ps.error, *ps.p ? ps.p : "end");
+        arith_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+/*
+ * arith_var_value - Integer value of a variable: unset or empty is 0, numbers convert
+ * directly, anything else is evaluated as an expression.
+ */
+static int arith_var_value(const char *name, long long *value, int depth) {
+    struct shell_var *var = find_var(name);
+    if (var && var->number_valid) {
+        *value = var->number;
+        return 0;
+    }
+    const char *text = var ? var->value : getenv(name);
+    while (text && isspace((unsigned char)*text)) text++;
+    if (!text || !*text) {
+        *value = 0;
+        return 0;
+    }
+    char *end;
+    *value = strtoll(text, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (!*end) return 0;
+    if (depth >= ARITH_MAX_DEPTH) {
+        fprintf(stderr, "myshell: %s: expression recursion level exceeded\n", name);
+        return 1;
+    }
+    return arith_eval(text, value, depth + 1);
+}
+
+/*
+ * arith_run - Executes a compiled program on a value stack. Integer overflow wraps; division
+ * by zero and negative exponents are errors. Returns 0, or 1 after printing the error.
+ */
+int arith_run(const struct arith_program *prog, long long *result, int depth) {
+    // Each instruction pushes at most one value, so the program length bounds the stack
+    long long small[64];
+    long long *stack = prog->length < 64 ? small : malloc((prog->length + 1) * sizeof(long long));
+    if (!stack) {
+        perror("malloc failed");
+        return 1;
+    }
+    const char *error = NULL;
+    int sp = 0;
+    for (int pc = 0; pc < prog->length && !error; pc++) {
+        const struct arith_insn *insn = &prog->code[pc];
+        switch (insn->op) {
+        case AOP_PUSH: stack[sp++] = insn->value; break;
+        case AOP_LOAD:
+            if (arith_var_value(prog->names[insn->operand], &stack[sp], depth) != 0) error = "";
+            sp++;
+            break;
+        case AOP_STORE: set_var_number(prog->names[insn->operand], stack[sp - 1]); break;
+        case AOP_POP: sp--; break;
+        case AOP_JZ: if (!stack[--sp]) pc = insn->value - 1; break;
+        case AOP_JNZ: if (stack[--sp]) pc = insn->value - 1; break;
+        case AOP_JMP: pc = insn->value - 1; break;
+        case AOP_BOOL: stack[sp - 1] = stack[sp - 1] != 0; break;
+        case AOP_NEG: stack[sp - 1] = (long long)(0ULL - (unsigned long long)stack[sp - 1]); break;
+        case AOP_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+        case AOP_BITNOT: stack[sp - 1] = ~stack[sp - 1]; break;
+        default: {
+            long long b = stack[--sp], a = stack[sp - 1], r = 0;
+            unsigned long long ua = a, ub = b;
+            switch (insn->op) {
+            case AOP_MUL: r = (long long)(ua * ub); break;
+            case AOP_DIV:
+            case AOP_MOD:
+                if (b == 0) {
+                    error = "division by 0";
+                } else if (b == -1) {
+                    // LLONG_MIN / -1 overflows; wrap like the other operators
+                    r = insn->op == AOP_DIV ? (long long)(0ULL - ua) : 0;
+                } else {
+                    r = insn->op == AOP_DIV ? a / b : a % b;
+                }
+                break;
+            case AOP_POW:
+                if (b < 0) {
+                    error = "exponent less than 0";
+                    break;
+                }
+                for (r = 1; b; b >>= 1, ua *= ua) {
+                    if (b & 1) r = (long long)((unsigned long long)r * ua);
+                }
+                break;
+            case AOP_ADD: r = (long long)(ua + ub); break;
+            case AOP_SUB: r = (long long)(ua - ub); break;
+            case AOP_SHL: r = (long long)(ua << (b & 63)); break;
+            case AOP_SHR: r = a >> (b & 63); break;
+            case AOP_LT: r = a < b; break;
+            case AOP_LE: r = a <= b; break;
+            case AOP_GT: r = a > b; break;
+            case AOP_GE: r = a >= b; break;
+            case AOP_EQ: r = a == b; break;
+            case AOP_NE: r = a != b; break;
+            case AOP_BAND: r = a & b; break;
+            case AOP_XOR: r = a ^ b; break;
+            case AOP_BOR: r = a | b; break;
+            }
+            stack[sp - 1] = r;
+        }
+        }
+    }
+    // Errors from a variable's own expression were already reported
+    if (error && *error) fprintf(stderr, "myshell: %s: %s\n", prog->text, error);
+    if (!error) *result = sp ? stack[sp - 1] : 0;
+    if (stack != small) free(stack);
+    return error != NULL;
+}
+
+/*
+ * arith_free - Releases a compiled program.
+ */
+void arith_free(struct arith_program *prog) {
+    for (int i = 0; i < prog->name_count; i++) free(prog->names[i]);
+    free(prog->names);
+    free(prog->code);
+    free(prog->text);
+    free(prog);
+}
+
+/*
+ * builtin_read - read [-r] [-d delim] [-n count] [-a array] [-u fd] [name...]
+ * Reads one record and splits it on IFS into the names (the last takes the rest), into an
+ * array with -a, or into REPLY. Status 1 at end of input.
+ */
+int builtin_read(char *args[], int background) {
+    int raw = 0, fd = STDIN_FILENO, delim = '\n';
+    long limit = -1;
+    const char *array = NULL;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char *flag = args[i] + 1; *flag; flag++) {
+            if (*flag == 'r') {
+                raw = 1;
+                continue;
+            }
+            // Options with a value take the rest of the word or the next word
+            char *value = flag[1] ? flag + 1 : args[i + 1];
+            if (!strchr("dnau", *flag) || !value) {
+                fprintf(stderr, "Usage: read [-r] [-d delim] [-n count] [-a array] [-u fd] [name...]\n");
+                last_status = 2;
+                return 1;
+            }
+            if (!flag[1]) i++;
+            if (*flag == 'd') delim = (unsigned char)value[0];
+            if (*flag == 'n') limit = atol(value);
+            if (*flag == 'a') array = value;
+            if (*flag == 'u') fd = atoi(value);
+            break;
+        }
+    }
+
+    struct text_builder line = {NULL, 0, 0};
+    int found = read_record(fd, delim, limit, raw, &line);
+    if (found < 0) {
+        free(line.data);
+        last_status = 1;
+        return 1;
+    }
+    const char *ifs = get_var("IFS");
+    if (!ifs) ifs = " \t\n";
+    char *cursor = line.data;
+    if (array) {
+        char **fields = NULL;
+        size_t count = 0;
+        char *field;
+        while ((field = ifs_field(&cursor, ifs, 0, !raw))) {
+            char **grown = realloc(fields, (count + 1) * sizeof(char *));
+            if (!grown) break;
+            fields = grown;
+            fields[count++] = field;
+        }
+        set_var_array(array, fields, count);
+        free(fields);
+    } else if (!args[i]) {
+        if (!raw) remove_backslashes(line.data);
+        set_var("REPLY", line.data);
+    } else {
+        for (; args[i]; i++) {
+            char *field = ifs_field(&cursor, ifs, args[i + 1] == NULL, !raw);
+            set_var(args[i], field ? field : "");
+        }
+    }
+    free(line.data);
+    // A final record without its delimiter is still assigned, but ends the input
+    last_status = !found;
+    return 1;
+}
+
+/*
+ * builtin_mapfile - mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]
+ * Loads lines into an array in one pass. Regular files are mmapped; other input is read to
+ * the end in large blocks, except with -n, where read's record reader stops at the last line.
+ */
+int builtin_mapfile(char *args[], int background) {
+    int strip = 0, fd = STDIN_FILENO, delim = '\n';
+    long max = 0, skip = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char *flag = args[i] + 1; *flag; flag++) {
+            if (*flag == 't') {
+                strip = 1;
+                continue;
+            }
+            char *value = flag[1] ? flag + 1 : args[i + 1];
+            if (!strchr("dnsu", *flag) || !value) {
+                fprintf(stderr, "Usage: mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]\n");
+                last_status = 2;
+                return 1;
+            }
+            if (!flag[1]) i++;
+            if (*flag == 'd') delim = (unsigned char)value[0];
+            if (*flag == 'n') max = atol(value);
+            if (*flag == 's') skip = atol(value);
+            if (*flag == 'u') fd = atoi(value);
+            break;
+        }
+    }
+    const char *name = args[i] ? args[i] : "MAPFILE";
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "mapfile: %d: invalid file descriptor\n", fd);
+        last_status = 1;
+        return 1;
+    }
+    last_status = 0;
+
+    if (S_ISREG(st.st_mode)) {
+        // Map from the current offset (rounded down to a page) to the end of the file
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        if (start < 0 || start >= st.st_size) {
+            mapfile_build(name, "", 0, delim, strip, skip, max);
+            return 1;
+        }
+        off_t aligned = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        size_t map_len = st.st_size - aligned;
+        char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, aligned);
+        if (map == MAP_FAILED) {
+            perror("mapfile: mmap");
+            last_status = 1;
+            return 1;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        size_t used = mapfile_build(name, map + (start - aligned), st.st_size - start, delim, strip, skip, max);
+        munmap(map, map_len);
+        lseek(fd, start + used, SEEK_SET);
+        return 1;
+    }
+
+    struct text_builder input = {NULL, 0, 0};
+    if (max > 0) {
+        // Stop exactly after the last line wanted; the rest stays for the next command
+        struct text_builder record = {NULL, 0, 0};
+        for (long line = 0; line < skip + max; line++) {
+            record.len = 0;
+            int found = read_record(fd, delim, -1, 1, &record);
+            if (found < 0) break;
+            if (line >= skip) {
+                text_append(&input, record.data, record.len);
+                char terminator = delim;
+                if (found) text_append(&input, &terminator, 1);
+            }
+            if (!found) break;
+        }
+        free(record.data);
+        skip = 0;
+    } else {
+        // Everything to end of input, in blocks that double up to 8 MiB
+        size_t block = IO_BUFFER_SIZE;
+        for (;;) {
+            if (input.cap - input.len < block + 1) {
+                size_t cap = input.cap ? input.cap : block;
+                while (cap - input.len < block + 1) cap *= 2;
+                char *grown = realloc(input.data, cap);
+                if (!grown) {
+                    perror("realloc failed");
+                    break;
+                }
+                input.data = grown;
+                input.cap = cap;
+            }
+            ssize_t n = read(fd, input.data + input.len, block);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) perror("mapfile: read");
+            if (n <= 0) break;
+            input.len += n;
+            if (block < 8 * 1024 * 1024) block *= 2;
+        }
+    }
+    mapfile_build(name, input.data ? input.data : "", input.len, delim, strip, skip, max);
+    free(input.data);
+    return 1;
+}
+
+/*
+ * mapfile_build - Splits data into lines with memchr and stores them in array name as views
+ * into one block (two allocations whatever the line count). Skips the first skip lines and
+ * keeps at most max (0 = all). Returns the bytes of data consumed.
+ */
+size_t mapfile_build(const char *name, const char *data, size_t size, int delim, int strip, long skip, long max) {
+    // Pass 1: line start offsets, kept in the block that later becomes the element pointers
+    size_t cap = 1024, count = 0, pos = 0;
+    size_t *offsets = malloc(cap * sizeof(size_t));
+    if (!offsets) {
+        perror("malloc failed");
+        return 0;
+    }
+    for (long skipped = 0; pos < size && skipped < skip; skipped++) {
+        const char *hit = memchr(data + pos, delim, size - pos);
+        pos = hit ? (size_t)(hit - data) + 1 : size;
+    }
+    size_t first = pos;
+    while (pos < size && (max == 0 || count < (size_t)max)) {
+        if (count + 1 == cap) {
+            size_t *grown = realloc(offsets, cap * 2 * sizeof(size_t));
+            if (!grown) break;
+            offsets = grown;
+            cap *= 2;
+        }
+        offsets[count++] = pos;
+        const char *hit = memchr(data + pos, delim, size - pos);
+        pos = hit ? (size_t)(hit - data) + 1 : size;
+    }
+    offsets[count] = pos;
+
+    // Pass 2: one copy of the lines, each NUL-terminated (in place of the delimiter with -t)
+    size_t storage_size = pos - first + (strip ? 1 : count + 1);
+    char *storage = malloc(storage_size);
+    if (!storage) {
+        perror("malloc failed");
+        free(offsets);
+        return 0;
+    }
+    char **items = (char **)offsets;
+    if (strip) {
+        memcpy(storage, data + first, pos - first);
+        storage[pos - first] = '\0';
+        for (size_t i = 0; i < count; i++) {
+            size_t end = offsets[i + 1] - first;
+            if (end > offsets[i] - first && storage[end - 1] == (char)delim) storage[end - 1] = '\0';
+            items[i] = storage + (offsets[i] - first);
+        }
+    } else {
+        char *p = storage;
+        for (size_t i = 0; i < count; i++) {
+            size_t len = offsets[i + 1] - offsets[i];
+            memcpy(p, data + offsets[i], len);
+            p[len] = '\0';
+            items[i] = p;
+            p += len + 1;
+        }
+    }
+    adopt_var_array(name, storage, storage_size, items, count);
+    return pos;
+}
+
+/*
+ * ifs_field - Cuts the next IFS field from *cursor in place. IFS whitespace around fields is
+ * dropped; other IFS characters each end a field. With last, the field is the rest of the line
+ * minus trailing IFS whitespace. With quoted, a backslash keeps the next character from
+ * splitting, and the backslashes are removed from the field once it is cut.
+ * Returns NULL when no field is left.
+ */
+char *ifs_field(char **cursor, const char *ifs, int last, int quoted) {
+    char *p = *cursor;
+    while (*p && strchr(ifs, *p) && isspace((unsigned char)*p)) p++;
+    if (!*p) {
+        *cursor = p;
+        return NULL;
+    }
+    char *field = p;
+    if (last) {
+        // The field ends after its last character that is not IFS whitespace, or is quoted
+        char *end = p;
+        while (*p) {
+            if (quoted && *p == '\\' && p[1]) {
+                p += 2;
+                end = p;
+            } else if (strchr(ifs, *p) && isspace((unsigned char)*p)) {
+                p++;
+            } else {
+                end = ++p;
+            }
+        }
+        *end = '\0';
+        *cursor = end;
+        if (quoted) remove_backslashes(field);
+        return field;
+    }
+    while (*p) {
+        if (quoted && *p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (strchr(ifs, *p)) break;
+        p++;
+    }
+    if (*p) {
+        int separator_seen = !isspace((unsigned char)*p);
+        *p++ = '\0';
+        while (*p && strchr(ifs, *p) && isspace((unsigned char)*p)) p++;
+        // "a , b": whitespace and one non-whitespace separator together end a single field
+        if (!separator_seen && *p && strchr(ifs, *p)) {
+            p++;
+            while (*p && strchr(ifs, *p) && isspace((unsigned char)*p)) p++;
+        }
+    }
+    *cursor = p;
+    if (quoted) remove_backslashes(field);
+    return field;
+}
+
+/*
+ * remove_backslashes - Drops each quoting backslash from text in place, keeping what it quotes.
+ */
+void remove_backslashes(char *text) {
+    char *out = text;
+    for (char *p = text; *p; p++) {
+        if (*p == '\\' && p[1]) p++;
+        *out++ = *p;
+    }
+    *out = '\0';
+}
+
+/*
+ * read_record - Reads one record, up to delim or limit characters, from fd into out.
+ * Input arrives in blocks through the descriptor's read-ahead buffer instead of a byte at a
+ * time, without ever consuming past the record:
+ *  - regular files are read with pread and the offset is set just past the record;
+ *  - pipes are peeked with tee(2) into a private pipe, and only the bytes handed out are taken
+ *    from the pipe, in bulk, when the buffer runs dry or another command is about to run
+ *    (see release_read_ahead);
+ *  - terminals return a line per read(2) anyway; anything else is read a byte at a time.
+ * Without raw, a backslash quotes the next character and backslash-newline joins lines; the
+ * backslash stays in out, for the caller to remove after splitting fields.
+ * Returns 1 when the delimiter or limit ended the record, 0 at end of input, -1 on error.
+ */
+int read_record(int fd, int delim, long limit, int raw, struct text_builder *out) {
+    struct stat st;
+    if (fd < 0 || fd >= READ_FDS || fstat(fd, &st) != 0) {
+        fprintf(stderr, "read: %d: invalid file descriptor\n", fd);
+        return -1;
+    }
+    struct read_buffer *rb = &read_buffers[fd];
+    struct io_buffer *io = &rb->io;
+    int kind = S_ISREG(st.st_mode) ? READ_FILE : S_ISFIFO(st.st_mode) ? READ_PIPE : isatty(fd) ? READ_TTY : READ_BYTES;
+    off_t offset = kind == READ_FILE ? lseek(fd, 0, SEEK_CUR) : rb->offset;
+    // Read-ahead only carries over while it still describes what the descriptor returns next
+    if (rb->dev != st.st_dev || rb->ino != st.st_ino || rb->kind != kind || offset != rb->offset) {
+        io->start = io->len = 0;
+        rb->dev = st.st_dev;
+        rb->ino = st.st_ino;
+        rb->kind = kind;
+        offset = kind == READ_FILE ? offset : 0;
+        shell_counters[SUB_READ].misses++;
+    } else if (io->start < io->len) {
+        shell_counters[SUB_READ].hits++;
+    }
+    rb->offset = offset;
+    text_append(out, "", 0);
+
+    long count = 0;
+    int result;
+    for (;;) {
+        // Copy the longest run of plain characters in one go
+        size_t i = io->start;
+        if (raw && limit < 0) {
+            char *hit = io->data ? memchr(io->data + i, delim, io->len - i) : NULL;
+            i = hit ? (size_t)(hit - io->data) : io->len;
+        } else {
+            while (i < io->len && io->data[i] != delim && (raw || io->data[i] != '\\') &&
+                   (limit < 0 || count + (long)(i - io->start) < limit)) i++;
+        }
+        text_append(out, io->data + io->start, i - io->start);
+        count += i - io->start;
+        rb->offset += i - io->start;
+        io->start = i;
+        if (limit >= 0 && count >= limit) {
+            result = 1;
+            break;
+        }
+        if (i < io->len && io->data[i] == delim) {
+            io->start++;
+            rb->offset++;
+            result = 1;
+            break;
+        }
+        if (i + 1 < io->len) {
+            // Backslash and the character it quotes; a quoted newline disappears
+            char quoted = io->data[i + 1];
+            io->start += 2;
+            rb->offset += 2;
+            if (quoted != '\n') {
+                text_append(out, io->data + i, 2);
+                count++;
+            }
+            continue;
+        }
+        ssize_t n = read_refill(fd, rb);
+        if (n < 0) {
+            result = -1;
+            break;
+        }
+        if (n == 0) {
+            // End of input; a backslash at the very end quotes nothing
+            rb->offset += io->len - io->start;
+            io->start = io->len;
+            result = 0;
+            break;
+        }
+    }
+    if (kind == READ_FILE) lseek(fd, rb->offset, SEEK_SET);
+    return result;
+}
+
+/*
+ * read_refill - Adds input to a read-ahead buffer, keeping unread bytes (at most a trailing
+ * backslash when called from read_record). Returns the bytes added, 0 at end of input, -1 on error.
+ */
+ssize_t read_refill(int fd, struct read_buffer *rb) {
+    struct io_buffer *io = &rb->io;
+    if (rb->kind == READ_PIPE) {
+        // Take what was handed out, then peek afresh: the unread bytes are still in the pipe.
+        // A held-back tail is taken as well, or tee would peek the same bytes forever and the
+        // end of input behind them would never show; offset goes negative until it is handed out
+        size_t tail = io->len - io->start;
+        rb->offset += tail;
+        if (release_pipe(fd, rb) != 0) return -1;
+        memmove(io->data, io->data + io->start, tail);
+        io->start = 0;
+        io->len = tail;
+        rb->offset = -(off_t)tail;
+        if (rb->peek[0] <= 0 && pipe2(rb->peek, O_CLOEXEC) != 0) {
+            perror("read: pipe");
+            return -1;
+        }
+    } else if (io->start > 0) {
+        memmove(io->data, io->data + io->start, io->len - io->start);
+        io->len -= io->start;
+        io->start = 0;
+    }
+    if (io->len == io->cap) {
+        size_t cap = io->cap ? io->cap * 2 : IO_BUFFER_SIZE;
+        char *data = realloc(io->data, cap);
+        if (!data) {
+            perror("realloc failed");
+            return -1;
+        }
+        shell_counters[SUB_READ].bytes += cap - io->cap;
+        io->data = data;
+        io->cap = cap;
+    }
+    size_t room = io->cap - io->len;
+    ssize_t n;
+    do {
+        switch (rb->kind) {
+        case READ_FILE: n = pread(fd, io->data + io->len, room, rb->offset + io->len); break;
+        case READ_PIPE: n = tee(fd, rb->peek[1], room, 0); break;
+        case READ_TTY: n = read(fd, io->data + io->len, room); break;
+        default: n = read(fd, io->data + io->len, 1); break;
+        }
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("read");
+        return -1;
+    }
+    // The peeked copy is drained whole, so the private pipe is empty for the next tee
+    for (ssize_t got = 0; rb->kind == READ_PIPE && got < n;) {
+        ssize_t r = read(rb->peek[0], io->data + io->len + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            perror("read");
+            return -1;
+        }
+        got += r;
+    }
+    io->len += n;
+    shell_counters[SUB_READ].allocs++;
+    return n;
+}
+
+/*
+ * release_pipe - Removes from a pipe the bytes read has handed out since the last release.
+ */
+int release_pipe(int fd, struct read_buffer *rb) {
+    char scratch[8192];
+    while (rb->offset > 0) {
+        ssize_t n = read(fd, scratch, rb->offset < (off_t)sizeof(scratch) ? (size_t)rb->offset : sizeof(scratch));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("read");
+            return -1;
+        }
+        rb->offset -= n;
+    }
+    return 0;
+}
+
+/*
+ * release_read_ahead - Before any command other than read runs, settles every pipe read has
+ * peeked at so the command sees exactly what read left, and drops all read-ahead (a command
+ * may move a descriptor's position or consume its data).
+ */
+void release_read_ahead(void) {
+    for (int fd = 0; fd < READ_FDS; fd++) {
+        struct read_buffer *rb = &read_buffers[fd];
+        struct stat st;
+        if (rb->kind == READ_PIPE && rb->offset > 0 && fstat(fd, &st) == 0 && st.st_dev == rb->dev &&
+            st.st_ino == rb->ino) {
+            release_pipe(fd, rb);
+        }
+        rb->io.start = rb->io.len = 0;
+        rb->offset = 0;
+        rb->dev = 0;
+        rb->ino = 0;
+    }
+}
+
+/*
+ * redirect_builtin - Applies the redirections of a builtin that runs in the shell itself, without
+ * forking: the descriptors it replaces are saved in saved[] (one slot per redirection) for
+ * restore_redirect. Returns 0, or 1 (with everything restored) if a redirection fails.
+ */
+int redirect_builtin(const struct redirect *list, struct saved_fd *saved, int *saved_count) {
+    *saved_count = 0;
+    fflush(stdout);
+    fflush(stderr);
+    for (const struct redirect *r = list; r; r = r->next) {
+        if (r->fd == STDIN_FILENO) release_read_ahead();
+    }
+    if (apply_redirects(list, saved, saved_count) != 0) {
+        restore_redirects(saved, *saved_count);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * restore_redirect - Puts back the descriptors saved by redirect_builtin.
+ */
+void restore_redirect(struct saved_fd *saved, int count) {
+    fflush(stdout);
+    fflush(stderr);
+    restore_redirects(saved, count);
+}
+
+/*
+ * builtin_test - test expr / [ expr ] / [[ expr ]]: status 0 when true, 1 when false, 2 on error.
+ */
+int builtin_test(char *args[], int background) {
+    int count = 0;
+    while (args[count]) count++;
+    const char *closer = strcmp(args[0], "[") == 0 ? "]" : strcmp(args[0], "[[") == 0 ? "]]" : NULL;
+    if (closer && strcmp(args[count - 1], closer) != 0) {
+        fprintf(stderr, "%s: missing '%s'\n", args[0], closer);
+        last_status = 2;
+        return 1;
+    }
+    struct cond_parser ps = {args + 1, count - 1 - (closer != NULL), 0, closer && closer[1], NULL};
+    int result = ps.count == 0 ? 0 : cond_or(&ps);
+    if (!ps.error && ps.pos < ps.count) ps.error = "too many arguments";
+    if (ps.error) {
+        fprintf(stderr, "%s: %s\n", args[0], ps.error);
+        last_status = 2;
+        return 1;
+    }
+    last_status = !result;
+    return 1;
+}
+
+/*
+ * run_cond_command - Runs a "[[ ... ]]" pipeline. Its words are split on blanks only: inside
+ * [[ ]], < > && || are operators and patterns are not file globs. Each word is expanded after
+ * the split and stays one operand, so an empty or blank-filled $x is still a single word.
+ */
+int run_cond_command(const char *text) {
+    const char *end = text + strlen(text);
+    while (end > text && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if (strncmp(text, "[[", 2) != 0 || (text[2] != ' ' && text[2] != '\t') || end - text < 5 ||
+        strncmp(end - 2, "]]", 2) != 0 || (end[-3] != ' ' && end[-3] != '\t')) {
+        return 0;
+    }
+    char *words = strndup(text, end - text);
+    int argc = 0, cap = 8, ok = words != NULL;
+    char **args = calloc(cap, sizeof(char *));
+    if (!args) ok = 0;
+    for (char *word = words ? strtok(words, " \t") : NULL; ok && word; word = strtok(NULL, " \t")) {
+        char *expanded = NULL;
+        if (strchr(word, '$') && expand_line(word, &expanded, 0) != 0) {
+            last_status = 2;
+            ok = 0;
+            break;
+        }
+        ok = argv_append(&args, &argc, &cap, expanded ? expanded : word);
+        free(expanded);
+    }
+    if (ok) builtin_test(args, 0);
+    free_args(args);
+    free(words);
+    return 1;
+}
+
+/*
+ * cond_or - expr -o expr ([[: expr || expr]).
+ */
+int cond_or(struct cond_parser *ps) {
+    int result = cond_and(ps);
+    while (!ps->error && ps->pos < ps->count && strcmp(ps->words[ps->pos], ps->extended ? "||" : "-o") == 0) {
+        ps->pos++;
+        int right = cond_and(ps);
+        result = result || right;
+    }
+    return result;
+}
+
+/*
+ * cond_and - expr -a expr ([[: expr && expr]).
+ */
+int cond_and(struct cond_parser *ps) {
+    int result = cond_not(ps);
+    while (!ps->error && ps->pos < ps->count && strcmp(ps->words[ps->pos], ps->extended ? "&&" : "-a") == 0) {
+        ps->pos++;
+        int right = cond_not(ps);
+        result = result && right;
+    }
+    return result;
+}
+
+/*
+ * cond_not - ! expr, ( expr ), or a primary. "!" alone is just a non-empty string.
+ */
+int cond_not(struct cond_parser *ps) {
+    if (ps->pos >= ps->count) {
+        ps->error = "argument expected";
+        return 0;
+    }
+    char **w = ps->words + ps->pos;
+    int left = ps->count - ps->pos;
+    // A binary operator second wins: [ ! = x ] compares "!" with "x"
+    if (left >= 3 && cond_binary_op(w[1], ps->extended)) return cond_primary(ps);
+    if (strcmp(w[0], "!") == 0 && left > 1) {
+        ps->pos++;
+        return !cond_not(ps);
+    }
+    if (strcmp(w[0], "(") == 0 && left > 1) {
+        ps->pos++;
+        int result = cond_or(ps);
+        if (!ps->error && (ps->pos >= ps->count || strcmp(ps->words[ps->pos], ")") != 0)) ps->error = "missing ')'";
+        ps->pos++;
+        return result;
+    }
+    return cond_primary(ps);
+}
+
+/*
+ * cond_binary_op - Whether word is a binary operator (=~ only inside [[ ]]).
+ */
+int cond_binary_op(const char *word, int extended) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(word, ops[i]) == 0) return 1;
+    }
+    return extended && strcmp(word, "=~") == 0;
+}
+
+/*
+ * cond_integer - Operand of -eq and friends: a plain integer, or an arithmetic expression in [[ ]].
+ */
+static long long cond_integer(struct cond_parser *ps, const char *text) {
+    long long value = 0;
+    if (ps->extended) {
+        if (arith_eval(text, &value, 0) != 0) ps->error = "bad arithmetic operand";
+        return value;
+    }
+    char *end;
+    while (isspace((unsigned char)*text)) text++;
+    value = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == text || *end) ps->error = "integer expression expected";
+    return value;
+}
+
+/*
+ * cond_primary - Unary file and string tests, binary comparisons, or a lone string (true if non-empty).
+ */
+int cond_primary(struct cond_parser *ps) {
+    char **w = ps->words + ps->pos;
+    int left = ps->count - ps->pos;
+    if (left >= 3 && cond_binary_op(w[1], ps->extended)) {
+        ps->pos += 3;
+        const char *a = w[0], *op = w[1], *b = w[2];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0 || strcmp(op, "!=") == 0) {
+            // [[ ]] matches the right side as a pattern
+            int equal;
+            if (ps->extended) {
+                struct pattern *pat = pattern_get(b, PATTERN_GLOB);
+                equal = pat && pattern_match(pat, a, strlen(a));
+            } else {
+                equal = strcmp(a, b) == 0;
+            }
+            return op[0] == '!' ? !equal : equal;
+        }
+        if (strcmp(op, "=~") == 0) {
+            struct pattern *pat = pattern_get(b, PATTERN_REGEX);
+            if (!pat) {
+                ps->error = "invalid regular expression";
+                return 0;
+            }
+            return pattern_match(pat, a, strlen(a));
+        }
+        if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+        if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+        if (op[1] == 'e' && op[2] == 'f') {
+            struct statx sa, sb;
+            return cached_statx(a, 1, &sa) == 0 && cached_statx(b, 1, &sb) == 0 && sa.stx_ino == sb.stx_ino &&
+                   sa.stx_dev_major == sb.stx_dev_major && sa.stx_dev_minor == sb.stx_dev_minor;
+        }
+        if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+            // A file that exists is newer than one that does not
+            struct statx sa, sb;
+            int has_a = cached_statx(a, 1, &sa) == 0, has_b = cached_statx(b, 1, &sb) == 0;
+            if (op[1] == 'o') {
+                struct statx swap = sa;
+                sa = sb;
+                sb = swap;
+                int swap_has = has_a;
+                has_a = has_b;
+                has_b = swap_has;
+            }
+            if (!has_a || !has_b) return has_a;
+            return sa.stx_mtime.tv_sec > sb.stx_mtime.tv_sec ||
+                   (sa.stx_mtime.tv_sec == sb.stx_mtime.tv_sec && sa.stx_mtime.tv_nsec > sb.stx_mtime.tv_nsec);
+        }
+        long long x = cond_integer(ps, a), y = cond_integer(ps, b);
+        if (strcmp(op, "-eq") == 0) return x == y;
+        if (strcmp(op, "-ne") == 0) return x != y;
+        if (strcmp(op, "-lt") == 0) return x < y;
+        if (strcmp(op, "-le") == 0) return x <= y;
+        if (strcmp(op, "-gt") == 0) return x > y;
+        return x >= y;
+    }
+    if (left >= 2 && w[0][0] == '-' && w[0][1] && !w[0][2] && strchr("bcdefghkLprsStuwxOGnz", w[0][1])) {
+        ps->pos += 2;
+        const char *arg = w[1];
+        char test = w[0][1];
+        if (test == 'z') return *arg == '\0';
+        if (test == 'n') return *arg != '\0';
+        if (test == 't') return isatty(atoi(arg));
+        if (test == 'r' || test == 'w' || test == 'x') {
+            return faccessat(AT_FDCWD, arg, test == 'r' ? R_OK : test == 'w' ? W_OK : X_OK, AT_EACCESS) == 0;
+        }
+        struct statx st;
+        if (cached_statx(arg, test != 'L' && test != 'h', &st) != 0) return 0;
+        switch (test) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.stx_mode);
+        case 'd': return S_ISDIR(st.stx_mode);
+        case 's': return st.stx_size > 0;
+        case 'b': return S_ISBLK(st.stx_mode);
+        case 'c': return S_ISCHR(st.stx_mode);
+        case 'p': return S_ISFIFO(st.stx_mode);
+        case 'S': return S_ISSOCK(st.stx_mode);
+        case 'L':
+        case 'h': return S_ISLNK(st.stx_mode);
+        case 'g': return (st.stx_mode & S_ISGID) != 0;
+        case 'u': return (st.stx_mode & S_ISUID) != 0;
+        case 'k': return (st.stx_mode & S_ISVTX) != 0;
+        case 'O': return st.stx_uid == geteuid();
+        case 'G': return st.stx_gid == getegid();
+        }
+    }
+    ps->pos++;
+    return w[0][0] != '\0';
+}
+
+/*
+ * cached_statx - statx(2) through the per-list cache: a condition chain testing the same path
+ * several times costs one syscall. Failures are cached too. Returns 0, or -1 with errno set.
+ */
+int cached_statx(const char *path, int follow, struct statx *out) {
+    for (int i = 0; i < stat_cache_count; i++) {
+        struct stat_entry *entry = &stat_cache[i];
+        if (entry->follow == follow && strcmp(entry->path, path) == 0) {
+            shell_counters[SUB_STATCACHE].hits++;
+            if (entry->error) {
+                errno = entry->error;
+                return -1;
+            }
+            *out = entry->stx;
+            return 0;
+        }
+    }
+    shell_counters[SUB_STATCACHE].misses++;
+    int failed = statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW,
+                       STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_MTIME | STATX_INO | STATX_SIZE, out);
+    int error = failed ? errno : 0;
+    char *copy = strdup(path);
+    if (copy) {
+        // Round-robin over a few slots; a list rarely tests more paths than that
+        struct stat_entry *entry = &stat_cache[stat_cache_next];
+        if (stat_cache_next < stat_cache_count) {
+            shell_counters[SUB_STATCACHE].bytes -= strlen(entry->path) + 1;
+            free(entry->path);
+        } else {
+            stat_cache_count++;
+        }
+        entry->path = copy;
+        entry->follow = follow;
+        entry->error = error;
+        if (!failed) entry->stx = *out;
+        stat_cache_next = (stat_cache_next + 1) % STAT_CACHE_SLOTS;
+        shell_counters[SUB_STATCACHE].entries = stat_cache_count;
+        shell_counters[SUB_STATCACHE].bytes += strlen(copy) + 1;
+        shell_counters[SUB_STATCACHE].allocs++;
+    }
+    errno = error;
+    return failed ? -1 : 0;
+}
+
+/*
+ * clear_stat_cache - Forgets cached stat results (at list boundaries and after any command that
+ * could have changed the file system).
+ */
+void clear_stat_cache(void) {
+    for (int i = 0; i < stat_cache_count; i++) free(stat_cache[i].path);
+    stat_cache_count = stat_cache_next = 0;
+    shell_counters[SUB_STATCACHE].entries = 0;
+    shell_counters[SUB_STATCACHE].bytes = 0;
+}
+
+/*
+ * sigchld_handler - Handles SIGCHLD signal for background process completion.
+ */
+void sigchld_handler(int sig, siginfo_t *info, void *context) {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        SHELL_PROBE(reap, pid, status);
+        job_done(pid, status);
+        printf("[PID %d] Completed\n", pid);
+    }
+}
+
+/*
+ * execute_system_command - Executes system commands with redirection and background support.
+ * A leading "--chunk" or "--chunk=N" forces ARG_MAX chunking (N batches in parallel).
+ */
+void execute_system_command(char *args[], struct redirect *redirects, int background) {
+    if (args[0] == NULL) return;
+
+    int force_chunk = 0, jobs = 1;
+    if (strncmp(args[0], "--chunk", 7) == 0 && (args[0][7] == '\0' || args[0][7] == '=')) {
+        force_chunk = 1;
+        if (args[0][7] == '=') {
+            jobs = atoi(args[0] + 8);
+            if (jobs < 1) jobs = 1;
+        }
+        args++;
+        if (args[0] == NULL) {
+            printf("Usage: --chunk[=jobs] [command] [args...]\n");
+            return;
+        }
+    }
+    // Resolve in the shell: a missing command is reported without forking, and the child skips the PATH walk
+    char resolved[MAX_PATH];
+    int error = resolve_command(args[0], resolved, sizeof(resolved));
+    if (error) {
+        report_not_found(args[0], error);
+        last_status = error == EACCES ? 126 : 127;
+        return;
+    }
+    if ((force_chunk || is_chunkable(args)) && argv_bytes(args) > (size_t)arg_limit()) {
+        if (!background) {
+            last_status = execute_chunked(args, redirects, jobs);
+            return;
+        }
+        // Background chunked runs are driven by a child so the prompt returns immediately
+        fflush(stdout);
+        pid_t pid = fork();
+        fork_count++;
+        if (pid < 0) {
+            perror("fork failed");
+        } else if (pid == 0) {
+            setsid();
+            int status = execute_chunked(args, redirects, jobs);
+            fflush(stdout);
+            _exit(status);
+        } else {
+            printf("[PID %d] Running in background\n", pid);
+            job_add(pid, args[0]);
+        }
+        return;
+    }
+
+    sigset_t old_mask;
+    if (!background) {
+        // Keep the SIGCHLD handler from reaping the foreground child before we collect its status
+        sigset_t block;
+        sigemptyset(&block);
+        sigaddset(&block, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &block, &old_mask);
+    }
+    pid_t pid = fork();
+    fork_count++;
+    exec_count++;
+    if (pid < 0) {
+        perror("fork failed");
+        if (!background) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return;
+    }
+    if (pid > 0) SHELL_PROBE(spawn, args[0], pid);
+    if (pid == 0) {
+        // Child process
+        if (!background) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        close_shell_fds();
+        if (apply_redirects(redirects, NULL, NULL) != 0) _exit(1);
+        if (background) {
+            setsid();
+        }
+        if (execvp(resolved, args) == -1) {
+            if (errno == E2BIG) {
+                fprintf(stderr, "Error: Argument list too long for '%s' (use --chunk)\n", args[0]);
+            } else {
+                fprintf(stderr, "Error: Command '%s' not found or permission denied\n", args[0]);
+            }
+            // _exit: the shell's unflushed stdout must not land in a redirected output file
+            _exit(errno == E2BIG ? 126 : 127);
+        }
+    } else {
+        // Parent process
+        if (!background) {
+            last_status = wait_foreground(pid);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        } else {
+            printf("[PID %d] Running in background\n", pid);
+            job_add(pid, args[0]);
+        }
+    }
+}
+
+/*
+ * wait_foreground - Waits for a foreground child (SIGCHLD must be blocked) and returns its exit status.
+ */
+int wait_foreground(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return 1;
+    }
+    SHELL_PROBE(reap, pid, status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/*
+ * is_chunkable - Checks whether a command's operands can be split across invocations.
+ * cp, mv and ln only qualify when their last operand is a directory.
+ */
+int is_chunkable(char *args[]) {
+    const char *slash = strrchr(args[0], '/');
+    const char *name = slash ? slash + 1 : args[0];
+    int flagged = 0;
+    for (int i = 0; chunkable_commands[i]; i++) {
+        if (strcmp(name, chunkable_commands[i]) == 0) {
+            flagged = 1;
+            break;
+        }
+    }
+    if (!flagged) return 0;
+    if (chunk_has_target(args[0])) {
+        int argc = 0;
+        while (args[argc]) argc++;
+        struct stat st;
+        return argc > 2 && stat(args[argc - 1], &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    return 1;
+}
+
+/*
+ * chunk_has_target - Whether command (by basename) takes a target directory as its last operand.
+ */
+int chunk_has_target(const char *command) {
+    const char *slash = strrchr(command, '/');
+    const char *name = slash ? slash + 1 : command;
+    for (int i = 0; chunk_target_commands[i]; i++) {
+        if (strcmp(name, chunk_target_commands[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * open_pidfd - A descriptor that polls readable once child pid has exited, or -1 where the
+ * kernel has no pidfds.
+ */
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * await_children - Sleeps until one of the children behind pidfds exits, or timeout_ms passes
+ * (-1 for no limit). An entry of -1 is a child without a pidfd, looked at every 50 ms instead.
+ * Unlike sigtimedwait, this leaves SIGCHLD pending for the handler that reaps background jobs.
+ */
+void await_children(const int *pidfds, int count, int timeout_ms) {
+    struct pollfd watch[count + 1];
+    int watched = 0;
+    for (int i = 0; i < count; i++) {
+        if (pidfds[i] >= 0) {
+            watch[watched].fd = pidfds[i];
+            watch[watched].events = POLLIN;
+            watched++;
+        } else if (timeout_ms < 0 || timeout_ms > 50) {
+            timeout_ms = 50;
+        }
+    }
+    // EINTR only means the caller looks at its children a little early
+    poll(watch, watched, timeout_ms);
+}
+
+/*
+ * argv_bytes - Bytes execve needs for an argument vector plus the current environment.
+ */
+size_t argv_bytes(char *args[]) {
+    extern char **environ;
+    size_t total = 0;
+    for (int i = 0; args[i]; i++) {
+        total += strlen(args[i]) + 1 + sizeof(char *);
+    }
+    for (int i = 0; environ[i]; i++) {
+        total += strlen(environ[i]) + 1 + sizeof(char *);
+    }
+    return total;
+}
+
+/*
+ * arg_limit - Usable ARG_MAX, leaving the same 2 KiB headroom xargs keeps.
+ */
+long arg_limit(void) {
+    long limit = sysconf(_SC_ARG_MAX);
+    if (limit <= 0) limit = 131072;
+    return limit - 2048;
+}
+
+/*
+ * execute_chunked - Splits an oversized invocation into batches that fit ARG_MAX.
+ * Leading options are repeated in every batch, and so is the target directory of cp, mv and ln.
+ * Batches run sequentially, or up to jobs at a time. Returns the highest batch exit status.
+ */
+int execute_chunked(char *args[], struct redirect *redirects, int jobs) {
+    int argc = 0;
+    while (args[argc]) argc++;
+    int first = 1;
+    while (first < argc && args[first][0] == '-') {
+        if (strcmp(args[first++], "--") == 0) break;
+    }
+    int last = argc;
+    if (chunk_has_target(args[0]) && argc - first > 1) {
+        last = argc - 1;
+    }
+
+    size_t fixed = argv_bytes(args);
+    for (int i = first; i < last; i++) {
+        fixed -= strlen(args[i]) + 1 + sizeof(char *);
+    }
+    long limit = arg_limit();
+    if ((long)fixed >= limit) {
+        fprintf(stderr, "Error: Argument list too long for '%s' even without operands\n", args[0]);
+        return 126;
+    }
+
+    char **batch = malloc((argc + 1) * sizeof(char *));
+    pid_t *pids = calloc(jobs, sizeof(pid_t));
+    int *pidfds = malloc(jobs * sizeof(int));
+    if (!batch || !pids || !pidfds) {
+        perror("malloc failed");
+        free(batch);
+        free(pids);
+        free(pidfds);
+        return 1;
+    }
+    for (int j = 0; j < jobs; j++) pidfds[j] = -1;
+    for (int i = 0; i < first; i++) batch[i] = args[i];
+
+    // Parallel batches share the output files, so truncate them once up front
+    for (struct redirect *r = redirects; r && jobs > 1; r = r->next) {
+        if (r->kind != REDIR_OUTPUT) continue;
+        int fd = open(r->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) close(fd);
+        r->kind = REDIR_APPEND;
+    }
+
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+
+    int worst = 0, running = 0, batches = 0;
+    int next = first;
+    while (next < last || running > 0) {
+        if (next < last && running < jobs) {
+            int n = first;
+            size_t used = fixed;
+            while (next < last) {
+                size_t need = strlen(args[next]) + 1 + sizeof(char *);
+                if (n > first && (long)(used + need) > limit) break;
+                used += need;
+                batch[n++] = args[next++];
+            }
+            for (int i = last; i < argc; i++) batch[n++] = args[i];
+            batch[n] = NULL;
+
+            pid_t pid = fork();
+            fork_count++;
+            exec_count++;
+            if (pid < 0) {
+                perror("fork failed");
+                worst = 1;
+                next = last;
+                continue;
+            }
+            if (pid > 0) SHELL_PROBE(spawn, batch[0], pid);
+            if (pid == 0) {
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                close_shell_fds();
+                if (apply_redirects(redirects, NULL, NULL) != 0) _exit(1);
+                execvp(batch[0], batch);
+                fprintf(stderr, "Error: Command '%s' not found or permission denied\n", batch[0]);
+                _exit(127);
+            }
+            for (int j = 0; j < jobs; j++) {
+                if (pids[j] == 0) {
+                    pids[j] = pid;
+                    pidfds[j] = open_pidfd(pid);
+                    break;
+                }
+            }
+            running++;
+            batches++;
+            // Later sequential batches must not clobber what earlier ones wrote
+            for (struct redirect *r = redirects; r; r = r->next) {
+                if (r->kind == REDIR_OUTPUT) r->kind = REDIR_APPEND;
+            }
+            continue;
+        }
+        // Wait on this run's own batches only, leaving background jobs to the SIGCHLD handler
+        int live[jobs], count = 0;
+        for (int j = 0; j < jobs; j++) {
+            if (pids[j] > 0) live[count++] = pidfds[j];
+        }
+        await_children(live, count, -1);
+        for (int j = 0; j < jobs; j++) {
+            int status;
+            if (pids[j] <= 0) continue;
+            pid_t done = waitpid(pids[j], &status, WNOHANG);
+            if (done == 0 || (done < 0 && errno == EINTR)) continue;
+            int code = 1;
+            if (done > 0) {
+                SHELL_PROBE(reap, done, status);
+                code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+            }
+            pids[j] = 0;
+            close_fds(&pidfds[j], 1);
+            running--;
+            if (code > worst) worst = code;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    free(batch);
+    free(pids);
+    free(pidfds);
+    fprintf(stderr, "[chunk] %s: %d operands in %d batches, exit status %d\n", args[0], last - first, batches, worst);
+    return worst;
+}
+
+/*
+ * argv_append - Appends a copy of word to a growable NULL-terminated argument vector.
+ */
+int argv_append(char ***argv, int *argc, int *cap, const char *word) {
+    if (*argc + 1 >= *cap) {
+        int new_cap = *cap * 2;
+        char **grown = realloc(*argv, new_cap * sizeof(char *));
+        if (!grown) {
+            perror("realloc failed");
+            return 0;
+        }
+        *argv = grown;
+        *cap = new_cap;
+        shell_counters[SUB_PARSER].allocs++;
+    }
+    shell_counters[SUB_PARSER].allocs++;
+    char *copy = strdup(word);
+    if (!copy) {
+        perror("strdup failed");
+        return 0;
+    }
+    unprotect_word(copy);
+    (*argv)[(*argc)++] = copy;
+    (*argv)[*argc] = NULL;
+    return 1;
+}
+
+/*
+ * free_args - Frees an argument vector built by parse_command.
+ */
+void free_args(char **args) {
+    if (!args) return;
+    for (int j = 0; args[j]; j++) {
+        free(args[j]);
+    }
+    free(args);
+}
+
+/*
+ * execute_multiple_pipes - Executes multiple commands connected by pipes.
+ * Pipes are made one edge at a time with O_CLOEXEC, so the shell holds only the read end feeding
+ * the next stage and each child only its own two ends: building N stages is O(N).
+ * With "set -o pipemeter" each pipe gets a relay that counts the bytes crossing it.
+ * With profile set (the "pipeprof" prefix) stages are sampled until they finish.
+ */
+void execute_multiple_pipes(char **args[], int num_commands, struct redirect **redirects, int *background, int profile) {
+    int edges = num_commands - 1;
+    pid_t pids[num_commands];
+    pid_t relay_pids[num_commands];
+    int held_fds[num_commands];
+    struct stage_profile prof[num_commands];
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+
+    // The meter is a single flag test unless enabled; a lone stage has no pipe to meter
+    int metered = shell_options[OPT_PIPEMETER] && !*background && edges > 0;
+    unsigned long long *edge_bytes = NULL;
+    if (metered) {
+        edge_bytes = mmap(NULL, edges * sizeof(unsigned long long), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (edge_bytes == MAP_FAILED) {
+            perror("mmap failed");
+            edge_bytes = NULL;
+            metered = 0;
+        }
+    }
+    for (int i = 0; i < num_commands; i++) {
+        relay_pids[i] = -1;
+        held_fds[i] = -1;
+    }
+
+    // Children that run in-shell stages exit(), so they must not inherit unflushed output
+    fflush(stdout);
+    fflush(stderr);
+
+    // Fork each stage as soon as its output pipe exists
+    if (!*background) sigprocmask(SIG_BLOCK, &block, &old_mask);
+    int prev_read = -1, started = 0, failed = 0;
+    for (int i = 0; i < num_commands; i++) {
+        // next feeds stage i+1; with the meter, stage i writes into metered_edge and a relay copies it to next
+        int next[2] = {-1, -1}, metered_edge[2] = {-1, -1};
+        if (i < edges) {
+            int ok = (pipe2(next, O_CLOEXEC) == 0);
+            if (ok && metered) ok = (pipe2(metered_edge, O_CLOEXEC) == 0);
+            if (!ok) {
+                perror("pipe failed");
+                close_fds(next, 2);
+                failed = 1;
+                break;
+            }
+            // The profiler keeps its own copy of each pipe's read end to measure fill levels with FIONREAD
+            if (profile) held_fds[i] = fcntl(next[0], F_DUPFD_CLOEXEC, 0);
+        }
+        pids[i] = fork();
+        fork_count++;
+        const struct builtin *stage_builtin = lookup_builtin(args[i][0]);
+        if (!stage_builtin || !(stage_builtin->flags & (BUILTIN_PIPELINE_SAFE | BUILTIN_NEEDS_PARENT))) exec_count++;
+        if (pids[i] > 0) SHELL_PROBE(spawn, args[i][0], pids[i]);
+        if (pids[i] < 0) {
+            perror("fork failed");
+            close_fds(next, 2);
+            close_fds(metered_edge, 2);
+            failed = 1;
+            break;
+        }
+        if (pids[i] == 0) {
+            // Child
+            if (!*background) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            if (prev_read >= 0) dup2(prev_read, STDIN_FILENO);
+            if (i < edges) dup2(metered ? metered_edge[1] : next[1], STDOUT_FILENO);
+            // Only this stage's ends are open here; dup2 left the copies on 0 and 1 inheritable
+            if (prev_read >= 0) close(prev_read);
+            close_fds(next, 2);
+            close_fds(metered_edge, 2);
+            close_shell_fds();
+            // Redirections come after the pipes, so "2>&1 |" sends stderr down the pipe, and after
+            // close_shell_fds, so "3>file" survives the exec
+            if (apply_redirects(redirects[i], NULL, NULL) != 0) _exit(1);
+            // A stage is a copy of the shell: cd, set, unset and the like would change only the copy
+            if (stage_builtin && (stage_builtin->flags & BUILTIN_NEEDS_PARENT)) {
+                fprintf(stderr, "myshell: %s: changes the shell, so cannot run in a pipeline\n", args[i][0]);
+                _exit(1);
+            }
+            // Pipeline-safe builtins run right here instead of being exec'd
+            if (stage_builtin && (stage_builtin->flags & BUILTIN_PIPELINE_SAFE)) {
+                close_fds(held_fds, i + 1);
+                release_codecs();
+                running_as_stage = 1;
+                run_builtin(stage_builtin, args[i], 0);
+                fflush(stdout);
+                // _exit: exit() would run the shell's atexit handlers and rewind the script
+                // file the child shares with the shell to where its stdio copy stopped
+                _exit(last_status);
+            }
+            if (execvp(args[i][0], args[i]) == -1) {
+                int error = errno;
+                if (error == ENOENT || error == EACCES) {
+                    report_not_found(args[i][0], error);
+                    _exit(error == EACCES ? 126 : 127);
+                }
+                fprintf(stderr, "execvp failed: %s\n", args[i][0]);
+                _exit(1);
+            }
+        }
+        started++;
+        if (metered && i < edges) {
+            relay_pids[i] = fork();
+            fork_count++;
+            if (relay_pids[i] < 0) {
+                // Without its relay the edge has no reader, and the stage's output would be lost
+                fprintf(stderr, "pipemeter: cannot relay %d>%d: %s\n", i, i + 1, strerror(errno));
+                failed = 1;
+            } else if (relay_pids[i] == 0) {
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                if (prev_read >= 0) close(prev_read);
+                close_fds(held_fds, i + 1);
+                close(next[0]);
+                close(metered_edge[1]);
+                _exit(meter_relay(metered_edge[0], next[1], &edge_bytes[i], 0));
+            }
+        }
+        // The shell keeps only the read end the next stage starts from
+        if (prev_read >= 0) close(prev_read);
+        prev_read = next[0];
+        close_fds(next + 1, 1);
+        close_fds(metered_edge, 2);
+        if (failed) break;
+    }
+    if (prev_read >= 0) close(prev_read);
+    if (failed) {
+        close_fds(held_fds, num_commands);
+        if (!*background) {
+            for (int j = 0; j < started; j++) wait_foreground(pids[j]);
+            for (int j = 0; j < started && j < edges; j++) {
+                if (relay_pids[j] > 0) waitpid(relay_pids[j], NULL, 0);
+            }
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        }
+        if (edge_bytes) munmap(edge_bytes, edges * sizeof(unsigned long long));
+        last_status = 1;
+        return;
+    }
+
+    // Wait for children if not background; the pipeline's status is its last stage's
+    if (!*background) {
+        if (metered || profile) {
+            memset(prof, 0, sizeof(prof));
+            wait_pipeline(pids, num_commands, metered ? relay_pids : NULL, edge_bytes, profile ? prof : NULL, held_fds);
+            if (profile) report_profile(args, num_commands, prof);
+            if (edge_bytes) munmap(edge_bytes, edges * sizeof(unsigned long long));
+        } else {
+            for (int i = 0; i < num_commands; i++) {
+                last_status = wait_foreground(pids[i]);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    } else {
+        for (int i = 0; i < num_commands; i++) {
+            printf("[PID %d] Running in background\n", pids[i]);
+            job_add(pids[i], args[i][0]);
+        }
+    }
+}
+
+/*
+ * close_fds - Closes every descriptor in fds that is still open (>= 0).
+ */
+void close_fds(int *fds, int count) {
+    for (int j = 0; j < count; j++) {
+        if (fds[j] >= 0) {
+            close(fds[j]);
+            fds[j] = -1;
+        }
+    }
+}
+
+/*
+ * note_inherited_fds - Remembers the descriptors above 2 that the shell was started with, before
+ * it opens any of its own.
+ */
+void note_inherited_fds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && inherited_fd_count < INHERITED_FDS) {
+        if (entry->d_name[0] == '.') continue;
+        int fd = atoi(entry->d_name);
+        if (fd <= 2 || fd == dirfd(dir)) continue;
+        int j = inherited_fd_count++;
+        for (; j > 0 && inherited_fds[j - 1] > fd; j--) inherited_fds[j] = inherited_fds[j - 1];
+        inherited_fds[j] = fd;
+    }
+    closedir(dir);
+}
+
+/*
+ * close_shell_fds - In a child about to exec, marks close-on-exec every descriptor above 2 except
+ * those the shell inherited: the backstop for anything the shell opened without O_CLOEXEC.
+ * Simple commands, chunked batches and pipeline stages all go through here, so they see the same
+ * descriptors; redirections applied afterwards still survive the exec.
+ */
+void close_shell_fds(void) {
+    unsigned int from = 3;
+    for (int i = 0; i < inherited_fd_count; i++) {
+        if ((unsigned int)inherited_fds[i] > from) close_range(from, inherited_fds[i] - 1, CLOSE_RANGE_CLOEXEC);
+        from = inherited_fds[i] + 1;
+    }
+    close_range(from, ~0U, CLOSE_RANGE_CLOEXEC);
+}
+
+/*
+ * now_seconds - Monotonic time in seconds.
+ */
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * format_bytes - Formats a byte count with a binary unit, ex: "12.3 MiB".
+ */
+void format_bytes(double bytes, char *buf, size_t size) {
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
+
+/*
+ * meter_relay - Copies in_fd to out_fd until EOF, counting bytes.
+ * Uses splice so data moves pipe to pipe without touching userspace, falling back to
+ * read/write when either end cannot splice. With report set, shows a status line on stderr.
+ */
+int meter_relay(int in_fd, int out_fd, unsigned long long *counter, int report) {
+    unsigned long long total = 0, last_total = 0;
+    double start = now_seconds(), last_report = start;
+    int use_splice = 1;
+    char buffer[65536];
+    char amount[32], rate[32];
+
+    while (1) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(in_fd, NULL, out_fd, NULL, sizeof(buffer), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL) {
+                use_splice = 0;
+                continue;
+            }
+        } else {
+            n = read(in_fd, buffer, sizeof(buffer));
+            for (ssize_t off = 0; n > 0 && off < n;) {
+                ssize_t w = write(out_fd, buffer + off, n - off);
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    n = -1;
+                    break;
+                }
+                off += w;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // The reader went away (EPIPE) or the source failed; stop relaying
+            break;
+        }
+        if (n == 0) break;
+        total += n;
+        if (counter) __atomic_store_n(counter, total, __ATOMIC_RELAXED);
+        if (report) {
+            double now = now_seconds();
+            if (now - last_report >= 0.5) {
+                format_bytes(total, amount, sizeof(amount));
+                format_bytes((total - last_total) / (now - last_report), rate, sizeof(rate));
+                fprintf(stderr, "\r\033[K[meter] %s  %s/s", amount, rate);
+                last_report = now;
+                last_total = total;
+            }
+        }
+    }
+    if (report) {
+        double elapsed = now_seconds() - start;
+        format_bytes(total, amount, sizeof(amount));
+        format_bytes(elapsed > 0 ? total / elapsed : 0, rate, sizeof(rate));
+        fprintf(stderr, "\r\033[K[meter] %s in %.2fs (%s/s)\n", amount, elapsed, rate);
+    }
+    return 0;
+}
+
+/*
+ * wait_pipeline - Waits for a foreground pipeline while watching it. With edge_bytes it
+ * refreshes a per-edge throughput line on stderr twice a second; with prof it samples every
+ * stage at a fixed interval. SIGCHLD must be blocked so the handler cannot reap the stages; their
+ * exits wake the wait through pidfds, and background jobs are left for the handler afterwards.
+ */
+void wait_pipeline(pid_t *pids, int num_commands, pid_t *relay_pids, unsigned long long *edge_bytes,
+                   struct stage_profile *prof, int *held_fds) {
+    int edges = num_commands - 1;
+    int remaining = num_commands;
+    int stage_done[num_commands], relay_done[num_commands];
+    unsigned long long last_bytes[num_commands];
+    memset(stage_done, 0, sizeof(stage_done));
+    memset(relay_done, 0, sizeof(relay_done));
+    memset(last_bytes, 0, sizeof(last_bytes));
+    double start = now_seconds(), last_tick = start, last_sample = start;
+    double interval = prof ? 0.05 : 0.5;
+    char amount[32], rate[32];
+
+    int stage_fds[num_commands], relay_fds[num_commands];
+    for (int i = 0; i < num_commands; i++) {
+        stage_fds[i] = open_pidfd(pids[i]);
+        relay_fds[i] = -1;
+    }
+    for (int i = 0; i < edges; i++) {
+        if (relay_pids && relay_pids[i] > 0) {
+            remaining++;
+            relay_fds[i] = open_pidfd(relay_pids[i]);
+        } else {
+            relay_done[i] = 1;
+        }
+    }
+
+    while (remaining > 0) {
+        int live[2 * num_commands], count = 0;
+        for (int i = 0; i < num_commands; i++) {
+            if (!stage_done[i]) live[count++] = stage_fds[i];
+            if (i < edges && !relay_done[i]) live[count++] = relay_fds[i];
+        }
+        await_children(live, count, (int)(interval * 1000));
+        double now = now_seconds();
+        if (prof) {
+            sample_stages(pids, num_commands, stage_done, prof, held_fds, now - last_sample);
+            last_sample = now;
+        }
+        for (int i = 0; i < num_commands; i++) {
+            int status;
+            struct rusage ru;
+            if (!stage_done[i] && wait4(pids[i], &status, WNOHANG, &ru) == pids[i]) {
+                SHELL_PROBE(reap, pids[i], status);
+                stage_done[i] = 1;
+                remaining--;
+                if (i == num_commands - 1) {
+                    last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+                }
+                if (prof) {
+                    // rusage of the reaped child is exact, unlike the last /proc sample
+                    prof[i].cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+                    prof[i].wall = now - start;
+                }
+                // A finished reader must not be kept alive by our copy of its input pipe,
+                // or the writer would never see EPIPE
+                if (i > 0 && held_fds[i - 1] >= 0) {
+                    close(held_fds[i - 1]);
+                    held_fds[i - 1] = -1;
+                }
+            }
+        }
+        for (int i = 0; i < edges; i++) {
+            if (!relay_done[i] && waitpid(relay_pids[i], NULL, WNOHANG) == relay_pids[i]) {
+                relay_done[i] = 1;
+                remaining--;
+            }
+        }
+        if (edge_bytes && remaining > 0 && now - last_tick >= 0.5) {
+            fprintf(stderr, "\r\033[K[pipemeter]");
+            for (int i = 0; i < edges; i++) {
+                unsigned long long bytes = __atomic_load_n(&edge_bytes[i], __ATOMIC_RELAXED);
+                format_bytes(bytes, amount, sizeof(amount));
+                format_bytes((bytes - last_bytes[i]) / (now - last_tick), rate, sizeof(rate));
+                fprintf(stderr, "%s %d>%d %s %s/s", i ? " |" : "", i, i + 1, amount, rate);
+                last_bytes[i] = bytes;
+            }
+            last_tick = now;
+        }
+    }
+    close_fds(held_fds, edges);
+    close_fds(stage_fds, num_commands);
+    close_fds(relay_fds, num_commands);
+
+    if (edge_bytes) {
+        for (int i = 0; i < edges; i++) last_pipe_bytes += edge_bytes[i];
+        double elapsed = now_seconds() - start;
+        fprintf(stderr, "\r\033[K[pipemeter]");
+        for (int i = 0; i < edges; i++) {
+            format_bytes(edge_bytes[i], amount, sizeof(amount));
+            format_bytes(elapsed > 0 ? edge_bytes[i] / elapsed : 0, rate, sizeof(rate));
+            fprintf(stderr, "%s %d>%d %s avg %s/s", i ? " |" : "", i, i + 1, amount, rate);
+        }
+        fprintf(stderr, " (%.2fs)\n", elapsed);
+    }
+}
+
+/*
+ * sample_stages - Takes one profiler sample. CPU time comes from /proc/<pid>/stat; a stage
+ * that is asleep is charged to its output when that pipe is nearly full, or to its input when
+ * that pipe is empty.
+ */
+void sample_stages(pid_t *pids, int num_commands, int *stage_done, struct stage_profile *prof, int *held_fds, double interval) {
+    static long ticks_per_second = 0;
+    if (!ticks_per_second) ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    for (int i = 0; i < num_commands; i++) {
+        if (stage_done[i]) continue;
+        char path[64], stat_line[512];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pids[i]);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ssize_t n = read(fd, stat_line, sizeof(stat_line) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        stat_line[n] = '\0';
+        // The command name may contain spaces; fields resume after its closing parenthesis
+        char *fields = strrchr(stat_line, ')');
+        if (!fields) continue;
+        char state;
+        unsigned long long utime, stime;
+        if (sscanf(fields + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &state, &utime, &stime) != 3) continue;
+
+        unsigned long long ticks = utime + stime;
+        prof[i].cpu = (double)ticks / ticks_per_second;
+        prof[i].wall += interval;
+        double busy = (double)(ticks - prof[i].ticks) / ticks_per_second;
+        prof[i].ticks = ticks;
+        if (state == 'R' || busy >= interval / 2) continue;
+
+        int in_fill = -1, out_fill = -1, out_capacity = 0;
+        if (i > 0 && held_fds[i - 1] >= 0) ioctl(held_fds[i - 1], FIONREAD, &in_fill);
+        if (i < num_commands - 1 && held_fds[i] >= 0) {
+            ioctl(held_fds[i], FIONREAD, &out_fill);
+            out_capacity = fcntl(held_fds[i], F_GETPIPE_SZ);
+        }
+        if (out_fill >= 0 && out_capacity > 0 && out_fill >= out_capacity - 4096) {
+            prof[i].blocked_out += interval - busy;
+        } else if (in_fill == 0) {
+            prof[i].blocked_in += interval - busy;
+        }
+    }
+}
+
+/*
+ * report_profile - Prints per-stage utilization and pipe waits, naming the limiting stage.
+ */
+void report_profile(char **args[], int num_commands, struct stage_profile *prof) {
+    int bottleneck = 0;
+    double best = -1;
+    fprintf(stderr, "[pipeprof] %-5s %-16s %8s %8s %8s %8s\n", "stage", "command", "wall(s)", "cpu%", "in-wait%", "out-wait%");
+    for (int i = 0; i < num_commands; i++) {
+        double wall = prof[i].wall > 0 ? prof[i].wall : 1e-9;
+        double util = 100 * prof[i].cpu / wall;
+        fprintf(stderr, "[pipeprof] %-5d %-16.16s %8.2f %8.1f %8.1f %8.1f\n", i, args[i][0], prof[i].wall, util,
+                100 * prof[i].blocked_in / wall, 100 * prof[i].blocked_out / wall);
+        if (util > best) {
+            best = util;
+            bottleneck = i;
+        }
+    }
+    fprintf(stderr, "[pipeprof] bottleneck: stage %d (%s) at %.1f%% CPU\n", bottleneck, args[bottleneck][0], best);
+}
+
+/*
+ * hash_string - FNV-1a hash of a NUL-terminated string.
+ */
+unsigned long hash_string(const char *text) {
+    unsigned long hash = 14695981039346656037UL;
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * profile_record - Charges one executed line to its per-line entry and to each command name in it.
+ * Lines are indexed by line number, so a hot line costs an array lookup. A line without a
+ * pipeline ("(( ))", "[[ ]]") is charged to its first word.
+ */
+void profile_record(const char *text, char **args[], int num_commands, double wall, double child_cpu,
+                    unsigned long forks, unsigned long execs) {
+    if (script_line >= profile_line_cap) {
+        int cap = profile_line_cap ? profile_line_cap : 256;
+        while (script_line >= cap) cap *= 2;
+        struct profile_line *grown = realloc(profile_lines, cap * sizeof(struct profile_line));
+        if (!grown) return;
+        memset(grown + profile_line_cap, 0, (cap - profile_line_cap) * sizeof(struct profile_line));
+        profile_lines = grown;
+        profile_line_cap = cap;
+        shell_counters[SUB_PROFILER].allocs++;
+        shell_counters[SUB_PROFILER].bytes = cap * sizeof(struct profile_line);
+    }
+    char first_word[16];
+    snprintf(first_word, sizeof(first_word), "%.*s", (int)strcspn(text, " \t"), text);
+    struct profile_line *line = &profile_lines[script_line];
+    if (!line->text) {
+        shell_counters[SUB_PROFILER].entries++;
+        shell_counters[SUB_PROFILER].allocs += 2;
+        line->text = strdup(text);
+        size_t len = 1;
+        for (int c = 0; c < num_commands; c++) len += strlen(args[c][0] ? args[c][0] : "") + 1;
+        line->stack = malloc(len + sizeof(first_word));
+        if (line->stack && !num_commands) {
+            strcpy(line->stack, first_word);
+        } else if (line->stack) {
+            line->stack[0] = '\0';
+            for (int c = 0; c < num_commands; c++) {
+                if (c) strcat(line->stack, "|");
+                strcat(line->stack, args[c][0] ? args[c][0] : "");
+            }
+        }
+    }
+    line->count++;
+    line->wall += wall;
+    line->child_cpu += child_cpu;
+    line->forks += forks;
+    line->execs += execs;
+
+    // Per-command totals live in an open-addressing table keyed by name
+    if ((profile_command_count + num_commands + 1) * 2 >= profile_command_cap) {
+        unsigned cap = profile_command_cap ? profile_command_cap * 2 : 64;
+        struct profile_command *table = calloc(cap, sizeof(struct profile_command));
+        if (!table) return;
+        for (unsigned i = 0; i < profile_command_cap; i++) {
+            if (!profile_commands[i].name) continue;
+            unsigned slot = hash_string(profile_commands[i].name) & (cap - 1);
+            while (table[slot].name) slot = (slot + 1) & (cap - 1);
+            table[slot] = profile_commands[i];
+        }
+        free(profile_commands);
+        profile_commands = table;
+        profile_command_cap = cap;
+    }
+    for (int c = 0; c < (num_commands ? num_commands : 1); c++) {
+        const char *name = num_commands ? args[c][0] : first_word;
+        if (!name || !*name) continue;
+        unsigned slot = hash_string(name) & (profile_command_cap - 1);
+        while (profile_commands[slot].name && strcmp(profile_commands[slot].name, name) != 0) {
+            slot = (slot + 1) & (profile_command_cap - 1);
+        }
+        struct profile_command *entry = &profile_commands[slot];
+        if (!entry->name) {
+            entry->name = strdup(name);
+            if (!entry->name) return;
+            profile_command_count++;
+        }
+        // Stages of one pipeline run concurrently and their children are reaped together, so each
+        // command is charged the whole line's time, child CPU and forks (labelled line-* in the report)
+        entry->calls++;
+        entry->wall += wall;
+        entry->child_cpu += child_cpu;
+        entry->forks += forks;
+    }
+}
+
+/*
+ * compare_lines_by_wall - qsort order for the profile report, slowest line first.
+ */
+static int compare_lines_by_wall(const void *a, const void *b) {
+    const struct profile_line *x = *(struct profile_line * const *)a, *y = *(struct profile_line * const *)b;
+    return (x->wall < y->wall) - (x->wall > y->wall);
+}
+
+/*
+ * profile_report - Prints the line and command tables sorted by wall time to stderr, writes
+ * collapsed stacks ("script;line: text;command microseconds") for flamegraph tools, then
+ * clears the profile.
+ */
+void profile_report(void) {
+    if (!profile_lines) return;
+    const char *source = script_name ? script_name : "interactive";
+    int used = 0;
+    struct profile_line **order = malloc(profile_line_cap * sizeof(struct profile_line *));
+    if (!order) return;
+    for (int i = 0; i < profile_line_cap; i++) {
+        if (profile_lines[i].count) order[used++] = &profile_lines[i];
+    }
+    qsort(order, used, sizeof(struct profile_line *), compare_lines_by_wall);
+
+    fprintf(stderr, "[profile] %s: %d lines\n", source, used);
+    fprintf(stderr, "%6s %8s %10s %12s %7s %7s  %s\n", "line", "count", "wall(s)", "child-cpu(s)", "forks", "execs", "command");
+    for (int i = 0; i < used; i++) {
+        struct profile_line *line = order[i];
+        fprintf(stderr, "%6d %8lu %10.4f %12.4f %7lu %7lu  %.60s\n", (int)(line - profile_lines), line->count,
+                line->wall, line->child_cpu, line->forks, line->execs, line->text);
+    }
+    fprintf(stderr, "%-16s %8s %12s %12s %10s\n", "command", "calls", "line-wall(s)", "line-cpu(s)", "line-forks");
+    for (unsigned i = 0; i < profile_command_cap; i++) {
+        struct profile_command *entry = &profile_commands[i];
+        if (!entry->name) continue;
+        fprintf(stderr, "%-16.16s %8lu %12.4f %12.4f %10lu\n", entry->name, entry->calls, entry->wall,
+                entry->child_cpu, entry->forks);
+    }
+
+    FILE *folded = fopen(profile_out, "w");
+    if (!folded) {
+        perror(profile_out);
+    } else {
+        for (int i = 0; i < used; i++) {
+            struct profile_line *line = order[i];
+            // Frames are separated by ';', so it cannot appear inside one
+            fprintf(folded, "%s;%d: ", source, (int)(line - profile_lines));
+            for (const char *p = line->text; *p && p - line->text < 60; p++) fputc(*p == ';' ? ',' : *p, folded);
+            fprintf(folded, ";%s %llu\n", line->stack ? line->stack : "?", (unsigned long long)(line->wall * 1e6));
+        }
+        fclose(folded);
+        fprintf(stderr, "[profile] collapsed stacks written to %s\n", profile_out);
+    }
+    free(order);
+
+    for (int i = 0; i < profile_line_cap; i++) {
+        free(profile_lines[i].text);
+        free(profile_lines[i].stack);
+    }
+    free(profile_lines);
+    profile_lines = NULL;
+    profile_line_cap = 0;
+    shell_counters[SUB_PROFILER].entries = shell_counters[SUB_PROFILER].bytes = 0;
+    for (unsigned i = 0; i < profile_command_cap; i++) free(profile_commands[i].name);
+    free(profile_commands);
+    profile_commands = NULL;
+    profile_command_cap = profile_command_count = 0;
+}
+
+/*
+ * stats_column_offset - Offset of a column inside a block of the stats file.
+ */
+size_t stats_column_offset(int column) {
+    size_t offset = 0;
+    for (int c = 0; c < column; c++) offset += stats_col_size[c] * STATS_BLOCK_RECORDS;
+    return offset;
+}
+
+/*
+ * stats_append - Appends one record to the stats log, scattering its fields into the columns
+ * of the current block. The file stays open; flock serialises shells sharing it.
+ */
+void stats_append(const struct stats_record *record) {
+    if (stats_fd == -2) return;
+    if (stats_fd < 0) {
+        char path[MAX_PATH];
+        const char *configured = getenv("MYSHELL_STATS");
+        const char *home = getenv("HOME");
+        if (configured) {
+            snprintf(path, sizeof(path), "%s", configured);
+        } else {
+            snprintf(path, sizeof(path), "%s/.myshell_stats", home ? home : ".");
+        }
+        stats_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        // Like the script, the log stays clear of the descriptors redirections use
+        if (stats_fd >= 0 && stats_fd < 10) {
+            int high = fcntl(stats_fd, F_DUPFD_CLOEXEC, 10);
+            close(stats_fd);
+            stats_fd = high;
+        }
+        if (stats_fd < 0) {
+            // Logging is best effort; do not retry on every command
+            stats_fd = -2;
+            return;
+        }
+    }
+    if (flock(stats_fd, LOCK_EX) != 0) return;
+
+    struct stats_header header;
+    if (pread(stats_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, STATS_MAGIC, 8) != 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STATS_MAGIC, 8);
+        header.block_records = STATS_BLOCK_RECORDS;
+    }
+    if (header.block_records != STATS_BLOCK_RECORDS) {
+        flock(stats_fd, LOCK_UN);
+        return;
+    }
+    size_t block_bytes = stats_column_offset(COL_COUNT);
+    off_t block = STATS_HEADER_SIZE + (off_t)(header.count / STATS_BLOCK_RECORDS) * block_bytes;
+    size_t slot = header.count % STATS_BLOCK_RECORDS;
+    // Size a new block up front (sparsely) so readers can map it whole
+    if (slot == 0 && ftruncate(stats_fd, block + block_bytes) != 0) {
+        flock(stats_fd, LOCK_UN);
+        return;
+    }
+    const void *fields[COL_COUNT] = {
+        &record->start_us, &record->duration_us, &record->status, &record->utime_us, &record->stime_us,
+        &record->maxrss_kb, &record->pipe_bytes, &record->cwd_hash, &record->cmd_hash, record->name
+    };
+    int ok = 1;
+    for (int c = 0; c < COL_COUNT && ok; c++) {
+        off_t at = block + stats_column_offset(c) + slot * stats_col_size[c];
+        ok = (pwrite(stats_fd, fields[c], stats_col_size[c], at) == (ssize_t)stats_col_size[c]);
+    }
+    if (ok) {
+        header.count++;
+        ok = (pwrite(stats_fd, &header, sizeof(header), 0) == sizeof(header));
+        shell_counters[SUB_STATSLOG].entries = header.count;
+        shell_counters[SUB_STATSLOG].bytes = STATS_HEADER_SIZE + (header.count + STATS_BLOCK_RECORDS - 1) / STATS_BLOCK_RECORDS * block_bytes;
+    }
+    flock(stats_fd, LOCK_UN);
+}
+
+// Durations gathered for one command while answering a stats query
+struct stats_group {
+    uint64_t cmd_hash;
+    char name[17];
+    uint64_t *durations;
+    size_t count, cap, failures;
+    uint64_t cpu_us;
+};
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_groups_by_count(const void *a, const void *b) {
+    const struct stats_group *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/*
+ * stats_query - The stats builtin: "stats [-w window] [command]", window like 30m, 24h, 7d.
+ * Maps the log read-only under a shared lock and reads only the columns it needs. Rows find
+ * their command's group through an open-addressing table keyed by command hash.
+ */
+void stats_query(char *args[]) {
+    int64_t window_us = 0;
+    const char *only = NULL;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-w") == 0 && args[i + 1]) {
+            char *unit;
+            double amount = strtod(args[++i], &unit);
+            double scale = *unit == 'd' ? 86400 : *unit == 'h' ? 3600 : *unit == 'm' ? 60 : 1;
+            window_us = amount * scale * 1e6;
+        } else if (args[i][0] == '-') {
+            printf("Usage: stats [-w window] [command]\n");
+            return;
+        } else {
+            only = args[i];
+        }
+    }
+
+    char path[MAX_PATH];
+    const char *configured = getenv("MYSHELL_STATS");
+    const char *home = getenv("HOME");
+    if (configured) {
+        snprintf(path, sizeof(path), "%s", configured);
+    } else {
+        snprintf(path, sizeof(path), "%s/.myshell_stats", home ? home : ".");
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    // Writers hold LOCK_EX while they fill a row and bump the count, so the shared lock sees whole rows
+    if (fd < 0 || flock(fd, LOCK_SH) != 0 || fstat(fd, &st) != 0 || st.st_size < STATS_HEADER_SIZE) {
+        printf("stats: no statistics recorded yet\n");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("stats: mmap failed");
+        close(fd);
+        return;
+    }
+    const struct stats_header *header = (const struct stats_header *)map;
+    size_t block_bytes = stats_column_offset(COL_COUNT);
+    uint64_t count = header->count;
+    if (memcmp(header->magic, STATS_MAGIC, 8) != 0) count = 0;
+    // Never trust the count beyond what the file actually holds
+    while (count > 0 && STATS_HEADER_SIZE + ((count - 1) / STATS_BLOCK_RECORDS + 1) * block_bytes > (uint64_t)st.st_size) {
+        count = (count - 1) / STATS_BLOCK_RECORDS * STATS_BLOCK_RECORDS;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t since = window_us ? now.tv_sec * 1000000LL + now.tv_usec - window_us : INT64_MIN;
+    uint64_t only_hash = only ? hash_string(only) : 0;
+
+    size_t group_cap = 64, group_count = 0, slot_mask = 2 * group_cap - 1;
+    struct stats_group *groups = calloc(group_cap, sizeof(struct stats_group));
+    size_t *group_slots = calloc(slot_mask + 1, sizeof(size_t));   // group index + 1, 0 when free
+    if (!groups || !group_slots) {
+        free(groups);
+        free(group_slots);
+        munmap(map, st.st_size);
+        close(fd);
+        return;
+    }
+    for (uint64_t row = 0; row < count; row++) {
+        const unsigned char *block = map + STATS_HEADER_SIZE + (row / STATS_BLOCK_RECORDS) * block_bytes;
+        size_t slot = row % STATS_BLOCK_RECORDS;
+        int64_t start_us;
+        memcpy(&start_us, block + stats_column_offset(COL_START) + slot * 8, 8);
+        if (start_us < since) continue;
+        uint64_t cmd_hash;
+        memcpy(&cmd_hash, block + stats_column_offset(COL_CMD_HASH) + slot * 8, 8);
+        if (only && cmd_hash != only_hash) continue;
+
+        size_t at = cmd_hash & slot_mask;
+        while (group_slots[at] && groups[group_slots[at] - 1].cmd_hash != cmd_hash) at = (at + 1) & slot_mask;
+        size_t g = group_slots[at] ? group_slots[at] - 1 : group_count;
+        if (g == group_count) {
+            if (group_count == group_cap) {
+                // The slot table stays at most half full: grow both and rehash
+                struct stats_group *grown = realloc(groups, group_cap * 2 * sizeof(struct stats_group));
+                size_t *slots = grown ? calloc(4 * group_cap, sizeof(size_t)) : NULL;
+                if (!slots) {
+                    if (grown) groups = grown;
+                    break;
+                }
+                groups = grown;
+                group_cap *= 2;
+                slot_mask = 2 * group_cap - 1;
+                free(group_slots);
+                group_slots = slots;
+                for (size_t k = 0; k < group_count; k++) {
+                    size_t s = groups[k].cmd_hash & slot_mask;
+                    while (group_slots[s]) s = (s + 1) & slot_mask;
+                    group_slots[s] = k + 1;
+                }
+                at = cmd_hash & slot_mask;
+                while (group_slots[at]) at = (at + 1) & slot_mask;
+            }
+            group_slots[at] = g + 1;
+            memset(&groups[g], 0, sizeof(struct stats_group));
+            groups[g].cmd_hash = cmd_hash;
+            memcpy(groups[g].name, block + stats_column_offset(COL_NAME) + slot * 16, 16);
+            group_count++;
+        }
+        struct stats_group *group = &groups[g];
+        if (group->count == group->cap) {
+            size_t cap = group->cap ? group->cap * 2 : 64;
+            uint64_t *grown = realloc(group->durations, cap * sizeof(uint64_t));
+            if (!grown) continue;
+            group->durations = grown;
+            group->cap = cap;
+        }
+        uint64_t duration, utime, stime;
+        int32_t status;
+        memcpy(&duration, block + stats_column_offset(COL_DURATION) + slot * 8, 8);
+        memcpy(&status, block + stats_column_offset(COL_STATUS) + slot * 4, 4);
+        memcpy(&utime, block + stats_column_offset(COL_UTIME) + slot * 8, 8);
+        memcpy(&stime, block + stats_column_offset(COL_STIME) + slot * 8, 8);
+        group->durations[group->count++] = duration;
+        if (status != 0) group->failures++;
+        group->cpu_us += utime + stime;
+    }
+    munmap(map, st.st_size);
+    close(fd);
+    free(group_slots);
+
+    qsort(groups, group_count, sizeof(struct stats_group), compare_groups_by_count);
+    printf("%-16s %8s %7s %10s %10s %10s %10s\n", "command", "runs", "fail%", "p50(ms)", "p95(ms)", "p99(ms)", "cpu(s)");
+    for (size_t g = 0; g < group_count; g++) {
+        struct stats_group *group = &groups[g];
+        // Nearest-rank percentiles
+        qsort(group->durations, group->count, sizeof(uint64_t), compare_u64);
+        double p50 = group->durations[(group->count * 50 + 99) / 100 - 1] / 1e3;
+        double p95 = group->durations[(group->count * 95 + 99) / 100 - 1] / 1e3;
+        double p99 = group->durations[(group->count * 99 + 99) / 100 - 1] / 1e3;
+        printf("%-16s %8zu %7.1f %10.2f %10.2f %10.2f %10.2f\n", group->name, group->count,
+               100.0 * group->failures / group->count, p50, p95, p99, group->cpu_us / 1e6);
+        free(group->durations);
+    }
+    if (group_count == 0) printf("stats: no matching commands\n");
+    free(groups);
+}
+
+/*
+ * shellstat - The shellstat builtin: process memory, heap usage and per-subsystem counters.
+ * "--json" prints one JSON object for scraping; "--reset" zeroes counters and the high-water mark.
+ */
+void shellstat(char *args[]) {
+    int json = 0;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(args[i], "--reset") == 0) {
+            for (int s = 0; s < SUB_COUNT; s++) {
+                shell_counters[s].hits = shell_counters[s].misses = shell_counters[s].allocs = 0;
+            }
+            heap_high_water = 0;
+            return;
+        } else {
+            printf("Usage: shellstat [--json] [--reset]\n");
+            return;
+        }
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long size_pages = 0, resident_pages = 0, peak_kb = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%lu %lu", &size_pages, &resident_pages) != 2) resident_pages = 0;
+        fclose(statm);
+    }
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        char line[256];
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "VmHWM: %lu kB", &peak_kb) == 1) break;
+        }
+        fclose(status);
+    }
+    struct mallinfo2 heap = mallinfo2();
+    size_t in_use = heap.uordblks + heap.hblkhd;
+    if (in_use > heap_high_water) heap_high_water = in_use;
+
+    if (json) {
+        printf("{\"rss_bytes\":%lu,\"peak_rss_bytes\":%lu,\"heap\":{\"arena_bytes\":%zu,\"in_use_bytes\":%zu,"
+               "\"mmap_bytes\":%zu,\"free_bytes\":%zu,\"high_water_bytes\":%zu},\"subsystems\":{",
+               resident_pages * page, peak_kb * 1024, heap.arena, in_use, heap.hblkhd, heap.fordblks, heap_high_water);
+        for (int s = 0; s < SUB_COUNT; s++) {
+            struct subsystem_stats *sub = &shell_counters[s];
+            printf("%s\"%s\":{\"entries\":%lu,\"bytes\":%lu,\"hits\":%lu,\"misses\":%lu,\"allocs\":%lu}", s ? "," : "",
+                   sub->name, sub->entries, sub->bytes, sub->hits, sub->misses, sub->allocs);
+        }
+        printf("}}\n");
+        return;
+    }
+
+    char a[32], b[32], c[32];
+    format_bytes(resident_pages * page, a, sizeof(a));
+    format_bytes(peak_kb * 1024.0, b, sizeof(b));
+    printf("RSS %s (peak %s)\n", a, b);
+    format_bytes(heap.arena, a, sizeof(a));
+    format_bytes(in_use, b, sizeof(b));
+    format_bytes(heap_high_water, c, sizeof(c));
+    printf("heap: arena %s, in use %s, high-water %s\n", a, b, c);
+    printf("%-16s %8s %10s %10s %10s %7s %10s\n", "subsystem", "entries", "bytes", "hits", "misses", "hit%", "allocs");
+    for (int s = 0; s < SUB_COUNT; s++) {
+        struct subsystem_stats *sub = &shell_counters[s];
+        unsigned long lookups = sub->hits + sub->misses;
+        printf("%-16s %8lu %10lu %10lu %10lu %7.1f %10lu\n", sub->name, sub->entries, sub->bytes, sub->hits,
+               sub->misses, lookups ? 100.0 * sub->hits / lookups : 0.0, sub->allocs);
+    }
+}
+
+/*
+ * copy_file - Copies a regular file to dest, or into dest when it is a directory.
+ * Returns 0 on success, 1 on failure.
+ */
+int copy_file(const char *src, const char *dest) {
+    struct stat st;
+    if (stat(src, &st) != 0) {
+        perror("cp: cannot stat source");
+        return 1;
+    }
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd < 0) {
+        perror("cp: cannot open source");
+        return 1;
+    }
+    struct stat dest_st;
+    char final_dest[MAX_PATH];
+    if (stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
+        if (snprintf(final_dest, sizeof(final_dest), "%s/%s", dest, strrchr(src, '/') ? strrchr(src, '/') + 1 : src) >= sizeof(final_dest)) {
+            fprintf(stderr, "cp: destination path too long\n");
+            close(src_fd);
+            return 1;
+        }
+    } else {
+        strncpy(final_dest, dest, sizeof(final_dest) - 1);
+        final_dest[sizeof(final_dest) - 1] = '\0';
+    }
+    int dest_fd = open(final_dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
+    if (dest_fd < 0) {
+        perror("cp: cannot open destination");
+        close(src_fd);
+        return 1;
+    }
+    char buffer[1024];
+    ssize_t bytes;
+    while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
+        if (write(dest_fd, buffer, bytes) != bytes) {
+            perror("cp: write failed");
+            close(src_fd);
+            close(dest_fd);
+            return 1;
+        }
+    }
+    if (bytes < 0) {
+        perror("cp: read failed");
+    }
+    close(src_fd);
+    close(dest_fd);
+    return bytes < 0;
+}
+
+/*
+ * recursive_delete - Recursively deletes a directory and its contents.
+ */
+void recursive_delete(const char *path, int depth) {
+    // [FIX: Limit recursion depth]
+    if (depth > MAX_RECURSION) {
+        fprintf(stderr, "recursive_delete: maximum recursion depth exceeded\n");
+        return;
+    }
+    struct stat st;
+    // [FIX: Use stat to avoid following symlinks]
+    if (stat(path, &st) != 0) {
+        perror("stat failed");
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            perror("opendir failed");
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char full_path[MAX_PATH];
+            if (snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name) >= sizeof(full_path)) {
+                fprintf(stderr, "recursive_delete: path too long\n");
+                closedir(dir);
+                return;
+            }
+            recursive_delete(full_path, depth + 1);
+        }
+        closedir(dir);
+        if (rmdir(path) != 0) {
+            perror("rmdir failed");
+        }
+    } else {
+        if (unlink(path) != 0) {
+            perror("unlink failed");
+        }
+    }
+}
+
+/*
+ * recursive_copy - Recursively copies a directory and its contents.
+ */
+void recursive_copy(const char *src, const char *dest, int depth) {
+    // [FIX: Limit recursion depth]
+    if (depth > MAX_RECURSION) {
+        fprintf(stderr, "recursive_copy: maximum recursion depth exceeded\n");
+        return;
+    }
+    struct stat st;
+    if (stat(src, &st) != 0) {
+        perror("stat failed");
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        struct stat dest_st;
+        if (stat(dest, &dest_st) == 0 && !S_ISDIR(dest_st.st_mode)) {
+            fprintf(stderr, "cp: cannot overwrite non-directory '%s' with directory '%s'\n", dest, src);
+            return;
+        }
+        if (mkdir(dest, st.st_mode) != 0 && errno != EEXIST) {
+            perror("mkdir failed");
+            return;
+        }
+        DIR *dir = opendir(src);
+        if (!dir) {
+            perror("opendir failed");
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char src_path[MAX_PATH], dest_path[MAX_PATH];
+            if (snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name) >= sizeof(src_path) ||
+                snprintf(dest_path, sizeof(dest_path), "%s/%s", dest, entry->d_name) >= sizeof(dest_path)) {
+                fprintf(stderr, "recursive_copy: path too long\n");
+                closedir(dir);
+                return;
+            }
+            recursive_copy(src_path, dest_path, depth + 1);
+        }
+        closedir(dir);
+    } else {
+        int src_fd = open(src, O_RDONLY);
+        if (src_fd < 0) {
+            perror("fopen src failed");
+            return;
+        }
+        struct stat dest_st;
+        char final_dest[MAX_PATH];
+        if (stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
+            if (snprintf(final_dest, sizeof(final_dest), "%s/%s", dest, strrchr(src, '/') ? strrchr(src, '/') + 1 : src) >= sizeof(final_dest)) {
+                fprintf(stderr, "recursive_copy: destination path too long\n");
+                close(src_fd);
+                return;
+            }
+        } else {
+            strncpy(final_dest, dest, sizeof(final_dest));
+        }
+        int dest_fd = open(final_dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
+        if (dest_fd < 0) {
+            perror("fopen dest failed");
+            close(src_fd);
+            return;
+        }
+        char buffer[1024];
+        ssize_t bytes;
+        while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
+            if (write(dest_fd, buffer, bytes) != bytes) {
+                perror("write failed");
+                close(src_fd);
+                close(dest_fd);
+                return;
+            }
+        }
+        if (bytes < 0) {
+            perror("read failed");
+        }
+        close(src_fd);
+        close(dest_fd);
+    }
+}
+
+/*
+ * index_file - Path of the file index: $MYSHELL_INDEX, or ~/.myshell_index.
+ */
+void index_file(char *path, size_t size) {
+    const char *configured = getenv("MYSHELL_INDEX");
+    const char *home = getenv("HOME");
+    if (configured) {
+        snprintf(path, size, "%s", configured);
+    } else {
+        snprintf(path, size, "%s/.myshell_index", home ? home : ".");
+    }
+}
+
+/*
+ * index_root - Canonical directory the file index covers: $MYSHELL_INDEX_ROOT, or $HOME.
+ */
+int index_root(char *root) {
+    const char *configured = getenv("MYSHELL_INDEX_ROOT");
+    if (!configured) configured = getenv("HOME");
+    if (!realpath(configured ? configured : "/", root)) return -1;
+    // Paths are stored as root + "/" + rest, so "/" itself is kept as the empty string
+    if (strcmp(root, "/") == 0) root[0] = '\0';
+    return 0;
+}
+
+/*
+ * index_add - Appends a copy of path (len bytes) to a scan's path list.
+ */
+static int index_add(struct index_scan *scan, const char *path, size_t len) {
+    if (scan->count == scan->cap) {
+        size_t cap = scan->cap ? scan->cap * 2 : 4096;
+        char **grown = realloc(scan->paths, cap * sizeof(char *));
+        if (!grown) return -1;
+        scan->paths = grown;
+        scan->cap = cap;
+    }
+    char *copy = strndup(path, len);
+    if (!copy) return -1;
+    scan->paths[scan->count++] = copy;
+    return 0;
+}
+
+/*
+ * index_watch - Watches a directory for the worker, remembering its path by watch descriptor.
+ * Running out of watches turns inotify off for the scan, which then falls back to rescans.
+ */
+static void index_watch(struct index_scan *scan, const char *path) {
+    if (scan->inotify_fd < 0) return;
+    int wd = inotify_add_watch(scan->inotify_fd, path, INDEX_WATCH_MASK);
+    if (wd < 0) {
+        if (errno != ENOSPC && errno != ENOMEM) return;
+        close(scan->inotify_fd);
+        scan->inotify_fd = -1;
+        return;
+    }
+    if (wd >= scan->watch_cap) {
+        int cap = scan->watch_cap ? scan->watch_cap : 1024;
+        while (cap <= wd) cap *= 2;
+        char **grown = realloc(scan->watches, cap * sizeof(char *));
+        if (!grown) return;
+        memset(grown + scan->watch_cap, 0, (cap - scan->watch_cap) * sizeof(char *));
+        scan->watches = grown;
+        scan->watch_cap = cap;
+    }
+    // A directory moved inside the root keeps its watch descriptor under the new name
+    free(scan->watches[wd]);
+    scan->watches[wd] = strdup(path);
+}
+
+/*
+ * index_scan_dir - Adds everything below the directory in path[0..len) to scan, staying on scan->dev.
+ * path is a INDEX_PATH_MAX buffer the walk extends in place.
+ */
+void index_scan_dir(struct index_scan *scan, char *path, size_t len) {
+    if (__atomic_load_n(&index_stop_requested, __ATOMIC_RELAXED)) return;
+    path[len] = '\0';
+    DIR *dir = opendir(len ? path : "/");
+    if (!dir) return;
+    index_watch(scan, len ? path : "/");
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        size_t name_len = strlen(name);
+        if (len + 1 + name_len >= INDEX_PATH_MAX) continue;
+        path[len] = '/';
+        memcpy(path + len + 1, name, name_len + 1);
+        if (index_add(scan, path, len + 1 + name_len) != 0) break;
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) continue;
+        // Other mounts (and the pseudo filesystems under /) get their own index
+        if (st.st_dev != scan->dev) continue;
+        index_scan_dir(scan, path, len + 1 + name_len);
+    }
+    closedir(dir);
+    path[len] = '\0';
+}
+
+/*
+ * index_compare - qsort comparator putting paths in byte order, so a directory's subtree is contiguous.
+ */
+static int index_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * index_put_varint - Appends value to out as a little-endian base-128 varint; returns its length.
+ */
+static size_t index_put_varint(unsigned char *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+/*
+ * index_get_varint - Decodes a varint at *p (before end); returns -1 when it runs past end.
+ */
+static int index_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+/*
+ * index_write - Writes sorted paths as a front-coded index to file, replacing it atomically.
+ */
+int index_write(const char *file, const char *root, char **paths, size_t count) {
+    // A unique temp name per writer: the background worker and locate -u may run at once
+    char tmp[MAX_PATH + 32];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t restart_count = (count + INDEX_RESTART - 1) / INDEX_RESTART;
+    uint64_t *restarts = malloc((restart_count + 1) * sizeof(uint64_t));
+    if (!restarts) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    struct index_header header = {.magic = INDEX_MAGIC};
+    header.count = count;
+    header.built = time(NULL);
+    header.root_len = strlen(root);
+    struct io_buffer out = {.fd = fd};
+    io_write(&out, &header, sizeof(header));
+    io_write(&out, root, header.root_len);
+    uint64_t offset = sizeof(header) + header.root_len;
+    const char *prev = "";
+    for (size_t i = 0; i < count; i++) {
+        size_t shared = 0;
+        if (i % INDEX_RESTART == 0) {
+            restarts[i / INDEX_RESTART] = offset;
+        } else {
+            while (prev[shared] && prev[shared] == paths[i][shared]) shared++;
+        }
+        size_t len = strlen(paths[i]);
+        unsigned char lengths[20];
+        size_t n = index_put_varint(lengths, shared);
+        n += index_put_varint(lengths + n, len - shared);
+        io_write(&out, lengths, n);
+        io_write(&out, paths[i] + shared, len - shared);
+        offset += n + len - shared;
+        prev = paths[i];
+    }
+    // The restart table is 8-byte aligned so readers can index it in place
+    static const char pad[8];
+    io_write(&out, pad, (8 - offset % 8) % 8);
+    header.restarts = (offset + 7) & ~(uint64_t)7;
+    io_write(&out, restarts, restart_count * sizeof(uint64_t));
+    io_flush(&out);
+    free(out.data);
+    free(restarts);
+    int failed = out.failed;
+    failed |= pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+    failed |= close(fd) != 0;
+    if (failed || rename(tmp, file) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * index_build - Scans root into scan->paths and sorts them; the paths are the caller's to free.
+ */
+int index_build(struct index_scan *scan, const char *root) {
+    struct stat st;
+    if (stat(root[0] ? root : "/", &st) != 0) return -1;
+    scan->dev = st.st_dev;
+    char *path = malloc(INDEX_PATH_MAX);
+    if (!path) return -1;
+    size_t len = strlen(root);
+    memcpy(path, root, len + 1);
+    index_scan_dir(scan, path, len);
+    free(path);
+    qsort(scan->paths, scan->count, sizeof(char *), index_compare);
+    return 0;
+}
+
+/*
+ * index_free_scan - Releases a scan's paths, watch table and inotify descriptor.
+ */
+static void index_free_scan(struct index_scan *scan) {
+    for (size_t i = 0; i < scan->count; i++) free(scan->paths[i]);
+    free(scan->paths);
+    for (int i = 0; i < scan->watch_cap; i++) free(scan->watches[i]);
+    free(scan->watches);
+    if (scan->inotify_fd >= 0) close(scan->inotify_fd);
+    memset(scan, 0, sizeof(*scan));
+    scan->inotify_fd = -1;
+}
+
+/*
+ * index_lower_bound - First position in the sorted paths that is not below key.
+ */
+static size_t index_lower_bound(char **paths, size_t count, const char *key) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(paths[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * index_apply - Folds a batch of inotify changes into the worker's sorted paths.
+ * Removals drop the path and its subtree; additions are checked against the disk when applied
+ * (so create-then-delete cancels out) and new directories are scanned whole.
+ */
+static void index_apply(struct index_scan *scan, struct index_scan *added, struct index_scan *removed) {
+    char *key = malloc(INDEX_PATH_MAX + 1);
+    if (!key) return;
+    for (size_t r = 0; r < removed->count; r++) {
+        const char *gone = removed->paths[r];
+        size_t len = strlen(gone);
+        // The subtree of d is exactly the range ["d/", "d0"): '0' follows '/' in byte order
+        memcpy(key, gone, len);
+        strcpy(key + len, "0");
+        size_t from = index_lower_bound(scan->paths, scan->count, gone);
+        size_t to = index_lower_bound(scan->paths, scan->count, key);
+        size_t kept = from;
+        for (size_t i = from; i < to; i++) {
+            const char *path = scan->paths[i];
+            if (strcmp(path, gone) == 0 || (strncmp(path, gone, len) == 0 && path[len] == '/')) {
+                free(scan->paths[i]);
+            } else {
+                scan->paths[kept++] = scan->paths[i];
+            }
+        }
+        memmove(scan->paths + kept, scan->paths + to, (scan->count - to) * sizeof(char *));
+        scan->count -= to - kept;
+    }
+    // Collect what still exists, scanning new directories
+    struct index_scan fresh = {.dev = scan->dev, .inotify_fd = scan->inotify_fd,
+                               .watches = scan->watches, .watch_cap = scan->watch_cap};
+    for (size_t a = 0; a < added->count; a++) {
+        struct stat st;
+        if (lstat(added->paths[a], &st) != 0) continue;
+        size_t len = strlen(added->paths[a]);
+        if (index_add(&fresh, added->paths[a], len) != 0) break;
+        if (S_ISDIR(st.st_mode) && st.st_dev == scan->dev && len < INDEX_PATH_MAX) {
+            memcpy(key, added->paths[a], len + 1);
+            index_scan_dir(&fresh, key, len);
+        }
+    }
+    scan->inotify_fd = fresh.inotify_fd;
+    scan->watches = fresh.watches;
+    scan->watch_cap = fresh.watch_cap;
+    free(key);
+    if (fresh.count == 0) {
+        free(fresh.paths);
+        return;
+    }
+    qsort(fresh.paths, fresh.count, sizeof(char *), index_compare);
+    char **merged = malloc((scan->count + fresh.count) * sizeof(char *));
+    if (!merged) {
+        for (size_t i = 0; i < fresh.count; i++) free(fresh.paths[i]);
+        free(fresh.paths);
+        return;
+    }
+    size_t i = 0, j = 0, n = 0;
+    while (i < scan->count || j < fresh.count) {
+        int order = i == scan->count ? 1 : j == fresh.count ? -1 : strcmp(scan->paths[i], fresh.paths[j]);
+        if (order <= 0) merged[n++] = scan->paths[i++];
+        if (order == 0) free(fresh.paths[j++]);
+        else if (order > 0) {
+            // Repeated events for one path arrive as duplicates in the batch
+            if (n > 0 && strcmp(merged[n - 1], fresh.paths[j]) == 0) free(fresh.paths[j++]);
+            else merged[n++] = fresh.paths[j++];
+        }
+    }
+    free(scan->paths);
+    free(fresh.paths);
+    scan->paths = merged;
+    scan->cap = scan->count + fresh.count;
+    scan->count = n;
+}
+
+/*
+ * index_collect - Sorts the worker's pending inotify events into added and removed paths.
+ * Returns -1 when the kernel queue overflowed and only a rescan can catch up.
+ */
+static int index_collect(struct index_scan *scan, struct index_scan *added, struct index_scan *removed) {
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[INDEX_PATH_MAX];
+    ssize_t n;
+    while ((n = read(scan->inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) return -1;
+            if (event->wd < 0 || event->wd >= scan->watch_cap || !scan->watches[event->wd]) continue;
+            if (event->mask & IN_IGNORED) {
+                free(scan->watches[event->wd]);
+                scan->watches[event->wd] = NULL;
+                continue;
+            }
+            if (!event->len) continue;
+            int len = snprintf(path, sizeof(path), "%s/%s", scan->watches[event->wd], event->name);
+            if (len < 0 || len >= (int)sizeof(path)) continue;
+            struct index_scan *batch = (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? removed : added;
+            if (index_add(batch, path, len) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * index_worker - Background thread keeping the file index current at idle CPU and I/O priority.
+ * A full scan builds the index; after that inotify events are batched and folded in, or, when
+ * watches run out, the whole root is rescanned every INDEX_RESCAN_SECONDS.
+ */
+static void *index_worker(void *arg) {
+    (void)arg;
+    pid_t tid = gettid();
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, 1, tid, INDEX_IOPRIO_IDLE);
+    char file[MAX_PATH], root[INDEX_PATH_MAX];
+    index_file(file, sizeof(file));
+    struct index_scan scan = {.inotify_fd = -1};
+    while (!__atomic_load_n(&index_stop_requested, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&index_live, 0, __ATOMIC_RELAXED);
+        index_free_scan(&scan);
+        if (index_root(root) != 0) break;
+        scan.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (index_build(&scan, root) != 0) break;
+        if (__atomic_load_n(&index_stop_requested, __ATOMIC_RELAXED)) break;
+        index_write(file, root, scan.paths, scan.count);
+        // Completion may answer from the index only while every change is being seen
+        __atomic_store_n(&index_pending, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&index_live, scan.inotify_fd >= 0, __ATOMIC_RELAXED);
+        for (;;) {
+            struct pollfd fds[2] = {{.fd = index_wake[0], .events = POLLIN}, {.fd = scan.inotify_fd, .events = POLLIN}};
+            int ready = poll(fds, scan.inotify_fd >= 0 ? 2 : 1, scan.inotify_fd >= 0 ? -1 : INDEX_RESCAN_SECONDS * 1000);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0 || __atomic_load_n(&index_stop_requested, __ATOMIC_RELAXED)) break;
+            if (!(fds[1].revents & POLLIN)) continue;
+            __atomic_store_n(&index_pending, 1, __ATOMIC_RELAXED);
+            // Let a burst (an unpacked archive, a build) settle into one rewrite
+            struct index_scan added = {.inotify_fd = -1}, removed = {.inotify_fd = -1};
+            int overflowed = index_collect(&scan, &added, &removed);
+            while (!overflowed && poll(&fds[1], 1, INDEX_SETTLE_MS) > 0) {
+                overflowed = index_collect(&scan, &added, &removed);
+            }
+            if (!overflowed) {
+                index_apply(&scan, &added, &removed);
+                index_write(file, root, scan.paths, scan.count);
+            }
+            index_free_scan(&added);
+            index_free_scan(&removed);
+            if (overflowed || scan.inotify_fd < 0) break;
+            __atomic_store_n(&index_pending, 0, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&index_live, 0, __ATOMIC_RELAXED);
+    index_free_scan(&scan);
+    return NULL;
+}
+
+/*
+ * index_start - Starts the index worker (set -o fileindex) with every signal blocked in it.
+ */
+int index_start(void) {
+    if (index_running) return 0;
+    if (index_wake[0] < 0 && pipe2(index_wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    __atomic_store_n(&index_stop_requested, 0, __ATOMIC_RELAXED);
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    int error = pthread_create(&index_thread, NULL, index_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (error) {
+        fprintf(stderr, "fileindex: %s\n", strerror(error));
+        return -1;
+    }
+    index_running = 1;
+    static int registered = 0;
+    if (!registered) atexit(index_stop);
+    registered = 1;
+    return 0;
+}
+
+/*
+ * index_stop - Stops the index worker and waits for it; a scan in progress is abandoned.
+ */
+void index_stop(void) {
+    if (!index_running) return;
+    __atomic_store_n(&index_stop_requested, 1, __ATOMIC_RELAXED);
+    ssize_t ignored = write(index_wake[1], "", 1);
+    (void)ignored;
+    pthread_join(index_thread, NULL);
+    char drain[16];
+    while (read(index_wake[0], drain, sizeof(drain)) > 0) continue;
+    index_running = 0;
+}
+
+/*
+ * index_map - Maps the index file, remapping when the worker or locate -u has replaced it.
+ * Returns 0 when file_index holds a valid index.
+ */
+int index_map(void) {
+    char file[MAX_PATH];
+    index_file(file, sizeof(file));
+    struct stat st;
+    if (stat(file, &st) != 0) st.st_ino = 0;
+    if (file_index.map && st.st_ino == file_index.ino && st.st_dev == file_index.dev &&
+        st.st_mtim.tv_sec == file_index.mtime.tv_sec && st.st_mtim.tv_nsec == file_index.mtime.tv_nsec) {
+        return 0;
+    }
+    if (file_index.map) munmap(file_index.map, file_index.size);
+    memset(&file_index, 0, sizeof(file_index));
+    shell_counters[SUB_FILEINDEX].entries = 0;
+    shell_counters[SUB_FILEINDEX].bytes = 0;
+    if (!st.st_ino || (size_t)st.st_size < sizeof(struct index_header)) return -1;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const struct index_header *header = map;
+    uint64_t restart_count = (header->count + INDEX_RESTART - 1) / INDEX_RESTART;
+    uint64_t entries = sizeof(struct index_header) + (uint64_t)header->root_len;
+    if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 || header->root_len >= INDEX_PATH_MAX ||
+        header->restarts < entries || header->restarts % 8 || restart_count > (uint64_t)st.st_size / 8 ||
+        header->restarts + restart_count * 8 > (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    file_index.map = map;
+    file_index.size = st.st_size;
+    file_index.dev = st.st_dev;
+    file_index.ino = st.st_ino;
+    file_index.mtime = st.st_mtim;
+    file_index.header = header;
+    file_index.restarts = (const uint64_t *)((const char *)map + header->restarts);
+    file_index.restart_count = restart_count;
+    shell_counters[SUB_FILEINDEX].entries = header->count;
+    shell_counters[SUB_FILEINDEX].bytes = st.st_size;
+    return 0;
+}
+
+/*
+ * index_restart - Points cur at the restart'th restart entry of the mapped index.
+ */
+static void index_restart(struct index_cursor *cur, uint64_t restart) {
+    const char *map = file_index.map;
+    cur->next = (const unsigned char *)map + (restart < file_index.restart_count ? file_index.restarts[restart]
+                                                                                 : file_index.header->restarts);
+    cur->end = (const unsigned char *)map + file_index.header->restarts;
+    cur->left = restart < file_index.restart_count ? file_index.header->count - restart * INDEX_RESTART : 0;
+    cur->len = cur->shared = 0;
+}
+
+/*
+ * index_next - Decodes the next path into cur->path; returns 0 at the end (or on a damaged entry).
+ */
+int index_next(struct index_cursor *cur) {
+    uint64_t shared, suffix;
+    if (!cur->left || index_get_varint(&cur->next, cur->end, &shared) != 0 ||
+        index_get_varint(&cur->next, cur->end, &suffix) != 0 || shared > cur->len ||
+        suffix > (uint64_t)(cur->end - cur->next) || shared + suffix >= INDEX_PATH_MAX) {
+        cur->left = 0;
+        return 0;
+    }
+    memcpy(cur->path + shared, cur->next, suffix);
+    cur->next += suffix;
+    cur->len = shared + suffix;
+    cur->path[cur->len] = '\0';
+    cur->shared = shared;
+    cur->left--;
+    return 1;
+}
+
+/*
+ * index_seek - Decodes up to the first path not below key; returns 0 when there is none.
+ * Restart entries are stored whole, so the binary search reads them in place.
+ */
+int index_seek(struct index_cursor *cur, const char *key) {
+    size_t key_len = strlen(key);
+    uint64_t lo = 0, hi = file_index.restart_count;
+    while (lo + 1 < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const unsigned char *p = (const unsigned char *)file_index.map + file_index.restarts[mid];
+        const unsigned char *end = (const unsigned char *)file_index.map + file_index.header->restarts;
+        uint64_t shared, len;
+        if (index_get_varint(&p, end, &shared) != 0 || index_get_varint(&p, end, &len) != 0 ||
+            len > (uint64_t)(end - p)) {
+            break;
+        }
+        int order = memcmp(p, key, len < key_len ? len : key_len);
+        if (order < 0 || (order == 0 && len < key_len)) lo = mid;
+        else hi = mid;
+    }
+    index_restart(cur, lo);
+    while (index_next(cur)) {
+        if (strcmp(cur->path, key) >= 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * builtin_locate - Lists indexed paths containing a substring, or matching a glob when the pattern
+ * has * ? or [. -u rebuilds the index now; the worker started by set -o fileindex keeps it current.
+ */
+int builtin_locate(char *args[], int background) {
+    int update = 0, count_only = 0, i = 1;
+    long limit = -1;
+    last_status = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "-u") == 0) update = 1;
+        else if (strcmp(args[i], "-c") == 0) count_only = 1;
+        else if (strcmp(args[i], "-n") == 0 && args[i + 1]) limit = atol(args[++i]);
+        else break;
+    }
+    const char *text = args[i];
+    if (!text && !update) {
+        printf("Usage: locate [-u] [-c] [-n count] pattern\n");
+        last_status = 2;
+        return 1;
+    }
+    if (update) {
+        char file[MAX_PATH], root[INDEX_PATH_MAX];
+        index_file(file, sizeof(file));
+        struct index_scan scan = {.inotify_fd = -1};
+        double started = now_seconds();
+        if (index_root(root) != 0 || index_build(&scan, root) != 0 || index_write(file, root, scan.paths, scan.count) != 0) {
+            perror("locate: updating the index failed");
+            last_status = 1;
+        } else if (!text) {
+            printf("Indexed %zu paths under %s in %.2fs\n", scan.count, root[0] ? root : "/", now_seconds() - started);
+        }
+        index_free_scan(&scan);
+        if (!text || last_status) return 1;
+    }
+    if (index_map() != 0) {
+        fprintf(stderr, "locate: no file index (run locate -u, or set -o fileindex)\n");
+        shell_counters[SUB_FILEINDEX].misses++;
+        last_status = 1;
+        return 1;
+    }
+    shell_counters[SUB_FILEINDEX].hits++;
+    const struct pattern *glob = strpbrk(text, "*?[") ? pattern_get(text, PATTERN_GLOB) : NULL;
+    size_t text_len = strlen(text);
+    struct index_cursor *cur = malloc(sizeof(struct index_cursor));
+    if (!cur) return 1;
+    index_restart(cur, 0);
+    long matches = 0;
+    size_t match_end = 0;       // end of the previous path's first match, 0 when it had none
+    while ((limit < 0 || matches < limit) && index_next(cur)) {
+        if (glob) {
+            if (!pattern_match(glob, cur->path, cur->len)) continue;
+        } else if (match_end && match_end <= cur->shared) {
+            // The match lies in the prefix this path shares with the previous one
+        } else {
+            // Any match must reach past the shared prefix, which the previous path did not contain
+            size_t from = cur->shared >= text_len ? cur->shared - text_len + 1 : 0;
+            const char *found = memmem(cur->path + from, cur->len - from, text, text_len);
+            match_end = found ? (size_t)(found - cur->path) + text_len : 0;
+            if (!found) continue;
+        }
+        matches++;
+        if (count_only) continue;
+        if (output_mode == OUTPUT_TEXT) {
+            cur->path[cur->len] = '\n';
+            fwrite(cur->path, 1, cur->len + 1, stdout);
+            cur->path[cur->len] = '\0';
+        } else {
+            record_open();
+            record_text("path", cur->path);
+            record_close();
+        }
+    }
+    free(cur);
+    if (count_only) printf("%ld\n", matches);
+    last_status = matches ? 0 : 1;
+    return 1;
+}
+
+/*
+ * pack_put - Appends len bytes to a frame buffer. Returns 0, or -1 when out of memory.
+ */
+static int pack_put(struct pack_bytes *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        unsigned char *grown = realloc(b->data, cap);
+        if (!grown) return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/*
+ * pack_put_le - Appends value as a little-endian integer of size bytes.
+ */
+static int pack_put_le(struct pack_bytes *b, uint64_t value, int size) {
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++) bytes[i] = value >> (8 * i);
+    return pack_put(b, bytes, size);
+}
+
+/*
+ * pack_put_varint - Appends value as a varint.
+ */
+static int pack_put_varint(struct pack_bytes *b, uint64_t value) {
+    unsigned char bytes[10];
+    return pack_put(b, bytes, index_put_varint(bytes, value));
+}
+
+/*
+ * pack_get_le - Reads a little-endian integer of size bytes.
+ */
+static uint64_t pack_get_le(const unsigned char *p, int size) {
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) value = value << 8 | p[i];
+    return value;
+}
+
+/*
+ * pack_octal - Fills a tar numeric field: octal digits and a NUL, or GNU base-256 when too large.
+ */
+static void pack_octal(char *field, int width, uint64_t value) {
+    if (value < 1ULL << (3 * (width - 1))) {
+        snprintf(field, width, "%0*llo", width - 1, (unsigned long long)value);
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (int i = width - 1; i > 0 && value; i--, value >>= 8) field[i] = value & 0xff;
+}
+
+/*
+ * pack_pax_record - Appends "len key=value\n" to out (when not NULL); returns the record length.
+ */
+static size_t pack_pax_record(char *out, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;      // ' ', '=' and '\n'
+    size_t len = body + 1;
+    while (len < body + snprintf(NULL, 0, "%zu", len)) len++;
+    if (out) snprintf(out, len + 1, "%zu %s=%s\n", len, key, value);
+    return len;
+}
+
+/*
+ * pack_header - Writes member's tar header into out (when not NULL): one ustar block, preceded by
+ * a pax header and its records when the name or link does not fit. Returns its length in bytes.
+ */
+static size_t pack_header(const struct pack_member *m, char *out) {
+    // ustar splits names longer than 100 bytes at a '/' into a 155-byte prefix and the name
+    char name[INDEX_PATH_MAX + 2];
+    size_t len = snprintf(name, sizeof(name), "%s%s", m->path, m->type == '5' ? "/" : "");
+    size_t split = 0;
+    int fits = len <= 100;
+    for (size_t i = 1; !fits && i < len && i <= 155; i++) {
+        if (name[i] == '/' && len - i - 1 <= 100 && len - i - 1 > 0) {
+            split = i;
+            fits = 1;
+        }
+    }
+    int long_link = m->link && strlen(m->link) > 100;
+    size_t pax = 0;
+    if (!fits) pax += pack_pax_record(NULL, "path", name);
+    if (long_link) pax += pack_pax_record(NULL, "linkpath", m->link);
+    size_t pax_blocks = pax ? 512 + (pax + 511) / 512 * 512 : 0;
+    if (!out) return pax_blocks + 512;
+    memset(out, 0, pax_blocks + 512);
+    char *header = out;
+    for (int pass = pax ? 0 : 1; pass < 2; pass++) {
+        if (pass == 0) {
+            strcpy(header, "PaxHeader");
+            pack_octal(header + 100, 8, 0644);
+            pack_octal(header + 124, 12, pax);
+            header[156] = 'x';
+            char *records = header + 512;
+            if (!fits) records += pack_pax_record(records, "path", name);
+            if (long_link) pack_pax_record(records, "linkpath", m->link);
+        } else if (split) {
+            memcpy(header, name + split + 1, len - split - 1);
+            memcpy(header + 345, name, split);
+        } else {
+            memcpy(header, name, len < 100 ? len : 100);
+        }
+        if (pass == 1) {
+            pack_octal(header + 100, 8, m->mode & 07777);
+            pack_octal(header + 124, 12, m->type == '0' ? m->size : 0);
+            header[156] = m->type;
+            if (m->link) memcpy(header + 157, m->link, long_link ? 100 : strlen(m->link));
+        }
+        pack_octal(header + 108, 8, m->uid);
+        pack_octal(header + 116, 8, m->gid);
+        pack_octal(header + 136, 12, m->mtime < 0 ? 0 : m->mtime);
+        memcpy(header + 257, "ustar\0" "00", 8);
+        memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (int i = 0; i < 512; i++) sum += (unsigned char)header[i];
+        snprintf(header + 148, 8, "%06o", sum);
+        header += pax_blocks;
+    }
+    return pax_blocks + 512;
+}
+
+/*
+ * pack_first_member - Index of the first member whose contents end at or after offset.
+ */
+static size_t pack_first_member(const struct pack_state *st, uint64_t offset) {
+    size_t lo = 0, hi = st->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct pack_member *m = &st->members[mid];
+        if (m->data_offset + (m->type == '0' ? m->size : 0) < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * pack_safe_path - Whether an archive path stays below the directory it is extracted into.
+ */
+static int pack_safe_path(const char *path) {
+    if (!path[0] || path[0] == '/') return 0;
+    for (const char *p = path; p; p = strchr(p, '/'), p = p ? p + 1 : NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2])) return 0;
+    }
+    return 1;
+}
+
+/*
+ * pack_add_member - Appends a member for the entry name in dir_fd, whose path under the packed
+ * folder is rel. Returns 1 if it is a directory to descend into, 0 otherwise.
+ */
+static int pack_add_member(struct pack_state *st, struct pack_member **list, size_t *count, size_t *cap,
+                           int dir_fd, const char *name, const char *rel, const struct stat *sb) {
+    char type = S_ISREG(sb->st_mode) ? '0' : S_ISDIR(sb->st_mode) ? '5' : S_ISLNK(sb->st_mode) ? '2' : 0;
+    const char *prefix = st->prefix;
+    if (!type) {
+        fprintf(stderr, "pack: %s%s%s: skipped (not a file, folder or symlink)\n", prefix, prefix[0] ? "/" : "", rel);
+        return 0;
+    }
+    if (*count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 64;
+        struct pack_member *grown = realloc(*list, grown_cap * sizeof(struct pack_member));
+        if (!grown) {
+            fprintf(stderr, "pack: %s: %s\n", rel, strerror(ENOMEM));
+            st->failed = 1;
+            return 0;
+        }
+        *list = grown;
+        *cap = grown_cap;
+    }
+    struct pack_member *m = &(*list)[*count];
+    memset(m, 0, sizeof(*m));
+    m->type = type;
+    m->mode = sb->st_mode;
+    m->uid = sb->st_uid;
+    m->gid = sb->st_gid;
+    m->mtime = sb->st_mtim.tv_sec;
+    m->mtime_nsec = sb->st_mtim.tv_nsec;
+    m->size = type == '0' ? (uint64_t)sb->st_size : 0;
+    if (asprintf(&m->path, "%s%s%s", prefix, prefix[0] && rel[0] ? "/" : "", rel) < 0) return 0;
+    if (type == '2') {
+        char target[INDEX_PATH_MAX];
+        ssize_t n = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+        if (n < 0 || !(m->link = strndup(target, n))) {
+            fprintf(stderr, "pack: %s: %s\n", m->path, strerror(n < 0 ? errno : ENOMEM));
+            free(m->path);
+            st->failed = 1;
+            return 0;
+        }
+    }
+    (*count)++;
+    return type == '5';
+}
+
+/*
+ * pack_walk_worker - Reads directories off the shared queue, adding their entries as members and
+ * their subdirectories to the queue, until the queue is empty and no other worker can refill it.
+ */
+static void *pack_walk_worker(void *arg) {
+    struct pack_state *st = arg;
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (!st->dir_count && st->walking) pthread_cond_wait(&st->changed, &st->lock);
+        if (!st->dir_count) break;
+        char *rel = st->dirs[--st->dir_count];
+        st->walking++;
+        pthread_mutex_unlock(&st->lock);
+
+        struct pack_member *found = NULL;
+        size_t found_count = 0, found_cap = 0;
+        char **subdirs = NULL;
+        size_t subdir_count = 0;
+        int fd = openat(st->root_fd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!dir) {
+            fprintf(stderr, "pack: %s: %s\n", rel[0] ? rel : ".", strerror(errno));
+            if (fd >= 0) close(fd);
+            st->failed = 1;
+        }
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            char *child;
+            struct stat sb;
+            if (asprintf(&child, "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name) < 0) break;
+            if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+                fprintf(stderr, "pack: %s: %s\n", child, strerror(errno));
+                st->failed = 1;
+            } else if (pack_add_member(st, &found, &found_count, &found_cap, dirfd(dir), entry->d_name, child, &sb)) {
+                char **grown = realloc(subdirs, (subdir_count + 1) * sizeof(char *));
+                if (grown) {
+                    subdirs = grown;
+                    subdirs[subdir_count++] = child;
+                    continue;
+                }
+            }
+            free(child);
+        }
+        if (dir) closedir(dir);
+        free(rel);
+
+        pthread_mutex_lock(&st->lock);
+        int ok = 1;
+        if (st->count + found_count > st->cap) {
+            size_t cap = st->cap * 2 > st->count + found_count ? st->cap * 2 : st->count + found_count;
+            struct pack_member *grown = realloc(st->members, cap * sizeof(struct pack_member));
+            if ((ok = grown != NULL)) {
+                st->members = grown;
+                st->cap = cap;
+            }
+        }
+        if (ok && st->dir_count + subdir_count > st->dir_cap) {
+            size_t cap = st->dir_cap * 2 > st->dir_count + subdir_count ? st->dir_cap * 2 : st->dir_count + subdir_count;
+            char **grown = realloc(st->dirs, cap * sizeof(char *));
+            if ((ok = grown != NULL)) {
+                st->dirs = grown;
+                st->dir_cap = cap;
+            }
+        }
+        if (ok) {
+            memcpy(st->members + st->count, found, found_count * sizeof(struct pack_member));
+            st->count += found_count;
+            memcpy(st->dirs + st->dir_count, subdirs, subdir_count * sizeof(char *));
+            st->dir_count += subdir_count;
+        } else {
+            fprintf(stderr, "pack: out of memory\n");
+            st->stop = st->failed = 1;
+            st->dir_count = 0;
+        }
+        free(found);
+        free(subdirs);
+        st->walking--;
+        pthread_cond_broadcast(&st->changed);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/*
+ * pack_fill_chunk - Builds chunk k of the tar stream in buf: the headers and file contents that
+ * fall in it, zeros elsewhere. Contents are read with pread, so any worker can build any chunk.
+ */
+static void pack_fill_chunk(struct pack_state *st, uint64_t k, char *buf, size_t len) {
+    uint64_t start = k * PACK_CHUNK, end = start + len;
+    memset(buf, 0, len);
+    for (size_t i = pack_first_member(st, start); i < st->count && st->members[i].header_offset < end; i++) {
+        const struct pack_member *m = &st->members[i];
+        if (m->data_offset > start) {
+            char *header = malloc(m->data_offset - m->header_offset);
+            if (!header) {
+                st->stop = 1;
+                return;
+            }
+            pack_header(m, header);
+            uint64_t from = m->header_offset > start ? m->header_offset : start;
+            uint64_t to = m->data_offset < end ? m->data_offset : end;
+            memcpy(buf + (from - start), header + (from - m->header_offset), to - from);
+            free(header);
+        }
+        uint64_t from = m->data_offset > start ? m->data_offset : start;
+        uint64_t to = m->data_offset + m->size < end ? m->data_offset + m->size : end;
+        if (m->type != '0' || from >= to) continue;
+        int fd = openat(st->root_fd, m->path + st->prefix_skip, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        uint64_t done = 0;
+        ssize_t n = 1;
+        while (fd >= 0 && done < to - from && (n = pread(fd, buf + (from - start) + done, to - from - done,
+                                                          from - m->data_offset + done)) != 0) {
+            if (n > 0) done += n;
+            else if (errno != EINTR) break;
+        }
+        if (fd < 0 || n < 0) {
+            fprintf(stderr, "pack: %s: %s\n", m->path, strerror(errno));
+            st->failed = 1;
+        } else if (done < to - from) {
+            // The size in its header is already fixed, so the rest stays zero
+            fprintf(stderr, "pack: %s: file shrank while being packed\n", m->path);
+            st->failed = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+/*
+ * pack_compress_worker - Builds and compresses chunks in turn, staying within window chunks of
+ * the one being written out so memory stays bounded.
+ */
+static void *pack_compress_worker(void *arg) {
+    struct pack_state *st = arg;
+    char *buf = malloc(PACK_CHUNK);
+    void *ctx = zstd_api.create_cctx();
+    if (ctx) zstd_api.set_parameter(ctx, ZSTD_C_COMPRESSION_LEVEL, st->level);
+    pthread_mutex_lock(&st->lock);
+    if (!buf || !ctx) st->stop = 1;
+    for (;;) {
+        while (!st->stop && st->next_chunk < st->chunks && st->next_chunk >= st->written + st->window) {
+            pthread_cond_wait(&st->changed, &st->lock);
+        }
+        if (st->stop || st->next_chunk >= st->chunks) break;
+        uint64_t k = st->next_chunk++;
+        pthread_mutex_unlock(&st->lock);
+
+        size_t len = st->tar_size - k * PACK_CHUNK < PACK_CHUNK ? st->tar_size - k * PACK_CHUNK : PACK_CHUNK;
+        pack_fill_chunk(st, k, buf, len);
+        size_t cap = len + len / 128 + 4096, size = 0;
+        char *out = malloc(cap);
+        struct zstd_buffer input = {buf, len, 0};
+        size_t left = 1;
+        while (out && left) {
+            struct zstd_buffer output = {out + size, cap - size, 0};
+            left = zstd_api.compress_stream2(ctx, &output, &input, ZSTD_E_END);
+            size += output.pos;
+            if (zstd_api.is_error(left)) {
+                fprintf(stderr, "pack: %s\n", zstd_api.error_name(left));
+                break;
+            }
+            char *grown = left ? realloc(out, cap *= 2) : out;
+            if (!grown) free(out);
+            out = grown;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        if (!out || left) {
+            free(out);
+            st->stop = 1;
+            break;
+        }
+        struct pack_slot *slot = &st->slots[k % st->window];
+        slot->chunk = k;
+        slot->data = out;
+        slot->size = size;
+        slot->ready = 1;
+        pthread_cond_broadcast(&st->changed);
+    }
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    if (ctx) zstd_api.free_cctx(ctx);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * pack_member_compare - Orders members by path, which puts every folder before its contents.
+ */
+static int pack_member_compare(const void *a, const void *b) {
+    return strcmp(((const struct pack_member *)a)->path, ((const struct pack_member *)b)->path);
+}
+
+/*
+ * pack_start_workers - Starts count threads running worker, with every signal blocked so they
+ * stay with the shell; their handles go in st->threads. Returns how many started.
+ */
+static int pack_start_workers(int count, void *(*worker)(void *), struct pack_state *st) {
+    if (!st->threads && !(st->threads = malloc(count * sizeof(pthread_t)))) {
+        perror("malloc failed");
+        return 0;
+    }
+    pthread_t *threads = st->threads;
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    int started = 0;
+    while (started < count && pthread_create(&threads[started], NULL, worker, st) == 0) started++;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (!started) fprintf(stderr, "pack: could not start worker threads\n");
+    return started;
+}
+
+/*
+ * pack_free_state - Releases the members, queues and synchronization of a pack or unpack.
+ */
+static void pack_free_state(struct pack_state *st) {
+    for (size_t i = 0; i < st->count; i++) {
+        free(st->members[i].path);
+        free(st->members[i].link);
+    }
+    free(st->members);
+    for (size_t i = 0; i < st->dir_count; i++) free(st->dirs[i]);
+    free(st->dirs);
+    for (size_t i = 0; st->slots && i < st->window; i++) free(st->slots[i].data);
+    free(st->slots);
+    free(st->threads);
+    if (st->root_fd >= 0) close(st->root_fd);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->changed);
+}
+
+/*
+ * pack_jobs - Parses a -j argument, defaulting to one thread per online CPU and capped at
+ * four per CPU (at most PACK_MAX_JOBS): each thread holds a chunk or two of memory.
+ */
+static int pack_jobs(const char *text) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0) cpus = 1;
+    long limit = 4 * cpus < PACK_MAX_JOBS ? 4 * cpus : PACK_MAX_JOBS;
+    long jobs = text ? atol(text) : 0;
+    if (jobs <= 0) jobs = cpus;
+    return jobs < limit ? jobs : limit;
+}
+
+/*
+ * builtin_pack - Writes an archive of a folder to stdout. Worker threads read the tree with
+ * openat/fstatat from a shared queue of folders, then build and compress chunks concurrently while
+ * this thread writes them out in order. -l sets the zstd level (COMPRESS_LEVEL, else 3).
+ */
+int builtin_pack(char *args[], int background) {
+    const char *jobs_arg = NULL, *level_arg = get_var("COMPRESS_LEVEL");
+    int i = 1;
+    last_status = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1]) jobs_arg = args[++i];
+        else if (strcmp(args[i], "-l") == 0 && args[i + 1]) level_arg = args[++i];
+        else break;
+    }
+    if (!args[i] || args[i + 1]) {
+        printf("Usage: pack [-j jobs] [-l level] dir > dir.tzst\n");
+        last_status = 2;
+        return 1;
+    }
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "pack: refusing to write an archive to a terminal\n");
+        last_status = 1;
+        return 1;
+    }
+    if (codec_load(CODEC_ZSTD) != 0) {
+        last_status = 1;
+        return 1;
+    }
+    struct pack_state st = {.root_fd = -1, .prefix = "", .level = level_arg ? atoi(level_arg) : 3};
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+    int jobs = pack_jobs(jobs_arg);
+
+    // Members are named like "tar -C parent dir": under the folder's own name, except for . .. and /
+    char *dir = args[i];
+    size_t dir_len = strlen(dir);
+    while (dir_len > 1 && dir[dir_len - 1] == '/') dir[--dir_len] = '\0';
+    const char *base = strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir;
+    struct stat sb;
+    st.root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (st.root_fd < 0 || fstat(st.root_fd, &sb) != 0) {
+        fprintf(stderr, "pack: %s: %s\n", dir, strerror(errno));
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    st.cap = 1024;
+    st.members = malloc(st.cap * sizeof(struct pack_member));
+    st.dirs = malloc(sizeof(char *));
+    st.dir_cap = 1;
+    if (!st.members || !st.dirs || !(st.dirs[0] = strdup(""))) {
+        perror("malloc failed");
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    st.dir_count = 1;
+    if (base[0] && strcmp(base, ".") != 0 && strcmp(base, "..") != 0) {
+        size_t count = 0, cap = 1;
+        pack_add_member(&st, &st.members, &count, &cap, st.root_fd, ".", base, &sb);
+        st.count = count;
+        st.prefix = base;
+        st.prefix_skip = strlen(base) + 1;
+    }
+
+    double started = now_seconds();
+    int walkers = pack_start_workers(jobs, pack_walk_worker, &st);
+    for (int t = 0; t < walkers; t++) pthread_join(st.threads[t], NULL);
+    if (!walkers || st.stop) {
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    qsort(st.members, st.count, sizeof(struct pack_member), pack_member_compare);
+
+    // Lay out the tar stream: every offset is known before any chunk is built
+    struct pack_bytes table = {0};
+    uint64_t offset = 0;
+    int ok = pack_put_le(&table, PACK_TABLE_FRAME, 4) == 0 && pack_put_le(&table, 0, 4) == 0 &&
+             pack_put(&table, PACK_MAGIC, 8) == 0 && pack_put_varint(&table, st.count) == 0;
+    for (size_t m = 0; ok && m < st.count; m++) {
+        struct pack_member *member = &st.members[m];
+        member->header_offset = offset;
+        member->data_offset = offset + pack_header(member, NULL);
+        offset = member->data_offset + (member->size + 511) / 512 * 512;
+        size_t link_len = member->link ? strlen(member->link) : 0;
+        ok = pack_put(&table, &member->type, 1) == 0 && pack_put_varint(&table, member->mode) == 0 &&
+             pack_put_varint(&table, member->uid) == 0 && pack_put_varint(&table, member->gid) == 0 &&
+             pack_put_varint(&table, member->mtime) == 0 && pack_put_varint(&table, member->mtime_nsec) == 0 &&
+             pack_put_varint(&table, member->size) == 0 && pack_put_varint(&table, member->header_offset) == 0 &&
+             pack_put_varint(&table, member->data_offset) == 0 && pack_put_varint(&table, strlen(member->path)) == 0 &&
+             pack_put(&table, member->path, strlen(member->path)) == 0 && pack_put_varint(&table, link_len) == 0 &&
+             pack_put(&table, member->link ? member->link : "", link_len) == 0;
+    }
+    // Two zero blocks end a tar archive
+    st.tar_size = offset + 1024;
+    st.chunks = (st.tar_size + PACK_CHUNK - 1) / PACK_CHUNK;
+    ok = ok && pack_put_varint(&table, st.tar_size) == 0 && pack_put_varint(&table, PACK_CHUNK) == 0;
+    if (ok) {
+        unsigned char *size = table.data + 4;
+        for (int b = 0; b < 4; b++) size[b] = (table.len - 8) >> (8 * b);
+    }
+    st.window = 2 * jobs;
+    st.slots = calloc(st.window, sizeof(struct pack_slot));
+    struct pack_bytes index = {0};
+    ok = ok && st.slots && pack_put_le(&index, PACK_INDEX_FRAME, 4) == 0 &&
+         pack_put_le(&index, st.chunks * PACK_INDEX_ENTRY + 16, 4) == 0;
+    if (!ok || write_all(STDOUT_FILENO, table.data, table.len) != 0) {
+        perror(ok ? "pack: write failed" : "pack: out of memory");
+        free(table.data);
+        free(index.data);
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    offset = table.len;
+    free(table.data);
+
+    // Chunks are written in order as the workers finish them
+    int compressors = pack_start_workers(jobs, pack_compress_worker, &st);
+    uint64_t packed = 0;
+    pthread_mutex_lock(&st.lock);
+    while (compressors && st.written < st.chunks) {
+        struct pack_slot *slot = &st.slots[st.written % st.window];
+        while (!st.stop && !slot->ready) pthread_cond_wait(&st.changed, &st.lock);
+        if (st.stop) break;
+        pthread_mutex_unlock(&st.lock);
+        unsigned char marker[12];
+        struct pack_bytes frame = {marker, 0, sizeof(marker)};
+        pack_put_le(&frame, PACK_CHUNK_FRAME, 4);
+        pack_put_le(&frame, 4, 4);
+        pack_put_le(&frame, slot->size, 4);
+        int written = write_all(STDOUT_FILENO, marker, sizeof(marker)) == 0 &&
+                      write_all(STDOUT_FILENO, slot->data, slot->size) == 0;
+        ok = written && pack_put_le(&index, offset + sizeof(marker), 8) == 0 && pack_put_le(&index, slot->size, 4) == 0;
+        offset += sizeof(marker) + slot->size;
+        packed += slot->size;
+        pthread_mutex_lock(&st.lock);
+        free(slot->data);
+        slot->data = NULL;
+        slot->ready = 0;
+        st.written++;
+        if (!ok) {
+            perror(written ? "pack: out of memory" : "pack: write failed");
+            st.stop = 1;
+        }
+        pthread_cond_broadcast(&st.changed);
+    }
+    if (!compressors) st.stop = 1;
+    pthread_mutex_unlock(&st.lock);
+    for (int t = 0; t < compressors; t++) pthread_join(st.threads[t], NULL);
+
+    // The index lets a reader that can seek go straight to the chunks it needs
+    if (!st.stop) {
+        ok = pack_put_le(&index, st.chunks, 8) == 0 && pack_put(&index, PACK_INDEX_MAGIC, 8) == 0;
+        if (!ok || write_all(STDOUT_FILENO, index.data, index.len) != 0) {
+            perror("pack: write failed");
+            st.stop = 1;
+        } else {
+            fprintf(stderr, "pack: %zu members, %llu bytes in %llu chunks, %llu compressed, %d threads, %.2fs\n",
+                    st.count, (unsigned long long)st.tar_size, (unsigned long long)st.chunks,
+                    (unsigned long long)packed, jobs, now_seconds() - started);
+        }
+    }
+    free(index.data);
+    last_status = st.stop || st.failed;
+    pack_free_state(&st);
+    return 1;
+}
+
+/*
+ * pack_read_exact - Reads len bytes from fd. Returns 0, or -1 at end of input or on error.
+ */
+static int pack_read_exact(int fd, void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * pack_read_table - Reads the member table that opens an archive. Returns 0, or -1 after reporting.
+ */
+static int pack_read_table(int fd, struct pack_state *st) {
+    unsigned char frame[8];
+    if (pack_read_exact(fd, frame, sizeof(frame)) != 0 || pack_get_le(frame, 4) != PACK_TABLE_FRAME) {
+        fprintf(stderr, "unpack: input is not a pack archive\n");
+        return -1;
+    }
+    size_t len = pack_get_le(frame + 4, 4);
+    unsigned char *table = malloc(len);
+    if (!table || pack_read_exact(fd, table, len) != 0 || len < 8 || memcmp(table, PACK_MAGIC, 8) != 0) {
+        fprintf(stderr, "unpack: %s\n", table ? "truncated or unknown archive" : strerror(ENOMEM));
+        free(table);
+        return -1;
+    }
+    const unsigned char *p = table + 8, *end = table + len;
+    uint64_t count, chunk_size;
+    int ok = index_get_varint(&p, end, &count) == 0 && count <= len;
+    if (ok && !(st->members = calloc(count ? count : 1, sizeof(struct pack_member)))) ok = 0;
+    for (uint64_t m = 0; ok && m < count; m++) {
+        struct pack_member *member = &st->members[m];
+        uint64_t fields[8], path_len, link_len;
+        if (p >= end) ok = 0;
+        member->type = ok ? *p++ : 0;
+        for (int f = 0; ok && f < 8; f++) ok = index_get_varint(&p, end, &fields[f]) == 0;
+        ok = ok && index_get_varint(&p, end, &path_len) == 0 && path_len <= (uint64_t)(end - p) &&
+             (member->path = strndup((const char *)p, path_len)) != NULL;
+        if (ok) p += path_len;
+        ok = ok && index_get_varint(&p, end, &link_len) == 0 && link_len <= (uint64_t)(end - p);
+        if (ok && member->type == '2') ok = (member->link = strndup((const char *)p, link_len)) != NULL;
+        if (!ok) break;
+        p += link_len;
+        st->count++;
+        member->mode = fields[0];
+        member->uid = fields[1];
+        member->gid = fields[2];
+        member->mtime = fields[3];
+        member->mtime_nsec = fields[4];
+        member->size = fields[5];
+        member->header_offset = fields[6];
+        member->data_offset = fields[7];
+        // Offsets must only grow, or chunks could not be matched to members
+        ok = fields[7] >= fields[6] && (m == 0 || fields[6] >= st->members[m - 1].data_offset);
+    }
+    ok = ok && index_get_varint(&p, end, &st->tar_size) == 0 && index_get_varint(&p, end, &chunk_size) == 0 &&
+         chunk_size == PACK_CHUNK;
+    free(table);
+    if (!ok) {
+        fprintf(stderr, "unpack: damaged member table\n");
+        return -1;
+    }
+    st->chunks = (st->tar_size + PACK_CHUNK - 1) / PACK_CHUNK;
+    return 0;
+}
+
+/*
+ * unpack_chunk - Writes the parts of selected files that fall in chunk k. The chunk holding a
+ * file's first byte creates and sizes it; any chunk may write into it, so files fill in parallel.
+ */
+static void unpack_chunk(struct pack_state *st, uint64_t k, const char *buf, size_t len) {
+    uint64_t start = k * PACK_CHUNK, end = start + len;
+    for (size_t i = pack_first_member(st, start); i < st->count && st->members[i].header_offset < end; i++) {
+        const struct pack_member *m = &st->members[i];
+        if (!m->selected || m->type != '0') continue;
+        int owner = m->data_offset / PACK_CHUNK == k;
+        uint64_t from = m->data_offset > start ? m->data_offset : start;
+        uint64_t to = m->data_offset + m->size < end ? m->data_offset + m->size : end;
+        if (!owner && from >= to) continue;
+        int fd = openat(st->root_fd, m->path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+        int ok = fd >= 0 && (!owner || ftruncate(fd, m->size) == 0);
+        uint64_t done = 0;
+        while (ok && from + done < to) {
+            ssize_t n = pwrite(fd, buf + (from - start) + done, to - from - done, from - m->data_offset + done);
+            if (n > 0) done += n;
+            else ok = n < 0 && errno == EINTR;
+        }
+        if (!ok) {
+            fprintf(stderr, "unpack: %s: %s\n", m->path, strerror(errno));
+            st->failed = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+/*
+ * unpack_worker - Takes compressed chunks off the queue, decompresses them and writes them out.
+ */
+static void *unpack_worker(void *arg) {
+    struct pack_state *st = arg;
+    char *out = malloc(PACK_CHUNK);
+    void *ctx = zstd_api.create_dctx();
+    pthread_mutex_lock(&st->lock);
+    if (!out || !ctx) st->stop = 1;
+    for (;;) {
+        while (!st->queued && !st->closed && !st->stop) pthread_cond_wait(&st->changed, &st->lock);
+        if (!st->queued || st->stop) break;
+        struct pack_slot job = st->slots[st->head];
+        st->slots[st->head].data = NULL;
+        st->head = (st->head + 1) % st->window;
+        st->queued--;
+        pthread_cond_broadcast(&st->changed);
+        pthread_mutex_unlock(&st->lock);
+
+        size_t len = st->tar_size - job.chunk * PACK_CHUNK < PACK_CHUNK ? st->tar_size - job.chunk * PACK_CHUNK : PACK_CHUNK;
+        struct zstd_buffer input = {job.data, job.size, 0}, output = {out, len, 0};
+        size_t left;
+        for (;;) {
+            size_t in_before = input.pos, out_before = output.pos;
+            left = zstd_api.decompress_stream(ctx, &output, &input);
+            if (zstd_api.is_error(left) || !left) break;
+            if (input.pos == in_before && output.pos == out_before) break;
+        }
+        if (zstd_api.is_error(left) || left || output.pos != len) {
+            fprintf(stderr, "unpack: chunk %llu: %s\n", (unsigned long long)job.chunk,
+                    zstd_api.is_error(left) ? zstd_api.error_name(left) : "wrong size");
+            st->failed = 1;
+            // A context left mid-frame would misread the next chunk
+            zstd_api.free_dctx(ctx);
+            ctx = zstd_api.create_dctx();
+        } else {
+            unpack_chunk(st, job.chunk, out, len);
+        }
+        free(job.data);
+        pthread_mutex_lock(&st->lock);
+        if (!ctx) st->stop = 1;
+    }
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    if (ctx) zstd_api.free_dctx(ctx);
+    free(out);
+    return NULL;
+}
+
+/*
+ * unpack_index - Reads the chunk index from the end of a seekable archive into entries.
+ * Returns 0, or -1 when the input cannot seek or has no usable index.
+ */
+static int unpack_index(int fd, const struct pack_state *st, unsigned char **entries) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    unsigned char footer[16];
+    size_t size = st->chunks * PACK_INDEX_ENTRY;
+    *entries = NULL;
+    if (end < (off_t)(size + sizeof(footer)) || pread(fd, footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer) ||
+        memcmp(footer + 8, PACK_INDEX_MAGIC, 8) != 0 || pack_get_le(footer, 8) != st->chunks) {
+        return -1;
+    }
+    if (!(*entries = malloc(size ? size : 1)) ||
+        pread(fd, *entries, size, end - sizeof(footer) - size) != (ssize_t)size) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * unpack_parents - Creates the folders leading to path that do not exist yet.
+ */
+static void unpack_parents(int root_fd, const char *path) {
+    char parent[INDEX_PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    for (char *slash = strchr(parent, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdirat(root_fd, parent, 0755);
+        *slash = '/';
+    }
+}
+
+/*
+ * builtin_unpack - Extracts an archive written by pack from stdin, or lists it with -t. The
+ * folders are made first; worker threads then decompress chunks and fill files with openat and
+ * pwrite as the chunks arrive. With paths, only those members (and what is below them) are
+ * extracted, and a seekable input is read through the index, skipping the other chunks.
+ */
+int builtin_unpack(char *args[], int background) {
+    const char *jobs_arg = NULL, *dest = ".";
+    int list = 0, i = 1;
+    last_status = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "-t") == 0) list = 1;
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1]) jobs_arg = args[++i];
+        else if (strcmp(args[i], "-C") == 0 && args[i + 1]) dest = args[++i];
+        else break;
+    }
+    if (isatty(STDIN_FILENO) || (args[i] && args[i][0] == '-')) {
+        printf("Usage: unpack [-t] [-j jobs] [-C dir] [path]... < dir.tzst\n");
+        last_status = 2;
+        return 1;
+    }
+    if (!list && codec_load(CODEC_ZSTD) != 0) {
+        last_status = 1;
+        return 1;
+    }
+    struct pack_state st = {.root_fd = -1};
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+    if (pack_read_table(STDIN_FILENO, &st) != 0) {
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    char **paths = args + i;
+    for (size_t m = 0; m < st.count; m++) {
+        struct pack_member *member = &st.members[m];
+        member->selected = !paths[0];
+        for (char **p = paths; *p && !member->selected; p++) {
+            size_t len = strlen(*p);
+            while (len > 1 && (*p)[len - 1] == '/') len--;
+            member->selected = strncmp(member->path, *p, len) == 0 && (!member->path[len] || member->path[len] == '/');
+        }
+    }
+
+    if (list) {
+        static const char *const types[] = {['0'] = "file", ['5'] = "directory", ['2'] = "symlink"};
+        for (size_t m = 0; m < st.count; m++) {
+            const struct pack_member *member = &st.members[m];
+            if (!member->selected) continue;
+            if (output_mode == OUTPUT_TEXT) {
+                printf("%s%s%s%s\n", member->path, member->type == '5' ? "/" : "", member->link ? " -> " : "",
+                       member->link ? member->link : "");
+                continue;
+            }
+            record_open();
+            record_text("path", member->path);
+            record_text("type", types[member->type == '5' || member->type == '2' ? member->type : '0']);
+            record_number("size", member->size);
+            record_number("mode", member->mode & 07777);
+            record_number("mtime", member->mtime);
+            if (member->link) record_text("link", member->link);
+            record_close();
+        }
+        pack_free_state(&st);
+        return 1;
+    }
+
+    st.root_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    unsigned char *needed = calloc(st.chunks ? st.chunks : 1, 1);
+    if (st.root_fd < 0 || !needed) {
+        fprintf(stderr, "unpack: %s: %s\n", dest, strerror(errno));
+        free(needed);
+        pack_free_state(&st);
+        last_status = 1;
+        return 1;
+    }
+    double started = now_seconds();
+    // Folders are made before any worker runs, private until their modes are set at the end
+    char *made = NULL;
+    for (size_t m = 0; m < st.count; m++) {
+        struct pack_member *member = &st.members[m];
+        if (!member->selected) continue;
+        if (!pack_safe_path(member->path)) {
+            fprintf(stderr, "unpack: %s: unsafe path, skipped\n", member->path);
+            member->selected = 0;
+            st.failed = 1;
+            continue;
+        }
+        const char *slash = strrchr(member->path, '/');
+        size_t parent_len = slash ? (size_t)(slash - member->path) : 0;
+        if (parent_len && !(made && strlen(made) == parent_len && strncmp(made, member->path, parent_len) == 0)) {
+            unpack_parents(st.root_fd, member->path);
+            free(made);
+            made = strndup(member->path, parent_len);
+        }
+        if (member->type == '5' && mkdirat(st.root_fd, member->path, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "unpack: %s: %s\n", member->path, strerror(errno));
+            st.failed = 1;
+        }
+        if (member->type == '0') {
+            uint64_t last = member->size ? member->data_offset + member->size - 1 : member->data_offset;
+            for (uint64_t k = member->data_offset / PACK_CHUNK; k <= last / PACK_CHUNK && k < st.chunks; k++) needed[k] = 1;
+        }
+    }
+    free(made);
+
+    int jobs = pack_jobs(jobs_arg);
+    st.window = 2 * jobs;
+    st.slots = calloc(st.window, sizeof(struct pack_slot));
+    int workers = st.slots ? pack_start_workers(jobs, unpack_worker, &st) : 0;
+    // A selective extract from a file seeks straight to its chunks; otherwise chunks are read in order
+    unsigned char *entries = NULL;
+    if (paths[0]) unpack_index(STDIN_FILENO, &st, &entries);
+    for (uint64_t k = 0; workers && k < st.chunks; k++) {
+        unsigned char marker[12];
+        errno = 0;
+        size_t size;
+        char *data = NULL;
+        if (entries) {
+            if (!needed[k]) continue;
+            const unsigned char *entry = entries + k * PACK_INDEX_ENTRY;
+            size = pack_get_le(entry + 8, 4);
+            data = malloc(size ? size : 1);
+            if (data && pread(STDIN_FILENO, data, size, pack_get_le(entry, 8)) != (ssize_t)size) {
+                free(data);
+                data = NULL;
+            }
+        } else {
+            if (pack_read_exact(STDIN_FILENO, marker, sizeof(marker)) != 0 || pack_get_le(marker, 4) != PACK_CHUNK_FRAME ||
+                pack_get_le(marker + 4, 4) != 4) {
+                fprintf(stderr, "unpack: archive damaged or truncated at chunk %llu\n", (unsigned long long)k);
+                st.failed = 1;
+                break;
+            }
+            size = pack_get_le(marker + 8, 4);
+            if (!needed[k] && lseek(STDIN_FILENO, size, SEEK_CUR) >= 0) continue;
+            data = malloc(size ? size : 1);
+            if (data && pack_read_exact(STDIN_FILENO, data, size) != 0) {
+                free(data);
+                data = NULL;
+            }
+            if (data && !needed[k]) {
+                free(data);
+                continue;
+            }
+        }
+        if (!data) {
+            fprintf(stderr, "unpack: chunk %llu: %s\n", (unsigned long long)k, errno ? strerror(errno) : "truncated");
+            st.failed = 1;
+            break;
+        }
+        pthread_mutex_lock(&st.lock);
+        while (st.queued == st.window && !st.stop) pthread_cond_wait(&st.changed, &st.lock);
+        if (st.stop) {
+            pthread_mutex_unlock(&st.lock);
+            free(data);
+            break;
+        }
+        struct pack_slot *slot = &st.slots[(st.head + st.queued) % st.window];
+        slot->chunk = k;
+        slot->data = data;
+        slot->size = size;
+        st.queued++;
+        pthread_cond_broadcast(&st.changed);
+        pthread_mutex_unlock(&st.lock);
+    }
+    free(entries);
+    free(needed);
+    pthread_mutex_lock(&st.lock);
+    st.closed = 1;
+    pthread_cond_broadcast(&st.changed);
+    pthread_mutex_unlock(&st.lock);
+    for (int t = 0; t < workers; t++) pthread_join(st.threads[t], NULL);
+
+    // Links, modes and times last: a symlink made earlier could redirect a later member's writes,
+    // and writing into a folder would change its time
+    size_t extracted = 0;
+    for (size_t m = 0; workers && m < st.count; m++) {
+        const struct pack_member *member = &st.members[m];
+        if (!member->selected) continue;
+        extracted++;
+        struct timespec times[2] = {{0, UTIME_NOW}, {member->mtime, member->mtime_nsec}};
+        int ok = 1;
+        if (member->type == '2') {
+            ok = symlinkat(member->link, st.root_fd, member->path) == 0 ||
+                 (errno == EEXIST && unlinkat(st.root_fd, member->path, 0) == 0 &&
+                  symlinkat(member->link, st.root_fd, member->path) == 0);
+            ok = ok && utimensat(st.root_fd, member->path, times, AT_SYMLINK_NOFOLLOW) == 0;
+        } else if (member->type == '0') {
+            ok = fchmodat(st.root_fd, member->path, member->mode & 07777, 0) == 0 &&
+                 utimensat(st.root_fd, member->path, times, 0) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "unpack: %s: %s\n", member->path, strerror(errno));
+            st.failed = 1;
+        }
+    }
+    for (size_t m = st.count; workers && m-- > 0;) {
+        const struct pack_member *member = &st.members[m];
+        if (!member->selected || member->type != '5') continue;
+        struct timespec times[2] = {{0, UTIME_NOW}, {member->mtime, member->mtime_nsec}};
+        if (fchmodat(st.root_fd, member->path, member->mode & 07777, 0) != 0 ||
+            utimensat(st.root_fd, member->path, times, 0) != 0) {
+            fprintf(stderr, "unpack: %s: %s\n", member->path, strerror(errno));
+            st.failed = 1;
+        }
+    }
+    if (workers && !st.stop) {
+        fprintf(stderr, "unpack: %zu members, %d threads, %.2fs\n", extracted, jobs, now_seconds() - started);
+    }
+    last_status = !workers || st.stop || st.failed;
+    pack_free_state(&st);
+    return 1;
+}
+
+/*
+ * first_difference - Offset of the first byte where a and b differ, len when they are equal.
+ * Whole blocks go through memcmp, which glibc vectorizes; only a differing block is narrowed
+ * down, first in 64-byte steps and then byte by byte.
+ */
+static size_t first_difference(const unsigned char *a, const unsigned char *b, size_t len) {
+    for (size_t pos = 0; pos < len; pos += CMP_BLOCK) {
+        size_t n = len - pos < CMP_BLOCK ? len - pos : CMP_BLOCK;
+        if (memcmp(a + pos, b + pos, n) == 0) continue;
+        size_t end = pos + n;
+        while (end - pos > 64 && memcmp(a + pos, b + pos, 64) == 0) pos += 64;
+        while (pos < end && a[pos] == b[pos]) pos++;
+        return pos;
+    }
+    return len;
+}
+
+/*
+ * compare_range - Compares len bytes at offset in two open files by mapping both a window at a
+ * time; *diff gets the offset of the first differing byte. Returns 0 when the ranges are equal,
+ * 1 when they differ, -1 when a file cannot be mapped.
+ */
+static int compare_range(int fd_a, int fd_b, uint64_t offset, uint64_t len, uint64_t *diff) {
+    static long page;
+    if (!page) page = sysconf(_SC_PAGESIZE);
+    while (len) {
+        // Mappings start on a page boundary, so the window begins up to a page early
+        uint64_t skew = offset % page, n = len < CMP_WINDOW ? len : CMP_WINDOW;
+        unsigned char *a = mmap(NULL, n + skew, PROT_READ, MAP_PRIVATE, fd_a, offset - skew);
+        unsigned char *b = a == MAP_FAILED ? MAP_FAILED : mmap(NULL, n + skew, PROT_READ, MAP_PRIVATE, fd_b, offset - skew);
+        if (b == MAP_FAILED) {
+            if (a != MAP_FAILED) munmap(a, n + skew);
+            return -1;
+        }
+        madvise(a, n + skew, MADV_SEQUENTIAL);
+        madvise(b, n + skew, MADV_SEQUENTIAL);
+        size_t at = first_difference(a + skew, b + skew, n);
+        munmap(a, n + skew);
+        munmap(b, n + skew);
+        if (at < n) {
+            *diff = offset + at;
+            return 1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * cmp_read_full - Reads up to len bytes, stopping early only at end of input. Returns the count or -1.
+ */
+static ssize_t cmp_read_full(int fd, unsigned char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * count_lines - Number of newlines in the first len bytes of fd, read with pread.
+ */
+static uint64_t count_lines(int fd, uint64_t len) {
+    unsigned char buf[CMP_BLOCK];
+    uint64_t lines = 0, offset = 0;
+    while (offset < len) {
+        ssize_t n = pread(fd, buf, len - offset < sizeof(buf) ? len - offset : sizeof(buf), offset);
+        if (n <= 0) break;
+        for (unsigned char *p = buf; (p = memchr(p, '\n', buf + n - p)); p++) lines++;
+        offset += n;
+    }
+    return lines;
+}
+
+/*
+ * builtin_cmp - Compares two files ("-" is stdin) and reports the first differing byte and its
+ * line, or which file ended first. Regular files are mapped and compared a block at a time;
+ * anything else is read. Status 0 when equal, 1 when different, 2 on trouble; -s prints nothing.
+ */
+int builtin_cmp(char *args[], int background) {
+    int silent = 0, i = 1;
+    if (args[i] && strcmp(args[i], "-s") == 0) silent = i++;
+    if (!args[i] || !args[i + 1] || args[i + 2]) {
+        printf("Usage: cmp [-s] file1 file2\n");
+        last_status = 2;
+        return 1;
+    }
+    const char *names[2] = {args[i], args[i + 1]};
+    int fds[2] = {-1, -1};
+    struct stat sb[2];
+    last_status = 2;
+    for (int f = 0; f < 2; f++) {
+        if (strcmp(names[f], "-") == 0) release_read_ahead();
+        fds[f] = strcmp(names[f], "-") == 0 ? dup(STDIN_FILENO) : open(names[f], O_RDONLY | O_CLOEXEC);
+        if (fds[f] < 0 || fstat(fds[f], &sb[f]) != 0) {
+            fprintf(stderr, "cmp: %s: %s\n", names[f], strerror(errno));
+            if (fds[0] >= 0) close(fds[0]);
+            return 1;
+        }
+    }
+    uint64_t diff = 0, lines = 0;
+    int state = -1, eof = -1;     // state: 0 equal, 1 differ; eof: the file that ended first
+    if (S_ISREG(sb[0].st_mode) && S_ISREG(sb[1].st_mode)) {
+        uint64_t common = sb[0].st_size < sb[1].st_size ? sb[0].st_size : sb[1].st_size;
+        state = compare_range(fds[0], fds[1], 0, common, &diff);
+        if (state == 0 && sb[0].st_size != sb[1].st_size) {
+            diff = common;
+            eof = sb[0].st_size > sb[1].st_size;
+        }
+        if (state >= 0 && !silent && (state || eof >= 0)) lines = count_lines(fds[0], diff);
+    }
+    if (state < 0) {
+        // Pipes, terminals, or files that cannot be mapped are read block by block
+        unsigned char *a = malloc(2 * CMP_BLOCK), *b = a + CMP_BLOCK;
+        state = a ? 0 : -1;
+        while (a && !state && eof < 0) {
+            ssize_t n_a = cmp_read_full(fds[0], a, CMP_BLOCK), n_b = cmp_read_full(fds[1], b, CMP_BLOCK);
+            if (n_a < 0 || n_b < 0) {
+                state = -1;
+                break;
+            }
+            size_t common = n_a < n_b ? n_a : n_b, at = first_difference(a, b, common);
+            for (unsigned char *p = a; (p = memchr(p, '\n', a + at - p)); p++) lines++;
+            diff += at;
+            if (at < common) state = 1;
+            else if (n_a != n_b) eof = n_a > n_b;
+            else if (n_a < CMP_BLOCK) break;
+        }
+        free(a);
+    }
+    if (state < 0) {
+        fprintf(stderr, "cmp: %s\n", strerror(errno));
+    } else if (state) {
+        if (!silent) printf("%s %s differ: char %llu, line %llu\n", names[0], names[1], (unsigned long long)diff + 1,
+                            (unsigned long long)lines + 1);
+        last_status = 1;
+    } else if (eof >= 0) {
+        if (!silent) fprintf(stderr, "cmp: EOF on %s after byte %llu, line %llu\n", names[eof],
+                             (unsigned long long)diff, (unsigned long long)lines);
+        last_status = 1;
+    } else {
+        last_status = 0;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return 1;
+}
+
+/*
+ * dircmp_report - Records one difference.
+ */
+static void dircmp_report(struct dircmp_state *st, const char *path, int state, const char *reason, uint64_t offset) {
+    pthread_mutex_lock(&st->lock);
+    if (st->result_count == st->result_cap) {
+        size_t cap = st->result_cap ? st->result_cap * 2 : 64;
+        struct dircmp_result *grown = realloc(st->results, cap * sizeof(struct dircmp_result));
+        if (grown) {
+            st->results = grown;
+            st->result_cap = cap;
+        }
+    }
+    char *copy = strdup(path);
+    if (copy && st->result_count < st->result_cap) {
+        st->results[st->result_count++] = (struct dircmp_result){copy, state, reason, offset};
+    } else {
+        free(copy);
+        st->trouble = 1;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/*
+ * dircmp_list - Reads the sorted entry names of folder rel under root_fd. Returns the count or -1.
+ */
+static ssize_t dircmp_list(int root_fd, const char *rel, char ***names) {
+    int fd = openat(root_fd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t count = 0, cap = 0;
+    *names = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(*names, cap * sizeof(char *));
+            if (!grown) break;
+            *names = grown;
+        }
+        if (!((*names)[count] = strdup(entry->d_name))) break;
+        count++;
+    }
+    closedir(dir);
+    if (count) qsort(*names, count, sizeof(char *), index_compare);
+    return count;
+}
+
+/*
+ * dircmp_folder - Matches up the entries of folder rel on both sides: reports those on one side
+ * only, settles what metadata can settle, and queues subfolders and file contents in *work.
+ */
+static void dircmp_folder(struct dircmp_state *st, const char *rel, struct dircmp_item **work) {
+    char **names[2] = {NULL, NULL};
+    ssize_t counts[2] = {dircmp_list(st->fd_a, rel, &names[0]), dircmp_list(st->fd_b, rel, &names[1])};
+    if (counts[0] < 0 || counts[1] < 0) {
+        fprintf(stderr, "dircmp: %s: %s\n", rel[0] ? rel : ".", strerror(errno));
+        st->trouble = 1;
+    }
+    for (ssize_t i = 0, j = 0; counts[0] >= 0 && counts[1] >= 0 && (i < counts[0] || j < counts[1]);) {
+        int order = i == counts[0] ? 1 : j == counts[1] ? -1 : strcmp(names[0][i], names[1][j]);
+        const char *name = order <= 0 ? names[0][i] : names[1][j];
+        char *path;
+        if (asprintf(&path, "%s%s%s", rel, rel[0] ? "/" : "", name) < 0) break;
+        i += order <= 0;
+        j += order >= 0;
+        struct stat a, b;
+        if (order) {
+            dircmp_report(st, path, order < 0 ? DIRCMP_MISSING : DIRCMP_EXTRA, NULL, 0);
+        } else if (fstatat(st->fd_a, path, &a, AT_SYMLINK_NOFOLLOW) != 0 ||
+                   fstatat(st->fd_b, path, &b, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "dircmp: %s: %s\n", path, strerror(errno));
+            st->trouble = 1;
+        } else if ((a.st_mode & S_IFMT) != (b.st_mode & S_IFMT)) {
+            dircmp_report(st, path, DIRCMP_DIFFERS, "type", 0);
+        } else if (S_ISLNK(a.st_mode)) {
+            char target_a[INDEX_PATH_MAX], target_b[INDEX_PATH_MAX];
+            ssize_t n_a = readlinkat(st->fd_a, path, target_a, sizeof(target_a));
+            ssize_t n_b = readlinkat(st->fd_b, path, target_b, sizeof(target_b));
+            if (n_a != n_b || n_a < 0 || memcmp(target_a, target_b, n_a) != 0) dircmp_report(st, path, DIRCMP_DIFFERS, "link", 0);
+        } else if (S_ISCHR(a.st_mode) || S_ISBLK(a.st_mode)) {
+            if (a.st_rdev != b.st_rdev) dircmp_report(st, path, DIRCMP_DIFFERS, "device", 0);
+        } else if (S_ISREG(a.st_mode) && a.st_size != b.st_size) {
+            dircmp_report(st, path, DIRCMP_DIFFERS, "size", 0);
+        } else if (S_ISDIR(a.st_mode) || (S_ISREG(a.st_mode) && a.st_size)) {
+            if (!(S_ISREG(a.st_mode) && st->trust_mtime && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+                  a.st_mtim.tv_nsec == b.st_mtim.tv_nsec)) {
+                // Folders are queued whole; files one DIRCMP_RANGE at a time
+                uint64_t size = S_ISDIR(a.st_mode) ? 1 : (uint64_t)a.st_size;
+                for (uint64_t offset = 0; offset < size; offset += DIRCMP_RANGE) {
+                    struct dircmp_item *item = malloc(sizeof(struct dircmp_item));
+                    if (!item || !(item->rel = strdup(path))) {
+                        free(item);
+                        st->trouble = 1;
+                        break;
+                    }
+                    item->dir = S_ISDIR(a.st_mode);
+                    item->offset = offset;
+                    item->len = size - offset < DIRCMP_RANGE ? size - offset : DIRCMP_RANGE;
+                    item->next = *work;
+                    *work = item;
+                }
+            }
+        }
+        free(path);
+    }
+    for (int side = 0; side < 2; side++) {
+        for (ssize_t i = 0; i < counts[side]; i++) free(names[side][i]);
+        free(names[side]);
+    }
+}
+
+/*
+ * dircmp_worker - Takes folders and file ranges off the shared stack until it is empty and no
+ * worker holding an item can add to it.
+ */
+static void *dircmp_worker(void *arg) {
+    struct dircmp_state *st = arg;
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (!st->items && st->busy) pthread_cond_wait(&st->changed, &st->lock);
+        struct dircmp_item *item = st->items;
+        if (!item) break;
+        st->items = item->next;
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+
+        struct dircmp_item *work = NULL;
+        if (item->dir) {
+            dircmp_folder(st, item->rel, &work);
+        } else {
+            int fd_a = openat(st->fd_a, item->rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            int fd_b = fd_a < 0 ? -1 : openat(st->fd_b, item->rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            uint64_t diff;
+            int state = fd_b < 0 ? -1 : compare_range(fd_a, fd_b, item->offset, item->len, &diff);
+            if (state < 0) {
+                fprintf(stderr, "dircmp: %s: %s\n", item->rel, strerror(errno));
+                st->trouble = 1;
+            } else if (state) {
+                dircmp_report(st, item->rel, DIRCMP_DIFFERS, "content", diff);
+            }
+            if (fd_a >= 0) close(fd_a);
+            if (fd_b >= 0) close(fd_b);
+        }
+        free(item->rel);
+        free(item);
+
+        pthread_mutex_lock(&st->lock);
+        while (work) {
+            struct dircmp_item *next = work->next;
+            work->next = st->items;
+            st->items = work;
+            work = next;
+        }
+        st->busy--;
+        pthread_cond_broadcast(&st->changed);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/*
+ * dircmp_result_compare - Orders results by path, and a file's ranges by offset.
+ */
+static int dircmp_result_compare(const void *a, const void *b) {
+    const struct dircmp_result *x = a, *y = b;
+    int order = strcmp(x->path, y->path);
+    return order ? order : (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * builtin_dircmp - Compares two folder trees: entries missing from the second, extra in it, and
+ * entries that differ in type, size, link target or content. Worker threads share one stack of
+ * folders to read and file ranges to compare, so big trees and big files both spread over them.
+ * -m takes equal size and mtime as equal content. Status 0 when the trees match, 1 when they
+ * differ, 2 on trouble.
+ */
+int builtin_dircmp(char *args[], int background) {
+    const char *jobs_arg = NULL;
+    int i = 1;
+    struct dircmp_state st = {.fd_a = -1, .fd_b = -1};
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "-m") == 0) st.trust_mtime = 1;
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1]) jobs_arg = args[++i];
+        else break;
+    }
+    if (!args[i] || !args[i + 1] || args[i + 2]) {
+        printf("Usage: dircmp [-m] [-j jobs] dir1 dir2\n");
+        last_status = 2;
+        return 1;
+    }
+    st.fd_a = open(args[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    st.fd_b = st.fd_a < 0 ? -1 : open(args[i + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    st.items = calloc(1, sizeof(struct dircmp_item));
+    if (st.fd_b < 0 || !st.items || !(st.items->rel = strdup(""))) {
+        fprintf(stderr, "dircmp: %s: %s\n", args[st.fd_a < 0 ? i : i + 1], strerror(errno));
+        if (st.fd_a >= 0) close(st.fd_a);
+        if (st.items) free(st.items->rel);
+        free(st.items);
+        last_status = 2;
+        return 1;
+    }
+    st.items->dir = 1;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+
+    int jobs = pack_jobs(jobs_arg), started = 0;
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    while (threads && started < jobs && pthread_create(&threads[started], NULL, dircmp_worker, &st) == 0) started++;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    // With no thread at all, this one does the work
+    if (!started) dircmp_worker(&st);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+
+    // A file differing in several ranges is reported once, at its first difference
+    if (st.result_count) qsort(st.results, st.result_count, sizeof(struct dircmp_result), dircmp_result_compare);
+    static const char *const states[] = {"missing", "extra", "differs"};
+    size_t reported = 0;
+    for (size_t r = 0; r < st.result_count; r++) {
+        const struct dircmp_result *result = &st.results[r];
+        if (r && strcmp(result->path, st.results[r - 1].path) == 0) continue;
+        reported++;
+        if (output_mode == OUTPUT_TEXT) {
+            printf("%-8s %s", states[result->state], result->path);
+            if (!result->reason) printf("\n");
+            else if (strcmp(result->reason, "content") == 0) printf(" (content at byte %llu)\n", (unsigned long long)result->offset + 1);
+            else printf(" (%s)\n", result->reason);
+            continue;
+        }
+        record_open();
+        record_text("path", result->path);
+        record_text("state", states[result->state]);
+        if (result->reason) record_text("reason", result->reason);
+        if (result->reason && strcmp(result->reason, "content") == 0) record_number("byte", result->offset + 1);
+        record_close();
+    }
+    for (size_t r = 0; r < st.result_count; r++) free(st.results[r].path);
+    free(st.results);
+    close(st.fd_a);
+    close(st.fd_b);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.changed);
+    last_status = st.trouble ? 2 : reported ? 1 : 0;
+    return 1;
+}
+
+/*
+ * index_generator - Completes paths from the file index when the index worker is live and idle.
+ * dir is the canonical directory being completed and prefix what was typed before the name.
+ */
+static char *index_generator(const char *dir, const char *prefix, const char *base, int state) {
+    static struct index_cursor *cur;
+    static char *key;
+    static size_t dir_len;
+    static int have;
+    if (!state) {
+        if (!cur) cur = malloc(sizeof(struct index_cursor));
+        if (!key) key = malloc(INDEX_PATH_MAX);
+        if (!cur || !key) return NULL;
+        dir_len = strlen(dir);
+        snprintf(key, INDEX_PATH_MAX, "%s/%s", dir, base);
+        have = index_seek(cur, key);
+    }
+    size_t base_len = strlen(base);
+    while (have) {
+        const char *name = cur->path + dir_len + 1;
+        if (strncmp(cur->path, key, dir_len + 1 + base_len) != 0) break;
+        const char *slash = strchr(name, '/');
+        if (slash) {
+            // Skip the rest of a child's subtree: it is the range up to child + "0"
+            size_t n = slash - cur->path;
+            memcpy(key + dir_len + 1, name, slash - name);
+            strcpy(key + n, "0");
+            have = index_seek(cur, key);
+            key[dir_len + 1 + base_len] = '\0';
+            memcpy(key + dir_len + 1, base, base_len);
+            continue;
+        }
+        char *match = NULL;
+        // Hidden files are only offered once the user has typed the dot
+        if (name[0] != '.' || base[0] == '.') {
+            size_t n = strlen(prefix) + strlen(name) + 1;
+            match = malloc(n);
+            if (match) snprintf(match, n, "%s%s", prefix, name);
+        }
+        have = index_next(cur);
+        if (match) return match;
+    }
+    return NULL;
+}
+
+/*
+ * index_covers - Whether completion in dir may use the file index: the worker is live with no
+ * changes pending and dir lies on the indexed mount under the root. Fills canonical on success.
+ */
+static int index_covers(const char *dir, char *canonical) {
+    if (!__atomic_load_n(&index_live, __ATOMIC_RELAXED) || __atomic_load_n(&index_pending, __ATOMIC_RELAXED)) return 0;
+    if (dir[0] == '~' || !realpath(dir[0] ? dir : ".", canonical) || index_map() != 0) return 0;
+    char root[INDEX_PATH_MAX];
+    size_t root_len = file_index.header->root_len;
+    memcpy(root, (const char *)file_index.map + sizeof(struct index_header), root_len);
+    root[root_len] = '\0';
+    if (strcmp(canonical, "/") == 0) canonical[0] = '\0';
+    if (strncmp(canonical, root, root_len) != 0 || (canonical[root_len] && canonical[root_len] != '/')) return 0;
+    struct stat at_dir, at_root;
+    if (stat(canonical[0] ? canonical : "/", &at_dir) != 0 || stat(root[0] ? root : "/", &at_root) != 0 ||
+        at_dir.st_dev != at_root.st_dev) {
+        return 0;
+    }
+    shell_counters[SUB_FILEINDEX].hits++;
+    return 1;
+}
+
+/*
+ * command_generator - Generates file/folder names or commands for tab completion.
+ */
+char *command_generator(const char *text, int state) {
+    static int index, len, phase;
+    static char *name;
+    static DIR *dir;
+
+    if (!state) {
+        index = 0;
+        phase = 0;
+        len = strlen(text);
+        // [FIX: Reset directory for file completion]
+        if (dir) {
+            closedir(dir);
+            dir = NULL;
+        }
+    }
+
+    // Complete builtin commands
+    if (!builtin_hash_mask) seal_builtins();
+    while (phase == 0 && index < builtin_count && (name = (char *)builtins[index].name)) {
+        index++;
+        if (strncmp(name, text, len) == 0) {
+            return strdup(name);
+        }
+    }
+    if (phase == 0) {
+        // Builtins and system commands need separate passes, or the shared index restarts forever
+        phase = 1;
+        index = 0;
+    }
+
+    // Complete system commands
+    while (phase == 1 && (name = system_commands[index])) {
+        index++;
+        if (strncmp(name, text, len) == 0) {
+            return strdup(name);
+        }
+    }
+
+    // File completion
+    if (phase == 1) {
+        phase = 2;
+        dir = opendir(".");
+        if (!dir) return NULL;
+    }
+    if (!dir) return NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, text, len) == 0) {
+            return strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    dir = NULL;
+    return NULL;
+}
+
+/*
+ * filename_generator - Generates paths matching text, completing the part after the last '/'.
+ */
+char *filename_generator(const char *text, int state) {
+    static DIR *dir;
+    static char dir_part[MAX_PATH];
+    static const char *base;
+    static size_t base_len;
+    static int from_index;
+
+    if (!state) {
+        if (dir) closedir(dir);
+        dir = NULL;
+        const char *slash = strrchr(text, '/');
+        if (slash) {
+            size_t n = slash - text + 1;
+            if (n >= sizeof(dir_part)) n = sizeof(dir_part) - 1;
+            memcpy(dir_part, text, n);
+            dir_part[n] = '\0';
+            base = slash + 1;
+        } else {
+            dir_part[0] = '\0';
+            base = text;
+        }
+        base_len = strlen(base);
+        // A live file index answers without reading the directory
+        char canonical[INDEX_PATH_MAX];
+        from_index = index_covers(dir_part, canonical);
+        if (from_index) return index_generator(canonical, dir_part, base, 0);
+        dir = opendir(dir_part[0] ? dir_part : ".");
+    }
+    if (from_index) return index_generator(NULL, dir_part, base, state);
+    if (!dir) return NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        // Hidden files are only offered once the user has typed the dot
+        if (entry->d_name[0] == '.' && base[0] != '.') continue;
+        if (strncmp(entry->d_name, base, base_len) == 0) {
+            size_t n = strlen(dir_part) + strlen(entry->d_name) + 1;
+            char *match = malloc(n);
+            if (!match) break;
+            snprintf(match, n, "%s%s", dir_part, entry->d_name);
+            return match;
+        }
+    }
+    closedir(dir);
+    dir = NULL;
+    return NULL;
+}
+
+/*
+ * completion_matches - Collects every candidate from generator. Element 0 holds the longest
+ * common prefix, followed by the matches themselves; NULL when nothing matches.
+ */
+char **completion_matches(const char *text, char *(*generator)(const char *, int)) {
+    int count = 0, cap = 16;
+    char **matches = malloc(cap * sizeof(char *));
+    if (!matches) return NULL;
+    char *match;
+    while ((match = generator(text, count))) {
+        if (count + 2 >= cap) {
+            cap *= 2;
+            char **grown = realloc(matches, cap * sizeof(char *));
+            if (!grown) {
+                free(match);
+                break;
+            }
+            matches = grown;
+        }
+        matches[++count] = match;
+    }
+    if (count == 0) {
+        shell_counters[SUB_COMPLETION].misses++;
+        free(matches);
+        return NULL;
+    }
+    shell_counters[SUB_COMPLETION].hits++;
+    size_t prefix = strlen(matches[1]);
+    for (int i = 2; i <= count; i++) {
+        size_t j = 0;
+        while (j < prefix && matches[i][j] == matches[1][j]) j++;
+        prefix = j;
+    }
+    matches[0] = strndup(matches[1], prefix);
+    matches[count + 1] = NULL;
+    shell_counters[SUB_COMPLETION].entries = count;
+    shell_counters[SUB_COMPLETION].allocs += count + 2;
+    return matches;
+}
+
+/*
+ * custom_completion - Custom tab completion for files and commands.
+ * Completes line[start..end]; command names are offered at the start of each pipeline stage.
+ */
+char **custom_completion(const char *line, int start, int end) {
+    char *text = strndup(line + start, end - start);
+    if (!text) return NULL;
+    int i = start - 1;
+    while (i >= 0 && (line[i] == ' ' || line[i] == '\t')) i--;
+    char **matches;
+    if ((i < 0 || line[i] == '|') && !strchr(text, '/')) {
+        matches = completion_matches(text, command_generator);
+    } else {
+        // Arguments of a loadable builtin with a completion hook are completed by the plugin
+        int stage = start;
+        while (stage > 0 && line[stage - 1] != '|') stage--;
+        while (line[stage] == ' ' || line[stage] == '\t') stage++;
+        size_t name_len = strcspn(line + stage, " \t|");
+        char name[64];
+        const struct builtin *builtin = NULL;
+        if (name_len < sizeof(name)) {
+            memcpy(name, line + stage, name_len);
+            name[name_len] = '\0';
+            builtin = lookup_builtin(name);
+        }
+        matches = NULL;
+        if (builtin && builtin->plugin && builtin->plugin->complete) {
+            completing_plugin = builtin->plugin;
+            completing_argn = 0;
+            for (int p = stage + name_len; p < start; p++) {
+                if ((line[p] == ' ' || line[p] == '\t') && line[p + 1] != ' ' && line[p + 1] != '\t') completing_argn++;
+            }
+            matches = completion_matches(text, plugin_generator);
+        }
+        if (!matches) matches = completion_matches(text, filename_generator);
+    }
+    free(text);
+    return matches;
+}
+
+/*
+ * plugin_generator - Feeds the completing plugin's hook into completion_matches.
+ */
+char *plugin_generator(const char *text, int state) {
+    const char *candidate = completing_plugin->complete(text, completing_argn, state);
+    return candidate ? strdup(candidate) : NULL;
+}
+
+/*
+ * add_history_entry - Appends a line to the history, dropping the oldest beyond MAX_HISTORY.
+ */
+void add_history_entry(const char *line) {
+    char *copy = strdup(line);
+    if (!copy) return;
+    shell_counters[SUB_HISTORY].allocs++;
+    shell_counters[SUB_HISTORY].bytes += strlen(line) + 1;
+    if (history_count == MAX_HISTORY) {
+        shell_counters[SUB_HISTORY].bytes -= strlen(history_lines[0]) + 1;
+        free(history_lines[0]);
+        memmove(history_lines, history_lines + 1, (MAX_HISTORY - 1) * sizeof(char *));
+        history_count--;
+        history_base++;
+    }
+    history_lines[history_count++] = copy;
+    shell_counters[SUB_HISTORY].entries = history_count;
+}
+
+/*
+ * clear_history_entries - Removes every history entry.
+ */
+void clear_history_entries(void) {
+    for (int i = 0; i < history_count; i++) {
+        free(history_lines[i]);
+        history_lines[i] = NULL;
+    }
+    history_count = 0;
+    history_base = 1;
+    shell_counters[SUB_HISTORY].entries = shell_counters[SUB_HISTORY].bytes = 0;
+}
+
+/*
+ * Line editor
+ *
+ * The editor keeps the cells it last put on screen. After each edit it re-lexes the line,
+ * finds the first cell whose text or colour changed, and rewrites only from there, so typing
+ * at the end of a long line costs one cell of output instead of a full redraw. Bracketed
+ * paste delivers a whole paste as a single insertion with one redraw and no completion.
+ */
+
+// Highlight classes produced by lex_line
+enum { HL_NONE, HL_COMMAND, HL_UNKNOWN, HL_OPERATOR, HL_GLOB, HL_TARGET };
+static const char *highlight_sgr[] = {"0", "1;32", "1;31", "1;36", "35", "4"};
+
+struct screen_cell {
+    char bytes[4];            // UTF-8 sequence for one character
+    unsigned char len;        // bytes used
+    unsigned char width;      // terminal columns (0-2)
+    unsigned char hl;         // highlight class
+};
+
+struct line_state {
+    char *buf;                // line being edited, NUL-terminated
+    size_t len, cap, pos;     // byte length, capacity, cursor byte offset
+    struct screen_cell *shown;// cells currently on screen
+    size_t shown_count;
+    int cursor_col;           // terminal cursor column, counted from the start of the prompt
+    int cols;                 // terminal width
+    int history_index;        // history entry being shown, history_count for the new line
+    char *saved_line;         // line being typed before browsing history
+    int last_was_tab;
+};
+
+// Buffered terminal input so pastes are not read one byte per syscall
+static unsigned char key_buf[4096];
+static size_t key_len = 0, key_pos = 0;
+
+/*
+ * read_key_byte - Returns the next input byte, or -1 on EOF/error.
+ */
+static int read_key_byte(void) {
+    if (key_pos == key_len) {
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, key_buf, sizeof(key_buf));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        key_len = n;
+        key_pos = 0;
+    }
+    return key_buf[key_pos++];
+}
+
+/*
+ * key_pending - Whether another input byte is buffered or arrives within timeout_ms. Terminals
+ * send an escape sequence in one burst, so a lone Esc is one with nothing right behind it.
+ */
+static int key_pending(int timeout_ms) {
+    if (key_pos < key_len) return 1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+
+/*
+ * utf8_length - Length of the UTF-8 sequence starting with byte c.
+ */
+static size_t utf8_length(unsigned char c) {
+    if (c < 0x80) return 1;
+    if ((c & 0xE0) == 0xC0) return 2;
+    if ((c & 0xF0) == 0xE0) return 3;
+    if ((c & 0xF8) == 0xF0) return 4;
+    return 1;
+}
+
+/*
+ * line_insert - Inserts n bytes at the cursor.
+ */
+static int line_insert(struct line_state *ls, const char *text, size_t n) {
+    if (ls->len + n + 1 > ls->cap) {
+        size_t cap = ls->cap * 2;
+        while (ls->len + n + 1 > cap) cap *= 2;
+        char *grown = realloc(ls->buf, cap);
+        if (!grown) return 0;
+        ls->buf = grown;
+        ls->cap = cap;
+    }
+    memmove(ls->buf + ls->pos + n, ls->buf + ls->pos, ls->len - ls->pos + 1);
+    memcpy(ls->buf + ls->pos, text, n);
+    ls->len += n;
+    ls->pos += n;
+    return 1;
+}
+
+/*
+ * line_delete - Deletes the bytes in [from, to) and leaves the cursor at from.
+ */
+static void line_delete(struct line_state *ls, size_t from, size_t to) {
+    memmove(ls->buf + from, ls->buf + to, ls->len - to + 1);
+    ls->len -= to - from;
+    ls->pos = from;
+}
+
+/*
+ * line_set - Replaces the whole line, placing the cursor at the end.
+ */
+static void line_set(struct line_state *ls, const char *text) {
+    ls->len = 0;
+    ls->pos = 0;
+    ls->buf[0] = '\0';
+    line_insert(ls, text, strlen(text));
+}
+
+/*
+ * prev_char / next_char - Byte offset of the neighbouring UTF-8 character.
+ */
+static size_t prev_char(const struct line_state *ls, size_t pos) {
+    if (pos == 0) return 0;
+    pos--;
+    while (pos > 0 && ((unsigned char)ls->buf[pos] & 0xC0) == 0x80) pos--;
+    return pos;
+}
+
+static size_t next_char(const struct line_state *ls, size_t pos) {
+    if (pos >= ls->len) return ls->len;
+    pos += utf8_length((unsigned char)ls->buf[pos]);
+    return pos > ls->len ? ls->len : pos;
+}
+
+/*
+ * resolve_command - Finds the file execvp would run for name, searching PATH like execvp does.
+ * Returns 0 with the path in out, ENOENT, or EACCES when only non-executable matches exist.
+ */
+int resolve_command(const char *name, char *out, size_t size) {
     struct stat st;
-    if (stat(src, &st) != 0) {
-        perror("stat failed");
+    if (strchr(name, '/')) {
+        if (stat(name, &st) != 0) return ENOENT;
+        if (S_ISDIR(st.st_mode) || access(name, X_OK) != 0) return EACCES;
+        snprintf(out, size, "%s", name);
+        return 0;
+    }
+    const char *path = getenv("PATH");
+    if (!path) path = "/bin:/usr/bin";
+    int error = ENOENT;
+    while (1) {
+        const char *colon = strchr(path, ':');
+        size_t n = colon ? (size_t)(colon - path) : strlen(path);
+        if (snprintf(out, size, "%.*s/%s", (int)n, n ? path : ".", name) < (int)size && stat(out, &st) == 0) {
+            if (!S_ISDIR(st.st_mode) && access(out, X_OK) == 0) return 0;
+            error = EACCES;
+        }
+        if (!colon) break;
+        path = colon + 1;
+    }
+    return error;
+}
+
+/*
+ * report_not_found - Explains why name could not run, with "did you mean" suggestions for a typo.
+ */
+void report_not_found(const char *name, int error) {
+    if (error == EACCES) {
+        fprintf(stderr, "Error: Command '%s': permission denied\n", name);
         return;
     }
-    if (S_ISDIR(st.st_mode)) {
-        struct stat dest_st;
-        if (stat(dest, &dest_st) == 0 && !S_ISDIR(dest_st.st_mode)) {
-            fprintf(stderr, "cp: cannot overwrite non-directory '%s' with directory '%s'\n", dest, src);
-            return;
+    fprintf(stderr, "Error: Command '%s' not found\n", name);
+    const char *suggestions[SUGGEST_MAX];
+    int count = suggest_commands(name, suggestions, SUGGEST_MAX);
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%s%s%s", i == 0 ? "  Did you mean: " : ", ", suggestions[i], i == count - 1 ? "?\n" : "");
+    }
+}
+
+/*
+ * edit_distance - Levenshtein distance between two command names, or with transpose set the
+ * optimal-string-alignment distance, where swapping two neighbours ("gti") costs one edit.
+ * Names over 63 bytes compare as far apart.
+ */
+int edit_distance(const char *a, const char *b, int transpose) {
+    size_t la = strlen(a), lb = strlen(b);
+    if (la > 63 || lb > 63) return 64;
+    int rows[3][64];
+    int *before = rows[0], *prev = rows[1], *row = rows[2];
+    for (size_t j = 0; j <= lb; j++) prev[j] = j;
+    for (size_t i = 1; i <= la; i++) {
+        row[0] = i;
+        for (size_t j = 1; j <= lb; j++) {
+            int best = prev[j - 1] + (a[i - 1] != b[j - 1]);
+            if (prev[j] + 1 < best) best = prev[j] + 1;
+            if (row[j - 1] + 1 < best) best = row[j - 1] + 1;
+            if (transpose && i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && before[j - 2] + 1 < best) {
+                best = before[j - 2] + 1;
+            }
+            row[j] = best;
         }
-        if (mkdir(dest, st.st_mode) != 0 && errno != EEXIST) {
-            perror("mkdir failed");
-            return;
+        int *oldest = before;
+        before = prev;
+        prev = row;
+        row = oldest;
+    }
+    return prev[lb];
+}
+
+/*
+ * edit_pattern_init - Prepares name for edit_pattern_distance.
+ */
+static void edit_pattern_init(struct edit_pattern *pat, const char *name) {
+    memset(pat->peq, 0, sizeof(pat->peq));
+    pat->len = strlen(name);
+    for (size_t i = 0; i < pat->len && i < 63; i++) pat->peq[(unsigned char)name[i]] |= 1ULL << i;
+}
+
+/*
+ * edit_pattern_distance - Levenshtein distance from a prepared name to text, a column of the
+ * DP table per byte of text in a few word operations (Myers / Hyyro). Over 63 bytes counts as 64.
+ */
+static int edit_pattern_distance(const struct edit_pattern *pat, const char *text) {
+    if (pat->len > 63) return 64;
+    if (pat->len == 0) return strlen(text) > 63 ? 64 : (int)strlen(text);
+    uint64_t pv = ~0ULL, mv = 0, top = 1ULL << (pat->len - 1);
+    int score = pat->len;
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (c - (const unsigned char *)text >= 63) return 64;
+        uint64_t eq = pat->peq[*c];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & top) score++;
+        else if (mh & top) score--;
+        // Row 0 of the table grows by one per column
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
+/*
+ * bk_insert - Adds one reference to name in the command index, inserting it into the BK-tree if new.
+ */
+struct bk_node *bk_insert(const char *name) {
+    struct bk_node **link = &command_index;
+    struct edit_pattern pat;
+    edit_pattern_init(&pat, name);
+    int d = 0;
+    while (*link) {
+        // Names over 63 bytes are 64 from everything, themselves included, so match by bytes first
+        if (strcmp((*link)->name, name) == 0) break;
+        d = edit_pattern_distance(&pat, (*link)->name);
+        // Children hang off their parent keyed by their distance to it
+        struct bk_node **child = &(*link)->child;
+        while (*child && (*child)->distance != d) child = &(*child)->sibling;
+        link = child;
+    }
+    if (!*link) {
+        struct bk_node *node = calloc(1, sizeof(struct bk_node));
+        if (!node || !(node->name = strdup(name))) {
+            free(node);
+            return NULL;
         }
-        DIR *dir = opendir(src);
-        if (!dir) {
-            perror("opendir failed");
-            return;
+        node->distance = d;
+        *link = node;
+        shell_counters[SUB_CMDINDEX].allocs++;
+        shell_counters[SUB_CMDINDEX].bytes += sizeof(struct bk_node) + strlen(name) + 1;
+    }
+    if ((*link)->refs++ == 0) shell_counters[SUB_CMDINDEX].entries++;
+    return *link;
+}
+
+/*
+ * bk_search - Collects live names within tolerance of name into the best[] list, kept sorted by distance.
+ * The tree is walked with Levenshtein distance (a metric, so pruning is exact) one wider than the
+ * tolerance, and candidates are then measured with transpositions allowed.
+ */
+static void bk_search(const struct bk_node *node, const struct edit_pattern *pat, const char *name, int tolerance,
+                      const struct bk_node **best, int *best_distance, int *count, int max) {
+    int radius = tolerance + 1;
+    int d = edit_pattern_distance(pat, node->name);
+    int close = d <= radius ? edit_distance(name, node->name, 1) : d;
+    if (node->refs > 0 && close <= tolerance) {
+        int at = *count;
+        while (at > 0 && (best_distance[at - 1] > close ||
+                          (best_distance[at - 1] == close && strcmp(best[at - 1]->name, node->name) > 0))) at--;
+        if (at < max) {
+            int last = *count < max ? *count : max - 1;
+            memmove(best + at + 1, best + at, (last - at) * sizeof(*best));
+            memmove(best_distance + at + 1, best_distance + at, (last - at) * sizeof(*best_distance));
+            best[at] = node;
+            best_distance[at] = close;
+            if (*count < max) (*count)++;
+        }
+    }
+    // Triangle inequality: only subtrees at distance d +- radius can hold a match
+    for (const struct bk_node *child = node->child; child; child = child->sibling) {
+        if (child->distance >= d - radius && child->distance <= d + radius) {
+            bk_search(child, pat, name, tolerance, best, best_distance, count, max);
+        }
+    }
+}
+
+/*
+ * suggest_commands - Up to max known command names closest to name, nearest first.
+ */
+int suggest_commands(const char *name, const char **out, int max) {
+    refresh_command_index();
+    if (!command_index || max <= 0) return 0;
+    // One typo in short names, two in longer ones
+    int tolerance = strlen(name) <= 4 ? 1 : 2;
+    const struct bk_node *best[max];
+    int best_distance[max], count = 0;
+    struct edit_pattern pat;
+    edit_pattern_init(&pat, name);
+    bk_search(command_index, &pat, name, tolerance, best, best_distance, &count, max);
+    for (int i = 0; i < count; i++) out[i] = best[i]->name;
+    return count;
+}
+
+/*
+ * scan_source - Re-reads one source's names (a PATH directory's executables, or the builtins)
+ * and swaps them in, adding references before dropping the old ones.
+ */
+static void scan_source(struct command_source *src) {
+    struct bk_node **names = NULL;
+    int count = 0, cap = 0;
+    DIR *dir = NULL;
+    if (!src->path) {
+        for (int i = 0; i < builtin_count; i++) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct bk_node **grown = realloc(names, cap * sizeof(*names));
+                if (!grown) break;
+                names = grown;
+            }
+            struct bk_node *node = bk_insert(builtins[i].name);
+            if (node) names[count++] = node;
         }
+    } else if ((dir = opendir(src->path))) {
         struct dirent *entry;
         while ((entry = readdir(dir))) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            char src_path[MAX_PATH], dest_path[MAX_PATH];
-            if (snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name) >= sizeof(src_path) ||
-                snprintf(dest_path, sizeof(dest_path), "%s/%s", dest, entry->d_name) >= sizeof(dest_path)) {
-                fprintf(stderr, "recursive_copy: path too long\n");
-                closedir(dir);
-                return;
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+            if (faccessat(dirfd(dir), entry->d_name, X_OK, 0) != 0) continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 256;
+                struct bk_node **grown = realloc(names, cap * sizeof(*names));
+                if (!grown) break;
+                names = grown;
             }
-            recursive_copy(src_path, dest_path, depth + 1);
+            struct bk_node *node = bk_insert(entry->d_name);
+            if (node) names[count++] = node;
         }
         closedir(dir);
-    } else {
-        int src_fd = open(src, O_RDONLY);
-        if (src_fd < 0) {
-            perror("fopen src failed");
+    }
+    for (int i = 0; i < src->count; i++) {
+        if (--src->names[i]->refs == 0) shell_counters[SUB_CMDINDEX].entries--;
+    }
+    free(src->names);
+    src->names = names;
+    src->count = count;
+}
+
+/*
+ * refresh_command_index - Brings the index up to date: follows PATH edits and rescans only the
+ * directories whose mtime changed (a directory's mtime moves when entries are added or removed).
+ */
+void refresh_command_index(void) {
+    const char *path = getenv("PATH");
+    if (!path) path = "/bin:/usr/bin";
+    if (!indexed_path || strcmp(indexed_path, path) != 0) {
+        // Source 0 is the builtin table; the rest follow PATH, reusing directories already indexed
+        int count = 2;
+        for (const char *p = path; *p; p++) count += *p == ':';
+        struct command_source *sources = calloc(count, sizeof(struct command_source));
+        char *copy = strdup(path);
+        if (!sources || !copy) {
+            free(sources);
+            free(copy);
             return;
         }
-        struct stat dest_st;
-        char final_dest[MAX_PATH];
-        if (stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode)) {
-            if (snprintf(final_dest, sizeof(final_dest), "%s/%s", dest, strrchr(src, '/') ? strrchr(src, '/') + 1 : src) >= sizeof(final_dest)) {
-                fprintf(stderr, "recursive_copy: destination path too long\n");
-                close(src_fd);
-                return;
+        int used = 1;
+        if (command_sources) sources[0] = command_sources[0];
+        for (char *dir = copy, *next; dir; dir = next) {
+            next = strchr(dir, ':');
+            if (next) *next++ = '\0';
+            const char *name = *dir ? dir : ".";
+            int i;
+            for (i = 0; i < used; i++) {
+                if (sources[i].path && strcmp(sources[i].path, name) == 0) break;
             }
-        } else {
-            strncpy(final_dest, dest, sizeof(final_dest));
-        }
-        int dest_fd = open(final_dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
-        if (dest_fd < 0) {
-            perror("fopen dest failed");
-            close(src_fd);
-            return;
+            if (i < used) continue;
+            for (i = 1; i < command_source_count; i++) {
+                if (command_sources[i].path && strcmp(command_sources[i].path, name) == 0) break;
+            }
+            if (i < command_source_count) {
+                sources[used] = command_sources[i];
+                command_sources[i].path = NULL;
+            } else {
+                sources[used].path = strdup(name);
+                sources[used].mtime.tv_sec = -1;
+            }
+            if (sources[used].path) used++;
         }
-        char buffer[1024];
-        ssize_t bytes;
-        while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(dest_fd, buffer, bytes) != bytes) {
-                perror("write failed");
-                close(src_fd);
-                close(dest_fd);
-                return;
+        // Directories that left PATH drop their names
+        for (int i = 1; i < command_source_count; i++) {
+            if (!command_sources[i].path) continue;
+            for (int j = 0; j < command_sources[i].count; j++) {
+                if (--command_sources[i].names[j]->refs == 0) shell_counters[SUB_CMDINDEX].entries--;
             }
+            free(command_sources[i].names);
+            free(command_sources[i].path);
         }
-        if (bytes < 0) {
-            perror("read failed");
+        free(command_sources);
+        free(indexed_path);
+        command_sources = sources;
+        command_source_count = used;
+        indexed_path = copy;
+        strcpy(indexed_path, path);
+    }
+    // The builtin table changes with enable -f / -d, so it is always re-read (a few dozen names)
+    scan_source(&command_sources[0]);
+    for (int i = 1; i < command_source_count; i++) {
+        struct command_source *src = &command_sources[i];
+        struct stat st;
+        if (stat(src->path, &st) != 0) memset(&st, 0, sizeof(st));
+        if (st.st_mtim.tv_sec == src->mtime.tv_sec && st.st_mtim.tv_nsec == src->mtime.tv_nsec &&
+            st.st_dev == src->dev && st.st_ino == src->ino) {
+            shell_counters[SUB_CMDINDEX].hits++;
+            continue;
         }
-        close(src_fd);
-        close(dest_fd);
+        shell_counters[SUB_CMDINDEX].misses++;
+        src->mtime = st.st_mtim;
+        src->dev = st.st_dev;
+        src->ino = st.st_ino;
+        scan_source(src);
     }
 }
 
 /*
- * command_generator - Generates file/folder names or commands for tab completion.
+ * command_exists - Checks whether name is a builtin or an executable reachable through PATH.
+ * The last answer is cached because highlighting asks again on every keystroke.
  */
-char *command_generator(const char *text, int state) {
-    static int index, len;
-    static char *name;
-    static DIR *dir;
+int command_exists(const char *name) {
+    static char last_name[MAX_PATH];
+    static int last_answer;
+    if (strcmp(name, last_name) == 0) {
+        shell_counters[SUB_COMMAND_LOOKUP].hits++;
+        return last_answer;
+    }
+    shell_counters[SUB_COMMAND_LOOKUP].misses++;
+    shell_counters[SUB_COMMAND_LOOKUP].entries = 1;
+    snprintf(last_name, sizeof(last_name), "%s", name);
 
-    if (!state) {
-        index = 0;
-        len = strlen(text);
-        // [FIX: Reset directory for file completion]
-        if (dir) {
-            closedir(dir);
-            dir = NULL;
+    last_answer = 0;
+    if (lookup_builtin(name)) return last_answer = 1;
+    if (strncmp(name, "--chunk", 7) == 0) return last_answer = 1;
+    if (strchr(name, '/')) return last_answer = (access(name, X_OK) == 0);
+    const char *path = getenv("PATH");
+    if (!path) return 0;
+    char candidate[MAX_PATH];
+    while (*path) {
+        const char *colon = strchr(path, ':');
+        size_t n = colon ? (size_t)(colon - path) : strlen(path);
+        if (snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)n, n ? path : ".", name) < (int)sizeof(candidate) &&
+            access(candidate, X_OK) == 0) {
+            return last_answer = 1;
         }
+        path += n;
+        if (*path == ':') path++;
     }
+    return 0;
+}
 
-    // Complete builtin commands
-    while ((name = (char *)builtin_commands[index])) {
-        index++;
-        if (strncmp(name, text, len) == 0) {
-            return strdup(name);
+/*
+ * lex_line - Classifies every byte of line for highlighting: command words, operators,
+ * wildcard words and redirection targets.
+ */
+void lex_line(const char *line, size_t len, unsigned char *classes) {
+    int expect_command = 1, expect_target = 0;
+    size_t i = 0;
+    while (i < len) {
+        char c = line[i];
+        if (c == ' ' || c == '\t') {
+            classes[i++] = HL_NONE;
+            continue;
+        }
+        if (c == '|' || c == '&' || c == '<' || c == '>') {
+            size_t start = i++;
+            if (c == '>' && i < len && line[i] == '>') i++;
+            memset(classes + start, HL_OPERATOR, i - start);
+            if (c == '|') expect_command = 1;
+            if (c == '<' || c == '>') expect_target = 1;
+            continue;
         }
+        size_t start = i;
+        int glob_word = 0;
+        while (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '|' && line[i] != '&' &&
+               line[i] != '<' && line[i] != '>') {
+            if (line[i] == '*' || line[i] == '?' || line[i] == '[') glob_word = 1;
+            i++;
+        }
+        unsigned char hl = HL_NONE;
+        if (expect_target) {
+            hl = HL_TARGET;
+            expect_target = 0;
+        } else if (expect_command) {
+            char word[MAX_PATH];
+            snprintf(word, sizeof(word), "%.*s", (int)(i - start), line + start);
+            hl = command_exists(word) ? HL_COMMAND : HL_UNKNOWN;
+            expect_command = 0;
+        } else if (glob_word) {
+            hl = HL_GLOB;
+        }
+        memset(classes + start, hl, i - start);
     }
+}
 
-    index = 0;
-    // Complete system commands
-    while ((name = system_commands[index])) {
-        index++;
-        if (strncmp(name, text, len) == 0) {
-            return strdup(name);
+/*
+ * out_append - Appends to the pending terminal output, which is flushed with a single write.
+ */
+static void out_append(char **out, size_t *len, size_t *cap, const char *data, size_t n) {
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        while (*len + n > new_cap) new_cap *= 2;
+        char *grown = realloc(*out, new_cap);
+        if (!grown) return;
+        *out = grown;
+        *cap = new_cap;
+    }
+    memcpy(*out + *len, data, n);
+    *len += n;
+}
+
+/*
+ * move_cursor - Emits the escape sequences that move the cursor between two columns,
+ * both counted from the start of the prompt, accounting for wrapped rows.
+ */
+static void move_cursor(char **out, size_t *len, size_t *cap, int cols, int from, int to) {
+    char seq[32];
+    int from_row = from / cols, to_row = to / cols;
+    if (to_row < from_row) {
+        out_append(out, len, cap, seq, snprintf(seq, sizeof(seq), "\033[%dA", from_row - to_row));
+    } else if (to_row > from_row) {
+        out_append(out, len, cap, seq, snprintf(seq, sizeof(seq), "\033[%dB", to_row - from_row));
+    }
+    if (from % cols != to % cols) {
+        out_append(out, len, cap, "\r", 1);
+        if (to % cols) {
+            out_append(out, len, cap, seq, snprintf(seq, sizeof(seq), "\033[%dC", to % cols));
+        }
+    }
+}
+
+/*
+ * refresh_line - Brings the screen in line with the buffer, rewriting only the changed tail.
+ */
+static void refresh_line(struct line_state *ls) {
+    unsigned char *classes = malloc(ls->len + 1);
+    struct screen_cell *cells = malloc((ls->len + 1) * sizeof(struct screen_cell));
+    if (!classes || !cells) {
+        free(classes);
+        free(cells);
+        return;
+    }
+    lex_line(ls->buf, ls->len, classes);
+
+    size_t count = 0, i = 0;
+    int cursor_target = current_prompt_width;
+    mbstate_t mb;
+    memset(&mb, 0, sizeof(mb));
+    while (i < ls->len) {
+        struct screen_cell *cell = &cells[count];
+        size_t n = utf8_length((unsigned char)ls->buf[i]);
+        if (i + n > ls->len) n = ls->len - i;
+        wchar_t wc;
+        size_t r = mbrtowc(&wc, ls->buf + i, n, &mb);
+        int w;
+        if (r == (size_t)-1 || r == (size_t)-2) {
+            memset(&mb, 0, sizeof(mb));
+            wc = '?';
+            w = 1;
+        } else {
+            w = wcwidth(wc);
+            if (w < 0) w = 0;
         }
+        memcpy(cell->bytes, ls->buf + i, n);
+        cell->len = n;
+        cell->width = w;
+        cell->hl = classes[i];
+        if (i < ls->pos) cursor_target += w;
+        count++;
+        i += n;
     }
+    free(classes);
 
-    // File completion
-    if (!state) {
-        dir = opendir(".");
-        if (!dir) return NULL;
+    // Find the first cell that differs from what is on screen
+    size_t same = 0;
+    int col = current_prompt_width;
+    while (same < count && same < ls->shown_count &&
+           cells[same].len == ls->shown[same].len && cells[same].hl == ls->shown[same].hl &&
+           memcmp(cells[same].bytes, ls->shown[same].bytes, cells[same].len) == 0) {
+        col += cells[same].width;
+        same++;
     }
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-        if (strncmp(entry->d_name, text, len) == 0) {
-            return strdup(entry->d_name);
+
+    char *out = NULL;
+    size_t out_len = 0, out_cap = 0;
+    if (same < count || same < ls->shown_count) {
+        move_cursor(&out, &out_len, &out_cap, ls->cols, ls->cursor_col, col);
+        int hl = -1;
+        for (size_t k = same; k < count; k++) {
+            if (cells[k].hl != hl) {
+                hl = cells[k].hl;
+                char seq[16];
+                out_append(&out, &out_len, &out_cap, seq, snprintf(seq, sizeof(seq), "\033[0;%sm", highlight_sgr[hl]));
+            }
+            out_append(&out, &out_len, &out_cap, cells[k].bytes, cells[k].len);
+            col += cells[k].width;
         }
+        if (hl != -1) out_append(&out, &out_len, &out_cap, "\033[0m", 4);
+        // A full last row leaves the terminal cursor pending-wrapped; make the wrap explicit
+        if (col > current_prompt_width && col % ls->cols == 0) out_append(&out, &out_len, &out_cap, "\r\n", 2);
+        if (same < ls->shown_count) out_append(&out, &out_len, &out_cap, "\033[J", 3);
+        ls->cursor_col = col;
     }
-    closedir(dir);
-    dir = NULL;
-    return NULL;
+    move_cursor(&out, &out_len, &out_cap, ls->cols, ls->cursor_col, cursor_target);
+    ls->cursor_col = cursor_target;
+    if (out_len && write(STDOUT_FILENO, out, out_len) < 0) {
+        // Nothing sensible to do if the terminal is gone
+    }
+    free(out);
+    free(ls->shown);
+    ls->shown = cells;
+    ls->shown_count = count;
 }
 
 /*
- * custom_completion - Custom tab completion for files and commands.
+ * redraw_prompt - Starts a fresh prompt line and repaints the whole buffer (after listings or Ctrl+L).
  */
-char **custom_completion(const char *text, int start, int end) {
-    rl_attempted_completion_over = 1;
-    if (start == 0) {
-        return rl_completion_matches(text, command_generator);
-    } else {
-        return rl_completion_matches(text, rl_filename_completion_function);
+static void redraw_prompt(struct line_state *ls) {
+    if (write(STDOUT_FILENO, current_prompt, strlen(current_prompt)) < 0) return;
+    free(ls->shown);
+    ls->shown = NULL;
+    ls->shown_count = 0;
+    ls->cursor_col = current_prompt_width;
+    refresh_line(ls);
+}
+
+/*
+ * complete_at_cursor - Tab completion for the word before the cursor.
+ * A second Tab without progress lists the candidates.
+ */
+static void complete_at_cursor(struct line_state *ls) {
+    size_t start = ls->pos;
+    while (start > 0 && ls->buf[start - 1] != ' ' && ls->buf[start - 1] != '\t' && ls->buf[start - 1] != '|' &&
+           ls->buf[start - 1] != '<' && ls->buf[start - 1] != '>') {
+        start--;
+    }
+    char **matches = custom_completion(ls->buf, start, ls->pos);
+    if (!matches) {
+        if (write(STDOUT_FILENO, "\a", 1) < 0) return;
+        return;
+    }
+    int count = 0;
+    while (matches[count + 1]) count++;
+    size_t typed = ls->pos - start;
+    if (strlen(matches[0]) > typed || count == 1) {
+        line_delete(ls, start, ls->pos);
+        line_insert(ls, matches[0], strlen(matches[0]));
+        if (count == 1) {
+            struct stat st;
+            int is_dir = (stat(matches[0], &st) == 0 && S_ISDIR(st.st_mode));
+            line_insert(ls, is_dir ? "/" : " ", 1);
+        }
+        refresh_line(ls);
+    } else if (ls->last_was_tab) {
+        // List candidates below the line, then repaint the prompt
+        char *out = NULL;
+        size_t out_len = 0, out_cap = 0;
+        int end_col = current_prompt_width;
+        for (size_t i = 0; i < ls->shown_count; i++) end_col += ls->shown[i].width;
+        move_cursor(&out, &out_len, &out_cap, ls->cols, ls->cursor_col, end_col);
+        out_append(&out, &out_len, &out_cap, "\r\n", 2);
+        if (count > 100) {
+            char note[64];
+            out_append(&out, &out_len, &out_cap, note, snprintf(note, sizeof(note), "(%d possibilities)\r\n", count));
+        } else {
+            for (int i = 1; i <= count; i++) {
+                const char *name = strrchr(matches[i], '/') && matches[i][strlen(matches[i]) - 1] != '/' ? strrchr(matches[i], '/') + 1 : matches[i];
+                out_append(&out, &out_len, &out_cap, name, strlen(name));
+                out_append(&out, &out_len, &out_cap, i == count ? "\r\n" : "  ", 2);
+            }
+        }
+        if (out_len && write(STDOUT_FILENO, out, out_len) < 0) {
+            // Ignore terminal write errors
+        }
+        free(out);
+        redraw_prompt(ls);
+    } else if (write(STDOUT_FILENO, "\a", 1) < 0) {
+        // Ignore terminal write errors
+    }
+    for (int i = 0; matches[i]; i++) free(matches[i]);
+    free(matches);
+}
+
+/*
+ * history_step - Moves through history by delta (-1 older, +1 newer).
+ */
+static void history_step(struct line_state *ls, int delta) {
+    int target = ls->history_index + delta;
+    if (target < 0 || target > history_count) return;
+    if (ls->history_index == history_count) {
+        free(ls->saved_line);
+        ls->saved_line = strdup(ls->buf);
+    }
+    ls->history_index = target;
+    line_set(ls, target == history_count ? (ls->saved_line ? ls->saved_line : "") : history_lines[target]);
+    refresh_line(ls);
+}
+
+/*
+ * read_paste - Collects a bracketed paste up to ESC[201~ and inserts it as one edit.
+ * Newlines become spaces because a command is a single line.
+ */
+static void read_paste(struct line_state *ls) {
+    static const char end_marker[] = "\033[201~";
+    size_t cap = 256, n = 0;
+    char *paste = malloc(cap);
+    if (!paste) return;
+    int c;
+    while ((c = read_key_byte()) >= 0) {
+        if (n + 1 >= cap) {
+            char *grown = realloc(paste, cap * 2);
+            if (!grown) break;
+            paste = grown;
+            cap *= 2;
+        }
+        paste[n++] = (c == '\n' || c == '\r') ? ' ' : c;
+        if (n >= 6 && memcmp(paste + n - 6, end_marker, 6) == 0) {
+            n -= 6;
+            break;
+        }
+    }
+    line_insert(ls, paste, n);
+    free(paste);
+    refresh_line(ls);
+}
+
+/*
+ * edit_line - Reads one line from the terminal in raw mode.
+ * When stdin is not a terminal (scripts, pipes), lines come through read's record reader, which
+ * never consumes past the line, so read and other commands see the input that follows.
+ * Returns a malloc'd line, or NULL at end of input.
+ */
+char *edit_line(void) {
+    if (!isatty(STDIN_FILENO)) {
+        struct text_builder line = {NULL, 0, 0};
+        int found = read_record(STDIN_FILENO, '\n', -1, 1, &line);
+        if (found < 0 || (found == 0 && line.len == 0)) {
+            free(line.data);
+            return NULL;
+        }
+        return line.data;
+    }
+
+    struct termios cooked, raw;
+    if (tcgetattr(STDIN_FILENO, &cooked) != 0) return NULL;
+    raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    // Enable bracketed paste for the duration of the edit
+    if (write(STDOUT_FILENO, "\033[?2004h", 8) < 0) {
+        // Terminal may not understand it; editing still works
+    }
+
+    struct line_state ls;
+    memset(&ls, 0, sizeof(ls));
+    ls.cap = 256;
+    ls.buf = malloc(ls.cap);
+    if (!ls.buf) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+        return NULL;
+    }
+    ls.buf[0] = '\0';
+    ls.cursor_col = current_prompt_width;
+    ls.history_index = history_count;
+    struct winsize ws;
+    ls.cols = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+
+    int done = 0, eof = 0;
+    while (!done) {
+        int c = read_key_byte();
+        int was_tab = ls.last_was_tab;
+        ls.last_was_tab = 0;
+        if (c < 0) {
+            eof = 1;
+            break;
+        }
+        switch (c) {
+        case '\r':
+        case '\n':
+            done = 1;
+            break;
+        case 4: // Ctrl+D: end of input on an empty line, otherwise delete forward
+            if (ls.len == 0) {
+                eof = 1;
+                done = 1;
+            } else if (ls.pos < ls.len) {
+                line_delete(&ls, ls.pos, next_char(&ls, ls.pos));
+                refresh_line(&ls);
+            }
+            break;
+        case 3: // Ctrl+C: abandon the line
+            line_set(&ls, "");
+            done = 1;
+            break;
+        case 127:
+        case 8: // Backspace
+            if (ls.pos > 0) {
+                line_delete(&ls, prev_char(&ls, ls.pos), ls.pos);
+                refresh_line(&ls);
+            }
+            break;
+        case 1: // Ctrl+A
+            ls.pos = 0;
+            refresh_line(&ls);
+            break;
+        case 5: // Ctrl+E
+            ls.pos = ls.len;
+            refresh_line(&ls);
+            break;
+        case 2: // Ctrl+B
+            ls.pos = prev_char(&ls, ls.pos);
+            refresh_line(&ls);
+            break;
+        case 6: // Ctrl+F
+            ls.pos = next_char(&ls, ls.pos);
+            refresh_line(&ls);
+            break;
+        case 11: // Ctrl+K: kill to end of line
+            line_delete(&ls, ls.pos, ls.len);
+            refresh_line(&ls);
+            break;
+        case 21: // Ctrl+U: kill to start of line
+            line_delete(&ls, 0, ls.pos);
+            refresh_line(&ls);
+            break;
+        case 23: { // Ctrl+W: delete previous word
+            size_t start = ls.pos;
+            while (start > 0 && ls.buf[start - 1] == ' ') start--;
+            while (start > 0 && ls.buf[start - 1] != ' ') start--;
+            line_delete(&ls, start, ls.pos);
+            refresh_line(&ls);
+            break;
+        }
+        case 12: // Ctrl+L: clear screen
+            if (write(STDOUT_FILENO, "\033[H\033[2J", 7) < 0) break;
+            redraw_prompt(&ls);
+            break;
+        case 16: // Ctrl+P
+            history_step(&ls, -1);
+            break;
+        case 14: // Ctrl+N
+            history_step(&ls, 1);
+            break;
+        case '\t':
+            ls.last_was_tab = was_tab;
+            complete_at_cursor(&ls);
+            ls.last_was_tab = 1;
+            break;
+        case 27: { // Escape sequences: arrows, Home/End, Delete, bracketed paste
+            if (!key_pending(50)) break;
+            int c1 = read_key_byte();
+            if (c1 != '[' && c1 != 'O') break;
+            char params[16];
+            size_t np = 0;
+            int final;
+            while ((final = read_key_byte()) >= 0 && final >= 0x20 && final < 0x40) {
+                if (np < sizeof(params) - 1) params[np++] = final;
+            }
+            params[np] = '\0';
+            if (final == 'A') {
+                history_step(&ls, -1);
+            } else if (final == 'B') {
+                history_step(&ls, 1);
+            } else if (final == 'C') {
+                ls.pos = next_char(&ls, ls.pos);
+                refresh_line(&ls);
+            } else if (final == 'D') {
+                ls.pos = prev_char(&ls, ls.pos);
+                refresh_line(&ls);
+            } else if (final == 'H' || (final == '~' && (strcmp(params, "1") == 0 || strcmp(params, "7") == 0))) {
+                ls.pos = 0;
+                refresh_line(&ls);
+            } else if (final == 'F' || (final == '~' && (strcmp(params, "4") == 0 || strcmp(params, "8") == 0))) {
+                ls.pos = ls.len;
+                refresh_line(&ls);
+            } else if (final == '~' && strcmp(params, "3") == 0) {
+                if (ls.pos < ls.len) {
+                    line_delete(&ls, ls.pos, next_char(&ls, ls.pos));
+                    refresh_line(&ls);
+                }
+            } else if (final == '~' && strcmp(params, "200") == 0) {
+                read_paste(&ls);
+            }
+            break;
+        }
+        default:
+            if (c >= 32) {
+                // Gather the rest of a UTF-8 sequence before inserting
+                char seq[4];
+                size_t n = utf8_length(c), k = 1;
+                seq[0] = c;
+                for (int next; k < n && (next = read_key_byte()) >= 0; k++) seq[k] = next;
+                // Input ended inside the sequence: drop the partial character
+                if (k < n) {
+                    eof = 1;
+                    break;
+                }
+                line_insert(&ls, seq, n);
+                refresh_line(&ls);
+            }
+            break;
+        }
     }
-}
\ No newline at end of file
+
+    // Leave the cursor after the line and hand the terminal back in cooked mode
+    ls.pos = ls.len;
+    refresh_line(&ls);
+    if (write(STDOUT_FILENO, "\033[?2004l\r\n", 10) < 0) {
+        // Ignore terminal write errors
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    free(ls.shown);
+    free(ls.saved_line);
+    if (eof && ls.len == 0) {
+        free(ls.buf);
+        return NULL;
+    }
+    return ls.buf;
+}
@@ -0,0 +1,56 @@
+/*
+ * myshell_plugin.h - ABI for MyShell loadable builtins.
+ * A plugin is a shared object exporting one "const struct myshell_plugin myshell_plugin_<name>"
+ * per command. "enable -f plugin.so name" loads it and registers <name> as a builtin, so it runs
+ * in the shell (or in the pipeline stage) without a fork or exec.
+ * Build: gcc -shared -fPIC -o logfilter.so logfilter.c
+ */
+
+#ifndef MYSHELL_PLUGIN_H
+#define MYSHELL_PLUGIN_H
+
+#include <stddef.h>               // size_t
+#include <sys/types.h>            // ssize_t
+
+// Bumped on any incompatible change to the structs below; new members only ever go at the end
+#define MYSHELL_PLUGIN_ABI 1
+
+// Plugin flags (same meaning as the shell's own builtin flags)
+#define MYSHELL_PLUGIN_PIPELINE_SAFE   0x1   // may run in-process as a pipeline stage
+#define MYSHELL_PLUGIN_BACKGROUND_SAFE 0x2   // may run in a forked child when followed by '&'
+
+// Services the shell hands to a plugin for the duration of one call
+struct myshell_api {
+    unsigned abi;                 // MYSHELL_PLUGIN_ABI of the running shell
+    size_t size;                  // sizeof(struct myshell_api) in the running shell
+    // Buffered stdin: returns the next line without its '\n' (valid until the next call), NULL at end of input
+    char *(*read_line)(size_t *len);
+    // Buffered stdout: flushed when full and after the plugin returns
+    void (*write)(const void *data, size_t len);
+    void (*print)(const char *text);
+    void (*flush)(void);
+    // Arena memory, released by the shell once the command line finishes; never free() it
+    void *(*alloc)(size_t size);
+    char *(*strdup)(const char *text);
+};
+
+// Descriptor exported by the plugin as myshell_plugin_<name>
+struct myshell_plugin {
+    unsigned abi;                 // MYSHELL_PLUGIN_ABI the plugin was built against
+    size_t size;                  // sizeof(struct myshell_plugin) the plugin was built with
+    const char *name;
+    const char *usage;
+    const char *help;
+    unsigned flags;
+    // Runs the command; argv[0] is the name, argv[argc] is NULL. Returns the exit status.
+    int (*handler)(const struct myshell_api *api, int argc, char *argv[]);
+    // Optional completion hook for argument argn (1 = first): returns the state'th candidate
+    // starting with text, or NULL when there are no more. May be NULL.
+    const char *(*complete)(const char *text, int argn, int state);
+};
+
+// Defines the descriptor with the right symbol name and ABI fields filled in
+#define MYSHELL_PLUGIN(ident) const struct myshell_plugin myshell_plugin_##ident
+#define MYSHELL_PLUGIN_HEADER .abi = MYSHELL_PLUGIN_ABI, .size = sizeof(struct myshell_plugin)
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * logfilter.c - Example MyShell loadable builtin: keeps log lines at or above a level.
+ * Build: gcc -shared -fPIC -I.. -o logfilter.so logfilter.c
+ * Usage: enable -f ./logfilter.so logfilter
+ *        cat app.log | logfilter [-c] WARN
+ */
+
+#include <string.h>               // string handling
+#include <stdio.h>                // snprintf
+#include "myshell_plugin.h"       // plugin descriptor and shell services
+
+static const char *levels[] = {"DEBUG", "INFO", "WARN", "ERROR", "FATAL", NULL};
+
+/*
+ * line_level - Index in levels of the first level word found in the line, -1 when none.
+ */
+static int line_level(const char *line) {
+    for (int i = 0; levels[i]; i++) {
+        if (strstr(line, levels[i])) return i;
+    }
+    return -1;
+}
+
+/*
+ * logfilter - Copies stdin lines whose level is at least the one given; -c prints only the count.
+ */
+static int logfilter(const struct myshell_api *api, int argc, char *argv[]) {
+    int count_only = 0, arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-c") == 0) {
+        count_only = 1;
+        arg++;
+    }
+    int minimum = arg < argc ? line_level(argv[arg]) : 0;
+    if (minimum < 0 || arg + 1 < argc) {
+        api->print("Usage: logfilter [-c] [DEBUG|INFO|WARN|ERROR|FATAL]\n");
+        return 2;
+    }
+    unsigned long matched = 0;
+    size_t len;
+    char *line;
+    while ((line = api->read_line(&len))) {
+        if (line_level(line) < minimum) continue;
+        matched++;
+        if (!count_only) {
+            api->write(line, len);
+            api->write("\n", 1);
+        }
+    }
+    if (count_only) {
+        // Scratch formatting goes in the shell's arena; it is released with the command line
+        char *text = api->alloc(32);
+        if (!text) return 2;
+        snprintf(text, 32, "%lu\n", matched);
+        api->print(text);
+    }
+    return matched ? 0 : 1;
+}
+
+/*
+ * logfilter_complete - Offers the level names for the level argument (the first, or the second after -c).
+ */
+static const char *logfilter_complete(const char *text, int argn, int state) {
+    if (argn > 2) return NULL;
+    size_t len = strlen(text);
+    for (int i = 0; levels[i]; i++) {
+        if (strncmp(levels[i], text, len) == 0 && state-- == 0) return levels[i];
+    }
+    return NULL;
+}
+
+MYSHELL_PLUGIN(logfilter) = {
+    MYSHELL_PLUGIN_HEADER,
+    .name = "logfilter",
+    .usage = "... | logfilter [-c] [level]",
+    .help = "Keep log lines at or above a level (loadable example)",
+    .flags = MYSHELL_PLUGIN_PIPELINE_SAFE | MYSHELL_PLUGIN_BACKGROUND_SAFE,
+    .handler = logfilter,
+    .complete = logfilter_complete,
+};
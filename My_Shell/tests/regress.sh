@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# regress.sh - Script-level checks for behaviors fixed in review: long names in the command
+# index, escaped and quoted ';', the patterns of ${v^pat} and ${v,pat}, the glob counters, and
+# input ending inside a UTF-8 character in the line editor.
+# Prints one ok/FAIL line per check and exits with the number of failures.
+# Usage: tests/regress.sh [path/to/myshell]
+#
+
+SHELL_BIN=$(realpath "${1:-./myshell}")
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+export MYSHELL_STATS=/dev/null
+failures=0
+
+# Compares a check's actual output with the expected one
+check() {
+    if [ "$3" = "$2" ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1: expected '$2', got '$3'"
+        failures=$((failures + 1))
+    fi
+}
+
+# Runs the given lines as a script and prints their output
+run() {
+    printf '%s\n' "$@" > "$WORK/line.sh"
+    "$SHELL_BIN" "$WORK/line.sh" 2>&1
+}
+
+# A name longer than 63 bytes is found again on a rescan instead of being indexed twice, so
+# adding one name to its directory allocates one node
+mkdir bin
+long=$(printf 'long%.0s' $(seq 20))
+touch "bin/$long"
+chmod +x "bin/$long"
+allocs=$(PATH="$WORK/bin:$PATH" run 'no_such_command_x' 'shellstat --json' 'touch bin/added' 'chmod +x bin/added' \
+    'no_such_command_x' 'shellstat --json' | grep -o '"command_index":{[^}]*}' | grep -o '"allocs":[0-9]*' | sed 's/.*://')
+first=$(echo "$allocs" | head -n 1)
+second=$(echo "$allocs" | tail -n 1)
+check "command index: long names" "1" "$((second - first))"
+
+# ';' that is escaped or quoted belongs to the command
+touch semi_target
+check "';' escaped" "found ./semi_target" "$(run 'find . -name semi_target -exec echo found {} \;')"
+check "';' quoted" "found ./semi_target" "$(run "find . -name semi_target -exec echo found {} ';'")"
+check "[[ ]] empty operand" "false" "$(run '[[ $unset_var == y ]] || echo false')"
+
+# Only characters matching the pattern change case
+check '${v^^pat}' "bAnAnA BaNaNa" "$(run 'v=banana' 'echo ${v^^a} ${v^^[bn]}')"
+check '${v,,pat}' "BaNaNa bANANA" "$(run 'v=BANANA' 'echo ${v,,A} ${v,B}')"
+
+# A pattern with no match counts as a glob miss, one with matches as a hit
+touch match.txt
+glob=$(run 'echo *.none' 'echo *.txt' 'shellstat --json' | grep -o '"glob":{[^}]*}' | grep -o '"hits":[0-9]*,"misses":[0-9]*')
+check "glob counters" '"hits":1,"misses":1' "$glob"
+
+# Input ending inside a UTF-8 character drops the partial character and runs the line
+if command -v python3 > /dev/null; then
+    python3 - "$SHELL_BIN" << 'EOF'
+import os, pty, select, signal, sys, time
+pid, fd = pty.fork()
+if pid == 0:
+    # Closing the terminal would otherwise hang up the shell before it sees end of input
+    signal.signal(signal.SIGHUP, signal.SIG_IGN)
+    os.execv(sys.argv[1], [sys.argv[1]])
+def drain(seconds):
+    end = time.time() + seconds
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                os.read(fd, 65536)
+            except OSError:
+                return
+drain(0.5)
+os.write(fd, b'touch utf8_eof\xc3')
+drain(0.3)
+os.close(fd)
+os.waitpid(pid, 0)
+EOF
+    check "line editor: EOF inside UTF-8" "utf8_eof" "$(ls | grep '^utf8_eof')"
+else
+    echo "skip  line editor: EOF inside UTF-8 (no python3 for a pty)"
+fi
+
+exit "$failures"